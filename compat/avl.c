@@ -0,0 +1,322 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2022 Joyent, Inc.
+ */
+
+/*
+ * avl.c: AVL trees with the illumos interface (see compat/sys/avl.h).
+ *
+ * Each node records its parent and its balance (the height of its right
+ * subtree minus that of its left), which is always -1, 0, or 1 between
+ * operations.  Children are indexed 0 (left) and 1 (right), matching AVL_BEFORE
+ * and AVL_AFTER, so that most operations can be written once for both
+ * directions.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/avl.h>
+
+#define	AVL_NODE2DATA(tree, node)	\
+	((void *)((uintptr_t)(node) - (tree)->avl_offset))
+#define	AVL_DATA2NODE(tree, data)	\
+	((avl_node_t *)((uintptr_t)(data) + (tree)->avl_offset))
+
+#define	AVL_MKINDEX(node, child)	((avl_index_t)(node) | (child))
+#define	AVL_INDEX2NODE(where)		((avl_node_t *)((where) & ~1UL))
+#define	AVL_INDEX2CHILD(where)		((int)((where) & 1))
+
+/*
+ * Returns which child of its parent "node" is.  "node" must have a parent.
+ */
+static int
+avl_whichchild(const avl_node_t *node)
+{
+	return (node->avl_parent->avl_child[1] == node);
+}
+
+/*
+ * Rotate "node"'s child on side "which" up into "node"'s place.  This doesn't
+ * update balances, which depend on the case the caller is handling.
+ */
+static void
+avl_rotate(avl_tree_t *tree, avl_node_t *node, int which)
+{
+	avl_node_t *child = node->avl_child[which];
+	avl_node_t *inner = child->avl_child[1 - which];
+	avl_node_t *parent = node->avl_parent;
+
+	node->avl_child[which] = inner;
+	if (inner != NULL)
+		inner->avl_parent = node;
+
+	if (parent == NULL)
+		tree->avl_root = child;
+	else
+		parent->avl_child[avl_whichchild(node)] = child;
+
+	child->avl_parent = parent;
+	child->avl_child[1 - which] = node;
+	node->avl_parent = child;
+}
+
+void
+avl_create(avl_tree_t *tree, int (*compar)(const void *, const void *),
+    size_t size, size_t offset)
+{
+	assert(compar != NULL);
+	assert(offset + sizeof (avl_node_t) <= size);
+
+	tree->avl_root = NULL;
+	tree->avl_compar = compar;
+	tree->avl_offset = offset;
+	tree->avl_numnodes = 0;
+	tree->avl_size = size;
+}
+
+/*
+ * The tree must be empty (e.g., after avl_destroy_nodes() returns NULL).
+ */
+void
+avl_destroy(avl_tree_t *tree)
+{
+	assert(tree->avl_root == NULL);
+	assert(tree->avl_numnodes == 0);
+}
+
+/*
+ * Return the node matching "value", or NULL if there isn't one, in which case
+ * "where" (if not NULL) is set to where the node would be inserted.
+ */
+void *
+avl_find(avl_tree_t *tree, const void *value, avl_index_t *where)
+{
+	avl_node_t *node, *prev = NULL;
+	int child = 0;
+	int diff;
+
+	for (node = tree->avl_root; node != NULL;
+	    node = node->avl_child[child]) {
+		prev = node;
+		diff = tree->avl_compar(value, AVL_NODE2DATA(tree, node));
+		if (diff == 0)
+			return (AVL_NODE2DATA(tree, node));
+		child = diff > 0;
+	}
+
+	if (where != NULL)
+		*where = AVL_MKINDEX(prev, child);
+
+	return (NULL);
+}
+
+/*
+ * Insert "data" at "where", as returned by a failed avl_find(), and rebalance.
+ */
+void
+avl_insert(avl_tree_t *tree, void *data, avl_index_t where)
+{
+	avl_node_t *node = AVL_DATA2NODE(tree, data);
+	avl_node_t *parent = AVL_INDEX2NODE(where);
+	avl_node_t *child, *grandchild;
+	int which, delta;
+
+	node->avl_child[0] = NULL;
+	node->avl_child[1] = NULL;
+	node->avl_parent = parent;
+	node->avl_balance = 0;
+	tree->avl_numnodes++;
+
+	if (parent == NULL) {
+		assert(tree->avl_root == NULL);
+		tree->avl_root = node;
+		return;
+	}
+
+	assert(parent->avl_child[AVL_INDEX2CHILD(where)] == NULL);
+	parent->avl_child[AVL_INDEX2CHILD(where)] = node;
+
+	/*
+	 * Walk up from the new node while the height of the subtree rooted at
+	 * "node" has grown.  Stop when an ancestor's subtree stays the same
+	 * height, either because it was unbalanced toward its other side or
+	 * because we rotated it back to its original height.
+	 */
+	for (; parent != NULL; node = parent, parent = node->avl_parent) {
+		which = avl_whichchild(node);
+		delta = which == 0 ? -1 : 1;
+		parent->avl_balance += delta;
+		if (parent->avl_balance == 0)
+			return;
+		if (parent->avl_balance == delta)
+			continue;
+
+		/*
+		 * "parent" is now two levels heavier on the side of "node".  If
+		 * "node" leans the same way, one rotation fixes both of them.
+		 * Otherwise, "node"'s inner child has to be rotated up twice.
+		 */
+		child = node;
+		if (child->avl_balance == delta) {
+			avl_rotate(tree, parent, which);
+			parent->avl_balance = 0;
+			child->avl_balance = 0;
+			return;
+		}
+
+		grandchild = child->avl_child[1 - which];
+		avl_rotate(tree, child, 1 - which);
+		avl_rotate(tree, parent, which);
+		parent->avl_balance = grandchild->avl_balance == delta ?
+		    -delta : 0;
+		child->avl_balance = grandchild->avl_balance == -delta ?
+		    delta : 0;
+		grandchild->avl_balance = 0;
+		return;
+	}
+}
+
+/*
+ * Insert "data", which must not already be in the tree.
+ */
+void
+avl_add(avl_tree_t *tree, void *data)
+{
+	avl_index_t where = 0;
+
+	if (avl_find(tree, data, &where) != NULL) {
+		(void) fprintf(stderr, "avl_find() succeeded inside avl_add()\n");
+		abort();
+	}
+
+	avl_insert(tree, data, where);
+}
+
+static void *
+avl_extreme(avl_tree_t *tree, int which)
+{
+	avl_node_t *node = tree->avl_root;
+
+	if (node == NULL)
+		return (NULL);
+
+	while (node->avl_child[which] != NULL)
+		node = node->avl_child[which];
+
+	return (AVL_NODE2DATA(tree, node));
+}
+
+void *
+avl_first(avl_tree_t *tree)
+{
+	return (avl_extreme(tree, AVL_BEFORE));
+}
+
+void *
+avl_last(avl_tree_t *tree)
+{
+	return (avl_extreme(tree, AVL_AFTER));
+}
+
+/*
+ * Return the node after (AVL_AFTER) or before (AVL_BEFORE) "data" in the tree,
+ * or NULL if there isn't one.
+ */
+void *
+avl_walk(avl_tree_t *tree, void *data, int direction)
+{
+	avl_node_t *node = AVL_DATA2NODE(tree, data);
+
+	if (node->avl_child[direction] != NULL) {
+		node = node->avl_child[direction];
+		while (node->avl_child[1 - direction] != NULL)
+			node = node->avl_child[1 - direction];
+		return (AVL_NODE2DATA(tree, node));
+	}
+
+	for (;;) {
+		if (node->avl_parent == NULL)
+			return (NULL);
+		if (avl_whichchild(node) != direction)
+			return (AVL_NODE2DATA(tree, node->avl_parent));
+		node = node->avl_parent;
+	}
+}
+
+/*
+ * Given "where" from a failed avl_find(), return the node that would be just
+ * after (AVL_AFTER) or before (AVL_BEFORE) the value that wasn't found.
+ */
+void *
+avl_nearest(avl_tree_t *tree, avl_index_t where, int direction)
+{
+	avl_node_t *node = AVL_INDEX2NODE(where);
+	void *data;
+
+	if (node == NULL)
+		return (NULL);
+
+	data = AVL_NODE2DATA(tree, node);
+	if (AVL_INDEX2CHILD(where) != direction)
+		return (data);
+
+	return (avl_walk(tree, data, direction));
+}
+
+unsigned long
+avl_numnodes(avl_tree_t *tree)
+{
+	return (tree->avl_numnodes);
+}
+
+boolean_t
+avl_is_empty(avl_tree_t *tree)
+{
+	return (tree->avl_numnodes == 0 ? B_TRUE : B_FALSE);
+}
+
+/*
+ * Remove and return the nodes of the tree one at a time, without rebalancing,
+ * so that the caller can free them.  "*cookie" must be NULL on the first call
+ * and is used to keep track of where we are.  Returns NULL once the tree is
+ * empty.  The tree can't be used for anything else until then.
+ */
+void *
+avl_destroy_nodes(avl_tree_t *tree, void **cookie)
+{
+	avl_node_t *node, *parent;
+
+	node = *cookie != NULL ? *cookie : tree->avl_root;
+	if (node == NULL)
+		return (NULL);
+
+	/*
+	 * Find a leaf under "node", which will be the node we return, and
+	 * resume from its parent next time.
+	 */
+	for (;;) {
+		if (node->avl_child[0] != NULL)
+			node = node->avl_child[0];
+		else if (node->avl_child[1] != NULL)
+			node = node->avl_child[1];
+		else
+			break;
+	}
+
+	parent = node->avl_parent;
+	if (parent == NULL)
+		tree->avl_root = NULL;
+	else
+		parent->avl_child[avl_whichchild(node)] = NULL;
+
+	*cookie = parent;
+	tree->avl_numnodes--;
+	return (AVL_NODE2DATA(tree, node));
+}
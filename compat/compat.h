@@ -0,0 +1,37 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2022 Joyent, Inc.
+ */
+
+/*
+ * compat.h: definitions that illumos provides and that netcmp (or the AVL
+ * interface in compat/sys/avl.h) uses, for building on systems that lack them.
+ * The Makefile only puts this directory on the include path on Linux.
+ */
+
+#ifndef _COMPAT_H
+#define	_COMPAT_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	B_FALSE = 0,
+	B_TRUE = 1
+} boolean_t;
+
+extern size_t strlcpy(char *, const char *, size_t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _COMPAT_H */
@@ -0,0 +1,37 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2022 Joyent, Inc.
+ */
+
+/*
+ * strlcpy.c: strlcpy(3C) for C libraries that don't provide it.
+ */
+
+#include <string.h>
+
+#include "compat.h"
+
+/*
+ * Copy "src" into "dst", a buffer of "dstsize" bytes, truncating it if needed
+ * and always terminating "dst" unless "dstsize" is 0.  Returns the length of
+ * "src", so that truncation occurred if the return value is >= "dstsize".
+ */
+size_t
+strlcpy(char *dst, const char *src, size_t dstsize)
+{
+	size_t srclen = strlen(src);
+	size_t n;
+
+	if (dstsize != 0) {
+		n = srclen < dstsize - 1 ? srclen : dstsize - 1;
+		(void) memcpy(dst, src, n);
+		dst[n] = '\0';
+	}
+
+	return (srclen);
+}
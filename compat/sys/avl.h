@@ -0,0 +1,76 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2022 Joyent, Inc.
+ */
+
+/*
+ * sys/avl.h: the illumos AVL tree interface (see avl(3AVL)), for systems that
+ * don't have libavl.  Only the functions that netcmp uses, and a few closely
+ * related ones, are implemented (in compat/avl.c); in particular, nodes can't
+ * be removed individually.  Callers embed an avl_node_t in each of their
+ * structures and never look inside it or the avl_tree_t.
+ */
+
+#ifndef _SYS_AVL_H
+#define	_SYS_AVL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../compat.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct avl_node {
+	struct avl_node	*avl_child[2];		/* left and right children */
+	struct avl_node	*avl_parent;		/* parent, or NULL for root */
+	int		avl_balance;		/* right height - left height */
+} avl_node_t;
+
+typedef struct avl_tree {
+	avl_node_t	*avl_root;		/* root node, or NULL if empty */
+	int		(*avl_compar)(const void *, const void *);
+	size_t		avl_offset;		/* offset of avl_node_t in data */
+	unsigned long	avl_numnodes;		/* number of nodes */
+	size_t		avl_size;		/* size of each data structure */
+} avl_tree_t;
+
+/*
+ * An avl_index_t records where avl_find() would have found a node that isn't
+ * in the tree: the would-be parent node, with the low bit set if the node
+ * belongs on the right.  It's only valid until the tree is next modified.
+ */
+typedef uintptr_t avl_index_t;
+
+#define	AVL_BEFORE	(0)
+#define	AVL_AFTER	(1)
+
+#define	AVL_NEXT(tree, node)	avl_walk(tree, node, AVL_AFTER)
+#define	AVL_PREV(tree, node)	avl_walk(tree, node, AVL_BEFORE)
+
+extern void avl_create(avl_tree_t *, int (*)(const void *, const void *),
+    size_t, size_t);
+extern void avl_destroy(avl_tree_t *);
+extern void *avl_find(avl_tree_t *, const void *, avl_index_t *);
+extern void avl_insert(avl_tree_t *, void *, avl_index_t);
+extern void avl_add(avl_tree_t *, void *);
+extern void *avl_first(avl_tree_t *);
+extern void *avl_last(avl_tree_t *);
+extern void *avl_walk(avl_tree_t *, void *, int);
+extern void *avl_nearest(avl_tree_t *, avl_index_t, int);
+extern unsigned long avl_numnodes(avl_tree_t *);
+extern boolean_t avl_is_empty(avl_tree_t *);
+extern void *avl_destroy_nodes(avl_tree_t *, void **);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SYS_AVL_H */
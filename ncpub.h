@@ -0,0 +1,86 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2022 Joyent, Inc.
+ */
+
+/*
+ * ncpub.h: layout of the result file published by "netcmp -P FILE".
+ *
+ * The file is meant to be mapped read-only by consumers and used in place.  It
+ * begins with an ncpub_hdr_t, which gives the byte offset of each of the
+ * arrays that follow it.  Every array has ncph_nconns entries (except the
+ * source table, which has ncph_nsources), and entry i of each column array
+ * describes the same connection.  Connections are sorted by (ip1, ip2, port1,
+ * port2).  All offsets are multiples of 8 bytes, and all
+ * values are in the byte order of the system that wrote the file.
+ *
+ * netcmp never modifies a published file.  Each run writes a new file
+ * alongside it and renames it into place, so a consumer that has mapped the
+ * file keeps a consistent view of that generation until it unmaps it.  To pick
+ * up a new generation, consumers re-open the file and compare ncph_generation.
+ * Putting the file on a memory-backed filesystem (e.g., /tmp on illumos or
+ * /dev/shm on Linux) makes this equivalent to a shared memory segment.
+ */
+
+#ifndef	_NCPUB_H
+#define	_NCPUB_H
+
+#include <stdint.h>
+
+#define	NCPUB_MAGIC		"NCPUB001"
+#define	NCPUB_VERSION		2
+
+#define	NCPUB_MAXSTATES		16	/* max entries in ncph_states */
+#define	NCPUB_MAXCLASSES	8	/* max entries in ncph_classes */
+#define	NCPUB_NAMELEN		16	/* size of state and class names */
+#define	NCPUB_SOURCELEN		128	/* size of ncps_name */
+#define	NCPUB_NOSOURCE		UINT16_MAX /* no second source */
+
+typedef struct {
+	char		ncph_magic[8];		/* NCPUB_MAGIC (no NUL) */
+	uint32_t	ncph_version;		/* NCPUB_VERSION */
+	uint32_t	ncph_hdrsize;		/* sizeof (ncpub_hdr_t) */
+	uint64_t	ncph_size;		/* total size of the file */
+	uint64_t	ncph_generation;	/* incremented by each run */
+	int64_t		ncph_published;		/* time published (Unix) */
+
+	uint64_t	ncph_nconns;		/* entries in column arrays */
+	uint32_t	ncph_nsources;		/* entries in source table */
+	uint32_t	ncph_nstates;		/* entries in ncph_states */
+	uint32_t	ncph_nclasses;		/* entries in ncph_classes */
+	uint32_t	ncph_pad;
+
+	/* summary: localhost connections skipped, and count of each class */
+	uint64_t	ncph_nlocalhost;
+	uint64_t	ncph_nclass[NCPUB_MAXCLASSES];
+
+	/* names of the values used in the state and class columns */
+	char		ncph_states[NCPUB_MAXSTATES][NCPUB_NAMELEN];
+	char		ncph_classes[NCPUB_MAXCLASSES][NCPUB_NAMELEN];
+
+	/* byte offsets of the arrays (type of each element in parens) */
+	uint64_t	ncph_off_ip1;		/* first IP (uint32_t) */
+	uint64_t	ncph_off_ip2;		/* second IP (uint32_t) */
+	uint64_t	ncph_off_port1;		/* first TCP port (uint16_t) */
+	uint64_t	ncph_off_port2;		/* second TCP port (uint16_t) */
+	uint64_t	ncph_off_state;		/* TCP state (uint8_t) */
+	uint64_t	ncph_off_class;		/* class (uint8_t) */
+	uint64_t	ncph_off_source1;	/* first source (uint16_t) */
+	uint64_t	ncph_off_source2;	/* second source (uint16_t) */
+	uint64_t	ncph_off_sources;	/* sources (ncpub_source_t) */
+} ncpub_hdr_t;
+
+/*
+ * An entry in the source table, indexed by the values in the source columns.
+ */
+typedef struct {
+	char		ncps_name[NCPUB_SOURCELEN];	/* source label */
+	int64_t		ncps_captured;		/* capture time (Unix) */
+} ncpub_source_t;
+
+#endif	/* _NCPUB_H */
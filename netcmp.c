@@ -15,7 +15,142 @@
  *     netcmp [-d] FILE1 FILE2 ...
  *
  * where each of the named files contains the output of
- * "netstat -n -f inet -P tcp" from one system.
+ * "netstat -n -f inet -P tcp" from one system.  Files may also be packet
+ * captures (pcap or pcapng), in which case each IP address in the capture is
+ * treated as a system whose connections are those seen in the capture (see
+ * nc_read_pcap()), or connection tracking tables from NAT gateways, which are
+ * used to match up the two ends of translated connections (see ncnat_t).
+ * Alternatively, invoke as:
+ *
+ *     netcmp -D [-d] OLDFILE NEWFILE
+ *
+ * where both files contain the same netstat output taken from the same system
+ * at two different times.  In this mode, netcmp reports the connections that
+ * were added, removed, or changed state between the two snapshots.  Finally,
+ * invoke as:
+ *
+ *     netcmp -R [-o FILE] OLDRESULT NEWRESULT
+ *
+ * where both files are results published by earlier runs with "-P" (see
+ * below).  In this mode, netcmp reports which asymmetric connections, and which
+ * pairs of IP addresses with asymmetric connections between them, are new in
+ * NEWRESULT, were resolved since OLDRESULT, or persist in both.
+ *
+ * With "-a AGEFILE", netcmp records in AGEFILE when each connection was first
+ * seen, carrying that forward across successive runs.  The report then shows
+ * how long each asymmetric connection has existed (oldest first), and "-A
+ * MINAGE" hides asymmetric connections seen for fewer than MINAGE seconds.
+ *
+ * With "-i INTERVAL", netcmp runs continuously, repeating the whole comparison
+ * (reading the input files and other sources again, and rewriting the report)
+ * every INTERVAL seconds, and keeps a history of each round's summary, merging
+ * older rounds into coarser entries (see nchist_t).  "-H HISTFILE" saves the
+ * history across restarts, and "-C SOCKET" answers queries about it on a Unix
+ * socket (see nc_ctl_serve()).
+ *
+ * With "-b BENCHFILE", netcmp appends to BENCHFILE a line of measurements of
+ * the run (or of each round, with "-i"): rows ingested per second, time spent
+ * reading files, parsing rows, classifying, and reporting, and peak RSS.  Two
+ * such files, each from repeated runs of a different build, are compared by
+ * invoking as:
+ *
+ *     netcmp -M [-t PCT] [-o FILE] OLDBENCH NEWBENCH
+ *
+ * which reports the median of each measurement with a confidence interval, and
+ * flags changes for the worse of more than PCT percent (default 5) that are
+ * statistically significant.  The exit status is 3 if there are any.
+ *
+ * With "-O DIR", netcmp also writes into DIR one file per source label (i.e.,
+ * per input file) listing the asymmetric connections held only by that source.
+ * Slashes in labels (see "-N") are replaced with colons in the file names.
+ *
+ * With "-N" (Linux only), netcmp also collects the TCP connections of each of
+ * the local system's network namespaces directly from the kernel, as though
+ * each namespace's connections came from a separate netstat file.  This covers
+ * all of the containers on a host with one run.  The host's own namespace is
+ * labelled with the host name, and the others "HOSTNAME/NAME".  Each
+ * connection's TCP_INFO statistics are collected too, and the report then lists
+ * asymmetric connections longest idle first (unless "-a" is given), with their
+ * idle time, RTT, bytes acknowledged, and retransmits, and flags "STALLED"
+ * those that are retransmitting without getting any acknowledgement.
+ *
+ * Listing sockets still costs time proportional to the number of connections
+ * on every run.  "-T BPFDIR" (Linux only) instead installs a small BPF program
+ * on the sock:inet_sock_set_state tracepoint that maintains a table of the
+ * system's IPv4 TCP connections (in all namespaces) as they change state, and
+ * pins it in BPFDIR, a directory in a BPF filesystem.  The tracker stays
+ * installed after netcmp exits, until its pins are removed.  Later runs with
+ * "-B BPFDIR" read the table as a source labelled with the host name, without
+ * walking the kernel's socket tables.  Connections in TIME_WAIT are not
+ * tracked.
+ *
+ * With "-s SKEW", connections seen by only one side in a transient TCP state
+ * (SYN_SENT, SYN_RCVD, FIN_WAIT_1, or LAST_ACK) are reported as "in-flight"
+ * rather than abandoned when the two sides' snapshots were captured within SKEW
+ * seconds of each other.  Since the snapshots aren't taken at exactly the same
+ * time, such connections are usually just being opened or closed.  The capture
+ * time of each snapshot is taken to be the modification time of its file.
+ *
+ * With "-q", netcmp ingests and classifies the connections once and then reads
+ * queries from stdin instead of printing the report.  Each query is a line
+ * like:
+ *
+ *     [FIELD=VALUE | FIELD!=VALUE ...] [by FIELD] [limit N]
+ *
+ * where FIELD is one of "ip", "port", "state", "class", or "source".  "ip" and
+ * "port" match either end of the connection.  Without "by", the query prints
+ * the number of matching connections and the first N of them (default 20).
+ * With "by", it prints the number of matching connections in each group, for
+ * the N largest groups.  A connection is counted in the groups for both of its
+ * IP addresses or sources.  In addition to the filter fields, queries can group
+ * by "pair" (the pair of IP addresses).  When grouping by "port", each
+ * connection is counted under its lower-numbered port, which is usually the
+ * service port.
+ *
+ * Two other kinds of queries look up connections directly by tuple:
+ *
+ *     lookup IP1:PORT1 IP2:PORT2	show the connection with this tuple
+ *     pair IP1 IP2 [limit N]		show connections between IP1 and IP2
+ *
+ * These are answered from a compact, immutable copy of the connection index
+ * (see ncfrozen_t), so each takes a few microseconds.
+ *
+ * With "-o FILE", the report is written to FILE instead of stdout.  If FILE
+ * ends in ".gz" or ".zst", the report is compressed on the fly with gzip or
+ * zstd, respectively.
+ *
+ * Input files may also be compressed with gzip or zstd, which is detected from
+ * their contents.  Files made up of many independently compressed frames
+ * (multi-frame zstd, as written by seekable zstd tools, or gzip files written
+ * by bgzip) are decompressed by several threads at once.
+ *
+ * With "-V NAME=PATTERN[,PATTERN...]" (which may be repeated, up to 64 times),
+ * the report also includes a summary for the named view: the subset of sources
+ * whose labels match any of the shell-style patterns (e.g., "az1=db*,web1*").
+ * Each view's connections are classified as though only its sources had been
+ * supplied, so that the same input can be compared under several groupings of
+ * hosts in one run.
+ *
+ * With "-g K", the report also lists the K IP addresses (for which no data was
+ * supplied) that appear in the most external connections, along with how many
+ * sources saw each one.  These are the hosts whose data would resolve the most
+ * external connections.
+ *
+ * With "-c CKPTFILE", netcmp periodically saves the connections read so far,
+ * along with the list of input files completed, to CKPTFILE.  If CKPTFILE
+ * already exists when netcmp starts, it's loaded first and the files it lists
+ * are skipped, so that a run that was interrupted picks up where it left off.
+ * CKPTFILE is removed once the run completes successfully.
+ *
+ * With "-d", netcmp prints debugging information to stderr, including counts
+ * of connections that it could not classify cleanly (e.g., those involving an
+ * IP address for which no data was supplied).  Only a sample of such
+ * connections is printed for each category: by default the first 5, or the
+ * first N (at most 100000) with "-S N".
+ *
+ * With "-P FILE", netcmp also publishes the classified connections, the
+ * sources, and the summary counts to FILE in a binary form that other programs
+ * can map and use directly.  See ncpub.h for the format.
  *
  * TODO current status: This does produce a somewhat useful report, but the
  * summary is still pretty unwieldy.  It would be great if this produced a
@@ -44,19 +179,59 @@
  *       of examples (e.g., 5)
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define	_GNU_SOURCE	/* for setns(2) */
+#endif
+
 #include <assert.h>
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/avl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <linux/bpf.h>
+#include <linux/inet_diag.h>
+#include <linux/netlink.h>
+#include <linux/perf_event.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+#include "compat.h"
+#endif
+
+#include "ncpub.h"
 
 #define EXIT_USAGE 2
+#define EXIT_REGRESSION 3
 
 /*
  * There's not a great way to use the illumos-provided boolean_t in a portable
@@ -77,6 +252,61 @@ typedef enum {
 #define	TCP_PORTBUFSZ	(sizeof ("65536"))
 #define	IPV4PORT_BUFSZ	(sizeof ("000.000.000.000:12345"))
 
+/*
+ * TCP connection states reported by netstat.  The order of this enum must match
+ * the nc_states table of names below.
+ */
+typedef enum {
+	NS_CLOSED = 0,
+	NS_IDLE,
+	NS_BOUND,
+	NS_LISTEN,
+	NS_SYN_SENT,
+	NS_SYN_RCVD,
+	NS_ESTABLISHED,
+	NS_CLOSE_WAIT,
+	NS_FIN_WAIT_1,
+	NS_CLOSING,
+	NS_LAST_ACK,
+	NS_FIN_WAIT_2,
+	NS_TIME_WAIT,
+	NS_NSTATES
+} ncstate_t;
+
+static const char *nc_states[] = {
+	"CLOSED",
+	"IDLE",
+	"BOUND",
+	"LISTEN",
+	"SYN_SENT",
+	"SYN_RCVD",
+	"ESTABLISHED",
+	"CLOSE_WAIT",
+	"FIN_WAIT_1",
+	"CLOSING",
+	"LAST_ACK",
+	"FIN_WAIT_2",
+	"TIME_WAIT",
+};
+
+/*
+ * Represents a source label: the basename of an input file, which identifies
+ * the host that the data came from.  Labels are numbered in the order that we
+ * first see them.  Sources from different input files with the same basename
+ * share a label.
+ */
+typedef struct nclabel {
+	char		ncl_name[128];		/* label (file basename) */
+	unsigned int	ncl_id;			/* index in nc_labels */
+	time_t		ncl_captured;		/* time snapshot was taken */
+	uint64_t	ncl_views;		/* views with this label */
+
+	/* asymmetric connections held by this source ("-O" only) */
+	struct ncconn	**ncl_asym;
+	size_t		ncl_nasym;
+	size_t		ncl_nalloc;
+} nclabel_t;
+
 /*
  * Represents an input file, which corresponds to the netstat output from a
  * single host.  The host is identified by the basename of the input filename.
@@ -87,565 +317,10016 @@ typedef enum {
  *
  * We track a set of these in an AVL tree indexed by the local IP address.
  * (There can be more than one of these per input file when hosts have more
- * than one local IP address.)
+ * than one local IP address.)  A NAT gateway standing in for an IP address
+ * with no data of its own (see nc_nat_observe()) also gets one of these for
+ * the connections it saw, but it's kept out of the tree, since the IP address
+ * still has no data for any other connection.
  */
 typedef struct {
-	char		ncs_ip[IPV4_STRBUFSZ];	/* source IP address */
-	char		ncs_label[128];		/* source label */
+	uint32_t	ncs_ip;			/* source IP address */
+	ncbool_t	ncs_standin;		/* gateway standing in for ip */
+	nclabel_t	*ncs_label;		/* source label */
 	avl_node_t	ncs_link;		/* link in AVL tree */
 } ncsource_t;
 
 /*
  * This structure keeps track of each unique four-tuple: local and remote IP
  * addresses and TCP ports.  We're not going to do any network operations with
- * these, so we don't bother convering them to network byte order.  The only
- * reason we even parse the port numbers is to save a few bytes.  (We may end up
- * processing millions of connections.)  We could save more memory and
- * potentially operate faster by parsing the IP addresses, too.
+ * these, so we don't bother convering them to network byte order: IP addresses
+ * are stored as integers in host byte order, which also makes them sort
+ * numerically.  Parsing the addresses and ports saves memory and makes
+ * comparisons cheap.  (We may end up processing millions of connections.)
  *
  * In the best case, we're going to wind up seeing the same four-tuple twice:
  * once when we process the netstat output for each endpoint.  We normalize the
  * structure by sorting the (IP/port) pairs and putting the first one into
- * ncc_ip1/ncc_port1 and the second one into ncc_ip2/ncc_port2.
+ * ip1/port1 and the second one into ip2/port2.
+ *
+ * Most connections are between a small number of pairs of IP addresses (e.g.,
+ * from application servers to a database, with thousands of ephemeral ports),
+ * so connections are indexed in two levels.  Each pair of IP addresses has an
+ * ncpair_t, found through an AVL tree, and each pair holds an array of its
+ * connections, which record only their ports.  The sources for a connection
+ * are always the sources for one or both of the pair's IP addresses, so those
+ * are kept in the pair, too, and each connection records only which side each
+ * of its sources is on.
+ *
+ * While we're reading input, each pair's array of connections is an
+ * open-addressing hash table keyed by port numbers, where unused slots have
+ * ncc_nsources == 0.  The tables are allocated from the arena, like everything
+ * else in the index (see nc_conn_table_alloc()).  Once all the input has been
+ * read, nc_index_freeze() compacts each array in place and sorts it by ports.
+ * After that, connections don't move, and iterating with nc_conn_first() and
+ * nc_conn_next() visits them sorted by (ip1, ip2, port1, port2).
  */
-typedef struct {
-	char		ncc_ip1[IPV4_STRBUFSZ];	/* first IP/port tuple */
-	uint16_t	ncc_port1;
-	char		ncc_ip2[IPV4_STRBUFSZ];	/* second IP/port tuple */
-	uint16_t	ncc_port2;
+typedef struct ncpair {
+	uint32_t	ncpr_ip1;		/* first IP address */
+	uint32_t	ncpr_ip2;		/* second IP address */
+	ncsource_t	*ncpr_sources[2];	/* sources for ip1 and ip2 */
+	struct ncconn	*ncpr_conns;		/* connections (see above) */
+	uint32_t	ncpr_nconns;		/* number of connections */
+	uint32_t	ncpr_size;		/* slots in ncpr_conns */
+	avl_node_t	ncpr_link;		/* link in AVL tree */
+} ncpair_t;
 
-	/* This could be turned into an enum to save memory. */
-	char		ncc_state[16];		/* TCP connection state */
+typedef struct ncconn {
+	ncpair_t	*ncc_pair;		/* IP addresses and sources */
+	uint16_t	ncc_port1;		/* first port */
+	uint16_t	ncc_port2;		/* second port */
+
+	uint8_t		ncc_state;		/* TCP state (ncstate_t) */
+	uint8_t		ncc_class;		/* classification (ncclass_t) */
 
 	/*
 	 * In general, we expect no more than two sources.  We'll count up to
-	 * UINT8_MAX sources, but only track two of them.
+	 * UINT8_MAX sources, but only track two of them.  For each of the first
+	 * two, ncc_sides records (in two bits) whether it's the source for ip1
+	 * (1) or ip2 (2).  Use NCC_SOURCE() to get the source itself.
 	 */
 	uint8_t		ncc_nsources;		/* number of sources */
-	ncsource_t	*ncc_sources[2];	/* first two soures */
+	uint8_t		ncc_sides;		/* sides of first two sources */
 
-	avl_node_t	ncc_conn_link;		/* link in AVL tree */
+	/* time this connection was first seen (with "-a"), or 0 */
+	uint32_t	ncc_firstseen;
 } ncconn_t;
 
+#define	NCC_IP1(ncc)		((ncc)->ncc_pair->ncpr_ip1)
+#define	NCC_IP2(ncc)		((ncc)->ncc_pair->ncpr_ip2)
+#define	NCC_SIDE(ncc, i)	(((ncc)->ncc_sides >> (2 * (i))) & 0x3)
+#define	NCC_SOURCE(ncc, i)	\
+	((ncc)->ncc_pair->ncpr_sources[NCC_SIDE(ncc, i) - 1])
+
+#define	NC_PAIR_MINSIZE		4	/* initial slots per pair */
+
 /*
- * Represents the overall netcmp operation.  Configuration, counters, and
- * accumulated state hang off this object.
+ * Each connection is classified into one of the following classes by
+ * nc_classify().  The order of this enum must match the nc_classes table of
+ * names below.
  */
-typedef struct {
-	/* enable debug messages */
-	ncbool_t	nc_debug;
+typedef enum {
+	NCL_TIMEWAIT = 0,	/* in state TIME_WAIT (ignored) */
+	NCL_MULTI,		/* more than two sources (an error) */
+	NCL_SYMMETRIC,		/* present on both sides */
+	NCL_EXTERNAL,		/* we have data for only one side */
+	NCL_INFLIGHT,		/* one side only, in a transient state ("-s") */
+	NCL_ASYMMETRIC,		/* abandoned by one side */
+	NCL_NCLASSES
+} ncclass_t;
 
-	/* count of localhost connections skipped */
-	unsigned long	nc_nlocalhost;
+static const char *nc_classes[] = {
+	"timewait",
+	"multi",
+	"symmetric",
+	"external",
+	"inflight",
+	"asymmetric",
+};
 
-	/* set of all connections found */
-	avl_tree_t	nc_conns;
+/*
+ * A view ("-V") is a subset of the sources, named by a list of patterns that
+ * match source labels.  Each view is classified as though only its sources had
+ * been supplied, which changes which connections are external or asymmetric.
+ * All views are classified in the same pass over the connections as the full
+ * set of sources: each label records the set of views that include it as a
+ * bitmask (ncviewset_t), so the views that see each side of a connection, and
+ * the views that cover each IP address, are also bitmasks, and each class is
+ * computed for all views at once with a few bitwise operations.
+ */
+#define	NC_MAXVIEWS	64
 
-	/* set of all sources found */
-	avl_tree_t	nc_sources;
-} netcmp_t;
+typedef uint64_t ncviewset_t;
 
-static const char *nc_arg0;
-static void usage(void);
+typedef struct {
+	const char	*ncv_name;		/* view name */
+	const char	*ncv_patterns;		/* comma-separated patterns */
+	unsigned int	ncv_nsources;		/* labels in the view */
+	unsigned long	ncv_nclass[NCL_NCLASSES]; /* count of each class */
+} ncview_t;
 
-/* Public functions (if this were a separate module) */
-static void nc_init(netcmp_t *);
-static int nc_parse_options(netcmp_t *, int, char *[]);
-static int nc_read_file(netcmp_t *, const char *);
-static void nc_report(netcmp_t *);
-static void nc_ipport_tostr(char *, size_t, const char *, uint16_t);
-static void nc_conn_dump(FILE *, ncconn_t *);
+/*
+ * Column-oriented copy of the classified connections, used to answer queries
+ * ("-q").  Row i of each column describes the same connection, and rows are
+ * sorted by tuple.  Sources are identified by label id, with NC_NOLABEL for
+ * connections with only one source.
+ */
+#define	NC_NOLABEL	UINT16_MAX
 
-/* Private functions */
-static int nc_parse_row(netcmp_t *, const char *, char *);
-static int nc_parse_ipport(char *, size_t, uint16_t *, char *);
-static int nc_conn_compare(const void *, const void *);
-static int nc_source_compare(const void *vncs1, const void *vncs2);
+/*
+ * Round up to a multiple of 8 bytes, used to align arrays in the published
+ * result file ("-P").
+ */
+#define	NC_ROUNDUP8(x)	(((x) + 7) & ~(uint64_t)7)
 
-int
-main(int argc, char *argv[])
-{
-	int i;
-	netcmp_t netcmp;
+typedef struct {
+	size_t		ncrs_n;			/* number of rows */
+	uint32_t	*ncrs_ip1;		/* first IP address */
+	uint32_t	*ncrs_ip2;		/* second IP address */
+	uint16_t	*ncrs_port1;		/* first TCP port */
+	uint16_t	*ncrs_port2;		/* second TCP port */
+	uint8_t		*ncrs_state;		/* TCP state (ncstate_t) */
+	uint8_t		*ncrs_class;		/* classification (ncclass_t) */
+	uint16_t	*ncrs_label1;		/* first source's label */
+	uint16_t	*ncrs_label2;		/* second source's label */
+} ncresult_t;
 
-	nc_arg0 = argv[0];
-	nc_init(&netcmp);
-	i = nc_parse_options(&netcmp, argc, argv);
-	assert(i >= 0);
+/*
+ * Compact, immutable index of connections, built once ingest is finished for
+ * answering lookups by tuple ("-q").  Each connection's tuple is treated as a
+ * 96-bit key: ip1 in the high 32 bits ("hi") and ip2, port1, and port2 in the
+ * low 64 bits ("lo").  Keys are stored in sorted order as a stream of
+ * variable-length deltas: a varint for the difference in hi, followed by a
+ * varint for the difference in lo if hi didn't change or for lo itself if it
+ * did.  Since most connections share their IP addresses with their
+ * predecessor, most keys take 2-4 bytes.  Every NC_FROZEN_BLOCK keys, we
+ * record a sample of the full key and its position in the stream, so a lookup
+ * binary searches the samples and then decodes at most one block.  The other
+ * attributes of the connection are stored in plain columns.
+ */
+#define	NC_FROZEN_BLOCK		64
 
-	if (argc - optind < 2) {
-		warnx("need two filenames");
-		usage();
-	}
+typedef struct {
+	uint32_t	ncfs_hi;		/* first key in block (hi) */
+	uint32_t	ncfs_off;		/* offset of 2nd key's delta */
+	uint64_t	ncfs_lo;		/* first key in block (lo) */
+} ncfrozensample_t;
 
-	while (i < argc) {
-		assert(argv[i] != NULL);
-		if (nc_read_file(&netcmp, argv[i++]) != 0)
-			return (EXIT_FAILURE);
-	}
+typedef struct {
+	size_t			ncfz_n;		/* number of connections */
+	uint8_t			*ncfz_keys;	/* delta-encoded keys */
+	size_t			ncfz_keysz;	/* bytes in ncfz_keys */
+	ncfrozensample_t	*ncfz_samples;	/* one per block */
+	uint8_t			*ncfz_stclass;	/* state | class << 4 */
+	uint16_t		*ncfz_label1;	/* see ncrs_label1 */
+	uint16_t		*ncfz_label2;	/* see ncrs_label2 */
+} ncfrozen_t;
 
-	nc_report(&netcmp);
-	return (0);
-}
+/*
+ * Position in a frozen index, for decoding keys in order.
+ */
+typedef struct {
+	size_t		ncfc_i;			/* index of current key */
+	uint32_t	ncfc_hi;		/* current key (hi) */
+	uint64_t	ncfc_lo;		/* current key (lo) */
+	const uint8_t	*ncfc_p;		/* next delta in the stream */
+} ncfrozencur_t;
 
-static void
-usage(void)
-{
-	(void) fprintf(stderr, "usage: %s [-d] FILE1 FILE2 ...\n", nc_arg0);
-	exit(EXIT_USAGE);
-}
+#define	NC_KEY_LO(ip2, port1, port2)	\
+	((uint64_t)(ip2) << 32 | (uint32_t)(port1) << 16 | (port2))
 
 /*
- * netcmp "public" functions (if this were a separate module)
+ * Fields that queries can filter or group by.  The order of this enum must
+ * match the nc_qfields table of names below.
  */
+typedef enum {
+	NQF_IP = 0,
+	NQF_PORT,
+	NQF_STATE,
+	NQF_CLASS,
+	NQF_SOURCE,
+	NQF_PAIR,		/* group-by only */
+	NQF_NFIELDS,
+	NQF_NONE = NQF_NFIELDS
+} ncqfield_t;
+
+static const char *nc_qfields[] = {
+	"ip",
+	"port",
+	"state",
+	"class",
+	"source",
+	"pair",
+};
+
+#define	NC_QUERY_MAXPREDS	16
+#define	NC_QUERY_LIMIT		20
+
+typedef struct {
+	ncqfield_t	ncqp_field;		/* field to compare */
+	ncbool_t	ncqp_negate;		/* "!=" rather than "=" */
+	uint32_t	ncqp_value;		/* value to compare against */
+} ncqpred_t;
+
+typedef struct {
+	ncqpred_t	ncq_preds[NC_QUERY_MAXPREDS]; /* filters (ANDed) */
+	unsigned int	ncq_npreds;		/* number of filters */
+	ncqfield_t	ncq_groupby;		/* group-by field or NQF_NONE */
+	unsigned long	ncq_limit;		/* max rows/groups to print */
+} ncquery_t;
 
 /*
- * Initialize the netcmp operation.
+ * A published result file ("-P") mapped for reading ("-R").  The column
+ * pointers point into the mapping.
  */
-static void
-nc_init(netcmp_t *ncp)
-{
-	bzero(ncp, sizeof (*ncp));
-	avl_create(&ncp->nc_conns, nc_conn_compare,
-	    sizeof (ncconn_t), offsetof(ncconn_t, ncc_conn_link));
-	avl_create(&ncp->nc_sources, nc_source_compare,
-	    sizeof (ncsource_t), offsetof(ncsource_t, ncs_link));
-}
+typedef struct {
+	const char		*ncpm_path;	/* file name */
+	char			*ncpm_base;	/* start of mapping */
+	size_t			ncpm_size;	/* size of mapping */
+	const ncpub_hdr_t	*ncpm_hdr;	/* file header */
+	const uint32_t		*ncpm_ip1;	/* see ncph_off_ip1 */
+	const uint32_t		*ncpm_ip2;	/* see ncph_off_ip2 */
+	const uint16_t		*ncpm_port1;	/* see ncph_off_port1 */
+	const uint16_t		*ncpm_port2;	/* see ncph_off_port2 */
+	const uint8_t		*ncpm_state;	/* see ncph_off_state */
+	const uint8_t		*ncpm_class;	/* see ncph_off_class */
+	const uint16_t		*ncpm_source1;	/* see ncph_off_source1 */
+	const ncpub_source_t	*ncpm_sources;	/* see ncph_off_sources */
+	unsigned int		ncpm_asym;	/* "asymmetric" class value */
+} ncpubmap_t;
 
 /*
- * Parse command-line options, recording the requested configuration into "ncp".
+ * Open-addressing hash table mapping 64-bit keys to counts, used for
+ * aggregations.  A slot with a zero count is empty.  The size is always a power
+ * of two.
  */
-static int
-nc_parse_options(netcmp_t *ncp, int argc, char *argv[])
-{
-	char c;
+typedef struct {
+	uint64_t	*nch_keys;		/* keys */
+	uint64_t	*nch_counts;		/* counts */
+	size_t		nch_size;		/* number of slots */
+	size_t		nch_nused;		/* number of occupied slots */
+} nchash_t;
 
-	while ((c = getopt(argc, argv, ":d")) != -1) {
-		switch (c) {
-		case 'd':
-			ncp->nc_debug = NB_TRUE;
-			break;
+/*
+ * Every open-addressing hash table (nchash_t, the per-pair connection tables,
+ * and the flow, NAT, and TCP_INFO tables) places keys with nc_keyhash(), which
+ * is keyed with random words chosen for each run by nc_hashkey_init().  The
+ * ports, and often the addresses, of the connections we index are chosen by
+ * the clients that opened them.  With a fixed hash function, someone could pick
+ * tuples that all land in the same few slots, so that each insert probes past
+ * all of the others and ingest takes time quadratic in the number of
+ * connections.  Without the key, there's no way to tell which tuples collide.
+ * The mixing is that of wyhash: two rounds of multiplying two 64-bit words,
+ * each xored with key words, into a 128-bit product (see nc_mum()).
+ */
+#define	NC_HASHKEY_WORDS	4
 
-		case ':':
-			warnx("option requires an argument: -%c", c);
-			usage();
-			break;
+static uint64_t nc_hashkey[NC_HASHKEY_WORDS];
 
-		case '?':
-			warnx("unrecognized option: -%c", c);
-			usage();
-			break;
-		}
-	}
+/*
+ * Extended TCP statistics for one end of a connection, taken from the kernel's
+ * TCP_INFO when connections are collected with "-N".  Each end reports its own
+ * view, so entries are keyed by the (local, remote) tuple as that end sees it.
+ * They're kept in a separate open-addressing hash table (nctcpinfotab_t)
+ * rather than in the connection records, which stay the same size whether or
+ * not any statistics were collected.  A slot with ncti_used == 0 is empty.
+ */
+typedef struct nctcpinfo {
+	uint64_t	ncti_acked;		/* bytes acknowledged by peer */
+	uint32_t	ncti_lip;		/* local IP address */
+	uint32_t	ncti_rip;		/* remote IP address */
+	uint16_t	ncti_lport;		/* local TCP port */
+	uint16_t	ncti_rport;		/* remote TCP port */
+	uint32_t	ncti_lastsend;		/* ms since data last sent */
+	uint32_t	ncti_lastrecv;		/* ms since data last recvd */
+	uint32_t	ncti_rtt;		/* smoothed RTT (us) */
+	uint32_t	ncti_retrans;		/* total retransmits */
+	uint8_t		ncti_backoff;		/* unacknowledged timeouts */
+	uint8_t		ncti_used;		/* slot is in use */
+} nctcpinfo_t;
 
-	return (optind);
-}
+typedef struct {
+	nctcpinfo_t	*nct_slots;		/* entries (hash table) */
+	size_t		nct_size;		/* slots in nct_slots */
+	size_t		nct_nused;		/* entries in nct_slots */
+} nctcpinfotab_t;
 
 /*
- * Read the netstat data contained in the named file and record what we find.
+ * Used to sort asymmetric connections by idle time.  nci_idle is one more than
+ * the idle time in seconds, or 0 if the connection has no TCP_INFO.
  */
-static int
-nc_read_file(netcmp_t *ncp, const char *filename)
-{
-	FILE *fstream;
-	const char *source;
-	char buf[256];
-	int i;
-	int linenum = 1;
+typedef struct {
+	unsigned long	nci_idle;		/* idle time (see above) */
+	ncconn_t	*nci_conn;		/* connection */
+} ncidle_t;
 
-	(void) fprintf(stderr, "processing file %s\n", filename);
-	if ((fstream = fopen(filename, "r")) == NULL) {
-		err(EXIT_FAILURE, "fopen");
-	}
+/*
+ * The contents of a single row of netstat output, as produced by
+ * nc_parse_line().  Each netstat row has seven columns: the local and remote
+ * IP/port pairs, the four send/receive window and queue columns, and the TCP
+ * state.
+ */
+typedef struct {
+	uint32_t	ncrw_ip1;		/* local IP address */
+	uint32_t	ncrw_ip2;		/* remote IP address */
+	uint16_t	ncrw_port1;		/* local TCP port */
+	uint16_t	ncrw_port2;		/* remote TCP port */
+	uint32_t	ncrw_swind;		/* "Swind" column */
+	uint32_t	ncrw_sendq;		/* "Send-Q" column */
+	uint32_t	ncrw_rwind;		/* "Rwind" column */
+	uint32_t	ncrw_recvq;		/* "Recv-Q" column */
+	uint8_t		ncrw_state;		/* TCP state (ncstate_t) */
+	const nctcpinfo_t	*ncrw_tcpinfo;	/* TCP_INFO, or NULL */
+} ncrow_t;
 
-	/* Check the first line. */
-	if (fgets(buf, sizeof (buf), fstream) == NULL) {
-		errx(EXIT_FAILURE, "reading from stream");
-	}
+/*
+ * Return values from nc_parse_line().
+ */
+#define	NC_PARSE_OK	0	/* parsed a data row */
+#define	NC_PARSE_BLANK	1	/* skipped a blank line */
+#define	NC_PARSE_SHORT	2	/* need more input to finish the row */
+#define	NC_PARSE_ERROR	(-1)	/* the row is malformed */
 
-	if (strcmp(buf, "\n") != 0) {
-		errx(EXIT_FAILURE, "expected blank line");
-	}
+/*
+ * Describes a malformed row found by nc_parse_line().
+ */
+typedef struct {
+	const char	*ncpe_msg;		/* description of the problem */
+	const char	*ncpe_column;		/* name of netstat column */
+	int		ncpe_offset;		/* 1-based character offset */
+} ncparseerr_t;
 
-	/* Check the second line. */
-	linenum++;
-	if (fgets(buf, sizeof (buf), fstream) == NULL) {
-		errx(EXIT_FAILURE, "reading from stream");
-	}
+/*
+ * Names of the netstat columns, used in error messages from nc_parse_line().
+ */
+static const char *nc_columns[] = {
+	"Local Address",
+	"Remote Address",
+	"Swind",
+	"Send-Q",
+	"Rwind",
+	"Recv-Q",
+	"State",
+};
 
-	if (strcmp(buf, "TCP: IPv4\n") != 0) {
-		errx(EXIT_FAILURE, "expected \"TCP: IPv4\" header");
-	}
+/*
+ * nc_parse_line() recognizes TCP state names using a DFA built from nc_states
+ * by nc_state_dfa_init().  Node 0 is the dead state and node 1 is the start
+ * state.  nc_state_accept[node] is the ncstate_t recognized at "node", or -1.
+ */
+#define	NC_DFA_MAXNODES	128
 
-	/* Check the third line. */
-	linenum++;
-	if (fgets(buf, sizeof (buf), fstream) == NULL) {
-		errx(EXIT_FAILURE, "reading from stream");
-	}
+static uint8_t nc_state_dfa[NC_DFA_MAXNODES][128];
+static int8_t nc_state_accept[NC_DFA_MAXNODES];
 
-	if (strstr(buf, "Local Address") == NULL ||
-	    strstr(buf, "Remote Address") == NULL ||
-	    strstr(buf, "Swind") == NULL || strstr(buf, "Send-Q") == NULL ||
-	    strstr(buf, "Rwind") == NULL || strstr(buf, "Recv-Q") == NULL ||
-	    strstr(buf, "State") == NULL || strchr(buf, '\n') == NULL) {
-		errx(EXIT_FAILURE, "expected column headers");
-	}
+/*
+ * Size of the buffer used to read netstat data rows.  Rows longer than this are
+ * rejected.
+ */
+#define	NC_READBUFSZ	(1024 * 1024)
 
-	/* Check the fourth line. */
-	linenum++;
-	if (fgets(buf, sizeof (buf), fstream) == NULL) {
-		errx(EXIT_FAILURE, "reading from stream");
-	}
+/*
+ * IPv4 address of localhost (127.0.0.1), in host byte order.
+ */
+#define	NC_LOCALHOST	0x7f000001
 
-	for (i = 0; buf[i] != '\0' && buf[i] != '\n'; i++) {
-		if (buf[i] != '-' && !isspace(buf[i])) {
-			errx(EXIT_FAILURE, "expected separator row");
-		}
-	}
+/*
+ * Packet captures ("pcap" and "pcapng" files) are accepted as input in place of
+ * netstat output.  nc_read_pcap() follows each TCP connection in the capture
+ * through its handshake and teardown, and then reports each endpoint's view of
+ * the connections it was part of as though it came from a netstat file for
+ * that endpoint.  Capture files are recognized by their leading magic number.
+ */
+#define	NC_PCAP_MAGIC		0xa1b2c3d4	/* microsecond timestamps */
+#define	NC_PCAP_MAGIC_NS	0xa1b23c4d	/* nanosecond timestamps */
+#define	NC_PCAPNG_SHB		0x0a0d0d0a	/* pcapng section header */
+#define	NC_PCAPNG_BOM		0x1a2b3c4d	/* pcapng byte-order magic */
+#define	NC_PCAPNG_IDB		1		/* interface description */
+#define	NC_PCAPNG_SPB		3		/* simple packet block */
+#define	NC_PCAPNG_EPB		6		/* enhanced packet block */
+#define	NC_PCAPNG_TSRESOL	9		/* if_tsresol option */
+#define	NC_ROUNDUP4(x)		(((x) + 3) & ~3)
 
-	/* The remaining lines are data lines. */
-	source = strrchr(filename, '/');
-	if (source == NULL) {
-		source = filename;
-	} else {
-		source = source + 1;
-	}
+/*
+ * Read big-endian (network byte order) values from packet headers.
+ */
+#define	NC_BE16(p)	((uint16_t)(((p)[0] << 8) | (p)[1]))
+#define	NC_BE32(p)	\
+	(((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | \
+	((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
 
-	while (fgets(buf, sizeof (buf), fstream) != NULL) {
-		linenum++;
+/*
+ * Link-layer header types (from the tcpdump.org registry) that we can decode.
+ */
+#define	NC_DLT_NULL		0		/* BSD loopback */
+#define	NC_DLT_EN10MB		1		/* Ethernet */
+#define	NC_DLT_RAW		12		/* raw IP (some BSDs) */
+#define	NC_DLT_RAW_ALT		101		/* raw IP */
+#define	NC_DLT_LINUX_SLL	113		/* Linux "cooked" capture */
+#define	NC_DLT_IPV4		228		/* raw IPv4 */
+#define	NC_DLT_LINUX_SLL2	276		/* Linux "cooked" capture v2 */
 
-		if (strcmp(buf, "\n") == 0) {
-			continue;
-		}
+/*
+ * A connection that hasn't sent a packet in this many seconds of capture time
+ * is assumed to be gone from both ends and is forgotten.  This is a little
+ * longer than the default TCP keepalive interval (2 hours) so that idle
+ * connections with keepalives enabled are not lost.
+ */
+#define	NC_PCAP_IDLE		(2 * 60 * 60 + 10 * 60)
 
-		if (strchr(buf, '\n') == NULL) {
-			errx(EXIT_FAILURE, "line too long");
-		}
+/*
+ * Flags recording what each end of a captured connection has sent.
+ */
+#define	NCF_SYN		0x01	/* SYN (active open) */
+#define	NCF_SYNACK	0x02	/* SYN-ACK (passive open) */
+#define	NCF_ACK		0x04	/* segment with ACK and no SYN */
+#define	NCF_FIN		0x08	/* FIN */
+#define	NCF_FINACKED	0x10	/* the other end has acknowledged our FIN */
+#define	NCF_RST		0x20	/* RST */
 
-		if (nc_parse_row(ncp, source, buf) != 0) {
-			errx(EXIT_FAILURE,
-			    "failed to process line %d", linenum);
-		}
-	}
+/*
+ * A TCP connection found in a packet capture.  The endpoints are ordered so
+ * that (ncfl_ip[0], ncfl_port[0]) sorts before (ncfl_ip[1], ncfl_port[1]), and
+ * each per-end array is indexed the same way.  Flows are kept in an
+ * open-addressing hash table (ncflowtab_t) in which a slot with ncfl_used ==
+ * 0 is empty.
+ */
+typedef struct {
+	uint32_t	ncfl_ip[2];		/* IP address of each end */
+	uint16_t	ncfl_port[2];		/* TCP port of each end */
+	uint32_t	ncfl_finseq[2];		/* sequence number after FIN */
+	uint32_t	ncfl_lastseen;		/* time of last packet */
+	uint8_t		ncfl_flags[2];		/* NCF_* flags for each end */
+	uint8_t		ncfl_finfirst;		/* 1 + end that closed first */
+	uint8_t		ncfl_used;		/* slot is in use */
+} ncflow_t;
 
-	(void) fclose(fstream);
-	return (0);
-}
+typedef struct {
+	ncflow_t	*ncft_flows;		/* slots */
+	size_t		ncft_size;		/* number of slots */
+	size_t		ncft_nused;		/* number of occupied slots */
+	uint32_t	ncft_nextsweep;		/* time of next idle sweep */
+	uint64_t	ncft_npackets;		/* packets read */
+	uint64_t	ncft_ntcp;		/* TCP packets decoded */
+	uint64_t	ncft_nexpired;		/* flows forgotten when idle */
+} ncflowtab_t;
 
 /*
- * Dump to stdout a final report -- the actual "netcmp" output.
+ * Connection tracking tables from NAT gateways (the contents of
+ * /proc/net/nf_conntrack, or the output of "conntrack -L") are also accepted as
+ * input.  Each entry gives the tuple of a connection as its initiator sees it
+ * (the "original" tuple) and as its responder sees it (the "reply" tuple).
+ * When the gateway translates addresses, the two ends of the connection report
+ * it with different tuples, so nc_parse_row() uses the translations found in
+ * these tables to rewrite each end's view so that the remote end is the real
+ * peer.  For example, an entry:
+ *
+ *     src=C dst=D sport=c dport=d src=S dst=P sport=s dport=p
+ *
+ * maps the initiator's view (local C:c, remote D:d) to (local C:c, remote S:s)
+ * and the responder's view (local S:s, remote P:p) to (local S:s, remote C:c).
+ *
+ * Each table is also an observation of its connections by the gateway.  For a
+ * connection where one of the real ends has no other data (e.g., a host on the
+ * Internet), the gateway stands in for that end, so that the other end's data
+ * can be checked against the gateway's.
  */
-static void
-nc_report(netcmp_t *ncp)
-{
-	ncconn_t *ncc;
-	ncconn_t *ncc_error;
-	ncsource_t source;
-	boolean_t external;
-	int nsymmetric = 0;
-	int nasymmetric = 0;
-	int nexternal = 0;
-	int nerror = 0;
-	int ntimewait = 0;
-	char buf1[IPV4PORT_BUFSZ];
-	char buf2[IPV4PORT_BUFSZ];
+typedef struct {
+	uint32_t	nctr_lip;		/* local IP address */
+	uint32_t	nctr_rip;		/* remote IP address */
+	uint16_t	nctr_lport;		/* local TCP port */
+	uint16_t	nctr_rport;		/* remote TCP port */
+	uint32_t	nctr_ip;		/* real remote IP address */
+	uint16_t	nctr_port;		/* real remote TCP port */
+	uint16_t	nctr_used;		/* slot is in use */
+} nctrans_t;
 
-	for (ncc = avl_first(&ncp->nc_conns); ncc != NULL;
-	    ncc = AVL_NEXT(&ncp->nc_conns, ncc)) {
-		if (strcmp(ncc->ncc_state, "TIME_WAIT") == 0) {
-			ntimewait++;
-			continue;
-		}
+typedef struct {
+	uint32_t	ncno_ip[2];		/* initiator, responder IP */
+	uint16_t	ncno_port[2];		/* initiator, responder port */
+	uint16_t	ncno_label;		/* id of gateway's label */
+	uint8_t		ncno_state;		/* TCP state (ncstate_t) */
+} ncnatobs_t;
 
-		if (ncc->ncc_nsources > 2) {
-			if (ncp->nc_debug) {
-				(void) fprintf(stderr, "found connection "
-				    "with more than two sources:\n");
-				nc_conn_dump(stderr, ncc);
-			}
+typedef struct {
+	nctrans_t	*ncn_trans;		/* translations (hash table) */
+	size_t		ncn_size;		/* slots in ncn_trans */
+	size_t		ncn_ntrans;		/* translations in ncn_trans */
+	ncnatobs_t	*ncn_obs;		/* gateway observations */
+	size_t		ncn_nobs;		/* entries in ncn_obs */
+	size_t		ncn_nalloc;		/* allocated size of ncn_obs */
+} ncnat_t;
+
+/*
+ * Names of the TCP states in connection tracking tables, and the netstat
+ * states that we use for the gateway's observations.  Entries in other states
+ * (e.g., "CLOSE") are used only for their translations.
+ */
+static const struct {
+	const char	*ncts_name;
+	ncstate_t	ncts_state;
+} nc_ct_states[] = {
+	{ "SYN_SENT",		NS_SYN_SENT },
+	{ "SYN_SENT2",		NS_SYN_SENT },
+	{ "SYN_RECV",		NS_SYN_RCVD },
+	{ "ESTABLISHED",	NS_ESTABLISHED },
+	{ "FIN_WAIT",		NS_FIN_WAIT_1 },
+	{ "CLOSE_WAIT",		NS_CLOSE_WAIT },
+	{ "LAST_ACK",		NS_LAST_ACK },
+	{ "TIME_WAIT",		NS_TIME_WAIT },
+};
+
+/*
+ * Packed representation of a single netstat row, used when comparing two
+ * snapshots from the same system ("-D" mode).  IP addresses are stored in host
+ * byte order so that records sort numerically.  Unlike ncconn_t, the tuples are
+ * not normalized: since both snapshots come from the same system, the first
+ * tuple is always the local one.
+ */
+typedef struct {
+	uint32_t	ncr_ip1;		/* local IP address */
+	uint32_t	ncr_ip2;		/* remote IP address */
+	uint16_t	ncr_port1;		/* local TCP port */
+	uint16_t	ncr_port2;		/* remote TCP port */
+	uint8_t		ncr_state;		/* TCP state (ncstate_t) */
+} ncrec_t;
+
+/*
+ * Number of bytes in the sort key of an ncrec_t (both IP addresses and ports).
+ */
+#define	NC_REC_KEYBYTES	12
+
+/*
+ * Record in the connection age file ("-a").  The file consists of a header
+ * followed by these records, sorted by tuple in the same order as ncrec_t.
+ * Tuples are normalized the same way as in ncconn_t.  Everything is stored in
+ * native byte order, since the file is only expected to be read by the system
+ * that wrote it.
+ */
+typedef struct {
+	uint32_t	nca_ip1;		/* first IP address */
+	uint32_t	nca_ip2;		/* second IP address */
+	uint16_t	nca_port1;		/* first TCP port */
+	uint16_t	nca_port2;		/* second TCP port */
+	uint32_t	nca_firstseen;		/* time first seen */
+} ncagerec_t;
+
+#define	NC_AGE_MAGIC	"NCAGE001"
+#define	NC_AGE_MAGICSZ	(sizeof (NC_AGE_MAGIC) - 1)
+
+/*
+ * A growable array of packed records read from one snapshot.
+ */
+typedef struct {
+	ncrec_t		*ncsn_recs;		/* array of records */
+	size_t		ncsn_nrecs;		/* number of valid records */
+	size_t		ncsn_nalloc;		/* records allocated */
+} ncsnap_t;
+
+/*
+ * The ingest checkpoint file ("-c") consists of NC_CKPT_MAGIC, followed by an
+ * ncckpthdr_t, and then the source labels (as ncpub_source_t, in order of
+ * ncl_id), the sources, the connections, and the names of the input files
+ * completed (each terminated with a NUL).  Like the age file, it's stored in
+ * native byte order.  The connections collected with "-N" and "-B" are read
+ * before any files, so they're in every checkpoint, and ncch_others records
+ * that they needn't be collected again.
+ */
+#define	NC_CKPT_MAGIC		"NCCKPT01"
+#define	NC_CKPT_MAGICSZ		(sizeof (NC_CKPT_MAGIC) - 1)
+#define	NC_CKPT_INTERVAL	60	/* seconds between checkpoints */
+#define	NC_CKPT_NETNS		0x1	/* namespaces ("-N") read */
+#define	NC_CKPT_TRACKER		0x2	/* tracker ("-B") read */
+
+typedef struct {
+	uint64_t	ncch_nconns;		/* number of connections */
+	uint64_t	ncch_nlocalhost;	/* see nc_nlocalhost */
+	uint64_t	ncch_nrows;		/* see nc_nrows */
+	uint32_t	ncch_nlabels;		/* number of source labels */
+	uint32_t	ncch_nsources;		/* number of sources */
+	uint32_t	ncch_nfiles;		/* number of files completed */
+	uint32_t	ncch_others;		/* NC_CKPT_* inputs completed */
+} ncckpthdr_t;
+
+typedef struct {
+	uint32_t	nccs_ip;		/* see ncs_ip */
+	uint32_t	nccs_label;		/* ncl_id of ncs_label */
+} ncckptsrc_t;
+
+/*
+ * A connection in the checkpoint file.  Each source of a connection is the
+ * source for one of the connection's two IP addresses, so we just record which
+ * one.
+ */
+typedef struct {
+	uint32_t	nccc_ip1;		/* first IP address */
+	uint32_t	nccc_ip2;		/* second IP address */
+	uint16_t	nccc_port1;		/* first TCP port */
+	uint16_t	nccc_port2;		/* second TCP port */
+	uint8_t		nccc_state;		/* TCP state (ncstate_t) */
+	uint8_t		nccc_nsources;		/* see ncc_nsources */
+	uint8_t		nccc_side[2];		/* 2 if source is for ip2 */
+} ncckptconn_t;
+
+/*
+ * Connection and source records are never freed individually, so we allocate
+ * them from an arena made of large chunks of anonymous memory.  Besides
+ * avoiding per-record malloc overhead, this lets us ask the system to back the
+ * chunks with large pages: with tens of millions of records, TLB misses are a
+ * noticeable part of the cost of walking the AVL trees.  Each chunk is aligned
+ * to the large page size.  If large pages aren't available, the chunks are
+ * simply backed by normal pages.  The first bytes of each chunk point to the
+ * previous chunk.  A request too big for a chunk (like the connection array of
+ * a pair with millions of connections) gets a chunk of its own, sized to fit.
+ */
+#define	NC_LARGEPAGESZ		(2 * 1024 * 1024)
+#define	NC_ARENA_CHUNKSZ	(16 * NC_LARGEPAGESZ)
+
+typedef struct {
+	char		*ncar_chunk;		/* most recent chunk */
+	size_t		ncar_used;		/* bytes used in chunk */
+	ncbool_t	ncar_nolarge;		/* don't request large pages */
+	unsigned long	ncar_nchunks;		/* number of chunks allocated */
+	size_t		ncar_nbytes;		/* total size of chunks */
+	size_t		ncar_nlarge;		/* bytes advised large pages */
+} ncarena_t;
+
+/*
+ * Compression formats for the report output ("-o") and for input files.
+ */
+typedef enum {
+	NCZ_NONE = 0,
+	NCZ_GZIP,
+	NCZ_ZSTD
+} nccomp_t;
+
+/*
+ * Size of the buffer used for the report output stream.
+ */
+#define	NC_OUTBUFSZ	(256 * 1024)
+
+/*
+ * Categories of connections reported in debug output ("-d").  For each
+ * category, we count the connections and keep a sample of them so that debug
+ * output stays bounded no matter how many connections there are.  The order of
+ * this enum must match the nc_diag_descs table below.
+ */
+typedef enum {
+	NCD_MULTI = 0,		/* more than two sources */
+	NCD_EXTERNAL,		/* involving an IP with no data */
+	NCD_NCATEGORIES
+} ncdiagcat_t;
+
+static const char *nc_diag_descs[] = {
+	"with more than two sources",
+	"involving IP for which we have no data",
+};
+
+#define	NC_DIAG_NSAMPLES	5
+#define	NC_DIAG_MAXSAMPLES	100000		/* upper bound for -S */
+
+typedef struct {
+	unsigned long	ncd_count;		/* connections in category */
+	ncconn_t	**ncd_samples;		/* first nc_nsamples of them */
+} ncdiag_t;
+
+/*
+ * Describes where the report is written.  For compressed output, the report
+ * writer writes uncompressed text into a pipe, and a separate thread reads from
+ * the pipe and writes the compressed stream to the output file.  That way the
+ * report is generated concurrently with compression, and we never write an
+ * uncompressed intermediate file.
+ */
+typedef struct {
+	const char	*nco_path;		/* output file ("-o") */
+	nccomp_t	nco_comp;		/* compression format */
+	int		nco_pipefd;		/* read side of pipe */
+	int		nco_fd;			/* output file descriptor */
+	int		nco_error;		/* set on compression failure */
+	pthread_t	nco_thread;		/* compression thread */
+} ncoutput_t;
+
+/*
+ * Describes a compressed input file (gzip or zstd) being read.  Like
+ * compressed output, this uses a pipe: other threads decompress the file and
+ * write the data into the pipe, and nc_read_file() reads from the other end as
+ * though it were the uncompressed file.  Rows that straddle the boundaries
+ * between frames are handled by nc_read_file()'s usual handling of rows that
+ * straddle read blocks.
+ *
+ * A file made up of many independently compressed frames (zstd frames, or
+ * gzip members that record their compressed size, as written by bgzip) is
+ * decoded in parallel.  Each decoder thread repeatedly claims the next frame
+ * and decompresses it into memory, and the feeder thread writes the decoded
+ * frames into the pipe in order.  Decoders stay no more than NC_DECODEAHEAD
+ * frames ahead of the feeder, which bounds the memory used.  Any other file is
+ * decompressed as a single stream by the feeder thread.
+ */
+#define	NC_MAXDECODERS	16
+#define	NC_DECODEAHEAD	(4 * NC_MAXDECODERS)
+
+typedef struct {
+	const uint8_t	*ncfr_src;		/* compressed frame */
+	size_t		ncfr_srclen;		/* size of compressed frame */
+	char		*ncfr_buf;		/* decompressed data */
+	size_t		ncfr_len;		/* size of decompressed data */
+	ncbool_t	ncfr_done;		/* frame has been decoded */
+} ncframe_t;
+
+typedef struct {
+	const char	*nci_path;		/* input file */
+	nccomp_t	nci_comp;		/* compression format */
+	uint8_t		*nci_base;		/* mapping of input file */
+	size_t		nci_size;		/* size of input file */
+	ncframe_t	*nci_frames;		/* frames to decode */
+	size_t		nci_nframes;		/* number of frames */
+	size_t		nci_next;		/* next frame to decode */
+	size_t		nci_nwritten;		/* frames written to pipe */
+	unsigned int	nci_ndecoders;		/* number of decoder threads */
+	int		nci_pipefd;		/* write side of pipe */
+	int		nci_error;		/* set on failure */
+	pthread_mutex_t	nci_lock;		/* protects fields above */
+	pthread_cond_t	nci_cv;			/* signalled on progress */
+	pthread_t	nci_thread;		/* feeder thread */
+	pthread_t	nci_decoders[NC_MAXDECODERS];	/* decoder threads */
+} ncinput_t;
+
+/*
+ * In continuous mode ("-i"), netcmp runs a round (reading the inputs again,
+ * classifying, and reporting) every nc_interval seconds.  Each round runs in a
+ * child process, so that it starts from an empty index and the memory it uses
+ * is returned when it exits, and sends the parent an ncround_t summarizing it:
+ * the count of each class, the count of asymmetric connections in each of the
+ * first NC_HIST_NVIEWS views ("-V"), the pairs of IP addresses with the most
+ * asymmetric connections, and how long ingest and classification took.
+ *
+ * The parent keeps the summaries in an nchist_t: NC_HIST_NTIERS rings of
+ * NC_HIST_SIZE entries each.  Tier 0 holds one entry per round.  Every
+ * NC_HIST_MERGE consecutive entries of each tier are also merged into one
+ * entry of the next tier, so each tier covers NC_HIST_MERGE times as long a
+ * period as the one before it, at lower resolution.  A merged entry records
+ * the sums of its rounds' counts and times (so averages can be computed), the
+ * largest asymmetric count of any of them, and the top pairs of the round
+ * with that count.  The history can be queried over a Unix socket ("-C"), and
+ * is saved to a file ("-H") after every round so that it survives restarts.
+ */
+#define	NC_HIST_NTIERS		3
+#define	NC_HIST_SIZE		256	/* entries in each tier */
+#define	NC_HIST_MERGE		16	/* entries merged into the next tier */
+#define	NC_HIST_NVIEWS		8	/* views recorded per round */
+#define	NC_HIST_NPAIRS		5	/* top pairs recorded per round */
+#define	NC_HIST_NAMELEN		32	/* size of view names in history file */
+#define	NC_HIST_CMDLEN		256	/* max length of a control command */
+#define	NC_CTL_TIMEOUT		5	/* seconds to wait for a client */
+
+typedef struct {
+	uint32_t	ncrp_ip1;		/* first IP address */
+	uint32_t	ncrp_ip2;		/* second IP address */
+	uint64_t	ncrp_nasym;		/* asymmetric connections */
+} ncroundpair_t;
+
+typedef struct {
+	int64_t		ncrd_start;		/* first round started (Unix) */
+	int64_t		ncrd_end;		/* last round finished (Unix) */
+	uint32_t	ncrd_nrounds;		/* rounds in this entry */
+	uint32_t	ncrd_nsources;		/* source labels (last round) */
+	uint64_t	ncrd_nrows;		/* rows recorded */
+	uint64_t	ncrd_nlocalhost;	/* localhost connections */
+	uint64_t	ncrd_nclass[NCL_NCLASSES]; /* count of each class */
+	uint64_t	ncrd_maxasym;		/* most asymmetric in a round */
+	uint64_t	ncrd_ingestms;		/* time to ingest (ms) */
+	uint64_t	ncrd_classifyms;	/* time to classify (ms) */
+	uint64_t	ncrd_vasym[NC_HIST_NVIEWS]; /* asymmetric per view */
+	ncroundpair_t	ncrd_pairs[NC_HIST_NPAIRS]; /* most asymmetric pairs */
+} ncround_t;
+
+typedef struct {
+	ncround_t	nch_ring[NC_HIST_NTIERS][NC_HIST_SIZE];
+	unsigned int	nch_first[NC_HIST_NTIERS];	/* oldest entry */
+	unsigned int	nch_count[NC_HIST_NTIERS];	/* entries in use */
+	ncround_t	nch_pending[NC_HIST_NTIERS];	/* for next tier */
+	unsigned int	nch_npending[NC_HIST_NTIERS];	/* entries merged */
+	char		nch_views[NC_HIST_NVIEWS][NC_HIST_NAMELEN];
+	unsigned int	nch_nviews;
+} nchist_t;
+
+/*
+ * The history file ("-H") consists of NC_HIST_MAGIC, followed by an
+ * nchisthdr_t, and then the entries of each tier (oldest first) and the
+ * pending entry of each tier.  Like the age file, it's stored in native byte
+ * order.  Views are matched up by name when the file is loaded, so views may
+ * be added or reordered across restarts.
+ */
+#define	NC_HIST_MAGIC		"NCHIST01"
+#define	NC_HIST_MAGICSZ		(sizeof (NC_HIST_MAGIC) - 1)
+
+typedef struct {
+	uint32_t	nchh_roundsz;		/* sizeof (ncround_t) */
+	uint32_t	nchh_ntiers;		/* NC_HIST_NTIERS */
+	uint32_t	nchh_size;		/* NC_HIST_SIZE */
+	uint32_t	nchh_merge;		/* NC_HIST_MERGE */
+	uint32_t	nchh_count[NC_HIST_NTIERS];	/* see nch_count */
+	uint32_t	nchh_npending[NC_HIST_NTIERS];	/* see nch_npending */
+	uint32_t	nchh_nviews;		/* see nch_nviews */
+	uint32_t	nchh_pad;
+	char		nchh_views[NC_HIST_NVIEWS][NC_HIST_NAMELEN];
+} nchisthdr_t;
+
+/*
+ * Measurements of a run ("-b").  Each run appends one line to the benchmark
+ * file: a JSON object with a field for each of nc_bench_metrics (and "time"
+ * and "rows"), so that the file holds a sample of repeated runs.  Time spent in
+ * the row function (nc_parse_row()) is estimated by timing only one row in
+ * NC_BENCH_SAMPLE, since reading the clock for every row would cost about as
+ * much as the work being measured.  Two benchmark files are compared with
+ * "-M" (see nc_bench_compare()).
+ */
+#define	NC_BENCH_SAMPLE		64	/* rows per timed row */
+#define	NC_BENCH_THRESHOLD	5.0	/* default regression threshold (%) */
+#define	NC_BENCH_ALPHA		0.05	/* significance level */
+#define	NC_BENCH_LINESZ		1024	/* max length of a benchmark line */
+
+typedef enum {
+	NCB_ROWSPERSEC = 0,	/* rows ingested per second */
+	NCB_READ,		/* time in nc_read_file() */
+	NCB_ROWFUNC,		/* time in nc_parse_row() (estimated) */
+	NCB_CLASSIFY,		/* time in nc_classify() */
+	NCB_REPORT,		/* time in nc_report() */
+	NCB_TOTAL,		/* time for the whole run */
+	NCB_MAXRSS,		/* peak resident set size (KB) */
+	NCB_NMETRICS
+} ncbenchmetric_t;
+
+static const struct {
+	const char	*ncbm_name;		/* JSON field name */
+	const char	*ncbm_desc;		/* description for "-M" */
+	int		ncbm_prec;		/* digits after decimal point */
+	ncbool_t	ncbm_higher;		/* higher values are better */
+} nc_bench_metrics[] = {
+	{ "rows_per_s",		"ingest rows/s",	0,	NB_TRUE },
+	{ "read_s",		"nc_read_file() s",	4,	NB_FALSE },
+	{ "parse_row_s",	"nc_parse_row() s",	4,	NB_FALSE },
+	{ "classify_s",		"nc_classify() s",	4,	NB_FALSE },
+	{ "report_s",		"nc_report() s",	4,	NB_FALSE },
+	{ "total_s",		"total s",		4,	NB_FALSE },
+	{ "maxrss_kb",		"peak RSS KB",		0,	NB_FALSE },
+};
+
+typedef struct {
+	const char	*ncb_path;		/* benchmark file ("-b") */
+	unsigned long	ncb_nrows;		/* rows handed to rowfunc */
+	double		ncb_values[NCB_NMETRICS]; /* measurements */
+} ncbench_t;
+
+/*
+ * The values of one metric from each run in a benchmark file.
+ */
+typedef struct {
+	double		*ncbs_values;		/* sorted values */
+	size_t		ncbs_n;			/* number of runs */
+	size_t		ncbs_nalloc;		/* values allocated */
+} ncbenchsample_t;
+
+/*
+ * Represents the overall netcmp operation.  Configuration, counters, and
+ * accumulated state hang off this object.
+ */
+typedef struct {
+	/* enable debug messages */
+	ncbool_t	nc_debug;
+
+	/* compare two snapshots of the same system ("-D") */
+	ncbool_t	nc_diff;
+
+	/* compare two published results ("-R") */
+	ncbool_t	nc_resdiff;
+
+	/* file recording when connections were first seen ("-a") */
+	const char	*nc_agefile;
+
+	/* minimum age of asymmetric connections to report ("-A") */
+	unsigned long	nc_minage;
+
+	/* time at which this run started */
+	time_t		nc_now;
+
+	/* max capture time skew for in-flight connections ("-s"), or -1 */
+	long		nc_skew;
+
+	/* number of connections in each class (see nc_classify()) */
+	unsigned long	nc_nclass[NCL_NCLASSES];
+
+	/*
+	 * Coverage gaps ("-g"): for each IP with no data, the number of
+	 * external connections involving it and the number of distinct sources
+	 * that saw it.  nc_gappairs records the (IP, source) pairs seen.
+	 */
+	unsigned long	nc_gapk;
+	nchash_t	nc_gapconns;
+	nchash_t	nc_gapsources;
+	nchash_t	nc_gappairs;
+
+	/* collect connections from local network namespaces ("-N") */
+	ncbool_t	nc_netns;
+
+	/* install the connection tracker in this directory ("-T") */
+	const char	*nc_trackinstall;
+
+	/* read connections from the tracker in this directory ("-B") */
+	const char	*nc_trackdir;
+
+	/* read queries from stdin instead of reporting ("-q") */
+	ncbool_t	nc_query;
+
+	/* count of localhost connections skipped */
+	unsigned long	nc_nlocalhost;
+
+	/* count of rows recorded (excluding localhost connections) */
+	unsigned long	nc_nrows;
+
+	/* memory for connection and source records */
+	ncarena_t	nc_arena;
+
+	/* set of all connections found, indexed by IP pair (see ncpair_t) */
+	avl_tree_t	nc_pairs;
+	unsigned long	nc_nconns;
+
+	/*
+	 * small connection tables that pairs have outgrown, by log2 of their
+	 * size, and the bytes of memory held for tables (see
+	 * nc_conn_table_alloc())
+	 */
+	ncconn_t	*nc_tablefree[32];
+	size_t		nc_tablebytes;
+	size_t		nc_tablepeak;
+
+	/* set of all sources found */
+	avl_tree_t	nc_sources;
+
+	/* translations and observations from NAT gateways (see ncnat_t) */
+	ncnat_t		nc_nat;
+
+	/* TCP_INFO statistics collected with "-N" (see nctcpinfo_t) */
+	nctcpinfotab_t	nc_tcpinfo;
+
+	/* all source labels found, indexed by ncl_id */
+	nclabel_t	**nc_labels;
+	unsigned int	nc_nlabels;
+
+	/* directory for per-source report files ("-O") */
+	const char	*nc_reportdir;
+
+	/* ingest checkpoint file ("-c"), and the inputs it covers */
+	const char	*nc_ckptfile;
+	char		**nc_ckptfiles;
+	unsigned int	nc_nckptfiles;
+	unsigned int	nc_ckptothers;		/* NC_CKPT_* inputs */
+	double		nc_ckptlast;		/* time of last checkpoint */
+
+	/* file to publish results to ("-P") */
+	const char	*nc_pubfile;
+
+	/* views to classify in addition to all sources ("-V") */
+	ncview_t	nc_views[NC_MAXVIEWS];
+	unsigned int	nc_nviews;
+
+	/* seconds between rounds in continuous mode ("-i"), or 0 */
+	unsigned long	nc_interval;
+
+	/* control socket ("-C") and history file ("-H") for "-i" */
+	const char	*nc_ctlpath;
+	const char	*nc_histfile;
+
+	/* measurements of this run ("-b") */
+	ncbench_t	nc_bench;
+
+	/* compare two benchmark files ("-M"), with threshold ("-t") or -1 */
+	ncbool_t	nc_benchcmp;
+	double		nc_benchthresh;
+
+	/* stream for the report (stdout, unless "-o" was specified) */
+	FILE		*nc_out;
+	ncoutput_t	nc_output;
+
+	/* debug diagnostics, and how many examples of each to print ("-S") */
+	ncdiag_t	nc_diag[NCD_NCATEGORIES];
+	unsigned long	nc_nsamples;
+
+	/* records for the snapshot currently being read ("-D" mode only) */
+	ncsnap_t	nc_snap;
+} netcmp_t;
+
+/*
+ * Function invoked by nc_read_file() for each data row of netstat output.
+ */
+typedef int (*ncrowfunc_t)(netcmp_t *, nclabel_t *, const ncrow_t *);
+
+/*
+ * Maximum number of threads used to write per-source report files ("-O").
+ */
+#define	NC_MAXWRITERS	8
+
+/*
+ * Size of the stdio buffer used for each per-source report file.
+ */
+#define	NC_WRITERBUFSZ	(256 * 1024)
+
+/*
+ * Describes the work of one thread writing per-source report files.  Each
+ * writer handles every ncw_stride'th label, starting at ncw_first.
+ */
+typedef struct {
+	netcmp_t	*ncw_ncp;		/* netcmp operation */
+	unsigned int	ncw_first;		/* first label to write */
+	unsigned int	ncw_stride;		/* number of writers */
+	int		ncw_error;		/* set on failure */
+	pthread_t	ncw_thread;		/* writer thread */
+} ncwriter_t;
+
+/*
+ * A network namespace whose TCP connections are collected directly from the
+ * kernel ("-N", Linux only).  See nc_netns_collect().
+ */
+typedef struct {
+	char		ncns_path[PATH_MAX];	/* namespace file */
+	char		ncns_name[128];		/* source label */
+	dev_t		ncns_dev;		/* device of namespace file */
+	ino_t		ncns_ino;		/* inode of namespace file */
+	ncrow_t		*ncns_rows;		/* connections collected */
+	nctcpinfo_t	*ncns_tcpinfo;		/* TCP_INFO for each row */
+	size_t		ncns_nrows;		/* entries in ncns_rows */
+	size_t		ncns_nalloc;		/* allocated entries */
+	ncbool_t	ncns_gone;		/* namespace no longer exists */
+	int		ncns_error;		/* set on failure */
+} ncnetns_t;
+
+/*
+ * Maximum number of threads used to collect connections from network
+ * namespaces ("-N"), and the arguments for each.  Like the report writers,
+ * each collector handles every ncc_stride'th namespace starting with
+ * ncc_first.
+ */
+#define	NC_MAXCOLLECTORS	16
+
+typedef struct {
+	ncnetns_t	*ncc_netns;		/* all namespaces */
+	size_t		ncc_nnetns;		/* number of namespaces */
+	size_t		ncc_first;		/* first namespace to collect */
+	size_t		ncc_stride;		/* number of collectors */
+	pthread_t	ncc_thread;		/* collector thread */
+} nccollector_t;
+
+/*
+ * The connection tracker ("-T", Linux only) is a small BPF program attached to
+ * the sock:inet_sock_set_state tracepoint, which fires whenever any TCP socket
+ * changes state.  It keeps a table of all IPv4 TCP connections in a BPF hash
+ * map, keyed by ncbpfkey_t, adding or updating an entry on each state change
+ * and removing it when the socket closes.  Both the map and the attachment
+ * are pinned in a BPF filesystem directory so that they outlive the netcmp
+ * process that installs them.  Later runs read the map directly ("-B")
+ * instead of listing sockets.  Addresses are in network byte order and ports
+ * in host byte order, as the tracepoint reports them.
+ */
+typedef struct {
+	uint32_t	ncbk_saddr;		/* local IP address */
+	uint32_t	ncbk_daddr;		/* remote IP address */
+	uint16_t	ncbk_sport;		/* local TCP port */
+	uint16_t	ncbk_dport;		/* remote TCP port */
+} ncbpfkey_t;
+
+typedef struct {
+	uint32_t	ncbv_state;		/* Linux TCP state */
+	uint32_t	ncbv_pad;
+	uint64_t	ncbv_changed;		/* time of last change (ns) */
+} ncbpfval_t;
+
+#define	NC_BPF_MAXCONNS		(4 * 1024 * 1024) /* max entries in map */
+#define	NC_BPF_BATCH		4096		/* entries read per call */
+#define	NC_BPF_MAP		"netcmp_conns"	/* pinned map name */
+#define	NC_BPF_LINK		"netcmp_link"	/* pinned attachment name */
+#define	NC_BPF_EVENT		"events/sock/inet_sock_set_state"
+
+/*
+ * Fields of the tracepoint used by the tracker.  Their offsets are read from
+ * the tracepoint's format file when the tracker is installed.
+ */
+typedef enum {
+	NCTP_FAMILY,
+	NCTP_PROTOCOL,
+	NCTP_SADDR,
+	NCTP_DADDR,
+	NCTP_SPORT,
+	NCTP_DPORT,
+	NCTP_NEWSTATE,
+	NCTP_NFIELDS
+} nctpfield_t;
+
+/*
+ * Directory where "ip netns" keeps named network namespaces, and size of the
+ * buffer used to receive sock_diag responses.
+ */
+#define	NC_NETNSDIR		"/var/run/netns"
+#define	NC_DIAGBUFSZ		(64 * 1024)
+
+static const char *nc_arg0;
+static volatile sig_atomic_t nc_stopping;
+static void usage(void);
+
+/* Public functions (if this were a separate module) */
+static void nc_init(netcmp_t *);
+static int nc_parse_options(netcmp_t *, int, char *[]);
+static int nc_run(netcmp_t *, int, char *[], ncround_t *);
+static int nc_daemon(netcmp_t *, int, char *[]);
+static int nc_read_file(netcmp_t *, const char *, ncrowfunc_t);
+static int nc_netns_collect(netcmp_t *);
+static int nc_tracker_install(netcmp_t *, const char *);
+static int nc_tracker_read(netcmp_t *, const char *);
+static int nc_output_open(netcmp_t *);
+static int nc_output_close(netcmp_t *);
+static void nc_classify(netcmp_t *);
+static void nc_report(netcmp_t *);
+static int nc_query_loop(netcmp_t *);
+static void nc_stop(int);
+static int nc_round_start(netcmp_t *, int, char *[], int, pid_t *);
+static void nc_round_finish(netcmp_t *, nchist_t *, int, pid_t);
+static void nc_round_summary(netcmp_t *, ncround_t *);
+static void nc_round_addpair(ncround_t *, const ncpair_t *, uint64_t);
+static void nc_round_merge(ncround_t *, const ncround_t *);
+static void nc_hist_add(nchist_t *, const ncround_t *);
+static int nc_hist_load(netcmp_t *, nchist_t *);
+static int nc_hist_read(FILE *, ncround_t *, const int *, unsigned int);
+static int nc_hist_save(netcmp_t *, const nchist_t *);
+static void nc_hist_print(FILE *, const nchist_t *, time_t);
+static void nc_hist_entry(FILE *, const nchist_t *, const ncround_t *);
+static void nc_hist_latest(FILE *, const nchist_t *);
+static int nc_ctl_open(netcmp_t *);
+static void nc_ctl_serve(const nchist_t *, int);
+static int nc_bench_save(netcmp_t *);
+static int nc_bench_compare(netcmp_t *, const char *, const char *);
+static int nc_publish(netcmp_t *);
+static int nc_diff(netcmp_t *, const char *, const char *);
+static int nc_resdiff(netcmp_t *, const char *, const char *);
+static int nc_age_update(netcmp_t *);
+static int nc_ckpt_load(netcmp_t *, int, char *[]);
+static int nc_ckpt_done(netcmp_t *, const char *);
+static int nc_ckpt_add(netcmp_t *, const char *);
+static int nc_ckpt_save(netcmp_t *);
+static void nc_ipport_tostr(char *, size_t, uint32_t, uint16_t);
+static void nc_ip_tostr(char *, size_t, uint32_t);
+static void nc_conn_dump(FILE *, ncconn_t *);
+static void nc_diag_record(netcmp_t *, ncdiagcat_t, ncconn_t *);
+static void nc_diag_report(netcmp_t *);
+
+/* Private functions */
+static int nc_parse_row(netcmp_t *, nclabel_t *, const ncrow_t *);
+static int nc_conn_record(netcmp_t *, ncsource_t *, const ncrow_t *);
+static int nc_snap_row(netcmp_t *, nclabel_t *, const ncrow_t *);
+static int nc_bench_row(netcmp_t *, ncrowfunc_t, nclabel_t *,
+    const ncrow_t *);
+static int nc_bench_load(const char *, ncbenchsample_t *, double *);
+static int nc_bench_field(const char *, const char *, double *);
+static void nc_bench_median(const ncbenchsample_t *, double *, double *,
+    double *);
+static double nc_bench_mannwhitney(const ncbenchsample_t *,
+    const ncbenchsample_t *);
+static int nc_read_pcap(netcmp_t *, const char *, ncrowfunc_t);
+static ncbool_t nc_pcap_magic(uint32_t);
+static uint32_t nc_bswap32(uint32_t);
+static uint32_t nc_pcap_get32(const uint8_t *, ncbool_t);
+static uint16_t nc_pcap_get16(const uint8_t *, ncbool_t);
+static int nc_pcap_readclassic(ncflowtab_t *, const char *, const uint8_t *,
+    size_t, uint32_t *);
+static int nc_pcap_readng(ncflowtab_t *, const char *, const uint8_t *,
+    size_t, uint32_t *);
+static int nc_pcap_packet(ncflowtab_t *, uint32_t, const uint8_t *, size_t,
+    uint32_t);
+static ncflow_t *nc_flow_slot(const ncflowtab_t *, uint32_t, uint16_t,
+    uint32_t, uint16_t);
+static int nc_flow_rebuild(ncflowtab_t *, size_t, uint32_t);
+static int nc_flow_update(ncflowtab_t *, uint32_t, uint16_t, uint32_t,
+    uint16_t, uint8_t, uint32_t, uint32_t, uint32_t, uint32_t);
+static int nc_flow_state(const ncflow_t *, int);
+static ncbool_t nc_conntrack_file(const char *);
+static int nc_read_conntrack(netcmp_t *, const char *);
+static const char *nc_conntrack_token(const char **, const char *, size_t *);
+static int nc_conntrack_parse(const char *, const char *, uint32_t *,
+    uint16_t *, int *);
+static int nc_conntrack_ipaddr(const char *, size_t, uint32_t *);
+static int nc_nat_add(netcmp_t *, nclabel_t *, const uint32_t *,
+    const uint16_t *, int);
+static size_t nc_nat_slot(const nctrans_t *, size_t, uint32_t, uint16_t,
+    uint32_t, uint16_t);
+static int nc_nat_insert(ncnat_t *, uint32_t, uint16_t, uint32_t, uint16_t,
+    uint32_t, uint16_t);
+static ncbool_t nc_nat_translate(const ncnat_t *, const ncrow_t *, ncrow_t *);
+static int nc_nat_observe(netcmp_t *);
+static size_t nc_tcpinfo_slot(const nctcpinfo_t *, size_t, uint32_t,
+    uint16_t, uint32_t, uint16_t);
+static int nc_tcpinfo_add(netcmp_t *, const ncrow_t *);
+static const nctcpinfo_t *nc_tcpinfo_lookup(const netcmp_t *,
+    const ncconn_t *);
+static unsigned long nc_tcpinfo_idle(const nctcpinfo_t *);
+static void nc_tcpinfo_sort(netcmp_t *, ncconn_t **, size_t);
+#ifdef __linux__
+static int nc_netns_list(const char *, ncnetns_t **, size_t *);
+static int nc_netns_readall(ncnetns_t *, size_t);
+static void nc_netns_free(ncnetns_t *, size_t);
+static int nc_netns_add(ncnetns_t **, size_t *, size_t *, const char *,
+    const char *);
+static void *nc_netns_collector(void *);
+static void nc_netns_read(ncnetns_t *, ncbool_t);
+static int nc_bpf(int, union bpf_attr *);
+static int nc_tracker_tracepoint(int *, int *);
+static int nc_tracker_prog(int, const int *);
+static int nc_tracker_walk(netcmp_t *, nclabel_t *, int, unsigned long *);
+#endif
+static ncclass_t nc_conn_classify(netcmp_t *, ncconn_t *);
+static int nc_view_add(netcmp_t *, char *);
+static void nc_view_assign(netcmp_t *);
+static ncviewset_t nc_view_coverage(netcmp_t *, uint32_t, ncsource_t *);
+static void nc_view_classify(netcmp_t *, ncconn_t *, const ncviewset_t *);
+static void nc_view_count(netcmp_t *, ncviewset_t, ncclass_t);
+static void nc_view_report(netcmp_t *);
+static int nc_result_build(netcmp_t *, ncresult_t *);
+static void nc_result_free(ncresult_t *);
+static int nc_frozen_build(const ncresult_t *, ncfrozen_t *);
+static void nc_frozen_free(ncfrozen_t *);
+static void nc_frozen_block(const ncfrozen_t *, size_t, ncfrozencur_t *);
+static ncbool_t nc_frozen_next(const ncfrozen_t *, ncfrozencur_t *);
+static ncbool_t nc_frozen_seek(const ncfrozen_t *, uint32_t, uint64_t,
+    ncfrozencur_t *);
+static void nc_frozen_print(netcmp_t *, const ncfrozen_t *,
+    const ncfrozencur_t *);
+static int nc_frozen_query(netcmp_t *, const ncfrozen_t *, char *);
+static size_t nc_varint_put(uint8_t *, uint64_t);
+static uint64_t nc_varint_get(const uint8_t **);
+static int nc_parse_ipport(const char *, uint32_t *, uint16_t *);
+static int nc_query_parse(netcmp_t *, char *, ncquery_t *);
+static void nc_query_filter(const ncresult_t *, const ncqpred_t *,
+    uint8_t *restrict);
+static size_t nc_query_select(const ncresult_t *, const uint8_t *, uint32_t *);
+static void nc_query_run(netcmp_t *, const ncresult_t *, const ncquery_t *,
+    uint8_t *, uint32_t *);
+static int nc_parse_ipaddr(const char *, uint32_t *);
+static void nc_hashkey_init(void);
+static void nc_mum(uint64_t *, uint64_t *);
+static uint64_t nc_keyhash(uint64_t, uint64_t);
+static int nc_hash_init(nchash_t *, size_t);
+static size_t nc_hash_slot(const nchash_t *, uint64_t);
+static int nc_hash_add(nchash_t *, uint64_t, uint64_t);
+static uint64_t nc_hash_get(const nchash_t *, uint64_t);
+static void nc_hash_fini(nchash_t *);
+static int nc_pub_map(const char *, ncpubmap_t *);
+static void nc_pub_unmap(ncpubmap_t *);
+static void nc_pub_print(FILE *, const char *, const ncpubmap_t *, size_t);
+static int nc_group_compare(const void *, const void *);
+static void nc_gap_record(netcmp_t *, ncconn_t *);
+static void nc_gap_report(netcmp_t *);
+static void nc_state_dfa_init(void);
+static ncbool_t nc_state_transient(uint8_t);
+static int nc_parse_line(const char *, const char *, ncrow_t *,
+    const char **, ncparseerr_t *);
+static nclabel_t *nc_label_lookup(netcmp_t *, const char *);
+static ncbool_t nc_asym_format(netcmp_t *, ncconn_t *, char *, size_t);
+static int nc_report_bylabel(netcmp_t *);
+static void *nc_report_writer(void *);
+static void *nc_output_gzip(void *);
+static void *nc_output_zstd(void *);
+static nccomp_t nc_input_comp(const uint8_t *);
+static int nc_input_open(netcmp_t *, ncinput_t *, const char *, nccomp_t,
+    FILE **);
+static int nc_input_close(ncinput_t *);
+static int nc_input_frames(ncinput_t *);
+static int nc_input_write(ncinput_t *, const char *, size_t);
+static void *nc_input_feed(void *);
+static void *nc_input_decoder(void *);
+static int nc_input_grow(ncframe_t *, size_t *, size_t);
+static int nc_input_unzstd(ncinput_t *, ZSTD_DCtx *, ncframe_t *);
+static int nc_input_gunzip(ncinput_t *, z_stream *, ncframe_t *);
+static int nc_input_stream(ncinput_t *);
+static void nc_rec_sort(ncrec_t *, size_t);
+static int nc_rec_compare(const ncrec_t *, const ncrec_t *);
+static char *nc_arena_map(ncarena_t *, size_t);
+static void nc_arena_unmap(ncarena_t *, char *, size_t);
+static void *nc_arena_alloc(ncarena_t *, size_t);
+static void nc_arena_report(FILE *, ncarena_t *);
+static double nc_time(void);
+static void nc_conn_tuple(const ncconn_t *, ncagerec_t *);
+static int nc_agerec_compare(const void *, const void *);
+static int nc_conn_age_compare(const void *, const void *);
+static int nc_idle_compare(const void *, const void *);
+static void nc_age_tostr(char *, size_t, unsigned long);
+static int nc_conn_compare(const void *, const void *);
+static int nc_flow_compare(const void *, const void *);
+static int nc_double_compare(const void *, const void *);
+static int nc_conn_port_compare(const void *, const void *);
+static int nc_pair_compare(const void *, const void *);
+static ncconn_t *nc_conn_insert(netcmp_t *, uint32_t, uint32_t, uint16_t,
+    uint16_t);
+static ncconn_t *nc_conn_scan(netcmp_t *, ncpair_t *, size_t);
+static ncconn_t *nc_conn_first(netcmp_t *);
+static ncconn_t *nc_conn_next(netcmp_t *, ncconn_t *);
+static ncconn_t *nc_conn_table_alloc(netcmp_t *, uint32_t);
+static void nc_conn_table_free(netcmp_t *, ncconn_t *, uint32_t);
+static void nc_index_freeze(netcmp_t *);
+static void nc_index_report(FILE *, netcmp_t *);
+static int nc_source_compare(const void *vncs1, const void *vncs2);
+
+int
+main(int argc, char *argv[])
+{
+	int i, rv;
+	netcmp_t netcmp;
+
+	nc_arg0 = argv[0];
+	nc_init(&netcmp);
+	i = nc_parse_options(&netcmp, argc, argv);
+	assert(i >= 0);
+
+	if (netcmp.nc_trackinstall != NULL) {
+		if (argc - optind != 0) {
+			warnx("-T does not take filenames");
+			usage();
+		}
+
+		return (nc_tracker_install(&netcmp, netcmp.nc_trackinstall) ==
+		    0 ? 0 : EXIT_FAILURE);
+	}
+
+	if (argc - optind < 1 && !netcmp.nc_netns &&
+	    netcmp.nc_trackdir == NULL) {
+		warnx("need at least one filename");
+		usage();
+	}
+
+	if (netcmp.nc_interval != 0) {
+		return (nc_daemon(&netcmp, argc - i, argv + i) == 0 ?
+		    0 : EXIT_FAILURE);
+	}
+
+	if (nc_output_open(&netcmp) != 0)
+		return (EXIT_FAILURE);
+
+	if (netcmp.nc_diff) {
+		if (argc - optind != 2) {
+			warnx("-D requires exactly two filenames");
+			usage();
+		}
+
+		if (nc_diff(&netcmp, argv[i], argv[i + 1]) != 0 ||
+		    nc_output_close(&netcmp) != 0) {
+			return (EXIT_FAILURE);
+		}
+
+		return (0);
+	}
+
+	if (netcmp.nc_resdiff) {
+		if (argc - optind != 2) {
+			warnx("-R requires exactly two filenames");
+			usage();
+		}
+
+		if (nc_resdiff(&netcmp, argv[i], argv[i + 1]) != 0 ||
+		    nc_output_close(&netcmp) != 0) {
+			return (EXIT_FAILURE);
+		}
+
+		return (0);
+	}
+
+	if (netcmp.nc_benchcmp) {
+		if (argc - optind != 2) {
+			warnx("-M requires exactly two filenames");
+			usage();
+		}
+
+		rv = nc_bench_compare(&netcmp, argv[i], argv[i + 1]);
+		if (rv < 0 || nc_output_close(&netcmp) != 0)
+			return (EXIT_FAILURE);
+
+		return (rv > 0 ? EXIT_REGRESSION : 0);
+	}
+
+	return (nc_run(&netcmp, argc - i, argv + i, NULL) == 0 ?
+	    0 : EXIT_FAILURE);
+}
+
+static void
+usage(void)
+{
+	(void) fprintf(stderr, "usage: %s [-dnNq] [-a AGEFILE [-A MINAGE]] "
+	    "[-b BENCHFILE] [-c CKPTFILE] [-g K]\n"
+	    "           [-o FILE] [-O DIR] [-B BPFDIR] [-P FILE] [-s SKEW] "
+	    "[-S NSAMPLES]\n"
+	    "           [-V NAME=PATTERNS ...] "
+	    "[-i INTERVAL [-C SOCKET] [-H HISTFILE]]\n"
+	    "           [FILE1 FILE2 ...]\n", nc_arg0);
+	(void) fprintf(stderr, "       %s -D [-d] [-o FILE] OLDFILE NEWFILE\n",
+	    nc_arg0);
+	(void) fprintf(stderr, "       %s -R [-o FILE] OLDRESULT NEWRESULT\n",
+	    nc_arg0);
+	(void) fprintf(stderr, "       %s -M [-t PCT] [-o FILE] "
+	    "OLDBENCH NEWBENCH\n", nc_arg0);
+	(void) fprintf(stderr, "       %s -T [-d] BPFDIR\n", nc_arg0);
+	exit(EXIT_USAGE);
+}
+
+/*
+ * netcmp "public" functions (if this were a separate module)
+ */
+
+/*
+ * Initialize the netcmp operation.
+ */
+static void
+nc_init(netcmp_t *ncp)
+{
+	bzero(ncp, sizeof (*ncp));
+	ncp->nc_now = time(NULL);
+	ncp->nc_skew = -1;
+	ncp->nc_nsamples = NC_DIAG_NSAMPLES;
+	ncp->nc_benchthresh = -1;
+	nc_state_dfa_init();
+	nc_hashkey_init();
+	avl_create(&ncp->nc_pairs, nc_pair_compare,
+	    sizeof (ncpair_t), offsetof(ncpair_t, ncpr_link));
+	avl_create(&ncp->nc_sources, nc_source_compare,
+	    sizeof (ncsource_t), offsetof(ncsource_t, ncs_link));
+}
+
+/*
+ * Parse a non-negative decimal option argument no larger than "max" into
+ * "valp".  strtoul() accepts a leading '-' and negates the result, so "-1"
+ * would otherwise silently become ULONG_MAX.
+ */
+static int
+nc_parse_ulong(const char *arg, unsigned long max, unsigned long *valp)
+{
+	char *endp;
+	unsigned long val;
+
+	if (!isdigit((unsigned char)arg[0]))
+		return (-1);
+
+	errno = 0;
+	val = strtoul(arg, &endp, 10);
+	if (errno != 0 || *endp != '\0' || val > max)
+		return (-1);
+
+	*valp = val;
+	return (0);
+}
+
+/*
+ * Parse command-line options, recording the requested configuration into "ncp".
+ */
+static int
+nc_parse_options(netcmp_t *ncp, int argc, char *argv[])
+{
+	char c;
+	char *endp;
+
+	while ((c = getopt(argc, argv,
+	    ":dDMnNqRa:A:b:B:c:C:g:H:i:o:O:P:s:S:t:T:V:")) != -1) {
+		switch (c) {
+		case 'd':
+			ncp->nc_debug = NB_TRUE;
+			break;
+
+		case 'b':
+			ncp->nc_bench.ncb_path = optarg;
+			break;
+
+		case 'c':
+			ncp->nc_ckptfile = optarg;
+			break;
+
+		case 'C':
+			ncp->nc_ctlpath = optarg;
+			break;
+
+		case 'D':
+			ncp->nc_diff = NB_TRUE;
+			break;
+
+		case 'R':
+			ncp->nc_resdiff = NB_TRUE;
+			break;
+
+		case 'M':
+			ncp->nc_benchcmp = NB_TRUE;
+			break;
+
+		case 'g':
+			if (nc_parse_ulong(optarg, UINT32_MAX,
+			    &ncp->nc_gapk) != 0) {
+				warnx("bad count: \"%s\"", optarg);
+				usage();
+			}
+			break;
+
+		case 'H':
+			ncp->nc_histfile = optarg;
+			break;
+
+		case 'i':
+			errno = 0;
+			ncp->nc_interval = strtoul(optarg, &endp, 10);
+			if (errno != 0 || *endp != '\0' ||
+			    ncp->nc_interval == 0) {
+				warnx("bad interval: \"%s\"", optarg);
+				usage();
+			}
+			break;
+
+		case 'n':
+			ncp->nc_arena.ncar_nolarge = NB_TRUE;
+			break;
+
+		case 'N':
+			ncp->nc_netns = NB_TRUE;
+			break;
+
+		case 'q':
+			ncp->nc_query = NB_TRUE;
+			break;
+
+		case 'B':
+			ncp->nc_trackdir = optarg;
+			break;
+
+		case 'T':
+			ncp->nc_trackinstall = optarg;
+			break;
+
+		case 'V':
+			if (nc_view_add(ncp, optarg) != 0)
+				usage();
+			break;
+
+		case 'a':
+			ncp->nc_agefile = optarg;
+			break;
+
+		case 'o':
+			ncp->nc_output.nco_path = optarg;
+			break;
+
+		case 'O':
+			ncp->nc_reportdir = optarg;
+			break;
+
+		case 'P':
+			ncp->nc_pubfile = optarg;
+			break;
+
+		case 'S':
+			if (nc_parse_ulong(optarg, NC_DIAG_MAXSAMPLES,
+			    &ncp->nc_nsamples) != 0) {
+				warnx("bad sample count: \"%s\"", optarg);
+				usage();
+			}
+			break;
+
+		case 'A':
+			if (nc_parse_ulong(optarg, UINT32_MAX,
+			    &ncp->nc_minage) != 0) {
+				warnx("bad minimum age: \"%s\"", optarg);
+				usage();
+			}
+			break;
+
+		case 't':
+			errno = 0;
+			ncp->nc_benchthresh = strtod(optarg, &endp);
+			if (errno != 0 || *endp != '\0' || endp == optarg ||
+			    ncp->nc_benchthresh < 0) {
+				warnx("bad threshold: \"%s\"", optarg);
+				usage();
+			}
+			break;
+
+		case 's':
+			errno = 0;
+			ncp->nc_skew = strtol(optarg, &endp, 10);
+			if (errno != 0 || *endp != '\0' || ncp->nc_skew < 0) {
+				warnx("bad skew: \"%s\"", optarg);
+				usage();
+			}
+			break;
+
+		case ':':
+			warnx("option requires an argument: -%c", c);
+			usage();
+			break;
+
+		case '?':
+			warnx("unrecognized option: -%c", c);
+			usage();
+			break;
+		}
+	}
+
+	if (ncp->nc_minage != 0 && ncp->nc_agefile == NULL) {
+		warnx("-A requires -a");
+		usage();
+	}
+
+	if (ncp->nc_diff && ncp->nc_ckptfile != NULL) {
+		warnx("-c cannot be used with -D");
+		usage();
+	}
+
+	/*
+	 * The comparison modes don't build the connection index, so none of the
+	 * options for collecting, classifying, or reporting connections apply.
+	 */
+	if ((ncp->nc_diff || ncp->nc_resdiff || ncp->nc_benchcmp) &&
+	    (ncp->nc_agefile != NULL || ncp->nc_gapk != 0 || ncp->nc_netns ||
+	    ncp->nc_trackdir != NULL || ncp->nc_reportdir != NULL ||
+	    ncp->nc_pubfile != NULL || ncp->nc_query || ncp->nc_skew >= 0 ||
+	    ncp->nc_nviews != 0)) {
+		warnx("-D, -M, and -R cannot be used with -a, -B, -g, -N, -O, "
+		    "-P, -q, -s, or -V");
+		usage();
+	}
+
+	if (ncp->nc_resdiff && (ncp->nc_diff || ncp->nc_ckptfile != NULL)) {
+		warnx("-R cannot be used with -c or -D");
+		usage();
+	}
+
+	if ((ncp->nc_ctlpath != NULL || ncp->nc_histfile != NULL) &&
+	    ncp->nc_interval == 0) {
+		warnx("-C and -H require -i");
+		usage();
+	}
+
+	if (ncp->nc_interval != 0 && (ncp->nc_diff || ncp->nc_resdiff ||
+	    ncp->nc_query || ncp->nc_ckptfile != NULL)) {
+		warnx("-i cannot be used with -c, -D, -q, or -R");
+		usage();
+	}
+
+	/*
+	 * The tracker's table covers the same connections as "-N" under the
+	 * same label, so every connection would appear to be seen twice.
+	 */
+	if (ncp->nc_netns && ncp->nc_trackdir != NULL) {
+		warnx("-N cannot be used with -B");
+		usage();
+	}
+
+	if (ncp->nc_benchthresh >= 0 && !ncp->nc_benchcmp) {
+		warnx("-t requires -M");
+		usage();
+	}
+
+	if (ncp->nc_benchcmp && (ncp->nc_diff || ncp->nc_resdiff ||
+	    ncp->nc_interval != 0 || ncp->nc_ckptfile != NULL ||
+	    ncp->nc_bench.ncb_path != NULL)) {
+		warnx("-M cannot be used with -b, -c, -D, -i, or -R");
+		usage();
+	}
+
+	if (ncp->nc_bench.ncb_path != NULL &&
+	    (ncp->nc_diff || ncp->nc_resdiff)) {
+		warnx("-b cannot be used with -D or -R");
+		usage();
+	}
+
+	return (optind);
+}
+
+/*
+ * Ingest the input files ("files") and the other sources of connections,
+ * classify the connections, and then print the report or answer queries.  In
+ * continuous mode ("-i"), this runs once per round, and the summary of the
+ * round is stored into "round".
+ */
+static int
+nc_run(netcmp_t *ncp, int nfiles, char *files[], ncround_t *round)
+{
+	int i;
+	double begin, start, elapsed, phase;
+	double *bench = ncp->nc_bench.ncb_values;
+
+	begin = nc_time();
+	if (ncp->nc_ckptfile != NULL && nc_ckpt_load(ncp, nfiles, files) != 0)
+		return (-1);
+
+	start = nc_time();
+	ncp->nc_ckptlast = start;
+
+	/*
+	 * Connection tracking tables are read first, since the translations
+	 * they contain apply to rows from all of the other files.  They're
+	 * cheap enough to read that they're not checkpointed.
+	 */
+	for (i = 0; i < nfiles; i++) {
+		if (nc_conntrack_file(files[i]) &&
+		    nc_read_conntrack(ncp, files[i]) != 0) {
+			return (-1);
+		}
+	}
+
+	/*
+	 * A checkpoint we resumed from already has the connections from "-N"
+	 * and "-B".
+	 */
+	if (ncp->nc_netns && (ncp->nc_ckptothers & NC_CKPT_NETNS) == 0) {
+		if (nc_netns_collect(ncp) != 0)
+			return (-1);
+		ncp->nc_ckptothers |= NC_CKPT_NETNS;
+	}
+
+	if (ncp->nc_trackdir != NULL &&
+	    (ncp->nc_ckptothers & NC_CKPT_TRACKER) == 0) {
+		if (nc_tracker_read(ncp, ncp->nc_trackdir) != 0)
+			return (-1);
+		ncp->nc_ckptothers |= NC_CKPT_TRACKER;
+	}
+
+	for (i = 0; i < nfiles; i++) {
+		assert(files[i] != NULL);
+		if (nc_ckpt_done(ncp, files[i]) ||
+		    nc_conntrack_file(files[i])) {
+			continue;
+		}
+
+		phase = nc_time();
+		if (nc_read_file(ncp, files[i], nc_parse_row) != 0)
+			return (-1);
+		bench[NCB_READ] += nc_time() - phase;
+
+		if (ncp->nc_ckptfile != NULL &&
+		    (nc_ckpt_add(ncp, files[i]) != 0 ||
+		    nc_ckpt_save(ncp) != 0)) {
+			return (-1);
+		}
+	}
+
+	if (nc_nat_observe(ncp) != 0)
+		return (-1);
+
+	nc_index_freeze(ncp);
+
+	elapsed = nc_time() - start;
+	bench[NCB_ROWSPERSEC] = elapsed > 0 ? ncp->nc_nrows / elapsed : 0;
+	if (ncp->nc_debug) {
+		(void) fprintf(stderr, "ingested %lu rows in %.3fs "
+		    "(%.0f rows/s)\n", ncp->nc_nrows, elapsed,
+		    bench[NCB_ROWSPERSEC]);
+		nc_index_report(stderr, ncp);
+		nc_arena_report(stderr, &ncp->nc_arena);
+	}
+
+	if (ncp->nc_agefile != NULL && nc_age_update(ncp) != 0)
+		return (-1);
+
+	phase = nc_time();
+	nc_classify(ncp);
+	bench[NCB_CLASSIFY] = nc_time() - phase;
+	if (round != NULL) {
+		nc_round_summary(ncp, round);
+		round->ncrd_ingestms = (uint64_t)(elapsed * 1000);
+		round->ncrd_classifyms = (uint64_t)(bench[NCB_CLASSIFY] * 1000);
+	}
+
+	if (ncp->nc_pubfile != NULL && nc_publish(ncp) != 0)
+		return (-1);
+
+	if (ncp->nc_query) {
+		if (nc_query_loop(ncp) != 0)
+			return (-1);
+	} else {
+		phase = nc_time();
+		nc_report(ncp);
+		bench[NCB_REPORT] = nc_time() - phase;
+	}
+
+	if (nc_output_close(ncp) != 0)
+		return (-1);
+
+	if (ncp->nc_ckptfile != NULL && unlink(ncp->nc_ckptfile) != 0 &&
+	    errno != ENOENT) {
+		warn("unlink \"%s\"", ncp->nc_ckptfile);
+		return (-1);
+	}
+
+	bench[NCB_TOTAL] = nc_time() - begin;
+	if (ncp->nc_bench.ncb_path != NULL && nc_bench_save(ncp) != 0)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Open the stream for the report.  This is stdout unless "-o" was given.  If
+ * the output file's name ends in ".gz" or ".zst", we start a thread to compress
+ * the report as it's written.
+ */
+static int
+nc_output_open(netcmp_t *ncp)
+{
+	ncoutput_t *nco = &ncp->nc_output;
+	void *(*compfunc)(void *);
+	size_t len;
+	int fds[2];
+
+	if (nco->nco_path == NULL) {
+		ncp->nc_out = stdout;
+		return (0);
+	}
+
+	len = strlen(nco->nco_path);
+	if (len > 3 && strcmp(nco->nco_path + len - 3, ".gz") == 0) {
+		nco->nco_comp = NCZ_GZIP;
+		compfunc = nc_output_gzip;
+	} else if (len > 4 && strcmp(nco->nco_path + len - 4, ".zst") == 0) {
+		nco->nco_comp = NCZ_ZSTD;
+		compfunc = nc_output_zstd;
+	} else {
+		nco->nco_comp = NCZ_NONE;
+		compfunc = NULL;
+	}
+
+	if (compfunc == NULL) {
+		if ((ncp->nc_out = fopen(nco->nco_path, "w")) == NULL) {
+			warn("fopen \"%s\"", nco->nco_path);
+			return (-1);
+		}
+
+		(void) setvbuf(ncp->nc_out, NULL, _IOFBF, NC_OUTBUFSZ);
+		return (0);
+	}
+
+	if ((nco->nco_fd = open(nco->nco_path,
+	    O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+		warn("open \"%s\"", nco->nco_path);
+		return (-1);
+	}
+
+	if (pipe(fds) != 0) {
+		warn("pipe");
+		(void) close(nco->nco_fd);
+		return (-1);
+	}
+
+	if ((ncp->nc_out = fdopen(fds[1], "w")) == NULL) {
+		warn("fdopen");
+		(void) close(fds[0]);
+		(void) close(fds[1]);
+		(void) close(nco->nco_fd);
+		return (-1);
+	}
+
+	(void) setvbuf(ncp->nc_out, NULL, _IOFBF, NC_OUTBUFSZ);
+	nco->nco_pipefd = fds[0];
+	if ((errno = pthread_create(&nco->nco_thread, NULL, compfunc,
+	    nco)) != 0) {
+		warn("pthread_create");
+		(void) fclose(ncp->nc_out);
+		(void) close(fds[0]);
+		(void) close(nco->nco_fd);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Flush and close the report stream, waiting for the compression thread (if
+ * any) to finish writing the output file.
+ */
+static int
+nc_output_close(netcmp_t *ncp)
+{
+	ncoutput_t *nco = &ncp->nc_output;
+	int rv = 0;
+
+	if (fflush(ncp->nc_out) != 0) {
+		warn("write report");
+		rv = -1;
+	}
+
+	if (ncp->nc_out == stdout)
+		return (rv);
+
+	if (fclose(ncp->nc_out) != 0) {
+		warn("write \"%s\"", nco->nco_path);
+		rv = -1;
+	}
+
+	ncp->nc_out = NULL;
+	if (nco->nco_comp == NCZ_NONE)
+		return (rv);
+
+	(void) pthread_join(nco->nco_thread, NULL);
+	(void) close(nco->nco_pipefd);
+	if (nco->nco_error != 0)
+		rv = -1;
+	return (rv);
+}
+
+/*
+ * Thread body that gzip-compresses the report.  See nc_output_open().
+ */
+static void *
+nc_output_gzip(void *arg)
+{
+	ncoutput_t *nco = arg;
+	gzFile gz;
+	char *buf;
+	ssize_t nread;
+	int gzerr;
+
+	if ((buf = malloc(NC_OUTBUFSZ)) == NULL) {
+		warn("malloc");
+		nco->nco_error = 1;
+		(void) close(nco->nco_fd);
+		return (NULL);
+	}
+
+	if ((gz = gzdopen(nco->nco_fd, "wb")) == NULL) {
+		warnx("gzdopen \"%s\" failed", nco->nco_path);
+		nco->nco_error = 1;
+		(void) close(nco->nco_fd);
+		free(buf);
+		return (NULL);
+	}
+
+	while ((nread = read(nco->nco_pipefd, buf, NC_OUTBUFSZ)) != 0) {
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+			warn("read report pipe");
+			nco->nco_error = 1;
+			break;
+		}
+
+		if (gzwrite(gz, buf, (unsigned int)nread) != nread) {
+			warnx("gzwrite \"%s\": %s", nco->nco_path,
+			    gzerror(gz, &gzerr));
+			nco->nco_error = 1;
+			break;
+		}
+	}
+
+	if ((gzerr = gzclose(gz)) != Z_OK) {
+		warnx("gzclose \"%s\" failed (error %d)", nco->nco_path,
+		    gzerr);
+		nco->nco_error = 1;
+	}
+
+	/* If we stopped early, drain the pipe so the report writer finishes. */
+	while (nco->nco_error != 0 &&
+	    read(nco->nco_pipefd, buf, NC_OUTBUFSZ) > 0)
+		;
+
+	free(buf);
+	return (NULL);
+}
+
+/*
+ * Thread body that zstd-compresses the report.  See nc_output_open().
+ */
+static void *
+nc_output_zstd(void *arg)
+{
+	ncoutput_t *nco = arg;
+	ZSTD_CCtx *cctx;
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	char *inbuf, *outbuf;
+	size_t outbufsz, remaining;
+	ssize_t nread, nwritten;
+	ZSTD_EndDirective mode;
+	size_t off;
+
+	outbufsz = ZSTD_CStreamOutSize();
+	inbuf = malloc(NC_OUTBUFSZ);
+	outbuf = malloc(outbufsz);
+	cctx = ZSTD_createCCtx();
+	if (inbuf == NULL || outbuf == NULL || cctx == NULL) {
+		warnx("failed to set up zstd compression");
+		nco->nco_error = 1;
+		goto out;
+	}
+
+	mode = ZSTD_e_continue;
+	while (mode != ZSTD_e_end) {
+		nread = read(nco->nco_pipefd, inbuf, NC_OUTBUFSZ);
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+			warn("read report pipe");
+			nco->nco_error = 1;
+			break;
+		}
+
+		if (nread == 0)
+			mode = ZSTD_e_end;
+
+		in.src = inbuf;
+		in.size = (size_t)nread;
+		in.pos = 0;
+		do {
+			out.dst = outbuf;
+			out.size = outbufsz;
+			out.pos = 0;
+			remaining = ZSTD_compressStream2(cctx, &out, &in, mode);
+			if (ZSTD_isError(remaining)) {
+				warnx("zstd: %s", ZSTD_getErrorName(remaining));
+				nco->nco_error = 1;
+				goto out;
+			}
+
+			for (off = 0; off < out.pos; off += nwritten) {
+				nwritten = write(nco->nco_fd, outbuf + off,
+				    out.pos - off);
+				if (nwritten < 0) {
+					warn("write \"%s\"", nco->nco_path);
+					nco->nco_error = 1;
+					goto out;
+				}
+			}
+		} while (mode == ZSTD_e_end ? remaining != 0 :
+		    in.pos < in.size);
+	}
+
+out:
+	if (close(nco->nco_fd) != 0 && nco->nco_error == 0) {
+		warn("close \"%s\"", nco->nco_path);
+		nco->nco_error = 1;
+	}
+
+	/* If we stopped early, drain the pipe so the report writer finishes. */
+	while (nco->nco_error != 0 && inbuf != NULL &&
+	    read(nco->nco_pipefd, inbuf, NC_OUTBUFSZ) > 0)
+		;
+
+	ZSTD_freeCCtx(cctx);
+	free(inbuf);
+	free(outbuf);
+	return (NULL);
+}
+
+/*
+ * Return the compression format of a file that begins with "magic" (the first
+ * four bytes of the file, in the byte order of this system).
+ */
+static nccomp_t
+nc_input_comp(const uint8_t *magic)
+{
+	if (magic[0] == 0x1f && magic[1] == 0x8b)
+		return (NCZ_GZIP);
+	if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f &&
+	    magic[3] == 0xfd)
+		return (NCZ_ZSTD);
+	return (NCZ_NONE);
+}
+
+/*
+ * Set up decompression of the compressed input file open as *fstreamp, and
+ * replace *fstreamp with a stream from which to read the decompressed data.
+ * On success, the caller must call nc_input_close() after reading the stream
+ * to the end.
+ */
+static int
+nc_input_open(netcmp_t *ncp, ncinput_t *nci, const char *filename,
+    nccomp_t comp, FILE **fstreamp)
+{
+	struct stat st;
+	FILE *fstream;
+	long ncpus;
+	int fds[2];
+
+	bzero(nci, sizeof (*nci));
+	nci->nci_path = filename;
+	nci->nci_comp = comp;
+	if (fstat(fileno(*fstreamp), &st) != 0) {
+		warn("fstat \"%s\"", filename);
+		return (-1);
+	}
+
+	nci->nci_size = st.st_size;
+	nci->nci_base = mmap(NULL, nci->nci_size, PROT_READ, MAP_PRIVATE,
+	    fileno(*fstreamp), 0);
+	if (nci->nci_base == MAP_FAILED) {
+		warn("mmap \"%s\"", filename);
+		return (-1);
+	}
+
+	(void) madvise(nci->nci_base, nci->nci_size, MADV_SEQUENTIAL);
+	if (nc_input_frames(nci) != 0) {
+		(void) munmap(nci->nci_base, nci->nci_size);
+		return (-1);
+	}
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nci->nci_nframes > 1 && ncpus > 1) {
+		nci->nci_ndecoders = ncpus < NC_MAXDECODERS ? ncpus :
+		    NC_MAXDECODERS;
+		if (nci->nci_ndecoders > nci->nci_nframes)
+			nci->nci_ndecoders = nci->nci_nframes;
+	}
+
+	if (ncp->nc_debug) {
+		(void) fprintf(stderr, "%s: %lu %s frames, %u decoder "
+		    "threads\n", filename, (unsigned long)nci->nci_nframes,
+		    comp == NCZ_GZIP ? "gzip" : "zstd", nci->nci_ndecoders);
+	}
+
+	if (pipe(fds) != 0) {
+		warn("pipe");
+		free(nci->nci_frames);
+		(void) munmap(nci->nci_base, nci->nci_size);
+		return (-1);
+	}
+
+#ifdef F_SETPIPE_SZ
+	(void) fcntl(fds[1], F_SETPIPE_SZ, NC_READBUFSZ);
+#endif
+
+	if ((fstream = fdopen(fds[0], "r")) == NULL) {
+		warn("fdopen");
+		(void) close(fds[0]);
+		(void) close(fds[1]);
+		free(nci->nci_frames);
+		(void) munmap(nci->nci_base, nci->nci_size);
+		return (-1);
+	}
+
+	nci->nci_pipefd = fds[1];
+	(void) pthread_mutex_init(&nci->nci_lock, NULL);
+	(void) pthread_cond_init(&nci->nci_cv, NULL);
+	if ((errno = pthread_create(&nci->nci_thread, NULL, nc_input_feed,
+	    nci)) != 0) {
+		warn("pthread_create");
+		(void) fclose(fstream);
+		(void) close(fds[1]);
+		free(nci->nci_frames);
+		(void) munmap(nci->nci_base, nci->nci_size);
+		return (-1);
+	}
+
+	(void) fclose(*fstreamp);
+	*fstreamp = fstream;
+	return (0);
+}
+
+/*
+ * Wait for the threads decompressing an input file to finish, once its stream
+ * has been read to the end.  Fails if the file could not be decompressed, in
+ * which case the data read was incomplete.
+ */
+static int
+nc_input_close(ncinput_t *nci)
+{
+	(void) pthread_join(nci->nci_thread, NULL);
+	(void) pthread_mutex_destroy(&nci->nci_lock);
+	(void) pthread_cond_destroy(&nci->nci_cv);
+	free(nci->nci_frames);
+	(void) munmap(nci->nci_base, nci->nci_size);
+	return (nci->nci_error == 0 ? 0 : -1);
+}
+
+/*
+ * Find the independently compressed frames in an input file, for decoding in
+ * parallel.  zstd frames record enough to find the end of each without
+ * decompressing it.  gzip members don't, unless they carry a "BC" extra field
+ * with their size (as bgzip writes).  If the frames can't all be found this
+ * way, the file is treated as a single frame and decompressed as one stream.
+ */
+static int
+nc_input_frames(ncinput_t *nci)
+{
+	const uint8_t *p;
+	size_t off, len, nalloc, xlen, x;
+	ncframe_t *frames;
+
+	nalloc = 0;
+	for (off = 0; off < nci->nci_size; off += len) {
+		p = nci->nci_base + off;
+		len = 0;
+		if (nci->nci_comp == NCZ_ZSTD) {
+			len = ZSTD_findFrameCompressedSize(p,
+			    nci->nci_size - off);
+			if (ZSTD_isError(len))
+				len = 0;
+		} else if (nci->nci_size - off >= 18 && p[0] == 0x1f &&
+		    p[1] == 0x8b && (p[3] & 0x04) != 0) {
+			/* Look for the "BC" subfield in FEXTRA. */
+			xlen = p[10] | (p[11] << 8);
+			for (x = 12; x + 6 <= 12 + xlen &&
+			    off + x + 6 <= nci->nci_size;
+			    x += 4 + (p[x + 2] | (p[x + 3] << 8))) {
+				if (p[x] == 'B' && p[x + 1] == 'C' &&
+				    p[x + 2] == 2 && p[x + 3] == 0) {
+					len = (p[x + 4] | (p[x + 5] << 8)) + 1;
+					break;
+				}
+			}
+
+			if (len > nci->nci_size - off)
+				len = 0;
+		}
+
+		if (len == 0) {
+			/* Decompress the whole file as one stream. */
+			free(nci->nci_frames);
+			nci->nci_frames = NULL;
+			nci->nci_nframes = 1;
+			return (0);
+		}
+
+		if (nci->nci_nframes == nalloc) {
+			nalloc = nalloc == 0 ? 1024 : nalloc * 2;
+			frames = realloc(nci->nci_frames,
+			    nalloc * sizeof (*frames));
+			if (frames == NULL) {
+				warn("realloc");
+				free(nci->nci_frames);
+				nci->nci_frames = NULL;
+				return (-1);
+			}
+			nci->nci_frames = frames;
+		}
+
+		bzero(&nci->nci_frames[nci->nci_nframes],
+		    sizeof (nci->nci_frames[0]));
+		nci->nci_frames[nci->nci_nframes].ncfr_src = p;
+		nci->nci_frames[nci->nci_nframes].ncfr_srclen = len;
+		nci->nci_nframes++;
+	}
+
+	return (0);
+}
+
+/*
+ * Write "len" bytes of decompressed input into the pipe.
+ */
+static int
+nc_input_write(ncinput_t *nci, const char *buf, size_t len)
+{
+	ssize_t nwritten;
+	size_t off;
+
+	for (off = 0; off < len; off += nwritten) {
+		if ((nwritten = write(nci->nci_pipefd, buf + off,
+		    len - off)) < 0) {
+			if (errno == EINTR) {
+				nwritten = 0;
+				continue;
+			}
+			warn("write input pipe for \"%s\"", nci->nci_path);
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Thread body that feeds the decompressed contents of an input file into the
+ * pipe.  See ncinput_t.
+ */
+static void *
+nc_input_feed(void *arg)
+{
+	ncinput_t *nci = arg;
+	ncframe_t *frame;
+	unsigned int i, nstarted;
+	size_t f;
+	int rv;
+
+	if (nci->nci_ndecoders == 0) {
+		if (nc_input_stream(nci) != 0)
+			nci->nci_error = 1;
+		(void) close(nci->nci_pipefd);
+		return (NULL);
+	}
+
+	for (nstarted = 0; nstarted < nci->nci_ndecoders; nstarted++) {
+		if (pthread_create(&nci->nci_decoders[nstarted], NULL,
+		    nc_input_decoder, nci) != 0) {
+			warn("pthread_create");
+			break;
+		}
+	}
+
+	(void) pthread_mutex_lock(&nci->nci_lock);
+	if (nstarted == 0)
+		nci->nci_error = 1;
+	for (f = 0; f < nci->nci_nframes && nci->nci_error == 0; f++) {
+		frame = &nci->nci_frames[f];
+		while (!frame->ncfr_done && nci->nci_error == 0)
+			(void) pthread_cond_wait(&nci->nci_cv, &nci->nci_lock);
+		if (nci->nci_error != 0)
+			break;
+
+		(void) pthread_mutex_unlock(&nci->nci_lock);
+		rv = nc_input_write(nci, frame->ncfr_buf, frame->ncfr_len);
+		free(frame->ncfr_buf);
+		frame->ncfr_buf = NULL;
+		(void) pthread_mutex_lock(&nci->nci_lock);
+		if (rv != 0)
+			nci->nci_error = 1;
+		nci->nci_nwritten++;
+		(void) pthread_cond_broadcast(&nci->nci_cv);
+	}
+
+	/* On failure, this tells the decoders to stop. */
+	(void) pthread_cond_broadcast(&nci->nci_cv);
+	(void) pthread_mutex_unlock(&nci->nci_lock);
+	for (i = 0; i < nstarted; i++)
+		(void) pthread_join(nci->nci_decoders[i], NULL);
+
+	for (; f < nci->nci_nframes; f++)
+		free(nci->nci_frames[f].ncfr_buf);
+
+	(void) close(nci->nci_pipefd);
+	return (NULL);
+}
+
+/*
+ * Thread body that decompresses frames of an input file.  See ncinput_t.
+ */
+static void *
+nc_input_decoder(void *arg)
+{
+	ncinput_t *nci = arg;
+	ZSTD_DCtx *dctx = NULL;
+	z_stream zs;
+	ncframe_t *frame;
+	size_t f;
+	int rv;
+
+	bzero(&zs, sizeof (zs));
+	if (nci->nci_comp == NCZ_ZSTD ? (dctx = ZSTD_createDCtx()) == NULL :
+	    inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+		warnx("failed to set up decompression");
+		(void) pthread_mutex_lock(&nci->nci_lock);
+		nci->nci_error = 1;
+		(void) pthread_cond_broadcast(&nci->nci_cv);
+		(void) pthread_mutex_unlock(&nci->nci_lock);
+		return (NULL);
+	}
+
+	(void) pthread_mutex_lock(&nci->nci_lock);
+	for (;;) {
+		while (nci->nci_error == 0 &&
+		    nci->nci_next < nci->nci_nframes &&
+		    nci->nci_next >= nci->nci_nwritten + NC_DECODEAHEAD)
+			(void) pthread_cond_wait(&nci->nci_cv, &nci->nci_lock);
+		if (nci->nci_error != 0 || nci->nci_next == nci->nci_nframes)
+			break;
+
+		f = nci->nci_next++;
+		(void) pthread_mutex_unlock(&nci->nci_lock);
+		frame = &nci->nci_frames[f];
+		rv = nci->nci_comp == NCZ_ZSTD ?
+		    nc_input_unzstd(nci, dctx, frame) :
+		    nc_input_gunzip(nci, &zs, frame);
+		(void) pthread_mutex_lock(&nci->nci_lock);
+		if (rv != 0)
+			nci->nci_error = 1;
+		frame->ncfr_done = NB_TRUE;
+		(void) pthread_cond_broadcast(&nci->nci_cv);
+	}
+
+	(void) pthread_mutex_unlock(&nci->nci_lock);
+	if (dctx != NULL)
+		ZSTD_freeDCtx(dctx);
+	else
+		(void) inflateEnd(&zs);
+	return (NULL);
+}
+
+/*
+ * Make sure that "frame" has room for at least "len" more bytes of
+ * decompressed data.
+ */
+static int
+nc_input_grow(ncframe_t *frame, size_t *capp, size_t len)
+{
+	char *buf;
+	size_t cap;
+
+	if (frame->ncfr_buf != NULL && frame->ncfr_len + len <= *capp)
+		return (0);
+
+	cap = *capp == 0 ? len : *capp;
+	while (cap < frame->ncfr_len + len)
+		cap *= 2;
+	if ((buf = realloc(frame->ncfr_buf, cap)) == NULL) {
+		warn("realloc");
+		return (-1);
+	}
+
+	frame->ncfr_buf = buf;
+	*capp = cap;
+	return (0);
+}
+
+/*
+ * Decompress one zstd frame of an input file into memory.
+ */
+static int
+nc_input_unzstd(ncinput_t *nci, ZSTD_DCtx *dctx, ncframe_t *frame)
+{
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	unsigned long long hint;
+	size_t cap, rv;
+
+	hint = ZSTD_getFrameContentSize(frame->ncfr_src, frame->ncfr_srclen);
+	if (hint == ZSTD_CONTENTSIZE_UNKNOWN || hint == ZSTD_CONTENTSIZE_ERROR)
+		hint = 4 * frame->ncfr_srclen;
+
+	cap = 0;
+	(void) ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+	in.src = frame->ncfr_src;
+	in.size = frame->ncfr_srclen;
+	in.pos = 0;
+	do {
+		if (nc_input_grow(frame, &cap, frame->ncfr_len == 0 ?
+		    hint + 1 : ZSTD_DStreamOutSize()) != 0)
+			return (-1);
+
+		out.dst = frame->ncfr_buf;
+		out.size = cap;
+		out.pos = frame->ncfr_len;
+		rv = ZSTD_decompressStream(dctx, &out, &in);
+		frame->ncfr_len = out.pos;
+		if (ZSTD_isError(rv)) {
+			warnx("%s: zstd: %s", nci->nci_path,
+			    ZSTD_getErrorName(rv));
+			return (-1);
+		}
+	} while (rv != 0);
+
+	return (0);
+}
+
+/*
+ * Decompress one gzip member of an input file into memory.
+ */
+static int
+nc_input_gunzip(ncinput_t *nci, z_stream *zs, ncframe_t *frame)
+{
+	const uint8_t *trailer;
+	size_t cap, hint;
+	int rv;
+
+	/* The last four bytes of the member give its uncompressed size. */
+	trailer = frame->ncfr_src + frame->ncfr_srclen - 4;
+	hint = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) |
+	    ((size_t)trailer[3] << 24);
+
+	cap = 0;
+	(void) inflateReset(zs);
+	zs->next_in = (Bytef *)frame->ncfr_src;
+	zs->avail_in = frame->ncfr_srclen;
+	do {
+		if (nc_input_grow(frame, &cap, frame->ncfr_len == 0 ?
+		    hint + 1 : NC_OUTBUFSZ) != 0)
+			return (-1);
+
+		zs->next_out = (Bytef *)frame->ncfr_buf + frame->ncfr_len;
+		zs->avail_out = cap - frame->ncfr_len;
+		rv = inflate(zs, Z_NO_FLUSH);
+		frame->ncfr_len = cap - zs->avail_out;
+		if (rv != Z_OK && rv != Z_STREAM_END) {
+			warnx("%s: gzip: %s", nci->nci_path, zs->msg != NULL ?
+			    zs->msg : "truncated or corrupt member");
+			return (-1);
+		}
+	} while (rv != Z_STREAM_END);
+
+	return (0);
+}
+
+/*
+ * Decompress a whole input file as a single stream, writing the data into the
+ * pipe as it's decompressed.  A gzip file may consist of several members.
+ */
+static int
+nc_input_stream(ncinput_t *nci)
+{
+	ZSTD_DCtx *dctx;
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	z_stream zs;
+	char *buf;
+	size_t off, rv;
+	int zrv;
+
+	if ((buf = malloc(NC_READBUFSZ)) == NULL) {
+		warn("malloc");
+		return (-1);
+	}
+
+	if (nci->nci_comp == NCZ_ZSTD) {
+		if ((dctx = ZSTD_createDCtx()) == NULL) {
+			warnx("failed to set up zstd decompression");
+			free(buf);
+			return (-1);
+		}
+
+		in.src = nci->nci_base;
+		in.size = nci->nci_size;
+		in.pos = 0;
+		rv = 1;
+		while (in.pos < in.size || rv != 0) {
+			out.dst = buf;
+			out.size = NC_READBUFSZ;
+			out.pos = 0;
+			rv = ZSTD_decompressStream(dctx, &out, &in);
+			if (ZSTD_isError(rv)) {
+				warnx("%s: zstd: %s", nci->nci_path,
+				    ZSTD_getErrorName(rv));
+				break;
+			}
+
+			if (out.pos == 0 && in.pos == in.size && rv != 0) {
+				warnx("%s: zstd: truncated file",
+				    nci->nci_path);
+				rv = 1;
+				break;
+			}
+
+			if (nc_input_write(nci, buf, out.pos) != 0) {
+				rv = 1;
+				break;
+			}
+		}
+
+		ZSTD_freeDCtx(dctx);
+		free(buf);
+		return (rv == 0 ? 0 : -1);
+	}
+
+	bzero(&zs, sizeof (zs));
+	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+		warnx("failed to set up gzip decompression");
+		free(buf);
+		return (-1);
+	}
+
+	/* zlib counts input in 32-bit quantities, so feed it in pieces. */
+	off = 0;
+	zrv = Z_OK;
+	while (zrv == Z_OK || zrv == Z_STREAM_END) {
+		if (zrv == Z_STREAM_END) {
+			if (zs.avail_in == 0 && off == nci->nci_size)
+				break;
+			(void) inflateReset(&zs);
+		}
+
+		if (zs.avail_in == 0) {
+			zs.next_in = nci->nci_base + off;
+			zs.avail_in = nci->nci_size - off < UINT32_MAX ?
+			    nci->nci_size - off : UINT32_MAX;
+			off += zs.avail_in;
+		}
+
+		zs.next_out = (Bytef *)buf;
+		zs.avail_out = NC_READBUFSZ;
+		zrv = inflate(&zs, Z_NO_FLUSH);
+		if (zrv == Z_BUF_ERROR && zs.avail_in == 0 &&
+		    off < nci->nci_size)
+			zrv = Z_OK;
+		if ((zrv == Z_OK || zrv == Z_STREAM_END) &&
+		    nc_input_write(nci, buf, NC_READBUFSZ - zs.avail_out) != 0)
+			zrv = Z_ERRNO;
+	}
+
+	if (zrv != Z_STREAM_END && zrv != Z_ERRNO) {
+		warnx("%s: gzip: %s", nci->nci_path, zs.msg != NULL ? zs.msg :
+		    "truncated or corrupt file");
+	}
+
+	(void) inflateEnd(&zs);
+	free(buf);
+	return (zrv == Z_STREAM_END ? 0 : -1);
+}
+
+/*
+ * Read the netstat data contained in the named file and record what we find.
+ * Each data row is handed to "rowfunc".
+ */
+static int
+nc_read_file(netcmp_t *ncp, const char *filename, ncrowfunc_t rowfunc)
+{
+	FILE *fstream;
+	struct stat st;
+	const char *source;
+	nclabel_t *label;
+	char buf[256];
+	char *rbuf;
+	const char *p, *end, *next;
+	ncparseerr_t perr;
+	ncrow_t row;
+	ncinput_t input;
+	nccomp_t comp;
+	size_t len, nread;
+	ncbool_t eof;
+	uint32_t magic;
+	int i, rv;
+	int linenum = 1;
+
+	(void) fprintf(stderr, "processing file %s\n", filename);
+	if ((fstream = fopen(filename, "r")) == NULL) {
+		err(EXIT_FAILURE, "fopen");
+	}
+
+	/* Packet captures are handled separately. */
+	magic = 0;
+	if (fread(&magic, sizeof (magic), 1, fstream) == 1 &&
+	    nc_pcap_magic(magic)) {
+		(void) fclose(fstream);
+		return (nc_read_pcap(ncp, filename, rowfunc));
+	}
+
+	rewind(fstream);
+
+	/*
+	 * The file's modification time tells us when the snapshot was taken.
+	 * Get it now, since compressed files are read through a pipe.
+	 */
+	if (fstat(fileno(fstream), &st) != 0)
+		err(EXIT_FAILURE, "fstat");
+
+	comp = nc_input_comp((const uint8_t *)&magic);
+	if (comp != NCZ_NONE &&
+	    nc_input_open(ncp, &input, filename, comp, &fstream) != 0) {
+		(void) fclose(fstream);
+		return (-1);
+	}
+
+	/* Check the first line. */
+	if (fgets(buf, sizeof (buf), fstream) == NULL) {
+		errx(EXIT_FAILURE, "reading from stream");
+	}
+
+	if (strcmp(buf, "\n") != 0) {
+		errx(EXIT_FAILURE, "expected blank line");
+	}
+
+	/* Check the second line. */
+	linenum++;
+	if (fgets(buf, sizeof (buf), fstream) == NULL) {
+		errx(EXIT_FAILURE, "reading from stream");
+	}
+
+	if (strcmp(buf, "TCP: IPv4\n") != 0) {
+		errx(EXIT_FAILURE, "expected \"TCP: IPv4\" header");
+	}
+
+	/* Check the third line. */
+	linenum++;
+	if (fgets(buf, sizeof (buf), fstream) == NULL) {
+		errx(EXIT_FAILURE, "reading from stream");
+	}
+
+	if (strstr(buf, "Local Address") == NULL ||
+	    strstr(buf, "Remote Address") == NULL ||
+	    strstr(buf, "Swind") == NULL || strstr(buf, "Send-Q") == NULL ||
+	    strstr(buf, "Rwind") == NULL || strstr(buf, "Recv-Q") == NULL ||
+	    strstr(buf, "State") == NULL || strchr(buf, '\n') == NULL) {
+		errx(EXIT_FAILURE, "expected column headers");
+	}
+
+	/* Check the fourth line. */
+	linenum++;
+	if (fgets(buf, sizeof (buf), fstream) == NULL) {
+		errx(EXIT_FAILURE, "reading from stream");
+	}
+
+	for (i = 0; buf[i] != '\0' && buf[i] != '\n'; i++) {
+		if (buf[i] != '-' && !isspace(buf[i])) {
+			errx(EXIT_FAILURE, "expected separator row");
+		}
+	}
+
+	/* The remaining lines are data lines. */
+	source = strrchr(filename, '/');
+	if (source == NULL) {
+		source = filename;
+	} else {
+		source = source + 1;
+	}
+
+	if ((label = nc_label_lookup(ncp, source)) == NULL)
+		return (-1);
+
+	/* If several files share a label, use the most recent one. */
+	if (st.st_mtime > label->ncl_captured)
+		label->ncl_captured = st.st_mtime;
+
+	/*
+	 * Data rows are read in large blocks and parsed in place.  A row that
+	 * straddles the end of a block is moved to the front of the buffer
+	 * before reading the next block.  The byte after the valid data is
+	 * always a NUL, which nc_parse_line() uses to find the end of the data.
+	 * The extra byte at the end of the buffer leaves room for a newline in
+	 * case the last row doesn't have one.
+	 */
+	if ((rbuf = malloc(NC_READBUFSZ + 2)) == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	len = 0;
+	eof = NB_FALSE;
+	while (!eof) {
+		nread = fread(rbuf + len, 1, NC_READBUFSZ - len, fstream);
+		if (nread == 0) {
+			if (ferror(fstream))
+				err(EXIT_FAILURE, "reading from stream");
+			eof = NB_TRUE;
+			if (len == 0)
+				break;
+			rbuf[len++] = '\n';
+		}
+
+		len += nread;
+		rbuf[len] = '\0';
+		end = rbuf + len;
+		for (p = rbuf; p < end; p = next) {
+			rv = nc_parse_line(p, end, &row, &next, &perr);
+			if (rv == NC_PARSE_SHORT)
+				break;
+
+			linenum++;
+			if (rv == NC_PARSE_ERROR) {
+				errx(EXIT_FAILURE, "%s: line %d, offset %d "
+				    "(%s column): %s", filename, linenum,
+				    perr.ncpe_offset, perr.ncpe_column,
+				    perr.ncpe_msg);
+			}
+
+			if (rv == NC_PARSE_OK &&
+			    nc_bench_row(ncp, rowfunc, label, &row) != 0) {
+				errx(EXIT_FAILURE,
+				    "failed to process line %d", linenum);
+			}
+		}
+
+		len = end - p;
+		if (len == NC_READBUFSZ)
+			errx(EXIT_FAILURE, "line %d too long", linenum + 1);
+		(void) memmove(rbuf, p, len);
+	}
+
+	free(rbuf);
+	(void) fclose(fstream);
+	if (comp != NCZ_NONE && nc_input_close(&input) != 0)
+		errx(EXIT_FAILURE, "%s: failed to decompress", filename);
+	return (0);
+}
+
+/*
+ * Hand a row to "rowfunc", timing one row in every NC_BENCH_SAMPLE when
+ * measuring the run ("-b").
+ */
+static int
+nc_bench_row(netcmp_t *ncp, ncrowfunc_t rowfunc, nclabel_t *label,
+    const ncrow_t *row)
+{
+	ncbench_t *ncb = &ncp->nc_bench;
+	double start;
+	int rv;
+
+	if (ncb->ncb_path == NULL || ++ncb->ncb_nrows % NC_BENCH_SAMPLE != 0)
+		return (rowfunc(ncp, label, row));
+
+	start = nc_time();
+	rv = rowfunc(ncp, label, row);
+	ncb->ncb_values[NCB_ROWFUNC] += (nc_time() - start) * NC_BENCH_SAMPLE;
+	return (rv);
+}
+
+/*
+ * Read a packet capture in pcap or pcapng format and reconstruct the state of
+ * each TCP connection in it.  Then invoke "rowfunc" for each end of each
+ * connection that it would still report at the end of the capture, as though
+ * the row came from a netstat file for that end's IP address.  Each IP address
+ * gets its own label, named by the address, whose capture time is the time of
+ * the last packet in the file.
+ */
+static int
+nc_read_pcap(netcmp_t *ncp, const char *filename, ncrowfunc_t rowfunc)
+{
+	int fd, side, state;
+	struct stat st;
+	uint8_t *base;
+	ncflowtab_t ft;
+	ncflow_t *flow;
+	nchash_t labels;
+	nclabel_t *label;
+	ncrow_t row;
+	char buf[IPV4_STRBUFSZ];
+	uint32_t magic, last;
+	uint64_t id;
+	size_t i, nflows;
+	int rv;
+
+	if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+		err(EXIT_FAILURE, "open \"%s\"", filename);
+
+	if (st.st_size < (off_t)sizeof (magic))
+		errx(EXIT_FAILURE, "%s: truncated capture file", filename);
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED)
+		err(EXIT_FAILURE, "mmap \"%s\"", filename);
+
+	(void) close(fd);
+	(void) madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+	bzero(&ft, sizeof (ft));
+	if (nc_flow_rebuild(&ft, 1024, 0) != 0)
+		return (-1);
+
+	(void) memcpy(&magic, base, sizeof (magic));
+	if (magic == NC_PCAPNG_SHB) {
+		rv = nc_pcap_readng(&ft, filename, base, st.st_size, &last);
+	} else {
+		rv = nc_pcap_readclassic(&ft, filename, base, st.st_size,
+		    &last);
+	}
+
+	(void) munmap(base, st.st_size);
+	if (rv != 0) {
+		free(ft.ncft_flows);
+		return (-1);
+	}
+
+	if (ncp->nc_debug) {
+		(void) fprintf(stderr, "%s: %llu packets (%llu TCP), "
+		    "%lu connections, %llu expired\n", filename,
+		    (unsigned long long)ft.ncft_npackets,
+		    (unsigned long long)ft.ncft_ntcp,
+		    (unsigned long)ft.ncft_nused,
+		    (unsigned long long)ft.ncft_nexpired);
+	}
+
+	/*
+	 * The order of the flow table depends on this run's hash key, so the
+	 * flows are sorted first.  That way hosts are labelled, and their
+	 * connections reported, in the same order on every run.
+	 */
+	for (i = 0, nflows = 0; i < ft.ncft_size; i++) {
+		if (ft.ncft_flows[i].ncfl_used)
+			ft.ncft_flows[nflows++] = ft.ncft_flows[i];
+	}
+	qsort(ft.ncft_flows, nflows, sizeof (ncflow_t), nc_flow_compare);
+
+	/*
+	 * Report each end of each connection.  "labels" maps each IP address
+	 * to 1 + the id of its label, so that we only search the label list
+	 * once per address.
+	 */
+	if (nc_hash_init(&labels, 64) != 0) {
+		free(ft.ncft_flows);
+		return (-1);
+	}
+
+	bzero(&row, sizeof (row));
+	for (i = 0; i < nflows; i++) {
+		flow = &ft.ncft_flows[i];
+		for (side = 0; side < 2; side++) {
+			if ((state = nc_flow_state(flow, side)) < 0)
+				continue;
+
+			row.ncrw_ip1 = flow->ncfl_ip[side];
+			row.ncrw_port1 = flow->ncfl_port[side];
+			row.ncrw_ip2 = flow->ncfl_ip[1 - side];
+			row.ncrw_port2 = flow->ncfl_port[1 - side];
+			row.ncrw_state = state;
+
+			if ((id = nc_hash_get(&labels, row.ncrw_ip1)) != 0) {
+				label = ncp->nc_labels[id - 1];
+			} else {
+				(void) snprintf(buf, sizeof (buf),
+				    "%u.%u.%u.%u", row.ncrw_ip1 >> 24,
+				    (row.ncrw_ip1 >> 16) & 0xff,
+				    (row.ncrw_ip1 >> 8) & 0xff,
+				    row.ncrw_ip1 & 0xff);
+				label = nc_label_lookup(ncp, buf);
+				if (label == NULL ||
+				    nc_hash_add(&labels, row.ncrw_ip1,
+				    label->ncl_id + 1) != 0) {
+					rv = -1;
+					break;
+				}
+
+				if (last > label->ncl_captured)
+					label->ncl_captured = last;
+			}
+
+			if (nc_bench_row(ncp, rowfunc, label, &row) != 0) {
+				warnx("%s: failed to process connection",
+				    filename);
+				rv = -1;
+				break;
+			}
+		}
+
+		if (rv != 0)
+			break;
+	}
+
+	nc_hash_fini(&labels);
+	free(ft.ncft_flows);
+	return (rv);
+}
+
+/*
+ * Returns true if "magic" (the first four bytes of an input file) identifies a
+ * packet capture file in either byte order.
+ */
+static ncbool_t
+nc_pcap_magic(uint32_t magic)
+{
+	return (magic == NC_PCAPNG_SHB || magic == NC_PCAP_MAGIC ||
+	    magic == NC_PCAP_MAGIC_NS ||
+	    magic == nc_bswap32(NC_PCAP_MAGIC) ||
+	    magic == nc_bswap32(NC_PCAP_MAGIC_NS));
+}
+
+/*
+ * Byte-swap a 32-bit value.
+ */
+static uint32_t
+nc_bswap32(uint32_t v)
+{
+	return ((v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) |
+	    (v << 24));
+}
+
+/*
+ * Read a 32-bit value from a capture file header, swapping it if the file was
+ * written on a system with the other byte order.
+ */
+static uint32_t
+nc_pcap_get32(const uint8_t *p, ncbool_t swap)
+{
+	uint32_t v;
+
+	(void) memcpy(&v, p, sizeof (v));
+	return (swap ? nc_bswap32(v) : v);
+}
+
+/*
+ * Like nc_pcap_get32(), but for a 16-bit value.
+ */
+static uint16_t
+nc_pcap_get16(const uint8_t *p, ncbool_t swap)
+{
+	uint16_t v;
+
+	(void) memcpy(&v, p, sizeof (v));
+	return (swap ? (uint16_t)((v >> 8) | (v << 8)) : v);
+}
+
+/*
+ * Read the packets from a classic pcap file (mapped at "base") into the flow
+ * table.  On success, stores the time of the last packet into *lastp.
+ */
+static int
+nc_pcap_readclassic(ncflowtab_t *ft, const char *filename, const uint8_t *base,
+    size_t size, uint32_t *lastp)
+{
+	const uint8_t *p, *end;
+	uint32_t magic, linktype, caplen, ts;
+	ncbool_t swap;
+
+	if (size < 24)
+		errx(EXIT_FAILURE, "%s: truncated capture file", filename);
+
+	(void) memcpy(&magic, base, sizeof (magic));
+	swap = magic == nc_bswap32(NC_PCAP_MAGIC) ||
+	    magic == nc_bswap32(NC_PCAP_MAGIC_NS);
+	linktype = nc_pcap_get32(base + 20, swap) & 0xffff;
+
+	ts = 0;
+	end = base + size;
+	for (p = base + 24; end - p >= 16; p += 16 + caplen) {
+		ts = nc_pcap_get32(p, swap);
+		caplen = nc_pcap_get32(p + 8, swap);
+		if (caplen > (size_t)(end - p - 16)) {
+			warnx("%s: last packet truncated", filename);
+			break;
+		}
+
+		if (nc_pcap_packet(ft, linktype, p + 16, caplen, ts) != 0)
+			return (-1);
+	}
+
+	*lastp = ts;
+	return (0);
+}
+
+/*
+ * Read the packets from a pcapng file (mapped at "base") into the flow table.
+ * On success, stores the time of the last packet into *lastp.  Each section
+ * of the file may have a different byte order and its own set of interfaces,
+ * each with its own link type and timestamp resolution.
+ */
+static int
+nc_pcap_readng(ncflowtab_t *ft, const char *filename, const uint8_t *base,
+    size_t size, uint32_t *lastp)
+{
+	const uint8_t *p, *end, *opt;
+	uint32_t btype, blen, iface, caplen, ts;
+	uint16_t optcode, optlen;
+	uint64_t tsunits, *units;
+	uint32_t *linktypes;
+	size_t nifaces;
+	ncbool_t swap, base10;
+	unsigned int i;
+
+	swap = NB_FALSE;
+	nifaces = 0;
+	linktypes = NULL;
+	units = NULL;
+	ts = 0;
+	end = base + size;
+	for (p = base; end - p >= 12; p += blen) {
+		btype = nc_pcap_get32(p, swap);
+		if (btype == NC_PCAPNG_SHB) {
+			swap = nc_pcap_get32(p + 8, NB_FALSE) != NC_PCAPNG_BOM;
+			if (swap && nc_pcap_get32(p + 8, NB_TRUE) !=
+			    NC_PCAPNG_BOM) {
+				errx(EXIT_FAILURE, "%s: bad section header",
+				    filename);
+			}
+
+			nifaces = 0;
+		}
+
+		blen = nc_pcap_get32(p + 4, swap);
+		if (blen < 12 || blen % 4 != 0 || blen > (size_t)(end - p)) {
+			warnx("%s: last block truncated", filename);
+			break;
+		}
+
+		switch (btype) {
+		case NC_PCAPNG_IDB:
+			if (blen < 20)
+				break;
+
+			linktypes = realloc(linktypes,
+			    (nifaces + 1) * sizeof (*linktypes));
+			units = realloc(units, (nifaces + 1) * sizeof (*units));
+			if (linktypes == NULL || units == NULL)
+				err(EXIT_FAILURE, "realloc");
+
+			linktypes[nifaces] = nc_pcap_get16(p + 8, swap);
+			units[nifaces] = 1000000;
+			for (opt = p + 16; opt + 4 <= p + blen - 4;
+			    opt += 4 + NC_ROUNDUP4(optlen)) {
+				optcode = nc_pcap_get16(opt, swap);
+				optlen = nc_pcap_get16(opt + 2, swap);
+				if (optcode == 0)
+					break;
+
+				if (optcode != NC_PCAPNG_TSRESOL ||
+				    optlen != 1 || opt + 5 > p + blen - 4)
+					continue;
+
+				/*
+				 * The value is the negative exponent of the
+				 * resolution, in base 2 if the high bit is set
+				 * and base 10 otherwise.
+				 */
+				base10 = (opt[4] & 0x80) == 0;
+				tsunits = 1;
+				for (i = 0; i < (opt[4] & 0x7fU) &&
+				    tsunits <= UINT64_MAX / 10; i++) {
+					tsunits *= base10 ? 10 : 2;
+				}
+				units[nifaces] = tsunits;
+			}
+
+			nifaces++;
+			break;
+
+		case NC_PCAPNG_EPB:
+			if (blen < 32)
+				break;
+
+			iface = nc_pcap_get32(p + 8, swap);
+			caplen = nc_pcap_get32(p + 20, swap);
+			if (iface >= nifaces || caplen > blen - 32) {
+				errx(EXIT_FAILURE, "%s: bad packet block",
+				    filename);
+			}
+
+			ts = (((uint64_t)nc_pcap_get32(p + 12, swap) << 32) |
+			    nc_pcap_get32(p + 16, swap)) / units[iface];
+			if (nc_pcap_packet(ft, linktypes[iface], p + 28,
+			    caplen, ts) != 0) {
+				goto fail;
+			}
+			break;
+
+		case NC_PCAPNG_SPB:
+			/*
+			 * Simple packet blocks have no timestamp, so we use
+			 * the time of the previous packet.
+			 */
+			if (blen < 16 || nifaces == 0)
+				break;
+
+			caplen = nc_pcap_get32(p + 8, swap);
+			if (caplen > blen - 16)
+				caplen = blen - 16;
+			if (nc_pcap_packet(ft, linktypes[0], p + 12, caplen,
+			    ts) != 0) {
+				goto fail;
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	free(linktypes);
+	free(units);
+	*lastp = ts;
+	return (0);
+
+fail:
+	free(linktypes);
+	free(units);
+	return (-1);
+}
+
+/*
+ * Decode a single captured packet with the given link type and, if it's an
+ * IPv4 TCP segment, update the flow table with it.  Other packets are counted
+ * and ignored.  Returns -1 only on allocation failure.
+ */
+static int
+nc_pcap_packet(ncflowtab_t *ft, uint32_t linktype, const uint8_t *pkt,
+    size_t len, uint32_t ts)
+{
+	const uint8_t *tcp;
+	size_t off, ihl, thl, iplen;
+	uint16_t ethertype;
+
+	ft->ncft_npackets++;
+	switch (linktype) {
+	case NC_DLT_EN10MB:
+		if (len < 14)
+			return (0);
+
+		/* Skip any 802.1Q or 802.1ad VLAN tags. */
+		ethertype = NC_BE16(pkt + 12);
+		for (off = 14; (ethertype == 0x8100 || ethertype == 0x88a8) &&
+		    len >= off + 4; off += 4) {
+			ethertype = NC_BE16(pkt + off + 2);
+		}
+		break;
+
+	case NC_DLT_LINUX_SLL:
+		if (len < 16)
+			return (0);
+
+		ethertype = NC_BE16(pkt + 14);
+		off = 16;
+		break;
+
+	case NC_DLT_LINUX_SLL2:
+		if (len < 20)
+			return (0);
+
+		ethertype = NC_BE16(pkt);
+		off = 20;
+		break;
+
+	case NC_DLT_NULL:
+		/*
+		 * The header is the address family in the byte order of the
+		 * capturing system.  AF_INET is 2 everywhere.
+		 */
+		if (len < 4)
+			return (0);
+
+		ethertype = pkt[0] == 2 || pkt[3] == 2 ? 0x0800 : 0;
+		off = 4;
+		break;
+
+	case NC_DLT_RAW:
+	case NC_DLT_RAW_ALT:
+	case NC_DLT_IPV4:
+		ethertype = 0x0800;
+		off = 0;
+		break;
+
+	default:
+		return (0);
+	}
+
+	if (ethertype != 0x0800 || len < off + 20)
+		return (0);
+
+	/*
+	 * Check for IPv4 carrying TCP, and skip all but the first fragment of
+	 * fragmented datagrams.  Captures taken on a host that uses TCP
+	 * segmentation offload may show a total length of zero, in which case
+	 * we use the captured length.
+	 */
+	pkt += off;
+	len -= off;
+	ihl = (pkt[0] & 0xf) * 4;
+	iplen = NC_BE16(pkt + 2);
+	if (iplen == 0)
+		iplen = len;
+
+	if ((pkt[0] >> 4) != 4 || pkt[9] != IPPROTO_TCP || ihl < 20 ||
+	    (NC_BE16(pkt + 6) & 0x1fff) != 0 || len < ihl + 20 ||
+	    iplen < ihl + 20) {
+		return (0);
+	}
+
+	tcp = pkt + ihl;
+	thl = (tcp[12] >> 4) * 4;
+	if (thl < 20 || thl > iplen - ihl)
+		return (0);
+
+	ft->ncft_ntcp++;
+	return (nc_flow_update(ft, NC_BE32(pkt + 12), NC_BE16(tcp),
+	    NC_BE32(pkt + 16), NC_BE16(tcp + 2), tcp[13], NC_BE32(tcp + 4),
+	    NC_BE32(tcp + 8), iplen - ihl - thl, ts));
+}
+
+/*
+ * Return the slot for the flow with the given (ordered) endpoints: either the
+ * slot where it's stored or the empty slot where it belongs.
+ */
+static ncflow_t *
+nc_flow_slot(const ncflowtab_t *ft, uint32_t ip0, uint16_t port0,
+    uint32_t ip1, uint16_t port1)
+{
+	ncflow_t *flow;
+	uint64_t h;
+	size_t i, mask;
+
+	mask = ft->ncft_size - 1;
+	h = nc_keyhash((uint64_t)ip0 << 32 | ip1,
+	    (uint64_t)port0 << 16 | port1);
+	i = (size_t)h & mask;
+	for (;;) {
+		flow = &ft->ncft_flows[i];
+		if (!flow->ncfl_used || (flow->ncfl_ip[0] == ip0 &&
+		    flow->ncfl_ip[1] == ip1 && flow->ncfl_port[0] == port0 &&
+		    flow->ncfl_port[1] == port1)) {
+			return (flow);
+		}
+		i = (i + 1) & mask;
+	}
+}
+
+/*
+ * Replace the flow table with one of at least "size" slots, dropping flows
+ * that have been idle for NC_PCAP_IDLE seconds as of time "now".  The new table
+ * is always at least four times the number of flows kept.
+ */
+static int
+nc_flow_rebuild(ncflowtab_t *ft, size_t size, uint32_t now)
+{
+	ncflow_t *old, *flow;
+	size_t i, oldsize, nkeep;
+
+	nkeep = 0;
+	for (i = 0; i < ft->ncft_size; i++) {
+		flow = &ft->ncft_flows[i];
+		if (flow->ncfl_used &&
+		    (uint64_t)flow->ncfl_lastseen + NC_PCAP_IDLE >= now)
+			nkeep++;
+	}
+
+	while (size < nkeep * 4)
+		size *= 2;
+
+	old = ft->ncft_flows;
+	oldsize = ft->ncft_size;
+	if ((ft->ncft_flows = calloc(size, sizeof (*flow))) == NULL) {
+		warn("calloc");
+		ft->ncft_flows = old;
+		return (-1);
+	}
+
+	ft->ncft_size = size;
+	ft->ncft_nused = nkeep;
+	for (i = 0; i < oldsize; i++) {
+		if (!old[i].ncfl_used)
+			continue;
+
+		if ((uint64_t)old[i].ncfl_lastseen + NC_PCAP_IDLE < now) {
+			ft->ncft_nexpired++;
+			continue;
+		}
+
+		*nc_flow_slot(ft, old[i].ncfl_ip[0], old[i].ncfl_port[0],
+		    old[i].ncfl_ip[1], old[i].ncfl_port[1]) = old[i];
+	}
+
+	free(old);
+	return (0);
+}
+
+/*
+ * Update the flow table with a TCP segment sent from (src, sport) to (dst,
+ * dport) at time "ts".  We record only what each end has sent: enough to infer
+ * the state that each end's TCP stack would report (see nc_flow_state()).
+ */
+static int
+nc_flow_update(ncflowtab_t *ft, uint32_t src, uint16_t sport, uint32_t dst,
+    uint16_t dport, uint8_t tcpflags, uint32_t seq, uint32_t ack,
+    uint32_t paylen, uint32_t ts)
+{
+	ncflow_t *flow;
+	int side, peer;
+
+	/*
+	 * Expire idle flows periodically, and grow the table when it's half
+	 * full.  Both rebuild the table.
+	 */
+	if (ts >= ft->ncft_nextsweep) {
+		if (nc_flow_rebuild(ft, 1024, ts) != 0)
+			return (-1);
+		ft->ncft_nextsweep = ts + NC_PCAP_IDLE / 4;
+	} else if (ft->ncft_nused * 2 >= ft->ncft_size &&
+	    nc_flow_rebuild(ft, ft->ncft_size * 2, 0) != 0) {
+		return (-1);
+	}
+
+	side = src > dst || (src == dst && sport > dport);
+	peer = 1 - side;
+	flow = side == 0 ? nc_flow_slot(ft, src, sport, dst, dport) :
+	    nc_flow_slot(ft, dst, dport, src, sport);
+
+	/*
+	 * A new SYN on a connection that has been closed or reset is a new
+	 * connection that reuses the same tuple.
+	 */
+	if (!flow->ncfl_used || ((tcpflags & (TH_SYN | TH_ACK)) == TH_SYN &&
+	    ((flow->ncfl_flags[0] | flow->ncfl_flags[1]) &
+	    (NCF_FIN | NCF_RST)) != 0)) {
+		if (!flow->ncfl_used)
+			ft->ncft_nused++;
+		bzero(flow, sizeof (*flow));
+		flow->ncfl_used = 1;
+		flow->ncfl_ip[side] = src;
+		flow->ncfl_port[side] = sport;
+		flow->ncfl_ip[peer] = dst;
+		flow->ncfl_port[peer] = dport;
+	}
+
+	flow->ncfl_lastseen = ts;
+	if ((tcpflags & TH_RST) != 0)
+		flow->ncfl_flags[side] |= NCF_RST;
+
+	if ((tcpflags & TH_SYN) != 0) {
+		flow->ncfl_flags[side] |= (tcpflags & TH_ACK) != 0 ?
+		    NCF_SYNACK : NCF_SYN;
+	} else if ((tcpflags & TH_ACK) != 0) {
+		flow->ncfl_flags[side] |= NCF_ACK;
+		if ((flow->ncfl_flags[peer] & NCF_FIN) != 0 &&
+		    (int32_t)(ack - flow->ncfl_finseq[peer]) >= 0) {
+			flow->ncfl_flags[peer] |= NCF_FINACKED;
+		}
+	}
+
+	/* The FIN occupies the sequence number after the payload. */
+	if ((tcpflags & TH_FIN) != 0 &&
+	    (flow->ncfl_flags[side] & NCF_FIN) == 0) {
+		flow->ncfl_flags[side] |= NCF_FIN;
+		flow->ncfl_finseq[side] = seq + paylen + 1;
+		if (flow->ncfl_finfirst == 0)
+			flow->ncfl_finfirst = side + 1;
+	}
+
+	return (0);
+}
+
+/*
+ * Infer the TCP state that end "side" of a captured connection would report,
+ * based on the segments seen from both ends.  Returns -1 if that end would not
+ * report the connection at all (e.g., because it was reset, or it's already
+ * closed).  A connection whose handshake wasn't captured is assumed to have
+ * been established before the capture started.
+ */
+static int
+nc_flow_state(const ncflow_t *flow, int side)
+{
+	uint8_t me, peer;
+
+	me = flow->ncfl_flags[side];
+	peer = flow->ncfl_flags[1 - side];
+	if (((me | peer) & NCF_RST) != 0)
+		return (-1);
+
+	if ((me & NCF_FIN) != 0 && (peer & NCF_FIN) != 0) {
+		if (flow->ncfl_finfirst != side + 1)
+			return ((me & NCF_FINACKED) != 0 ? -1 : NS_LAST_ACK);
+		if ((peer & NCF_FINACKED) != 0)
+			return (NS_TIME_WAIT);
+		return ((me & NCF_FINACKED) != 0 ? NS_FIN_WAIT_2 : NS_CLOSING);
+	}
+
+	if ((me & NCF_FIN) != 0)
+		return ((me & NCF_FINACKED) != 0 ? NS_FIN_WAIT_2 :
+		    NS_FIN_WAIT_1);
+
+	if ((peer & NCF_FIN) != 0)
+		return (NS_CLOSE_WAIT);
+
+	if ((me & NCF_SYN) != 0) {
+		return ((peer & NCF_SYNACK) != 0 && (me & NCF_ACK) != 0 ?
+		    NS_ESTABLISHED : NS_SYN_SENT);
+	}
+
+	if ((peer & NCF_SYN) != 0) {
+		if ((me & NCF_SYNACK) == 0)
+			return (-1);
+		return ((peer & NCF_ACK) != 0 ? NS_ESTABLISHED : NS_SYN_RCVD);
+	}
+
+	return (NS_ESTABLISHED);
+}
+
+/*
+ * Returns true if "filename" looks like a connection tracking table: either
+ * /proc/net/nf_conntrack, whose lines begin with the address family, or
+ * "conntrack -L" output, whose lines begin with the protocol.
+ */
+static ncbool_t
+nc_conntrack_file(const char *filename)
+{
+	static const char *prefixes[] = {
+		"ipv4 ", "ipv6 ", "tcp ", "udp ", "udplite ", "icmp ",
+		"icmpv6 ", "sctp ", "dccp ", "gre ", "unknown ",
+	};
+	char buf[16];
+	size_t nread;
+	unsigned int i;
+	FILE *fstream;
+
+	if ((fstream = fopen(filename, "r")) == NULL)
+		return (NB_FALSE);
+
+	nread = fread(buf, 1, sizeof (buf) - 1, fstream);
+	buf[nread] = '\0';
+	(void) fclose(fstream);
+	for (i = 0; i < sizeof (prefixes) / sizeof (prefixes[0]); i++) {
+		if (strncmp(buf, prefixes[i], strlen(prefixes[i])) == 0)
+			return (NB_TRUE);
+	}
+
+	return (NB_FALSE);
+}
+
+/*
+ * Read a connection tracking table, recording the address translations and
+ * gateway observations in it (see ncnat_t).  The table's label is the file's
+ * basename, as for netstat output.  Entries for protocols other than TCP and
+ * for IPv6 are ignored.
+ */
+static int
+nc_read_conntrack(netcmp_t *ncp, const char *filename)
+{
+	int fd, state, rv;
+	struct stat st;
+	char *base;
+	const char *p, *eol, *end, *source;
+	nclabel_t *label;
+	uint32_t ip[4];
+	uint16_t port[4];
+	size_t ntrans;
+	unsigned long linenum, ntcp;
+
+	(void) fprintf(stderr, "processing file %s\n", filename);
+	if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+		err(EXIT_FAILURE, "open \"%s\"", filename);
+
+	source = strrchr(filename, '/');
+	source = source == NULL ? filename : source + 1;
+	if ((label = nc_label_lookup(ncp, source)) == NULL)
+		return (-1);
+
+	if (st.st_mtime > label->ncl_captured)
+		label->ncl_captured = st.st_mtime;
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED)
+		err(EXIT_FAILURE, "mmap \"%s\"", filename);
+
+	(void) close(fd);
+	(void) madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+	rv = 0;
+	ntcp = 0;
+	ntrans = ncp->nc_nat.ncn_ntrans;
+	end = base + st.st_size;
+	for (p = base, linenum = 1; p < end; p = eol + 1, linenum++) {
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+
+		rv = nc_conntrack_parse(p, eol, ip, port, &state);
+		if (rv < 0) {
+			errx(EXIT_FAILURE, "%s: line %lu: malformed conntrack "
+			    "entry", filename, linenum);
+		}
+
+		if (rv > 0) {
+			rv = 0;
+			continue;
+		}
+
+		ntcp++;
+		if ((rv = nc_nat_add(ncp, label, ip, port, state)) != 0)
+			break;
+	}
+
+	(void) munmap(base, st.st_size);
+	if (ncp->nc_debug) {
+		(void) fprintf(stderr, "%s: %lu entries (%lu IPv4 TCP), "
+		    "%lu translations\n", filename, linenum - 1, ntcp,
+		    (unsigned long)(ncp->nc_nat.ncn_ntrans - ntrans));
+	}
+
+	return (rv);
+}
+
+/*
+ * Return the next whitespace-delimited token in [*pp, end), storing its length
+ * into *lenp and advancing *pp past it, or return NULL if there are no more.
+ */
+static const char *
+nc_conntrack_token(const char **pp, const char *end, size_t *lenp)
+{
+	const char *p, *tok;
+
+	for (p = *pp; p < end && (*p == ' ' || *p == '\t'); p++)
+		continue;
+
+	if (p == end)
+		return (NULL);
+
+	for (tok = p; p < end && *p != ' ' && *p != '\t'; p++)
+		continue;
+
+	*pp = p;
+	*lenp = p - tok;
+	return (tok);
+}
+
+/*
+ * Parse one line of a connection tracking table, like:
+ *
+ *     ipv4 2 tcp 6 431999 ESTABLISHED src=10.0.0.5 dst=192.0.2.7 sport=51234
+ *         dport=443 src=192.0.2.7 dst=198.51.100.1 sport=443 dport=51234
+ *         [ASSURED] mark=0 zone=0 use=2
+ *
+ * (on one line, and without the leading "ipv4 2" in "conntrack -L" output).
+ * On success, stores the original source and destination and the reply source
+ * and destination, in that order, into "ip" and "port", and the netstat state
+ * equivalent to the entry's state (or -1) into *statep.  Returns 0 on success,
+ * 1 if the line should be skipped (because it's blank or not an IPv4 TCP
+ * entry), or -1 if it's malformed.
+ */
+static int
+nc_conntrack_parse(const char *p, const char *end, uint32_t *ip,
+    uint16_t *port, int *statep)
+{
+	const char *tok;
+	size_t len, i;
+	unsigned int nips[2], nports[2], which;
+	unsigned long val;
+
+	if ((tok = nc_conntrack_token(&p, end, &len)) == NULL)
+		return (1);
+
+	/* Skip the address family and its number, if present. */
+	if (len == 4 && strncmp(tok, "ipv", 3) == 0) {
+		if (tok[3] != '4')
+			return (1);
+		if (nc_conntrack_token(&p, end, &len) == NULL ||
+		    (tok = nc_conntrack_token(&p, end, &len)) == NULL) {
+			return (-1);
+		}
+	}
+
+	if (len != 3 || strncmp(tok, "tcp", 3) != 0)
+		return (1);
+
+	/* Skip the protocol number and the timeout. */
+	if (nc_conntrack_token(&p, end, &len) == NULL ||
+	    nc_conntrack_token(&p, end, &len) == NULL ||
+	    (tok = nc_conntrack_token(&p, end, &len)) == NULL) {
+		return (-1);
+	}
+
+	*statep = -1;
+	for (i = 0; i < sizeof (nc_ct_states) / sizeof (nc_ct_states[0]);
+	    i++) {
+		if (strlen(nc_ct_states[i].ncts_name) == len &&
+		    strncmp(tok, nc_ct_states[i].ncts_name, len) == 0) {
+			*statep = nc_ct_states[i].ncts_state;
+			break;
+		}
+	}
+
+	/*
+	 * The first src/dst/sport/dport values are the original tuple and the
+	 * second ones are the reply tuple.  Other fields are ignored.
+	 */
+	nips[0] = nips[1] = nports[0] = nports[1] = 0;
+	while ((tok = nc_conntrack_token(&p, end, &len)) != NULL) {
+		if (len > 4 && strncmp(tok, "src=", 4) == 0) {
+			which = 0;
+			tok += 4;
+			len -= 4;
+		} else if (len > 4 && strncmp(tok, "dst=", 4) == 0) {
+			which = 1;
+			tok += 4;
+			len -= 4;
+		} else if (len > 6 && strncmp(tok, "sport=", 6) == 0) {
+			which = 2;
+			tok += 6;
+			len -= 6;
+		} else if (len > 6 && strncmp(tok, "dport=", 6) == 0) {
+			which = 3;
+			tok += 6;
+			len -= 6;
+		} else {
+			continue;
+		}
+
+		if (which < 2) {
+			if (nips[which] == 2)
+				return (-1);
+
+			/* "conntrack -L" shows IPv6 entries without a family */
+			if (memchr(tok, ':', len) != NULL)
+				return (1);
+
+			i = 2 * nips[which]++ + which;
+			if (nc_conntrack_ipaddr(tok, len, &ip[i]) != 0)
+				return (-1);
+			continue;
+		}
+
+		which -= 2;
+		if (nports[which] == 2 || len > 5)
+			return (-1);
+
+		for (val = 0, i = 0; i < len; i++) {
+			if (!isdigit((unsigned char)tok[i]))
+				return (-1);
+			val = val * 10 + (tok[i] - '0');
+		}
+
+		if (val > UINT16_MAX)
+			return (-1);
+		port[2 * nports[which]++ + which] = val;
+	}
+
+	if (nips[0] != 2 || nips[1] != 2 || nports[0] != 2 || nports[1] != 2)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Parse the dotted-decimal IPv4 address of "len" characters at "p" into *ipp
+ * (in host byte order).  This is like nc_parse_ipaddr(), but doesn't need the
+ * address to be NUL-terminated.  Returns 0 on success or -1 if the address is
+ * malformed.
+ */
+static int
+nc_conntrack_ipaddr(const char *p, size_t len, uint32_t *ipp)
+{
+	const char *end = p + len;
+	uint32_t ip, octet;
+	unsigned int i, ndigits;
+
+	ip = 0;
+	for (i = 0; i < 4; i++) {
+		octet = 0;
+		for (ndigits = 0; p < end && isdigit((unsigned char)*p);
+		    ndigits++, p++) {
+			octet = octet * 10 + (*p - '0');
+		}
+
+		if (ndigits == 0 || ndigits > 3 || octet > UINT8_MAX)
+			return (-1);
+
+		ip = (ip << 8) | octet;
+		if (i < 3 && (p == end || *p++ != '.'))
+			return (-1);
+	}
+
+	if (p != end)
+		return (-1);
+
+	*ipp = ip;
+	return (0);
+}
+
+/*
+ * Record one connection tracking entry for the gateway with the given label:
+ * the translations for each end (if the gateway translates the connection's
+ * addresses), and the gateway's observation (if the entry has a state that
+ * netstat would report).  "ip" and "port" are as returned by
+ * nc_conntrack_parse().
+ */
+static int
+nc_nat_add(netcmp_t *ncp, nclabel_t *label, const uint32_t *ip,
+    const uint16_t *port, int state)
+{
+	ncnat_t *nat = &ncp->nc_nat;
+	ncnatobs_t *obs;
+	size_t nalloc;
+
+	/*
+	 * The initiator sees the original destination as its peer, but the
+	 * real peer is the reply source.  The responder sees the reply
+	 * destination as its peer, but the real peer is the original source.
+	 */
+	if ((ip[1] != ip[2] || port[1] != port[2]) &&
+	    nc_nat_insert(nat, ip[0], port[0], ip[1], port[1], ip[2],
+	    port[2]) != 0) {
+		return (-1);
+	}
+
+	if ((ip[3] != ip[0] || port[3] != port[0]) &&
+	    nc_nat_insert(nat, ip[2], port[2], ip[3], port[3], ip[0],
+	    port[0]) != 0) {
+		return (-1);
+	}
+
+	if (state < 0)
+		return (0);
+
+	if (nat->ncn_nobs == nat->ncn_nalloc) {
+		nalloc = nat->ncn_nalloc == 0 ? 1024 : nat->ncn_nalloc * 2;
+		if ((obs = realloc(nat->ncn_obs,
+		    nalloc * sizeof (*obs))) == NULL) {
+			warn("realloc");
+			return (-1);
+		}
+
+		nat->ncn_obs = obs;
+		nat->ncn_nalloc = nalloc;
+	}
+
+	obs = &nat->ncn_obs[nat->ncn_nobs++];
+	obs->ncno_ip[0] = ip[0];
+	obs->ncno_port[0] = port[0];
+	obs->ncno_ip[1] = ip[2];
+	obs->ncno_port[1] = port[2];
+	obs->ncno_label = label->ncl_id;
+	obs->ncno_state = state;
+	return (0);
+}
+
+/*
+ * Return the index of the slot in "trans" (of "size" slots) for the
+ * translation of the given local and remote tuple: either the slot where it's
+ * stored or the empty slot where it belongs.
+ */
+static size_t
+nc_nat_slot(const nctrans_t *trans, size_t size, uint32_t lip,
+    uint16_t lport, uint32_t rip, uint16_t rport)
+{
+	const nctrans_t *tr;
+	uint64_t h;
+	size_t i, mask;
+
+	mask = size - 1;
+	h = nc_keyhash((uint64_t)lip << 32 | rip,
+	    (uint64_t)lport << 16 | rport);
+	for (i = (size_t)h & mask; ; i = (i + 1) & mask) {
+		tr = &trans[i];
+		if (!tr->nctr_used || (tr->nctr_lip == lip &&
+		    tr->nctr_rip == rip && tr->nctr_lport == lport &&
+		    tr->nctr_rport == rport)) {
+			return (i);
+		}
+	}
+}
+
+/*
+ * Record that the end with the given local tuple, which sees the given remote
+ * tuple as its peer, is really connected to (ip, port).
+ */
+static int
+nc_nat_insert(ncnat_t *nat, uint32_t lip, uint16_t lport, uint32_t rip,
+    uint16_t rport, uint32_t ip, uint16_t port)
+{
+	nctrans_t *trans, *tr;
+	size_t i, size;
+
+	if (nat->ncn_ntrans * 2 >= nat->ncn_size) {
+		size = nat->ncn_size == 0 ? 1024 : nat->ncn_size * 2;
+		if ((trans = calloc(size, sizeof (*trans))) == NULL) {
+			warn("calloc");
+			return (-1);
+		}
+
+		for (i = 0; i < nat->ncn_size; i++) {
+			tr = &nat->ncn_trans[i];
+			if (tr->nctr_used) {
+				trans[nc_nat_slot(trans, size, tr->nctr_lip,
+				    tr->nctr_lport, tr->nctr_rip,
+				    tr->nctr_rport)] = *tr;
+			}
+		}
+
+		free(nat->ncn_trans);
+		nat->ncn_trans = trans;
+		nat->ncn_size = size;
+	}
+
+	tr = &nat->ncn_trans[nc_nat_slot(nat->ncn_trans, nat->ncn_size, lip,
+	    lport, rip, rport)];
+	if (!tr->nctr_used) {
+		tr->nctr_used = 1;
+		tr->nctr_lip = lip;
+		tr->nctr_lport = lport;
+		tr->nctr_rip = rip;
+		tr->nctr_rport = rport;
+		nat->ncn_ntrans++;
+	}
+
+	tr->nctr_ip = ip;
+	tr->nctr_port = port;
+	return (0);
+}
+
+/*
+ * If there's a translation for the connection in "row", store a copy of the
+ * row with the real remote end into *xrow and return true.
+ */
+static ncbool_t
+nc_nat_translate(const ncnat_t *nat, const ncrow_t *row, ncrow_t *xrow)
+{
+	const nctrans_t *tr;
+
+	tr = &nat->ncn_trans[nc_nat_slot(nat->ncn_trans, nat->ncn_size,
+	    row->ncrw_ip1, row->ncrw_port1, row->ncrw_ip2, row->ncrw_port2)];
+	if (!tr->nctr_used)
+		return (NB_FALSE);
+
+	*xrow = *row;
+	xrow->ncrw_ip2 = tr->nctr_ip;
+	xrow->ncrw_port2 = tr->nctr_port;
+	return (NB_TRUE);
+}
+
+/*
+ * Once all of the input has been read, record the gateways' observations of
+ * connections for which we have data from only one end.  The gateway stands in
+ * for the other end.  We only do this for IP addresses with no data of their
+ * own, since a host's data is better evidence of its connections than a
+ * gateway's.  The gateway's source for such an IP address is kept out of
+ * nc_sources: it covers only the connections the gateway saw, so the IP's
+ * other connections are still external.
+ */
+static int
+nc_nat_observe(netcmp_t *ncp)
+{
+	ncnat_t *nat = &ncp->nc_nat;
+	ncnatobs_t *obs;
+	ncsource_t source, *ncs[2], *standin;
+	avl_tree_t standins;
+	avl_index_t where;
+	ncrow_t row;
+	size_t i;
+	void *cookie;
+	int side, rv;
+
+	avl_create(&standins, nc_source_compare, sizeof (ncsource_t),
+	    offsetof(ncsource_t, ncs_link));
+	bzero(&source, sizeof (source));
+	bzero(&row, sizeof (row));
+	rv = 0;
+	for (i = 0; i < nat->ncn_nobs; i++) {
+		obs = &nat->ncn_obs[i];
+		for (side = 0; side < 2; side++) {
+			source.ncs_ip = obs->ncno_ip[side];
+			ncs[side] = avl_find(&ncp->nc_sources, &source, NULL);
+			if (ncs[side] != NULL &&
+			    ncs[side]->ncs_label->ncl_id == obs->ncno_label)
+				ncs[side] = NULL;
+		}
+
+		if ((ncs[0] == NULL) == (ncs[1] == NULL))
+			continue;
+
+		side = ncs[0] == NULL ? 0 : 1;
+		row.ncrw_ip1 = obs->ncno_ip[side];
+		row.ncrw_port1 = obs->ncno_port[side];
+		row.ncrw_ip2 = obs->ncno_ip[1 - side];
+		row.ncrw_port2 = obs->ncno_port[1 - side];
+		row.ncrw_state = obs->ncno_state;
+		if (row.ncrw_ip1 == NC_LOCALHOST ||
+		    row.ncrw_ip2 == NC_LOCALHOST) {
+			ncp->nc_nlocalhost++;
+			continue;
+		}
+
+		source.ncs_ip = row.ncrw_ip1;
+		if ((standin = avl_find(&standins, &source, &where)) == NULL) {
+			if ((standin = nc_arena_alloc(&ncp->nc_arena,
+			    sizeof (*standin))) == NULL) {
+				rv = -1;
+				break;
+			}
+
+			standin->ncs_ip = row.ncrw_ip1;
+			standin->ncs_standin = NB_TRUE;
+			standin->ncs_label = ncp->nc_labels[obs->ncno_label];
+			avl_insert(&standins, standin, where);
+		}
+
+		if (nc_conn_record(ncp, standin, &row) != 0) {
+			rv = -1;
+			break;
+		}
+	}
+
+	cookie = NULL;
+	while (avl_destroy_nodes(&standins, &cookie) != NULL)
+		continue;
+	avl_destroy(&standins);
+
+	free(nat->ncn_obs);
+	nat->ncn_obs = NULL;
+	nat->ncn_nobs = nat->ncn_nalloc = 0;
+	return (rv);
+}
+
+/*
+ * Return the index of the slot for the given tuple in the TCP_INFO table
+ * "slots" (with "size" slots): either the slot holding it or the empty slot
+ * where it belongs.
+ */
+static size_t
+nc_tcpinfo_slot(const nctcpinfo_t *slots, size_t size, uint32_t lip,
+    uint16_t lport, uint32_t rip, uint16_t rport)
+{
+	const nctcpinfo_t *ti;
+	uint64_t h;
+	size_t i, mask;
+
+	mask = size - 1;
+	h = nc_keyhash((uint64_t)lip << 32 | rip,
+	    (uint64_t)lport << 16 | rport);
+	for (i = (size_t)h & mask; ; i = (i + 1) & mask) {
+		ti = &slots[i];
+		if (!ti->ncti_used || (ti->ncti_lip == lip &&
+		    ti->ncti_rip == rip && ti->ncti_lport == lport &&
+		    ti->ncti_rport == rport)) {
+			return (i);
+		}
+	}
+}
+
+/*
+ * Record the TCP_INFO statistics attached to "row", keyed by the row's tuple.
+ * The table is only allocated once the first statistics arrive.
+ */
+static int
+nc_tcpinfo_add(netcmp_t *ncp, const ncrow_t *row)
+{
+	nctcpinfotab_t *tab = &ncp->nc_tcpinfo;
+	nctcpinfo_t *slots, *ti;
+	size_t i, size;
+
+	if (tab->nct_nused * 2 >= tab->nct_size) {
+		size = tab->nct_size == 0 ? 1024 : tab->nct_size * 2;
+		if ((slots = calloc(size, sizeof (*slots))) == NULL) {
+			warn("calloc");
+			return (-1);
+		}
+
+		for (i = 0; i < tab->nct_size; i++) {
+			ti = &tab->nct_slots[i];
+			if (ti->ncti_used) {
+				slots[nc_tcpinfo_slot(slots, size,
+				    ti->ncti_lip, ti->ncti_lport, ti->ncti_rip,
+				    ti->ncti_rport)] = *ti;
+			}
+		}
+
+		free(tab->nct_slots);
+		tab->nct_slots = slots;
+		tab->nct_size = size;
+	}
+
+	ti = &tab->nct_slots[nc_tcpinfo_slot(tab->nct_slots, tab->nct_size,
+	    row->ncrw_ip1, row->ncrw_port1, row->ncrw_ip2, row->ncrw_port2)];
+	if (!ti->ncti_used)
+		tab->nct_nused++;
+	*ti = *row->ncrw_tcpinfo;
+	ti->ncti_used = 1;
+	ti->ncti_lip = row->ncrw_ip1;
+	ti->ncti_lport = row->ncrw_port1;
+	ti->ncti_rip = row->ncrw_ip2;
+	ti->ncti_rport = row->ncrw_port2;
+	return (0);
+}
+
+/*
+ * Return the TCP_INFO statistics reported by the first source of connection
+ * "ncc", or NULL if there are none.
+ */
+static const nctcpinfo_t *
+nc_tcpinfo_lookup(const netcmp_t *ncp, const ncconn_t *ncc)
+{
+	const nctcpinfotab_t *tab = &ncp->nc_tcpinfo;
+	const nctcpinfo_t *ti;
+
+	if (tab->nct_nused == 0 || ncc->ncc_nsources == 0)
+		return (NULL);
+
+	if (NCC_SIDE(ncc, 0) == 1) {
+		ti = &tab->nct_slots[nc_tcpinfo_slot(tab->nct_slots,
+		    tab->nct_size, NCC_IP1(ncc), ncc->ncc_port1, NCC_IP2(ncc),
+		    ncc->ncc_port2)];
+	} else {
+		ti = &tab->nct_slots[nc_tcpinfo_slot(tab->nct_slots,
+		    tab->nct_size, NCC_IP2(ncc), ncc->ncc_port2, NCC_IP1(ncc),
+		    ncc->ncc_port1)];
+	}
+
+	return (ti->ncti_used ? ti : NULL);
+}
+
+/*
+ * Return how long the connection described by "ti" has been idle, in seconds:
+ * the time since data was last sent or received, whichever is more recent.
+ */
+static unsigned long
+nc_tcpinfo_idle(const nctcpinfo_t *ti)
+{
+	return ((ti->ncti_lastsend < ti->ncti_lastrecv ?
+	    ti->ncti_lastsend : ti->ncti_lastrecv) / 1000);
+}
+
+/*
+ * Sort the "n" asymmetric connections in "asym" by how long they've been idle,
+ * longest first, followed by those with no TCP_INFO.
+ */
+static void
+nc_tcpinfo_sort(netcmp_t *ncp, ncconn_t **asym, size_t n)
+{
+	const nctcpinfo_t *ti;
+	ncidle_t *idle;
+	size_t i;
+
+	if ((idle = calloc(n + 1, sizeof (*idle))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	for (i = 0; i < n; i++) {
+		ti = nc_tcpinfo_lookup(ncp, asym[i]);
+		idle[i].nci_idle = ti == NULL ? 0 : nc_tcpinfo_idle(ti) + 1;
+		idle[i].nci_conn = asym[i];
+	}
+
+	qsort(idle, n, sizeof (*idle), nc_idle_compare);
+	for (i = 0; i < n; i++)
+		asym[i] = idle[i].nci_conn;
+	free(idle);
+}
+
+#ifdef __linux__
+
+/*
+ * Map Linux TCP states (as reported by sock_diag) to the equivalent netstat
+ * states, or -1 for sockets that netstat doesn't show.
+ */
+static const int8_t nc_linux_states[] = {
+	-1,			/* 0: unused */
+	NS_ESTABLISHED,		/* 1: TCP_ESTABLISHED */
+	NS_SYN_SENT,		/* 2: TCP_SYN_SENT */
+	NS_SYN_RCVD,		/* 3: TCP_SYN_RECV */
+	NS_FIN_WAIT_1,		/* 4: TCP_FIN_WAIT1 */
+	NS_FIN_WAIT_2,		/* 5: TCP_FIN_WAIT2 */
+	NS_TIME_WAIT,		/* 6: TCP_TIME_WAIT */
+	-1,			/* 7: TCP_CLOSE */
+	NS_CLOSE_WAIT,		/* 8: TCP_CLOSE_WAIT */
+	NS_LAST_ACK,		/* 9: TCP_LAST_ACK */
+	-1,			/* 10: TCP_LISTEN */
+	NS_CLOSING,		/* 11: TCP_CLOSING */
+};
+
+/*
+ * The kernel's TCP_INFO, which has grown over time.  The C library's struct
+ * tcp_info covers only the older fields, so this adds the ones after it that
+ * we use.  Check the attribute's length before using any of them.
+ */
+typedef struct {
+	struct tcp_info	nclt_info;
+	uint64_t	nclt_pacing;		/* tcpi_pacing_rate */
+	uint64_t	nclt_maxpacing;		/* tcpi_max_pacing_rate */
+	uint64_t	nclt_acked;		/* tcpi_bytes_acked */
+} nclinuxtcpinfo_t;
+
+/*
+ * Collect the TCP connections of each of this host's network namespaces
+ * ("-N") and record each namespace's connections as though they came from its
+ * own netstat file.  The namespaces are the host's own, those named by "ip
+ * netns" (in /var/run/netns), and those of all other processes (e.g., the init
+ * processes of containers).  The host's namespace is labelled with the host
+ * name, and each of the others "HOSTNAME/NAME", where NAME is its "ip netns"
+ * name or "netns-INODE".  Namespaces are read in parallel, and the rows are
+ * then recorded from this thread.
+ */
+static int
+nc_netns_collect(netcmp_t *ncp)
+{
+	ncnetns_t *netns;
+	nclabel_t *label;
+	char host[64];
+	size_t i, j, nnetns, nrows;
+	double start;
+	int rv;
+
+	start = nc_time();
+	if (gethostname(host, sizeof (host)) != 0) {
+		warn("gethostname");
+		return (-1);
+	}
+
+	host[sizeof (host) - 1] = '\0';
+	if (nc_netns_list(host, &netns, &nnetns) != 0)
+		return (-1);
+
+	rv = nc_netns_readall(netns, nnetns);
+	nrows = 0;
+	for (i = 0; rv == 0 && i < nnetns; i++) {
+		if (netns[i].ncns_error != 0) {
+			rv = -1;
+			break;
+		}
+
+		if (netns[i].ncns_gone)
+			continue;
+
+		if ((label = nc_label_lookup(ncp, netns[i].ncns_name)) ==
+		    NULL) {
+			rv = -1;
+			break;
+		}
+
+		label->ncl_captured = ncp->nc_now;
+		for (j = 0; j < netns[i].ncns_nrows; j++) {
+			if (netns[i].ncns_tcpinfo[j].ncti_used) {
+				netns[i].ncns_rows[j].ncrw_tcpinfo =
+				    &netns[i].ncns_tcpinfo[j];
+			}
+
+			if (nc_parse_row(ncp, label,
+			    &netns[i].ncns_rows[j]) != 0) {
+				rv = -1;
+				break;
+			}
+		}
+
+		nrows += netns[i].ncns_nrows;
+	}
+
+	if (rv == 0 && ncp->nc_debug) {
+		(void) fprintf(stderr, "collected %lu connections from %lu "
+		    "network namespaces in %.3fs\n", (unsigned long)nrows,
+		    (unsigned long)nnetns, nc_time() - start);
+		(void) fprintf(stderr, "tcp_info: %lu entries in %lu KB\n",
+		    (unsigned long)ncp->nc_tcpinfo.nct_nused,
+		    (unsigned long)(ncp->nc_tcpinfo.nct_size *
+		    sizeof (nctcpinfo_t) / 1024));
+	}
+
+	nc_netns_free(netns, nnetns);
+	return (rv);
+}
+
+/*
+ * Read the connections of each of the "nnetns" namespaces in "netns" (see
+ * nc_netns_list()).  This thread reads the host's own namespace (which is
+ * always first), since it doesn't need to switch namespaces to do so, and
+ * collector threads read the rest in parallel.  Failures to read a namespace
+ * are left in its ncns_error.
+ */
+static int
+nc_netns_readall(ncnetns_t *netns, size_t nnetns)
+{
+	nccollector_t collectors[NC_MAXCOLLECTORS];
+	size_t i, ncollectors;
+	int rv = 0;
+
+	ncollectors = nnetns - 1;
+	if (ncollectors > NC_MAXCOLLECTORS)
+		ncollectors = NC_MAXCOLLECTORS;
+	for (i = 0; i < ncollectors; i++) {
+		collectors[i].ncc_netns = netns;
+		collectors[i].ncc_nnetns = nnetns;
+		collectors[i].ncc_first = i + 1;
+		collectors[i].ncc_stride = ncollectors;
+		if (pthread_create(&collectors[i].ncc_thread, NULL,
+		    nc_netns_collector, &collectors[i]) != 0) {
+			warn("pthread_create");
+			ncollectors = i;
+			rv = -1;
+			break;
+		}
+	}
+
+	nc_netns_read(&netns[0], NB_FALSE);
+	for (i = 0; i < ncollectors; i++)
+		(void) pthread_join(collectors[i].ncc_thread, NULL);
+
+	return (rv);
+}
+
+/*
+ * Free the list of namespaces built by nc_netns_list().
+ */
+static void
+nc_netns_free(ncnetns_t *netns, size_t nnetns)
+{
+	size_t i;
+
+	for (i = 0; i < nnetns; i++) {
+		free(netns[i].ncns_rows);
+		free(netns[i].ncns_tcpinfo);
+	}
+	free(netns);
+}
+
+/*
+ * Build the list of network namespaces to collect from (see
+ * nc_netns_collect()).  Each namespace appears once, however many processes
+ * are in it, and the host's namespace is first.
+ */
+static int
+nc_netns_list(const char *host, ncnetns_t **netnsp, size_t *nnetnsp)
+{
+	char path[PATH_MAX];
+	char name[sizeof (((ncnetns_t *)NULL)->ncns_name)];
+	struct dirent *ent;
+	ncnetns_t *ns;
+	size_t i, nalloc;
+	DIR *dir;
+	int rv;
+
+	*netnsp = NULL;
+	*nnetnsp = nalloc = 0;
+	rv = nc_netns_add(netnsp, nnetnsp, &nalloc, "/proc/self/ns/net",
+	    host);
+	if (rv != 0) {
+		if (rv > 0)
+			warn("stat \"/proc/self/ns/net\"");
+		return (-1);
+	}
+
+	/*
+	 * Processes come and go, and we may not be allowed to see other users'
+	 * namespaces, so we skip any that we can't examine.
+	 */
+	if ((dir = opendir(NC_NETNSDIR)) != NULL) {
+		while (rv >= 0 && (ent = readdir(dir)) != NULL) {
+			if (ent->d_name[0] == '.')
+				continue;
+
+			if (snprintf(path, sizeof (path), "%s/%s", NC_NETNSDIR,
+			    ent->d_name) >= (int)sizeof (path) ||
+			    snprintf(name, sizeof (name), "%s/%s", host,
+			    ent->d_name) >= (int)sizeof (name)) {
+				continue;
+			}
+
+			rv = nc_netns_add(netnsp, nnetnsp, &nalloc, path, name);
+		}
+
+		(void) closedir(dir);
+	}
+
+	if (rv >= 0 && (dir = opendir("/proc")) == NULL) {
+		warn("opendir \"/proc\"");
+		rv = -1;
+	} else if (rv >= 0) {
+		while (rv >= 0 && (ent = readdir(dir)) != NULL) {
+			if (!isdigit((unsigned char)ent->d_name[0]))
+				continue;
+
+			if (snprintf(path, sizeof (path), "/proc/%s/ns/net",
+			    ent->d_name) >= (int)sizeof (path))
+				continue;
+
+			rv = nc_netns_add(netnsp, nnetnsp, &nalloc, path, NULL);
+		}
+
+		(void) closedir(dir);
+	}
+
+	if (rv < 0) {
+		free(*netnsp);
+		*netnsp = NULL;
+		return (-1);
+	}
+
+	/* Name the namespaces that only processes refer to by their inode. */
+	for (i = 0; i < *nnetnsp; i++) {
+		ns = &(*netnsp)[i];
+		if (ns->ncns_name[0] == '\0') {
+			(void) snprintf(ns->ncns_name, sizeof (ns->ncns_name),
+			    "%s/netns-%llu", host,
+			    (unsigned long long)ns->ncns_ino);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Append the network namespace whose file is "path" to the list in *netnsp,
+ * unless it's already there.  A namespace is identified by the device and
+ * inode of its file.  If "name" is NULL, the namespace is left unnamed.
+ * Returns 0 on success, 1 if "path" can't be examined, or -1 on failure.
+ */
+static int
+nc_netns_add(ncnetns_t **netnsp, size_t *nnetnsp, size_t *nallocp,
+    const char *path, const char *name)
+{
+	ncnetns_t *netns, *ns;
+	struct stat st;
+	size_t i;
+
+	if (stat(path, &st) != 0)
+		return (1);
+
+	netns = *netnsp;
+	for (i = 0; i < *nnetnsp; i++) {
+		if (netns[i].ncns_dev == st.st_dev &&
+		    netns[i].ncns_ino == st.st_ino)
+			return (0);
+	}
+
+	if (*nnetnsp == *nallocp) {
+		*nallocp = *nallocp == 0 ? 16 : *nallocp * 2;
+		if ((netns = realloc(netns, *nallocp * sizeof (*ns))) == NULL) {
+			warn("realloc");
+			return (-1);
+		}
+		*netnsp = netns;
+	}
+
+	ns = &netns[(*nnetnsp)++];
+	bzero(ns, sizeof (*ns));
+	ns->ncns_dev = st.st_dev;
+	ns->ncns_ino = st.st_ino;
+	(void) strlcpy(ns->ncns_path, path, sizeof (ns->ncns_path));
+	if (name != NULL)
+		(void) strlcpy(ns->ncns_name, name, sizeof (ns->ncns_name));
+
+	return (0);
+}
+
+/*
+ * Thread body for collecting connections from network namespaces.  See
+ * nc_netns_collect().
+ */
+static void *
+nc_netns_collector(void *arg)
+{
+	nccollector_t *ncc = arg;
+	size_t i;
+
+	for (i = ncc->ncc_first; i < ncc->ncc_nnetns; i += ncc->ncc_stride)
+		nc_netns_read(&ncc->ncc_netns[i], NB_TRUE);
+
+	return (NULL);
+}
+
+/*
+ * Read the TCP connections of network namespace "ns" using sock_diag(7).  If
+ * "enter" is true, the calling thread first switches to that namespace (which
+ * affects only this thread).  On failure, this sets ncns_error, or ncns_gone if
+ * the namespace no longer exists.
+ */
+static void
+nc_netns_read(ncnetns_t *ns, ncbool_t enter)
+{
+	struct {
+		struct nlmsghdr		nlh;
+		struct inet_diag_req_v2	req;
+	} msg;
+	struct inet_diag_msg *diag;
+	struct nlmsghdr *nlh;
+	struct nlmsgerr *nlerr;
+	struct rtattr *rta;
+	const nclinuxtcpinfo_t *lti;
+	ncrow_t *rows, *row;
+	nctcpinfo_t *tcpinfo, *ti;
+	char *buf;
+	ssize_t len;
+	size_t nalloc;
+	int fd, state, rtalen;
+	ncbool_t done;
+
+	if (enter) {
+		if ((fd = open(ns->ncns_path, O_RDONLY | O_CLOEXEC)) < 0) {
+			if (errno == ENOENT) {
+				ns->ncns_gone = NB_TRUE;
+				return;
+			}
+
+			warn("open \"%s\"", ns->ncns_path);
+			ns->ncns_error = 1;
+			return;
+		}
+
+		if (setns(fd, CLONE_NEWNET) != 0) {
+			warn("setns \"%s\"", ns->ncns_path);
+			ns->ncns_error = 1;
+			(void) close(fd);
+			return;
+		}
+
+		(void) close(fd);
+	}
+
+	if ((buf = malloc(NC_DIAGBUFSZ)) == NULL) {
+		warn("malloc");
+		ns->ncns_error = 1;
+		return;
+	}
+
+	if ((fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+	    NETLINK_SOCK_DIAG)) < 0) {
+		warn("socket");
+		ns->ncns_error = 1;
+		free(buf);
+		return;
+	}
+
+	/*
+	 * Ask for all IPv4 TCP sockets except listeners and closed ones, which
+	 * netstat doesn't show either, along with their TCP_INFO.
+	 */
+	bzero(&msg, sizeof (msg));
+	msg.nlh.nlmsg_len = sizeof (msg);
+	msg.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	msg.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	msg.req.sdiag_family = AF_INET;
+	msg.req.sdiag_protocol = IPPROTO_TCP;
+	msg.req.idiag_states = 0xfff & ~((1 << 0) | (1 << 7) | (1 << 10));
+	msg.req.idiag_ext = 1 << (INET_DIAG_INFO - 1);
+	if (send(fd, &msg, sizeof (msg), 0) != sizeof (msg)) {
+		warn("sock_diag request in \"%s\"", ns->ncns_path);
+		ns->ncns_error = 1;
+		(void) close(fd);
+		free(buf);
+		return;
+	}
+
+	for (done = NB_FALSE; !done && ns->ncns_error == 0; ) {
+		if ((len = recv(fd, buf, NC_DIAGBUFSZ, 0)) < 0) {
+			if (errno == EINTR)
+				continue;
+			warn("sock_diag response in \"%s\"", ns->ncns_path);
+			ns->ncns_error = 1;
+			break;
+		}
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		    nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type == NLMSG_DONE) {
+				done = NB_TRUE;
+				break;
+			}
+
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				nlerr = NLMSG_DATA(nlh);
+				warnx("sock_diag in \"%s\": %s", ns->ncns_path,
+				    strerror(-nlerr->error));
+				ns->ncns_error = 1;
+				break;
+			}
+
+			diag = NLMSG_DATA(nlh);
+			if (diag->idiag_state >= sizeof (nc_linux_states) ||
+			    (state = nc_linux_states[diag->idiag_state]) < 0)
+				continue;
+
+			if (ns->ncns_nrows == ns->ncns_nalloc) {
+				nalloc = ns->ncns_nalloc == 0 ? 256 :
+				    ns->ncns_nalloc * 2;
+				rows = realloc(ns->ncns_rows,
+				    nalloc * sizeof (*rows));
+				if (rows != NULL)
+					ns->ncns_rows = rows;
+				tcpinfo = realloc(ns->ncns_tcpinfo,
+				    nalloc * sizeof (*tcpinfo));
+				if (tcpinfo != NULL)
+					ns->ncns_tcpinfo = tcpinfo;
+				if (rows == NULL || tcpinfo == NULL) {
+					warn("realloc");
+					ns->ncns_error = 1;
+					break;
+				}
+				ns->ncns_nalloc = nalloc;
+			}
+
+			/*
+			 * TCP_INFO is absent for sockets in TIME_WAIT and
+			 * SYN_RECV, which the kernel keeps as minisockets.
+			 */
+			ti = &ns->ncns_tcpinfo[ns->ncns_nrows];
+			bzero(ti, sizeof (*ti));
+			rtalen = nlh->nlmsg_len - NLMSG_LENGTH(sizeof (*diag));
+			for (rta = (struct rtattr *)(diag + 1);
+			    RTA_OK(rta, rtalen); rta = RTA_NEXT(rta, rtalen)) {
+				if (rta->rta_type != INET_DIAG_INFO ||
+				    RTA_PAYLOAD(rta) <
+				    offsetof(nclinuxtcpinfo_t, nclt_pacing))
+					continue;
+
+				lti = RTA_DATA(rta);
+				ti->ncti_used = 1;
+				ti->ncti_lastsend =
+				    lti->nclt_info.tcpi_last_data_sent;
+				ti->ncti_lastrecv =
+				    lti->nclt_info.tcpi_last_data_recv;
+				ti->ncti_rtt = lti->nclt_info.tcpi_rtt;
+				ti->ncti_retrans =
+				    lti->nclt_info.tcpi_total_retrans;
+				ti->ncti_backoff =
+				    lti->nclt_info.tcpi_retransmits;
+				if (RTA_PAYLOAD(rta) >= sizeof (*lti))
+					ti->ncti_acked = lti->nclt_acked;
+			}
+
+			row = &ns->ncns_rows[ns->ncns_nrows++];
+			bzero(row, sizeof (*row));
+			row->ncrw_ip1 = ntohl(diag->id.idiag_src[0]);
+			row->ncrw_port1 = ntohs(diag->id.idiag_sport);
+			row->ncrw_ip2 = ntohl(diag->id.idiag_dst[0]);
+			row->ncrw_port2 = ntohs(diag->id.idiag_dport);
+			row->ncrw_sendq = diag->idiag_wqueue;
+			row->ncrw_recvq = diag->idiag_rqueue;
+			row->ncrw_state = state;
+		}
+	}
+
+	(void) close(fd);
+	free(buf);
+}
+
+/*
+ * Names of the tracepoint fields in nctpfield_t, as they appear in the
+ * tracepoint's format file.
+ */
+static const char *nc_tp_fields[] = {
+	" family;",
+	" protocol;",
+	" saddr[4];",
+	" daddr[4];",
+	" sport;",
+	" dport;",
+	" newstate;",
+};
+
+/*
+ * Construct a BPF instruction.
+ */
+#define	NC_BPF_INSN(c, d, s, o, i)	\
+	{ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) }
+
+/*
+ * Invoke the bpf(2) system call, for which there's no libc wrapper.
+ */
+static int
+nc_bpf(int cmd, union bpf_attr *attr)
+{
+	return (syscall(__NR_bpf, cmd, attr, sizeof (*attr)));
+}
+
+/*
+ * Find the sock:inet_sock_set_state tracepoint in tracefs, storing its id into
+ * *idp and the offsets of the fields that the tracker uses into "offsets".
+ */
+static int
+nc_tracker_tracepoint(int *idp, int *offsets)
+{
+	static const char *tracefs[] = {
+		"/sys/kernel/tracing",
+		"/sys/kernel/debug/tracing",
+	};
+	char path[PATH_MAX];
+	char buf[8192];
+	const char *p, *dir;
+	FILE *fstream;
+	size_t len;
+	unsigned int i;
+
+	fstream = NULL;
+	dir = NULL;
+	for (i = 0; fstream == NULL &&
+	    i < sizeof (tracefs) / sizeof (tracefs[0]); i++) {
+		dir = tracefs[i];
+		(void) snprintf(path, sizeof (path), "%s/%s/format", dir,
+		    NC_BPF_EVENT);
+		fstream = fopen(path, "r");
+	}
+
+	if (fstream == NULL) {
+		warnx("tracepoint sock:inet_sock_set_state not found "
+		    "(is tracefs mounted?)");
+		return (-1);
+	}
+
+	len = fread(buf, 1, sizeof (buf) - 1, fstream);
+	buf[len] = '\0';
+	(void) fclose(fstream);
+	for (i = 0; i < NCTP_NFIELDS; i++) {
+		if ((p = strstr(buf, nc_tp_fields[i])) == NULL ||
+		    (p = strstr(p, "offset:")) == NULL) {
+			warnx("%s: field \"%s\" not found", path,
+			    nc_tp_fields[i]);
+			return (-1);
+		}
+		offsets[i] = atoi(p + strlen("offset:"));
+	}
+
+	(void) snprintf(path, sizeof (path), "%s/%s/id", dir, NC_BPF_EVENT);
+	if ((fstream = fopen(path, "r")) == NULL ||
+	    fscanf(fstream, "%d", idp) != 1) {
+		warnx("failed to read tracepoint id from %s", path);
+		if (fstream != NULL)
+			(void) fclose(fstream);
+		return (-1);
+	}
+
+	(void) fclose(fstream);
+	return (0);
+}
+
+/*
+ * Load the tracker's BPF program, which updates the map "mapfd" using the
+ * tracepoint fields at "offs", and return its file descriptor.  The program
+ * builds the key (at fp-16) and value (at fp-32) on the stack from the
+ * tracepoint's fields, then updates or deletes the map entry.  Sockets that
+ * become listeners are treated like closed ones, since netcmp doesn't report
+ * them.
+ */
+static int
+nc_tracker_prog(int mapfd, const int *offs)
+{
+	union bpf_attr attr;
+	char verlog[4096];
+	int fd;
+	struct bpf_insn prog[] = {
+		/* r6 = ctx; skip anything but IPv4 TCP */
+		NC_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),
+		NC_BPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 2, 6,
+		    offs[NCTP_FAMILY], 0),
+		NC_BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 2, 0, 31, AF_INET),
+		NC_BPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 2, 6,
+		    offs[NCTP_PROTOCOL], 0),
+		NC_BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 2, 0, 29, IPPROTO_TCP),
+
+		/* build the key */
+		NC_BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 2, 6,
+		    offs[NCTP_SADDR], 0),
+		NC_BPF_INSN(BPF_STX | BPF_MEM | BPF_W, 10, 2, -16, 0),
+		NC_BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 2, 6,
+		    offs[NCTP_DADDR], 0),
+		NC_BPF_INSN(BPF_STX | BPF_MEM | BPF_W, 10, 2, -12, 0),
+		NC_BPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 2, 6,
+		    offs[NCTP_SPORT], 0),
+		NC_BPF_INSN(BPF_STX | BPF_MEM | BPF_H, 10, 2, -8, 0),
+		NC_BPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 2, 6,
+		    offs[NCTP_DPORT], 0),
+		NC_BPF_INSN(BPF_STX | BPF_MEM | BPF_H, 10, 2, -6, 0),
+
+		/* r7 = new state; delete on TCP_CLOSE or TCP_LISTEN */
+		NC_BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 7, 6,
+		    offs[NCTP_NEWSTATE], 0),
+		NC_BPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, 7, 0, 14, 7),
+		NC_BPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, 7, 0, 13, 10),
+
+		/* build the value and update the entry */
+		NC_BPF_INSN(BPF_STX | BPF_MEM | BPF_W, 10, 7, -32, 0),
+		NC_BPF_INSN(BPF_ST | BPF_MEM | BPF_W, 10, 0, -28, 0),
+		NC_BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0,
+		    BPF_FUNC_ktime_get_ns),
+		NC_BPF_INSN(BPF_STX | BPF_MEM | BPF_DW, 10, 0, -24, 0),
+		NC_BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD,
+		    0, mapfd),
+		NC_BPF_INSN(0, 0, 0, 0, 0),
+		NC_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0),
+		NC_BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -16),
+		NC_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 3, 10, 0, 0),
+		NC_BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 3, 0, 0, -32),
+		NC_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 4, 0, 0, BPF_ANY),
+		NC_BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0,
+		    BPF_FUNC_map_update_elem),
+		NC_BPF_INSN(BPF_JMP | BPF_JA, 0, 0, 5, 0),
+
+		/* delete the entry */
+		NC_BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD,
+		    0, mapfd),
+		NC_BPF_INSN(0, 0, 0, 0, 0),
+		NC_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0),
+		NC_BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -16),
+		NC_BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0,
+		    BPF_FUNC_map_delete_elem),
+
+		/* return 0 */
+		NC_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, 0),
+		NC_BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+
+	bzero(&attr, sizeof (attr));
+	attr.prog_type = BPF_PROG_TYPE_TRACEPOINT;
+	attr.insns = (uintptr_t)prog;
+	attr.insn_cnt = sizeof (prog) / sizeof (prog[0]);
+	attr.license = (uintptr_t)"Dual MPL/GPL";
+	attr.log_buf = (uintptr_t)verlog;
+	attr.log_size = sizeof (verlog);
+	attr.log_level = 1;
+	verlog[0] = '\0';
+	if ((fd = nc_bpf(BPF_PROG_LOAD, &attr)) < 0) {
+		warn("bpf program load");
+		if (verlog[0] != '\0')
+			(void) fprintf(stderr, "%s", verlog);
+	}
+
+	return (fd);
+}
+
+/*
+ * Install the connection tracker ("-T"), pinning its map and its attachment to
+ * the tracepoint in "dir", which must be in a BPF filesystem.  The map is then
+ * seeded with the connections that already exist, so that it's complete from
+ * the start.
+ */
+static int
+nc_tracker_install(netcmp_t *ncp, const char *dir)
+{
+	union bpf_attr attr;
+	struct perf_event_attr pattr;
+	ncnetns_t *netns, *ns;
+	ncbpfkey_t key;
+	ncbpfval_t val;
+	char mappath[PATH_MAX], linkpath[PATH_MAX];
+	char host[64];
+	int offs[NCTP_NFIELDS];
+	int tpid, mapfd, progfd, perffd, linkfd, rv;
+	size_t i, n, nnetns, nseeded;
+	unsigned int s;
+
+	if (nc_tracker_tracepoint(&tpid, offs) != 0)
+		return (-1);
+
+	(void) snprintf(mappath, sizeof (mappath), "%s/%s", dir, NC_BPF_MAP);
+	(void) snprintf(linkpath, sizeof (linkpath), "%s/%s", dir,
+	    NC_BPF_LINK);
+	rv = -1;
+	mapfd = progfd = perffd = linkfd = -1;
+	netns = NULL;
+	nnetns = 0;
+
+	bzero(&attr, sizeof (attr));
+	attr.map_type = BPF_MAP_TYPE_HASH;
+	attr.key_size = sizeof (ncbpfkey_t);
+	attr.value_size = sizeof (ncbpfval_t);
+	attr.max_entries = NC_BPF_MAXCONNS;
+	attr.map_flags = BPF_F_NO_PREALLOC;
+	(void) strlcpy(attr.map_name, "netcmp_conns", sizeof (attr.map_name));
+	if ((mapfd = nc_bpf(BPF_MAP_CREATE, &attr)) < 0) {
+		warn("bpf map create");
+		goto out;
+	}
+
+	if ((progfd = nc_tracker_prog(mapfd, offs)) < 0)
+		goto out;
+
+	bzero(&pattr, sizeof (pattr));
+	pattr.type = PERF_TYPE_TRACEPOINT;
+	pattr.size = sizeof (pattr);
+	pattr.config = tpid;
+	pattr.sample_period = 1;
+	pattr.wakeup_events = 1;
+	if ((perffd = syscall(__NR_perf_event_open, &pattr, -1, 0, -1,
+	    PERF_FLAG_FD_CLOEXEC)) < 0) {
+		warn("perf_event_open");
+		goto out;
+	}
+
+	bzero(&attr, sizeof (attr));
+	attr.link_create.prog_fd = progfd;
+	attr.link_create.target_fd = perffd;
+	attr.link_create.attach_type = BPF_PERF_EVENT;
+	if ((linkfd = nc_bpf(BPF_LINK_CREATE, &attr)) < 0) {
+		warn("bpf link create");
+		goto out;
+	}
+
+	bzero(&attr, sizeof (attr));
+	attr.pathname = (uintptr_t)mappath;
+	attr.bpf_fd = mapfd;
+	if (nc_bpf(BPF_OBJ_PIN, &attr) != 0) {
+		warn("pin \"%s\"", mappath);
+		goto out;
+	}
+
+	attr.pathname = (uintptr_t)linkpath;
+	attr.bpf_fd = linkfd;
+	if (nc_bpf(BPF_OBJ_PIN, &attr) != 0) {
+		warn("pin \"%s\"", linkpath);
+		(void) unlink(mappath);
+		goto out;
+	}
+
+	/*
+	 * Seed the map with the existing connections in every namespace, as
+	 * for "-N".  The tracker is already running, so an entry it has added
+	 * since then is more current than ours and is left alone.  If we can't
+	 * seed the map, we remove the tracker rather than leave it silently
+	 * missing connections.
+	 */
+	if (gethostname(host, sizeof (host)) != 0) {
+		warn("gethostname");
+		goto unpin;
+	}
+
+	host[sizeof (host) - 1] = '\0';
+	if (nc_netns_list(host, &netns, &nnetns) != 0 ||
+	    nc_netns_readall(netns, nnetns) != 0)
+		goto unpin;
+
+	nseeded = 0;
+	for (n = 0; n < nnetns; n++) {
+		ns = &netns[n];
+		if (ns->ncns_error != 0) {
+			warnx("failed to seed tracker from \"%s\"",
+			    ns->ncns_path);
+			goto unpin;
+		}
+
+		for (i = 0; !ns->ncns_gone && i < ns->ncns_nrows; i++) {
+			key.ncbk_saddr = htonl(ns->ncns_rows[i].ncrw_ip1);
+			key.ncbk_daddr = htonl(ns->ncns_rows[i].ncrw_ip2);
+			key.ncbk_sport = ns->ncns_rows[i].ncrw_port1;
+			key.ncbk_dport = ns->ncns_rows[i].ncrw_port2;
+			bzero(&val, sizeof (val));
+			for (s = 0; s < sizeof (nc_linux_states); s++) {
+				if (nc_linux_states[s] ==
+				    ns->ncns_rows[i].ncrw_state)
+					val.ncbv_state = s;
+			}
+
+			bzero(&attr, sizeof (attr));
+			attr.map_fd = mapfd;
+			attr.key = (uintptr_t)&key;
+			attr.value = (uintptr_t)&val;
+			attr.flags = BPF_NOEXIST;
+			if (nc_bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0 &&
+			    errno != EEXIST) {
+				warn("bpf map update");
+				goto unpin;
+			}
+			nseeded++;
+		}
+	}
+
+	if (ncp->nc_debug) {
+		(void) fprintf(stderr, "tracker installed in %s (seeded with "
+		    "%lu connections from %lu network namespaces)\n", dir,
+		    (unsigned long)nseeded, (unsigned long)nnetns);
+	}
+
+	rv = 0;
+	goto out;
+
+unpin:
+	(void) unlink(linkpath);
+	(void) unlink(mappath);
+
+out:
+	if (netns != NULL)
+		nc_netns_free(netns, nnetns);
+	if (linkfd >= 0)
+		(void) close(linkfd);
+	if (perffd >= 0)
+		(void) close(perffd);
+	if (progfd >= 0)
+		(void) close(progfd);
+	if (mapfd >= 0)
+		(void) close(mapfd);
+	return (rv);
+}
+
+/*
+ * Read the connections recorded by the tracker pinned in "dir" ("-B") and
+ * record them as a source labelled with the host name, just like the host's
+ * namespace with "-N".  The tracker sees sockets in all network namespaces.
+ */
+static int
+nc_tracker_read(netcmp_t *ncp, const char *dir)
+{
+	union bpf_attr attr;
+	ncbpfkey_t *keys;
+	ncbpfval_t *vals;
+	ncbpfkey_t token;
+	nclabel_t *label;
+	ncrow_t row;
+	char path[PATH_MAX];
+	char host[64];
+	double start;
+	unsigned long nconns;
+	uint32_t i, count;
+	ncbool_t first, done;
+	int fd, rv;
+
+	start = nc_time();
+	if (gethostname(host, sizeof (host)) != 0) {
+		warn("gethostname");
+		return (-1);
+	}
+
+	host[sizeof (host) - 1] = '\0';
+	if ((label = nc_label_lookup(ncp, host)) == NULL)
+		return (-1);
+	label->ncl_captured = ncp->nc_now;
+
+	(void) snprintf(path, sizeof (path), "%s/%s", dir, NC_BPF_MAP);
+	bzero(&attr, sizeof (attr));
+	attr.pathname = (uintptr_t)path;
+	if ((fd = nc_bpf(BPF_OBJ_GET, &attr)) < 0) {
+		warn("open tracker map \"%s\"", path);
+		return (-1);
+	}
+
+	keys = calloc(NC_BPF_BATCH, sizeof (*keys));
+	vals = calloc(NC_BPF_BATCH, sizeof (*vals));
+	if (keys == NULL || vals == NULL) {
+		warn("calloc");
+		free(keys);
+		free(vals);
+		(void) close(fd);
+		return (-1);
+	}
+
+	/*
+	 * Read the map a batch at a time.  Older kernels don't support batch
+	 * lookups, so fall back to walking the keys one at a time.
+	 */
+	rv = 0;
+	nconns = 0;
+	bzero(&row, sizeof (row));
+	for (first = NB_TRUE, done = NB_FALSE; !done; first = NB_FALSE) {
+		bzero(&attr, sizeof (attr));
+		attr.batch.map_fd = fd;
+		attr.batch.in_batch = first ? 0 : (uintptr_t)&token;
+		attr.batch.out_batch = (uintptr_t)&token;
+		attr.batch.keys = (uintptr_t)keys;
+		attr.batch.values = (uintptr_t)vals;
+		attr.batch.count = NC_BPF_BATCH;
+		if (nc_bpf(BPF_MAP_LOOKUP_BATCH, &attr) != 0) {
+			if (errno == EINVAL && first) {
+				rv = nc_tracker_walk(ncp, label, fd, &nconns);
+				break;
+			}
+
+			if (errno != ENOENT) {
+				warn("read tracker map \"%s\"", path);
+				rv = -1;
+				break;
+			}
+
+			done = NB_TRUE;
+		}
+
+		count = attr.batch.count;
+		for (i = 0; rv == 0 && i < count; i++) {
+			if (vals[i].ncbv_state >= sizeof (nc_linux_states) ||
+			    nc_linux_states[vals[i].ncbv_state] < 0)
+				continue;
+
+			row.ncrw_ip1 = ntohl(keys[i].ncbk_saddr);
+			row.ncrw_ip2 = ntohl(keys[i].ncbk_daddr);
+			row.ncrw_port1 = keys[i].ncbk_sport;
+			row.ncrw_port2 = keys[i].ncbk_dport;
+			row.ncrw_state = nc_linux_states[vals[i].ncbv_state];
+			rv = nc_parse_row(ncp, label, &row);
+			nconns++;
+		}
+
+		if (rv != 0)
+			break;
+	}
+
+	if (rv == 0 && ncp->nc_debug) {
+		(void) fprintf(stderr, "read %lu connections from tracker in "
+		    "%.3fs\n", nconns, nc_time() - start);
+	}
+
+	free(keys);
+	free(vals);
+	(void) close(fd);
+	return (rv);
+}
+
+/*
+ * Read the tracker's map one entry at a time.  This is much slower than the
+ * batch lookups in nc_tracker_read(), but works on older kernels.
+ */
+static int
+nc_tracker_walk(netcmp_t *ncp, nclabel_t *label, int fd,
+    unsigned long *nconnsp)
+{
+	union bpf_attr attr;
+	ncbpfkey_t key, next;
+	ncbpfval_t val;
+	ncrow_t row;
+	ncbool_t first;
+
+	bzero(&row, sizeof (row));
+	for (first = NB_TRUE; ; first = NB_FALSE) {
+		bzero(&attr, sizeof (attr));
+		attr.map_fd = fd;
+		attr.key = first ? 0 : (uintptr_t)&key;
+		attr.next_key = (uintptr_t)&next;
+		if (nc_bpf(BPF_MAP_GET_NEXT_KEY, &attr) != 0) {
+			if (errno == ENOENT)
+				return (0);
+			warn("read tracker map");
+			return (-1);
+		}
+
+		key = next;
+		bzero(&attr, sizeof (attr));
+		attr.map_fd = fd;
+		attr.key = (uintptr_t)&key;
+		attr.value = (uintptr_t)&val;
+		if (nc_bpf(BPF_MAP_LOOKUP_ELEM, &attr) != 0 ||
+		    val.ncbv_state >= sizeof (nc_linux_states) ||
+		    nc_linux_states[val.ncbv_state] < 0) {
+			continue;
+		}
+
+		row.ncrw_ip1 = ntohl(key.ncbk_saddr);
+		row.ncrw_ip2 = ntohl(key.ncbk_daddr);
+		row.ncrw_port1 = key.ncbk_sport;
+		row.ncrw_port2 = key.ncbk_dport;
+		row.ncrw_state = nc_linux_states[val.ncbv_state];
+		if (nc_parse_row(ncp, label, &row) != 0)
+			return (-1);
+		(*nconnsp)++;
+	}
+}
+
+#else	/* !__linux__ */
+
+/*
+ * Network namespaces and sock_diag are specific to Linux.
+ */
+static int
+nc_netns_collect(netcmp_t *ncp)
+{
+	(void) ncp;
+	warnx("-N is only supported on Linux");
+	return (-1);
+}
+
+/*
+ * The connection tracker uses BPF and a Linux tracepoint.
+ */
+static int
+nc_tracker_install(netcmp_t *ncp, const char *dir)
+{
+	(void) ncp;
+	(void) dir;
+	warnx("-T is only supported on Linux");
+	return (-1);
+}
+
+static int
+nc_tracker_read(netcmp_t *ncp, const char *dir)
+{
+	(void) ncp;
+	(void) dir;
+	warnx("-B is only supported on Linux");
+	return (-1);
+}
+
+#endif	/* __linux__ */
+
+/*
+ * Classify every connection, recording the class in the connection and the
+ * count of connections in each class in "ncp".
+ */
+static void
+nc_classify(netcmp_t *ncp)
+{
+	ncconn_t *ncc;
+	ncpair_t *pair = NULL;
+	ncviewset_t cov[2];
+
+	bzero(ncp->nc_nclass, sizeof (ncp->nc_nclass));
+	if (ncp->nc_nviews > 0)
+		nc_view_assign(ncp);
+
+	if (ncp->nc_gapk > 0 &&
+	    (nc_hash_init(&ncp->nc_gapconns, 1024) != 0 ||
+	    nc_hash_init(&ncp->nc_gapsources, 1024) != 0 ||
+	    nc_hash_init(&ncp->nc_gappairs, 1024) != 0)) {
+		errx(EXIT_FAILURE, "failed to allocate coverage gap tables");
+	}
+
+	for (ncc = nc_conn_first(ncp); ncc != NULL;
+	    ncc = nc_conn_next(ncp, ncc)) {
+		ncc->ncc_class = nc_conn_classify(ncp, ncc);
+		ncp->nc_nclass[ncc->ncc_class]++;
+		if (ncc->ncc_class == NCL_EXTERNAL && ncp->nc_gapk > 0)
+			nc_gap_record(ncp, ncc);
+		if (ncp->nc_nviews == 0)
+			continue;
+
+		/* Connections are visited by pair, so cache its coverage. */
+		if (ncc->ncc_pair != pair) {
+			pair = ncc->ncc_pair;
+			cov[0] = nc_view_coverage(ncp, pair->ncpr_ip1,
+			    pair->ncpr_sources[0]);
+			cov[1] = nc_view_coverage(ncp, pair->ncpr_ip2,
+			    pair->ncpr_sources[1]);
+		}
+
+		nc_view_classify(ncp, ncc, cov);
+	}
+}
+
+/*
+ * Dump to the report stream a final report -- the actual "netcmp" output.
+ * This relies on nc_classify() having classified the connections.
+ */
+static void
+nc_report(netcmp_t *ncp)
+{
+	FILE *out = ncp->nc_out;
+	ncconn_t *ncc;
+	ncconn_t *ncc_error = NULL;
+	ncconn_t **asym = NULL;
+	unsigned long *nclass = ncp->nc_nclass;
+	size_t nasymmetric = 0;
+	size_t i;
+	int nyoung = 0;
+	unsigned long nstalled = 0;
+	const nctcpinfo_t *ti;
+	nclabel_t *label;
+	char buf[256];
+
+	/*
+	 * We collect up the asymmetric connections before printing them so that
+	 * when tracking connection age, we can report them oldest first, or
+	 * with TCP_INFO, longest idle first.
+	 */
+	if ((asym = calloc(nclass[NCL_ASYMMETRIC] + 1,
+	    sizeof (*asym))) == NULL) {
+		err(EXIT_FAILURE, "calloc");
+	}
+
+	for (ncc = nc_conn_first(ncp); ncc != NULL;
+	    ncc = nc_conn_next(ncp, ncc)) {
+		switch (ncc->ncc_class) {
+		case NCL_MULTI:
+			nc_diag_record(ncp, NCD_MULTI, ncc);
+			ncc_error = ncc;
+			break;
+
+		case NCL_EXTERNAL:
+			nc_diag_record(ncp, NCD_EXTERNAL, ncc);
+			break;
+
+		case NCL_ASYMMETRIC:
+			asym[nasymmetric++] = ncc;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	nc_diag_report(ncp);
+	if (ncp->nc_agefile != NULL)
+		qsort(asym, nasymmetric, sizeof (*asym), nc_conn_age_compare);
+	else if (ncp->nc_tcpinfo.nct_nused != 0)
+		nc_tcpinfo_sort(ncp, asym, nasymmetric);
+
+	/*
+	 * Print the asymmetric connections.  If we're also writing per-source
+	 * report files, this is where we partition the connections by the
+	 * source that holds them.
+	 */
+	for (i = 0; i < nasymmetric; i++) {
+		ncc = asym[i];
+		if (!nc_asym_format(ncp, ncc, buf, sizeof (buf))) {
+			nyoung++;
+			continue;
+		}
+
+		(void) fputs(buf, out);
+		if ((ti = nc_tcpinfo_lookup(ncp, ncc)) != NULL &&
+		    ti->ncti_backoff != 0)
+			nstalled++;
+
+		if (ncp->nc_reportdir == NULL)
+			continue;
+
+		label = NCC_SOURCE(ncc, 0)->ncs_label;
+		if (label->ncl_nasym == label->ncl_nalloc) {
+			label->ncl_nalloc = label->ncl_nalloc == 0 ?
+			    64 : label->ncl_nalloc * 2;
+			label->ncl_asym = realloc(label->ncl_asym,
+			    label->ncl_nalloc * sizeof (*label->ncl_asym));
+			if (label->ncl_asym == NULL)
+				err(EXIT_FAILURE, "realloc");
+		}
+
+		label->ncl_asym[label->ncl_nasym++] = ncc;
+	}
+
+	free(asym);
+	if (ncp->nc_reportdir != NULL && nc_report_bylabel(ncp) != 0)
+		errx(EXIT_FAILURE, "failed to write per-source reports");
+
+	if (nclass[NCL_MULTI] != 0) {
+		warnx("%lu connection%s had more than two sources! example:\n",
+		    nclass[NCL_MULTI], nclass[NCL_MULTI] == 1 ? "" : "s");
+		nc_conn_dump(stderr, ncc_error);
+	}
+
+	(void) fprintf(out, "summary of connections found:\n");
+	(void) fprintf(out, "    %7lu localhost connections skipped\n",
+	    ncp->nc_nlocalhost);
+	(void) fprintf(out, "    %7lu pruned (in state TIME_WAIT)\n",
+	    nclass[NCL_TIMEWAIT]);
+	(void) fprintf(out, "    %7lu symmetric (present on both sides)\n",
+	    nclass[NCL_SYMMETRIC]);
+	(void) fprintf(out, "    %7lu external (only one side's data was "
+	    "supplied)\n", nclass[NCL_EXTERNAL]);
+	if (ncp->nc_skew >= 0) {
+		(void) fprintf(out, "    %7lu in-flight (one side, transient "
+		    "state)\n", nclass[NCL_INFLIGHT]);
+	}
+	(void) fprintf(out, "    %7lu asymmetric (abandoned by one side)\n",
+	    nclass[NCL_ASYMMETRIC]);
+	if (nyoung != 0) {
+		(void) fprintf(out, "    %7d of these not shown (seen for less "
+		    "than %lu seconds)\n", nyoung, ncp->nc_minage);
+	}
+	if (ncp->nc_tcpinfo.nct_nused != 0) {
+		(void) fprintf(out, "    %7lu of these stalled (retransmitting)"
+		    "\n", nstalled);
+	}
+
+	if (ncp->nc_nviews > 0)
+		nc_view_report(ncp);
+
+	if (ncp->nc_gapk > 0)
+		nc_gap_report(ncp);
+}
+
+/*
+ * Answer queries read from stdin ("-q").  The classified connections are
+ * copied into a column store once, and each query is then answered by
+ * scanning the columns it refers to.
+ */
+static int
+nc_query_loop(netcmp_t *ncp)
+{
+	ncresult_t res;
+	ncfrozen_t frozen;
+	ncquery_t query;
+	uint32_t *sel;
+	uint8_t *mask;
+	char *line = NULL;
+	size_t linesz = 0;
+	size_t bytes;
+	ncbool_t interactive;
+
+	if (nc_result_build(ncp, &res) != 0)
+		return (-1);
+
+	if (nc_frozen_build(&res, &frozen) != 0) {
+		nc_result_free(&res);
+		return (-1);
+	}
+
+	if (ncp->nc_debug) {
+		bytes = frozen.ncfz_keysz + frozen.ncfz_n * (sizeof (uint8_t) +
+		    2 * sizeof (uint16_t)) + (frozen.ncfz_n / NC_FROZEN_BLOCK +
+		    1) * sizeof (ncfrozensample_t);
+		(void) fprintf(stderr, "frozen index: %lu connections in %lu "
+		    "KB (%.1f bytes per connection, %.1f for keys)\n",
+		    (unsigned long)frozen.ncfz_n, (unsigned long)bytes / 1024,
+		    frozen.ncfz_n == 0 ? 0 : (double)bytes / frozen.ncfz_n,
+		    frozen.ncfz_n == 0 ? 0 :
+		    (double)frozen.ncfz_keysz / frozen.ncfz_n);
+	}
+
+	if ((sel = calloc(res.ncrs_n + 1, sizeof (*sel))) == NULL ||
+	    (mask = calloc(res.ncrs_n + 1, 1)) == NULL) {
+		warn("calloc");
+		free(sel);
+		nc_frozen_free(&frozen);
+		nc_result_free(&res);
+		return (-1);
+	}
+
+	interactive = isatty(STDIN_FILENO) ? NB_TRUE : NB_FALSE;
+	for (;;) {
+		if (interactive)
+			(void) fprintf(stderr, "netcmp> ");
+		if (getline(&line, &linesz, stdin) < 0)
+			break;
+
+		if (strncmp(line, "lookup ", 7) == 0 ||
+		    strncmp(line, "pair ", 5) == 0) {
+			(void) nc_frozen_query(ncp, &frozen, line);
+			(void) fflush(ncp->nc_out);
+			continue;
+		}
+
+		if (nc_query_parse(ncp, line, &query) != 0)
+			continue;
+
+		nc_query_run(ncp, &res, &query, mask, sel);
+		(void) fflush(ncp->nc_out);
+	}
+
+	free(line);
+	free(mask);
+	free(sel);
+	nc_frozen_free(&frozen);
+	nc_result_free(&res);
+	return (0);
+}
+
+/*
+ * Run a round every ncp->nc_interval seconds ("-i") until we're told to stop,
+ * keeping the history of their summaries (see nchist_t).  Rounds don't
+ * overlap: if one takes longer than the interval, the next starts as soon as
+ * it finishes.
+ */
+static int
+nc_daemon(netcmp_t *ncp, int nfiles, char *files[])
+{
+	nchist_t *hist;
+	struct pollfd pfds[2];
+	struct sigaction sa;
+	pid_t pid = -1;
+	int ctlfd = -1;
+	int roundfd = -1;
+	int rv = 0;
+	int i, n, timeout;
+	unsigned int v;
+	double now, next;
+
+	if ((hist = calloc(1, sizeof (*hist))) == NULL) {
+		warn("calloc");
+		return (-1);
+	}
+
+	for (v = 0; v < ncp->nc_nviews && v < NC_HIST_NVIEWS; v++) {
+		(void) strlcpy(hist->nch_views[v], ncp->nc_views[v].ncv_name,
+		    sizeof (hist->nch_views[v]));
+	}
+	hist->nch_nviews = v;
+
+	if ((ncp->nc_histfile != NULL && nc_hist_load(ncp, hist) != 0) ||
+	    (ncp->nc_ctlpath != NULL && (ctlfd = nc_ctl_open(ncp)) == -1)) {
+		free(hist);
+		return (-1);
+	}
+
+	bzero(&sa, sizeof (sa));
+	(void) sigemptyset(&sa.sa_mask);
+	sa.sa_handler = nc_stop;
+	(void) sigaction(SIGINT, &sa, NULL);
+	(void) sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	(void) sigaction(SIGPIPE, &sa, NULL);
+
+	next = nc_time();
+	while (!nc_stopping) {
+		now = nc_time();
+		if (roundfd == -1 && now >= next) {
+			roundfd = nc_round_start(ncp, nfiles, files, ctlfd,
+			    &pid);
+			if (roundfd == -1) {
+				rv = -1;
+				break;
+			}
+
+			next += ncp->nc_interval;
+			if (next <= now)
+				next = now + ncp->nc_interval;
+		}
+
+		n = 0;
+		if (ctlfd != -1) {
+			pfds[n].fd = ctlfd;
+			pfds[n++].events = POLLIN;
+		}
+		if (roundfd != -1) {
+			pfds[n].fd = roundfd;
+			pfds[n++].events = POLLIN;
+		}
+
+		timeout = roundfd != -1 ? -1 : (int)((next - now) * 1000) + 1;
+		if (poll(pfds, n, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			warn("poll");
+			rv = -1;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (pfds[i].revents == 0)
+				continue;
+
+			if (pfds[i].fd == ctlfd) {
+				nc_ctl_serve(hist, ctlfd);
+			} else {
+				nc_round_finish(ncp, hist, roundfd, pid);
+				roundfd = -1;
+			}
+		}
+	}
+
+	if (roundfd != -1) {
+		(void) kill(pid, SIGTERM);
+		(void) close(roundfd);
+		(void) waitpid(pid, NULL, 0);
+	}
+
+	if (ctlfd != -1) {
+		(void) close(ctlfd);
+		(void) unlink(ncp->nc_ctlpath);
+	}
+
+	free(hist);
+	return (rv);
+}
+
+/*
+ * Signal handler for SIGINT and SIGTERM in continuous mode ("-i").
+ */
+static void
+nc_stop(int sig)
+{
+	nc_stopping = sig;
+}
+
+/*
+ * Start a round in a child process.  The child writes the summary of the round
+ * into a pipe, and we return the read side of it.
+ */
+static int
+nc_round_start(netcmp_t *ncp, int nfiles, char *files[], int ctlfd,
+    pid_t *pidp)
+{
+	ncround_t round;
+	int fds[2];
+	int rv;
+
+	if (pipe(fds) != 0) {
+		warn("pipe");
+		return (-1);
+	}
+
+	if ((*pidp = fork()) == -1) {
+		warn("fork");
+		(void) close(fds[0]);
+		(void) close(fds[1]);
+		return (-1);
+	}
+
+	if (*pidp != 0) {
+		(void) close(fds[1]);
+		return (fds[0]);
+	}
+
+	(void) close(fds[0]);
+	if (ctlfd != -1)
+		(void) close(ctlfd);
+	(void) signal(SIGINT, SIG_DFL);
+	(void) signal(SIGTERM, SIG_DFL);
+	(void) signal(SIGPIPE, SIG_DFL);
+
+	bzero(&round, sizeof (round));
+	nc_hashkey_init();
+	ncp->nc_now = time(NULL);
+	round.ncrd_start = ncp->nc_now;
+	round.ncrd_nrounds = 1;
+	rv = nc_output_open(ncp) == 0 &&
+	    nc_run(ncp, nfiles, files, &round) == 0 ? 0 : -1;
+	round.ncrd_end = time(NULL);
+	if (rv == 0 && write(fds[1], &round, sizeof (round)) != sizeof (round))
+		rv = -1;
+
+	exit(rv == 0 ? 0 : EXIT_FAILURE);
+}
+
+/*
+ * Collect the summary of the round that's running in process "pid" from the
+ * pipe "fd", and add it to the history.  If the round failed, the child has
+ * already said why, and we just carry on with the next one.
+ */
+static void
+nc_round_finish(netcmp_t *ncp, nchist_t *hist, int fd, pid_t pid)
+{
+	ncround_t round;
+	ssize_t n;
+	int status;
+
+	n = read(fd, &round, sizeof (round));
+	(void) close(fd);
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0 || n != sizeof (round)) {
+		warnx("round failed");
+		return;
+	}
+
+	nc_hist_add(hist, &round);
+	if (ncp->nc_histfile != NULL)
+		(void) nc_hist_save(ncp, hist);
+
+	if (ncp->nc_debug) {
+		(void) fprintf(stderr, "round finished: %lu asymmetric, "
+		    "ingest %.3fs, classify %.3fs\n",
+		    (unsigned long)round.ncrd_nclass[NCL_ASYMMETRIC],
+		    round.ncrd_ingestms / 1000.0,
+		    round.ncrd_classifyms / 1000.0);
+	}
+}
+
+/*
+ * Summarize the classified connections for the history ("-i").
+ */
+static void
+nc_round_summary(netcmp_t *ncp, ncround_t *round)
+{
+	ncconn_t *ncc;
+	ncpair_t *pair = NULL;
+	uint64_t nasym = 0;
+	unsigned int v;
+	int c;
+
+	round->ncrd_nsources = ncp->nc_nlabels;
+	round->ncrd_nrows = ncp->nc_nrows;
+	round->ncrd_nlocalhost = ncp->nc_nlocalhost;
+	for (c = 0; c < NCL_NCLASSES; c++)
+		round->ncrd_nclass[c] = ncp->nc_nclass[c];
+	round->ncrd_maxasym = ncp->nc_nclass[NCL_ASYMMETRIC];
+	for (v = 0; v < ncp->nc_nviews && v < NC_HIST_NVIEWS; v++) {
+		round->ncrd_vasym[v] =
+		    ncp->nc_views[v].ncv_nclass[NCL_ASYMMETRIC];
+	}
+
+	/* Connections are visited by pair, so each pair's are counted. */
+	for (ncc = nc_conn_first(ncp); ; ncc = nc_conn_next(ncp, ncc)) {
+		if (ncc == NULL || ncc->ncc_pair != pair) {
+			if (nasym != 0)
+				nc_round_addpair(round, pair, nasym);
+			if (ncc == NULL)
+				break;
+			pair = ncc->ncc_pair;
+			nasym = 0;
+		}
+
+		if (ncc->ncc_class == NCL_ASYMMETRIC)
+			nasym++;
+	}
+}
+
+/*
+ * Record "pair" among the round's top pairs if it's one of the NC_HIST_NPAIRS
+ * with the most asymmetric connections so far.  The top pairs are kept sorted,
+ * most asymmetric connections first.
+ */
+static void
+nc_round_addpair(ncround_t *round, const ncpair_t *pair, uint64_t nasym)
+{
+	ncroundpair_t *pairs = round->ncrd_pairs;
+	int i;
+
+	for (i = NC_HIST_NPAIRS; i > 0 && pairs[i - 1].ncrp_nasym < nasym;
+	    i--) {
+		if (i < NC_HIST_NPAIRS)
+			pairs[i] = pairs[i - 1];
+	}
+
+	if (i < NC_HIST_NPAIRS) {
+		pairs[i].ncrp_ip1 = pair->ncpr_ip1;
+		pairs[i].ncrp_ip2 = pair->ncpr_ip2;
+		pairs[i].ncrp_nasym = nasym;
+	}
+}
+
+/*
+ * Merge the history entry "r", which follows the entries already merged into
+ * "acc", into "acc".
+ */
+static void
+nc_round_merge(ncround_t *acc, const ncround_t *r)
+{
+	unsigned int i;
+
+	if (acc->ncrd_nrounds == 0) {
+		*acc = *r;
+		return;
+	}
+
+	acc->ncrd_end = r->ncrd_end;
+	acc->ncrd_nrounds += r->ncrd_nrounds;
+	acc->ncrd_nsources = r->ncrd_nsources;
+	acc->ncrd_nrows += r->ncrd_nrows;
+	acc->ncrd_nlocalhost += r->ncrd_nlocalhost;
+	for (i = 0; i < NCL_NCLASSES; i++)
+		acc->ncrd_nclass[i] += r->ncrd_nclass[i];
+	acc->ncrd_ingestms += r->ncrd_ingestms;
+	acc->ncrd_classifyms += r->ncrd_classifyms;
+	for (i = 0; i < NC_HIST_NVIEWS; i++)
+		acc->ncrd_vasym[i] += r->ncrd_vasym[i];
+
+	if (r->ncrd_maxasym >= acc->ncrd_maxasym) {
+		acc->ncrd_maxasym = r->ncrd_maxasym;
+		bcopy(r->ncrd_pairs, acc->ncrd_pairs, sizeof (acc->ncrd_pairs));
+	}
+}
+
+/*
+ * Add the summary of a round to the history, merging it into the coarser
+ * tiers as described above nchist_t.
+ */
+static void
+nc_hist_add(nchist_t *hist, const ncround_t *round)
+{
+	ncround_t merged;
+	const ncround_t *r = round;
+	unsigned int t, slot;
+
+	for (t = 0; t < NC_HIST_NTIERS; t++) {
+		slot = (hist->nch_first[t] + hist->nch_count[t]) % NC_HIST_SIZE;
+		if (hist->nch_count[t] == NC_HIST_SIZE)
+			hist->nch_first[t] = (slot + 1) % NC_HIST_SIZE;
+		else
+			hist->nch_count[t]++;
+		hist->nch_ring[t][slot] = *r;
+
+		if (t == NC_HIST_NTIERS - 1)
+			break;
+
+		nc_round_merge(&hist->nch_pending[t], r);
+		if (++hist->nch_npending[t] < NC_HIST_MERGE)
+			break;
+
+		merged = hist->nch_pending[t];
+		bzero(&hist->nch_pending[t], sizeof (hist->nch_pending[t]));
+		hist->nch_npending[t] = 0;
+		r = &merged;
+	}
+}
+
+/*
+ * Load the history file ("-H"), if it exists.
+ */
+static int
+nc_hist_load(netcmp_t *ncp, nchist_t *hist)
+{
+	FILE *fstream;
+	nchisthdr_t hdr;
+	char magic[NC_HIST_MAGICSZ];
+	int map[NC_HIST_NVIEWS];
+	unsigned int t, i, v, w;
+
+	if ((fstream = fopen(ncp->nc_histfile, "r")) == NULL) {
+		if (errno == ENOENT)
+			return (0);
+		warn("fopen \"%s\"", ncp->nc_histfile);
+		return (-1);
+	}
+
+	if (fread(magic, sizeof (magic), 1, fstream) != 1 ||
+	    bcmp(magic, NC_HIST_MAGIC, sizeof (magic)) != 0 ||
+	    fread(&hdr, sizeof (hdr), 1, fstream) != 1) {
+		warnx("%s: not a history file", ncp->nc_histfile);
+		(void) fclose(fstream);
+		return (-1);
+	}
+
+	if (hdr.nchh_roundsz != sizeof (ncround_t) ||
+	    hdr.nchh_ntiers != NC_HIST_NTIERS ||
+	    hdr.nchh_size != NC_HIST_SIZE ||
+	    hdr.nchh_merge != NC_HIST_MERGE ||
+	    hdr.nchh_nviews > NC_HIST_NVIEWS) {
+		warnx("%s: unsupported history file", ncp->nc_histfile);
+		(void) fclose(fstream);
+		return (-1);
+	}
+
+	for (t = 0; t < NC_HIST_NTIERS; t++) {
+		if (hdr.nchh_count[t] > NC_HIST_SIZE ||
+		    hdr.nchh_npending[t] >= NC_HIST_MERGE) {
+			warnx("%s: corrupt history file", ncp->nc_histfile);
+			(void) fclose(fstream);
+			return (-1);
+		}
+	}
+
+	/* map[v] is the index in the file of view v, or -1 if it's new. */
+	for (v = 0; v < hist->nch_nviews; v++) {
+		map[v] = -1;
+		for (w = 0; w < hdr.nchh_nviews; w++) {
+			if (strncmp(hist->nch_views[v], hdr.nchh_views[w],
+			    NC_HIST_NAMELEN) == 0) {
+				map[v] = w;
+				break;
+			}
+		}
+	}
+
+	for (t = 0; t < NC_HIST_NTIERS; t++) {
+		hist->nch_first[t] = 0;
+		hist->nch_count[t] = hdr.nchh_count[t];
+		for (i = 0; i < hist->nch_count[t]; i++) {
+			if (nc_hist_read(fstream, &hist->nch_ring[t][i],
+			    map, hist->nch_nviews) != 0) {
+				break;
+			}
+		}
+		if (i < hist->nch_count[t])
+			break;
+	}
+
+	for (i = 0; t == NC_HIST_NTIERS && i < NC_HIST_NTIERS; i++) {
+		hist->nch_npending[i] = hdr.nchh_npending[i];
+		if (nc_hist_read(fstream, &hist->nch_pending[i], map,
+		    hist->nch_nviews) != 0) {
+			break;
+		}
+	}
+
+	(void) fclose(fstream);
+	if (t < NC_HIST_NTIERS || i < NC_HIST_NTIERS) {
+		warnx("%s: truncated history file", ncp->nc_histfile);
+		return (-1);
+	}
+
+	if (ncp->nc_debug) {
+		(void) fprintf(stderr, "loaded history \"%s\" (%u rounds)\n",
+		    ncp->nc_histfile, hist->nch_count[0]);
+	}
+
+	return (0);
+}
+
+/*
+ * Read one entry from the history file, moving the counts for each view to
+ * where that view is now (see nc_hist_load()).
+ */
+static int
+nc_hist_read(FILE *fstream, ncround_t *r, const int *map, unsigned int nviews)
+{
+	uint64_t vasym[NC_HIST_NVIEWS];
+	unsigned int v;
+
+	if (fread(r, sizeof (*r), 1, fstream) != 1)
+		return (-1);
+
+	bcopy(r->ncrd_vasym, vasym, sizeof (vasym));
+	bzero(r->ncrd_vasym, sizeof (r->ncrd_vasym));
+	for (v = 0; v < nviews; v++) {
+		if (map[v] != -1)
+			r->ncrd_vasym[v] = vasym[map[v]];
+	}
+
+	return (0);
+}
+
+/*
+ * Save the history to the history file ("-H").  Like the age file, it's
+ * written to a temporary file and renamed into place.
+ */
+static int
+nc_hist_save(netcmp_t *ncp, const nchist_t *hist)
+{
+	FILE *fstream;
+	nchisthdr_t hdr;
+	char tmpfile[PATH_MAX];
+	unsigned int t, i;
+	int rv = 0;
+
+	bzero(&hdr, sizeof (hdr));
+	hdr.nchh_roundsz = sizeof (ncround_t);
+	hdr.nchh_ntiers = NC_HIST_NTIERS;
+	hdr.nchh_size = NC_HIST_SIZE;
+	hdr.nchh_merge = NC_HIST_MERGE;
+	for (t = 0; t < NC_HIST_NTIERS; t++) {
+		hdr.nchh_count[t] = hist->nch_count[t];
+		hdr.nchh_npending[t] = hist->nch_npending[t];
+	}
+	hdr.nchh_nviews = hist->nch_nviews;
+	bcopy(hist->nch_views, hdr.nchh_views, sizeof (hdr.nchh_views));
+
+	(void) snprintf(tmpfile, sizeof (tmpfile), "%s.tmp", ncp->nc_histfile);
+	if ((fstream = fopen(tmpfile, "w")) == NULL) {
+		warn("fopen \"%s\"", tmpfile);
+		return (-1);
+	}
+
+	if (fwrite(NC_HIST_MAGIC, NC_HIST_MAGICSZ, 1, fstream) != 1 ||
+	    fwrite(&hdr, sizeof (hdr), 1, fstream) != 1) {
+		rv = -1;
+	}
+
+	for (t = 0; rv == 0 && t < NC_HIST_NTIERS; t++) {
+		for (i = 0; rv == 0 && i < hist->nch_count[t]; i++) {
+			if (fwrite(&hist->nch_ring[t][(hist->nch_first[t] +
+			    i) % NC_HIST_SIZE], sizeof (ncround_t), 1,
+			    fstream) != 1) {
+				rv = -1;
+			}
+		}
+	}
+
+	if (rv == 0 && fwrite(hist->nch_pending, sizeof (hist->nch_pending),
+	    1, fstream) != 1) {
+		rv = -1;
+	}
+
+	if (fclose(fstream) != 0 || rv != 0) {
+		warn("write \"%s\"", tmpfile);
+		return (-1);
+	}
+
+	if (rename(tmpfile, ncp->nc_histfile) != 0) {
+		warn("rename \"%s\"", tmpfile);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Print the history entries for rounds that finished at or after "since",
+ * oldest first.  Older periods come from the coarser tiers, and each tier
+ * stops where the next finer one begins.
+ */
+static void
+nc_hist_print(FILE *out, const nchist_t *hist, time_t since)
+{
+	const ncround_t *r;
+	int64_t until;
+	unsigned int i;
+	int t;
+
+	for (t = NC_HIST_NTIERS - 1; t >= 0; t--) {
+		until = INT64_MAX;
+		if (t > 0 && hist->nch_count[t - 1] > 0) {
+			until = hist->nch_ring[t - 1][hist->nch_first[t - 1]].
+			    ncrd_start;
+		}
+
+		for (i = 0; i < hist->nch_count[t]; i++) {
+			r = &hist->nch_ring[t][(hist->nch_first[t] + i) %
+			    NC_HIST_SIZE];
+			if (r->ncrd_end > until)
+				break;
+			if (r->ncrd_end >= since)
+				nc_hist_entry(out, hist, r);
+		}
+	}
+}
+
+/*
+ * Print one history entry on one line: the time that its last round finished,
+ * the number of rounds, and then the average over those rounds of each count
+ * and time.
+ */
+static void
+nc_hist_entry(FILE *out, const nchist_t *hist, const ncround_t *r)
+{
+	uint64_t n = r->ncrd_nrounds;
+	const ncroundpair_t *top = &r->ncrd_pairs[0];
+	char buf1[IPV4_STRBUFSZ], buf2[IPV4_STRBUFSZ];
+	unsigned int v;
+	int c;
+
+	(void) fprintf(out, "%lld %u", (long long)r->ncrd_end,
+	    r->ncrd_nrounds);
+	for (c = 0; c < NCL_NCLASSES; c++) {
+		(void) fprintf(out, " %s=%lu", nc_classes[c],
+		    (unsigned long)(r->ncrd_nclass[c] / n));
+	}
+	(void) fprintf(out, " maxasymmetric=%lu rows=%lu ingest=%.3fs "
+	    "classify=%.3fs", (unsigned long)r->ncrd_maxasym,
+	    (unsigned long)(r->ncrd_nrows / n),
+	    r->ncrd_ingestms / 1000.0 / n, r->ncrd_classifyms / 1000.0 / n);
+	for (v = 0; v < hist->nch_nviews; v++) {
+		(void) fprintf(out, " %s.asymmetric=%lu", hist->nch_views[v],
+		    (unsigned long)(r->ncrd_vasym[v] / n));
+	}
+	if (top->ncrp_nasym != 0) {
+		nc_ip_tostr(buf1, sizeof (buf1), top->ncrp_ip1);
+		nc_ip_tostr(buf2, sizeof (buf2), top->ncrp_ip2);
+		(void) fprintf(out, " top=%s,%s:%lu", buf1, buf2,
+		    (unsigned long)top->ncrp_nasym);
+	}
+	(void) fputc('\n', out);
+}
+
+/*
+ * Print the details of the most recent round.
+ */
+static void
+nc_hist_latest(FILE *out, const nchist_t *hist)
+{
+	const ncround_t *r;
+	char buf1[IPV4_STRBUFSZ], buf2[IPV4_STRBUFSZ];
+	unsigned int i;
+	int c;
+
+	if (hist->nch_count[0] == 0) {
+		(void) fprintf(out, "no rounds have finished\n");
+		return;
+	}
+
+	r = &hist->nch_ring[0][(hist->nch_first[0] + hist->nch_count[0] - 1) %
+	    NC_HIST_SIZE];
+	(void) fprintf(out, "round started %lld, finished %lld (ingest "
+	    "%.3fs, classify %.3fs):\n", (long long)r->ncrd_start,
+	    (long long)r->ncrd_end, r->ncrd_ingestms / 1000.0,
+	    r->ncrd_classifyms / 1000.0);
+	(void) fprintf(out, "    %7u sources\n", r->ncrd_nsources);
+	(void) fprintf(out, "    %7lu rows\n", (unsigned long)r->ncrd_nrows);
+	(void) fprintf(out, "    %7lu localhost\n",
+	    (unsigned long)r->ncrd_nlocalhost);
+	for (c = 0; c < NCL_NCLASSES; c++) {
+		(void) fprintf(out, "    %7lu %s\n",
+		    (unsigned long)r->ncrd_nclass[c], nc_classes[c]);
+	}
+	for (i = 0; i < hist->nch_nviews; i++) {
+		(void) fprintf(out, "    %7lu asymmetric in view %s\n",
+		    (unsigned long)r->ncrd_vasym[i], hist->nch_views[i]);
+	}
+
+	for (i = 0; i < NC_HIST_NPAIRS && r->ncrd_pairs[i].ncrp_nasym != 0;
+	    i++) {
+		if (i == 0) {
+			(void) fprintf(out, "pairs with the most asymmetric "
+			    "connections:\n");
+		}
+		nc_ip_tostr(buf1, sizeof (buf1), r->ncrd_pairs[i].ncrp_ip1);
+		nc_ip_tostr(buf2, sizeof (buf2), r->ncrd_pairs[i].ncrp_ip2);
+		(void) fprintf(out, "    %7lu %s %s\n",
+		    (unsigned long)r->ncrd_pairs[i].ncrp_nasym, buf1, buf2);
+	}
+}
+
+/*
+ * Create the control socket ("-C"), replacing any socket left behind by an
+ * earlier run that's no longer listening on it.
+ */
+static int
+nc_ctl_open(netcmp_t *ncp)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	bzero(&addr, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	if (strlcpy(addr.sun_path, ncp->nc_ctlpath, sizeof (addr.sun_path)) >=
+	    sizeof (addr.sun_path)) {
+		warnx("control socket path too long: \"%s\"", ncp->nc_ctlpath);
+		return (-1);
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		warn("socket");
+		return (-1);
+	}
+
+	if (lstat(ncp->nc_ctlpath, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			warnx("\"%s\" exists and is not a socket",
+			    ncp->nc_ctlpath);
+			(void) close(fd);
+			return (-1);
+		}
+
+		if (connect(fd, (struct sockaddr *)&addr, sizeof (addr)) == 0) {
+			warnx("\"%s\" is in use by another process",
+			    ncp->nc_ctlpath);
+			(void) close(fd);
+			return (-1);
+		}
+
+		(void) close(fd);
+		if (unlink(ncp->nc_ctlpath) != 0 ||
+		    (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+			warn("replace \"%s\"", ncp->nc_ctlpath);
+			return (-1);
+		}
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof (addr)) != 0 ||
+	    listen(fd, 8) != 0) {
+		warn("bind \"%s\"", ncp->nc_ctlpath);
+		(void) close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+/*
+ * Accept a connection on the control socket and answer the one command it
+ * sends, which is one of:
+ *
+ *     history [SECONDS]	summary of each round (or group of rounds)
+ *				finished in the last SECONDS (default: all)
+ *     latest			details of the most recent round
+ */
+static void
+nc_ctl_serve(const nchist_t *hist, int ctlfd)
+{
+	struct timeval tv;
+	FILE *out;
+	char cmd[NC_HIST_CMDLEN];
+	char *arg, *endp;
+	unsigned long secs = 0;
+	size_t len = 0;
+	ssize_t n;
+	int fd;
+
+	if ((fd = accept(ctlfd, NULL, NULL)) == -1) {
+		if (errno != EINTR && errno != ECONNABORTED)
+			warn("accept");
+		return;
+	}
+
+	/* Don't let a slow client hold up the next round for long. */
+	tv.tv_sec = NC_CTL_TIMEOUT;
+	tv.tv_usec = 0;
+	(void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+	(void) setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+
+	while (len < sizeof (cmd) - 1 &&
+	    memchr(cmd, '\n', len) == NULL &&
+	    (n = read(fd, cmd + len, sizeof (cmd) - 1 - len)) > 0) {
+		len += n;
+	}
+	cmd[len] = '\0';
+	cmd[strcspn(cmd, "\r\n")] = '\0';
+
+	if ((out = fdopen(fd, "w")) == NULL) {
+		warn("fdopen");
+		(void) close(fd);
+		return;
+	}
+
+	arg = cmd + strcspn(cmd, " \t");
+	if (*arg != '\0')
+		*arg++ = '\0';
+
+	if (strcmp(cmd, "latest") == 0 && *arg == '\0') {
+		nc_hist_latest(out, hist);
+	} else if (strcmp(cmd, "history") == 0) {
+		errno = 0;
+		if (*arg != '\0')
+			secs = strtoul(arg, &endp, 10);
+		if (errno != 0 || (*arg != '\0' && *endp != '\0')) {
+			(void) fprintf(out, "bad number of seconds: \"%s\"\n",
+			    arg);
+		} else {
+			nc_hist_print(out, hist,
+			    secs == 0 ? 0 : time(NULL) - (time_t)secs);
+		}
+	} else {
+		(void) fprintf(out, "unknown command: \"%s\" (expected "
+		    "\"history [SECONDS]\" or \"latest\")\n", cmd);
+	}
+
+	(void) fclose(out);
+}
+
+/*
+ * Publish the classified connections to ncp->nc_pubfile (see ncpub.h).  The
+ * new generation is built in a temporary file and renamed into place so that
+ * consumers never see a partially-written file.
+ */
+static int
+nc_publish(netcmp_t *ncp)
+{
+	ncresult_t res;
+	ncpub_hdr_t hdr, *hdrp;
+	ncpub_source_t *sources;
+	nclabel_t *label;
+	char tmpfile[PATH_MAX];
+	char *base;
+	uint64_t off;
+	size_t n;
+	unsigned int i;
+	int fd;
+
+	assert(NS_NSTATES <= NCPUB_MAXSTATES);
+	assert(NCL_NCLASSES <= NCPUB_MAXCLASSES);
+	assert(NC_NOLABEL == NCPUB_NOSOURCE);
+
+	/*
+	 * Continue the generation count from the file we're replacing, if any.
+	 */
+	bzero(&hdr, sizeof (hdr));
+	if ((fd = open(ncp->nc_pubfile, O_RDONLY)) >= 0) {
+		if (read(fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+		    memcmp(hdr.ncph_magic, NCPUB_MAGIC,
+		    sizeof (hdr.ncph_magic)) != 0) {
+			hdr.ncph_generation = 0;
+		}
+		(void) close(fd);
+	}
+
+	if (nc_result_build(ncp, &res) != 0)
+		return (-1);
+
+	n = res.ncrs_n;
+	bcopy(NCPUB_MAGIC, hdr.ncph_magic, sizeof (hdr.ncph_magic));
+	hdr.ncph_version = NCPUB_VERSION;
+	hdr.ncph_hdrsize = sizeof (hdr);
+	hdr.ncph_generation++;
+	hdr.ncph_published = ncp->nc_now;
+	hdr.ncph_nconns = n;
+	hdr.ncph_nsources = ncp->nc_nlabels;
+	hdr.ncph_nstates = NS_NSTATES;
+	hdr.ncph_nclasses = NCL_NCLASSES;
+	hdr.ncph_pad = 0;
+	hdr.ncph_nlocalhost = ncp->nc_nlocalhost;
+	bzero(hdr.ncph_nclass, sizeof (hdr.ncph_nclass));
+	bzero(hdr.ncph_states, sizeof (hdr.ncph_states));
+	bzero(hdr.ncph_classes, sizeof (hdr.ncph_classes));
+	for (i = 0; i < NS_NSTATES; i++) {
+		(void) strlcpy(hdr.ncph_states[i], nc_states[i],
+		    sizeof (hdr.ncph_states[i]));
+	}
+	for (i = 0; i < NCL_NCLASSES; i++) {
+		hdr.ncph_nclass[i] = ncp->nc_nclass[i];
+		(void) strlcpy(hdr.ncph_classes[i], nc_classes[i],
+		    sizeof (hdr.ncph_classes[i]));
+	}
+
+	off = NC_ROUNDUP8(sizeof (hdr));
+	hdr.ncph_off_ip1 = off;
+	off = NC_ROUNDUP8(off + n * sizeof (*res.ncrs_ip1));
+	hdr.ncph_off_ip2 = off;
+	off = NC_ROUNDUP8(off + n * sizeof (*res.ncrs_ip2));
+	hdr.ncph_off_port1 = off;
+	off = NC_ROUNDUP8(off + n * sizeof (*res.ncrs_port1));
+	hdr.ncph_off_port2 = off;
+	off = NC_ROUNDUP8(off + n * sizeof (*res.ncrs_port2));
+	hdr.ncph_off_state = off;
+	off = NC_ROUNDUP8(off + n * sizeof (*res.ncrs_state));
+	hdr.ncph_off_class = off;
+	off = NC_ROUNDUP8(off + n * sizeof (*res.ncrs_class));
+	hdr.ncph_off_source1 = off;
+	off = NC_ROUNDUP8(off + n * sizeof (*res.ncrs_label1));
+	hdr.ncph_off_source2 = off;
+	off = NC_ROUNDUP8(off + n * sizeof (*res.ncrs_label2));
+	hdr.ncph_off_sources = off;
+	off += ncp->nc_nlabels * sizeof (ncpub_source_t);
+	hdr.ncph_size = off;
+
+	(void) snprintf(tmpfile, sizeof (tmpfile), "%s.tmp", ncp->nc_pubfile);
+	if ((fd = open(tmpfile, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		warn("open \"%s\"", tmpfile);
+		nc_result_free(&res);
+		return (-1);
+	}
+
+	if (ftruncate(fd, hdr.ncph_size) != 0) {
+		warn("ftruncate \"%s\"", tmpfile);
+		(void) close(fd);
+		nc_result_free(&res);
+		return (-1);
+	}
+
+	base = mmap(NULL, hdr.ncph_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    fd, 0);
+	(void) close(fd);
+	if (base == MAP_FAILED) {
+		warn("mmap \"%s\"", tmpfile);
+		nc_result_free(&res);
+		return (-1);
+	}
+
+	bcopy(res.ncrs_ip1, base + hdr.ncph_off_ip1,
+	    n * sizeof (*res.ncrs_ip1));
+	bcopy(res.ncrs_ip2, base + hdr.ncph_off_ip2,
+	    n * sizeof (*res.ncrs_ip2));
+	bcopy(res.ncrs_port1, base + hdr.ncph_off_port1,
+	    n * sizeof (*res.ncrs_port1));
+	bcopy(res.ncrs_port2, base + hdr.ncph_off_port2,
+	    n * sizeof (*res.ncrs_port2));
+	bcopy(res.ncrs_state, base + hdr.ncph_off_state,
+	    n * sizeof (*res.ncrs_state));
+	bcopy(res.ncrs_class, base + hdr.ncph_off_class,
+	    n * sizeof (*res.ncrs_class));
+	bcopy(res.ncrs_label1, base + hdr.ncph_off_source1,
+	    n * sizeof (*res.ncrs_label1));
+	bcopy(res.ncrs_label2, base + hdr.ncph_off_source2,
+	    n * sizeof (*res.ncrs_label2));
+	nc_result_free(&res);
+
+	/* LINTED E_BAD_PTR_CAST_ALIGN */
+	sources = (ncpub_source_t *)(base + hdr.ncph_off_sources);
+	for (i = 0; i < ncp->nc_nlabels; i++) {
+		label = ncp->nc_labels[i];
+		(void) strlcpy(sources[i].ncps_name, label->ncl_name,
+		    sizeof (sources[i].ncps_name));
+		sources[i].ncps_captured = label->ncl_captured;
+	}
+
+	/* LINTED E_BAD_PTR_CAST_ALIGN */
+	hdrp = (ncpub_hdr_t *)base;
+	*hdrp = hdr;
+
+	if (munmap(base, hdr.ncph_size) != 0) {
+		warn("munmap \"%s\"", tmpfile);
+		return (-1);
+	}
+
+	if (rename(tmpfile, ncp->nc_pubfile) != 0) {
+		warn("rename \"%s\"", tmpfile);
+		return (-1);
+	}
+
+	if (ncp->nc_debug) {
+		(void) fprintf(stderr, "published generation %llu to \"%s\" "
+		    "(%llu bytes)\n", (unsigned long long)hdr.ncph_generation,
+		    ncp->nc_pubfile, (unsigned long long)hdr.ncph_size);
+	}
+
+	return (0);
+}
+
+/*
+ * Classify a single connection.  See ncclass_t.
+ */
+static ncclass_t
+nc_conn_classify(netcmp_t *ncp, ncconn_t *ncc)
+{
+	ncsource_t source, *ncs1, *ncs2, *peer;
+	time_t skew;
+
+	if (ncc->ncc_state == NS_TIME_WAIT)
+		return (NCL_TIMEWAIT);
+
+	if (ncc->ncc_nsources > 2)
+		return (NCL_MULTI);
+
+	if (ncc->ncc_nsources == 2)
+		return (NCL_SYMMETRIC);
+
+	assert(ncc->ncc_nsources == 1);
+	bzero(&source, sizeof (source));
+	source.ncs_ip = NCC_IP1(ncc);
+	ncs1 = avl_find(&ncp->nc_sources, &source, NULL);
+	ncs2 = NULL;
+	if (ncs1 != NULL) {
+		source.ncs_ip = NCC_IP2(ncc);
+		ncs2 = avl_find(&ncp->nc_sources, &source, NULL);
+	}
+
+	if (ncs1 == NULL || ncs2 == NULL)
+		return (NCL_EXTERNAL);
+
+	/*
+	 * If the connection is in a transient state on the only side that has
+	 * it, and the other side's snapshot was taken close enough in time,
+	 * then the connection was most likely being opened or closed between
+	 * the two snapshots.
+	 */
+	if (ncp->nc_skew >= 0 && nc_state_transient(ncc->ncc_state)) {
+		peer = NCC_SOURCE(ncc, 0) == ncs1 ? ncs2 : ncs1;
+		skew = NCC_SOURCE(ncc, 0)->ncs_label->ncl_captured -
+		    peer->ncs_label->ncl_captured;
+		if (skew < 0)
+			skew = -skew;
+		if (skew <= ncp->nc_skew)
+			return (NCL_INFLIGHT);
+	}
+
+	return (NCL_ASYMMETRIC);
+}
+
+/*
+ * Record a view given with "-V NAME=PATTERN[,PATTERN...]".
+ */
+static int
+nc_view_add(netcmp_t *ncp, char *arg)
+{
+	ncview_t *view;
+	char *eq;
+
+	if ((eq = strchr(arg, '=')) == NULL || eq == arg || eq[1] == '\0') {
+		warnx("bad view: \"%s\" (expected NAME=PATTERN[,PATTERN...])",
+		    arg);
+		return (-1);
+	}
+
+	if (ncp->nc_nviews == NC_MAXVIEWS) {
+		warnx("too many views (maximum %d)", NC_MAXVIEWS);
+		return (-1);
+	}
+
+	view = &ncp->nc_views[ncp->nc_nviews++];
+	*eq = '\0';
+	view->ncv_name = arg;
+	view->ncv_patterns = eq + 1;
+	return (0);
+}
+
+/*
+ * Work out which views include each source label, once all input has been
+ * read.  A label is in a view if it matches any of the view's patterns.
+ */
+static void
+nc_view_assign(netcmp_t *ncp)
+{
+	ncview_t *view;
+	nclabel_t *label;
+	const char *p, *comma;
+	char pattern[sizeof (label->ncl_name)];
+	unsigned int i, v;
+	size_t len;
+
+	for (v = 0; v < ncp->nc_nviews; v++) {
+		view = &ncp->nc_views[v];
+		for (p = view->ncv_patterns; *p != '\0'; p = comma) {
+			if ((comma = strchr(p, ',')) == NULL)
+				comma = p + strlen(p);
+			len = comma - p;
+			if (len >= sizeof (pattern))
+				len = sizeof (pattern) - 1;
+			(void) memcpy(pattern, p, len);
+			pattern[len] = '\0';
+			if (*comma == ',')
+				comma++;
+
+			for (i = 0; i < ncp->nc_nlabels; i++) {
+				label = ncp->nc_labels[i];
+				if (fnmatch(pattern, label->ncl_name, 0) == 0 &&
+				    (label->ncl_views & (1ULL << v)) == 0) {
+					label->ncl_views |= 1ULL << v;
+					view->ncv_nsources++;
+				}
+			}
+		}
+
+		if (view->ncv_nsources == 0)
+			warnx("view \"%s\" matches no sources", view->ncv_name);
+	}
+}
+
+/*
+ * Return the set of views that have data for IP address "ip", whose source is
+ * "ncs" if it's already known.  A gateway standing in for "ip" doesn't count,
+ * since it only has data for some of the IP's connections.
+ */
+static ncviewset_t
+nc_view_coverage(netcmp_t *ncp, uint32_t ip, ncsource_t *ncs)
+{
+	ncsource_t source;
+
+	if (ncs == NULL || ncs->ncs_standin) {
+		bzero(&source, sizeof (source));
+		source.ncs_ip = ip;
+		ncs = avl_find(&ncp->nc_sources, &source, NULL);
+	}
+
+	return (ncs == NULL ? 0 : ncs->ncs_label->ncl_views);
+}
+
+/*
+ * Classify connection "ncc" in every view at once, given the sets of views
+ * that have data for its first and second IP addresses.  The connection has
+ * already been classified using all sources, and within a view it's treated as
+ * though only that view's sources had been supplied: it's symmetric if both
+ * sides are in the view, asymmetric (or in-flight) if only one side has it but
+ * the view covers the other side's IP address, and external otherwise.  Views
+ * that include neither side don't see the connection at all.
+ */
+static void
+nc_view_classify(netcmp_t *ncp, ncconn_t *ncc, const ncviewset_t *cov)
+{
+	ncviewset_t seen[2], visible, sym, asym;
+	unsigned int i, side;
+
+	/* seen[i] is the set of views that include the i'th source. */
+	seen[0] = seen[1] = 0;
+	for (i = 0; i < ncc->ncc_nsources && i < 2; i++)
+		seen[i] = NCC_SOURCE(ncc, i)->ncs_label->ncl_views;
+
+	if ((visible = seen[0] | seen[1]) == 0)
+		return;
+
+	if (ncc->ncc_class == NCL_TIMEWAIT || ncc->ncc_class == NCL_MULTI) {
+		nc_view_count(ncp, visible, ncc->ncc_class);
+		return;
+	}
+
+	/*
+	 * Where a view sees only one of the sources, the connection is
+	 * asymmetric if the view covers the IP address on the other side.
+	 */
+	sym = seen[0] & seen[1];
+	asym = 0;
+	for (i = 0; i < ncc->ncc_nsources && i < 2; i++) {
+		side = NCC_SIDE(ncc, i);
+		asym |= seen[i] & ~sym & cov[2 - side];
+	}
+
+	nc_view_count(ncp, sym, NCL_SYMMETRIC);
+	nc_view_count(ncp, visible & ~sym & ~asym, NCL_EXTERNAL);
+	nc_view_count(ncp, asym, ncc->ncc_class == NCL_INFLIGHT ?
+	    NCL_INFLIGHT : NCL_ASYMMETRIC);
+}
+
+/*
+ * Count a connection of class "ncl" in each view in "views".
+ */
+static void
+nc_view_count(netcmp_t *ncp, ncviewset_t views, ncclass_t ncl)
+{
+	unsigned int v;
+
+	for (v = 0; views != 0; v++, views >>= 1) {
+		if ((views & 1) != 0)
+			ncp->nc_views[v].ncv_nclass[ncl]++;
+	}
+}
+
+/*
+ * Print the summary of connections found in each view ("-V").
+ */
+static void
+nc_view_report(netcmp_t *ncp)
+{
+	FILE *out = ncp->nc_out;
+	ncview_t *view;
+	unsigned int v;
+
+	for (v = 0; v < ncp->nc_nviews; v++) {
+		view = &ncp->nc_views[v];
+		(void) fprintf(out, "summary for view %s (%u source%s):\n",
+		    view->ncv_name, view->ncv_nsources,
+		    view->ncv_nsources == 1 ? "" : "s");
+		(void) fprintf(out, "    %7lu pruned (in state TIME_WAIT)\n",
+		    view->ncv_nclass[NCL_TIMEWAIT]);
+		(void) fprintf(out, "    %7lu symmetric (present on both "
+		    "sides)\n", view->ncv_nclass[NCL_SYMMETRIC]);
+		(void) fprintf(out, "    %7lu external (only one side's data "
+		    "was supplied)\n", view->ncv_nclass[NCL_EXTERNAL]);
+		if (ncp->nc_skew >= 0) {
+			(void) fprintf(out, "    %7lu in-flight (one side, "
+			    "transient state)\n",
+			    view->ncv_nclass[NCL_INFLIGHT]);
+		}
+		(void) fprintf(out, "    %7lu asymmetric (abandoned by one "
+		    "side)\n", view->ncv_nclass[NCL_ASYMMETRIC]);
+		if (view->ncv_nclass[NCL_MULTI] != 0) {
+			(void) fprintf(out, "    %7lu with more than two "
+			    "sources\n", view->ncv_nclass[NCL_MULTI]);
+		}
+	}
+}
+
+/*
+ * Record an external connection for the coverage gap report ("-g").  The
+ * connection's only source is for one of its IP addresses, and we have no
+ * data for the other one.
+ */
+static void
+nc_gap_record(netcmp_t *ncp, ncconn_t *ncc)
+{
+	ncsource_t *ncs = NCC_SOURCE(ncc, 0);
+	uint32_t unknown;
+	size_t nused;
+
+	unknown = NCC_SIDE(ncc, 0) == 1 ? NCC_IP2(ncc) : NCC_IP1(ncc);
+	nused = ncp->nc_gappairs.nch_nused;
+	if (nc_hash_add(&ncp->nc_gapconns, unknown, 1) != 0 ||
+	    nc_hash_add(&ncp->nc_gappairs,
+	    ((uint64_t)unknown << 32) | ncs->ncs_label->ncl_id, 1) != 0 ||
+	    (ncp->nc_gappairs.nch_nused != nused &&
+	    nc_hash_add(&ncp->nc_gapsources, unknown, 1) != 0)) {
+		errx(EXIT_FAILURE, "failed to record coverage gap");
+	}
+}
+
+/*
+ * Print the coverage gap report ("-g"): the nc_gapk IP addresses that appear in
+ * the most external connections.  We select them with a min-heap of size
+ * nc_gapk over the aggregated counts, so this is linear in the number of
+ * distinct IPs.  The heap is ordered like the report (see nc_group_compare()),
+ * with ties broken by IP address, so that which IPs are selected doesn't depend
+ * on the order of the hash table.
+ */
+static void
+nc_gap_report(netcmp_t *ncp)
+{
+	FILE *out = ncp->nc_out;
+	nchash_t *conns = &ncp->nc_gapconns;
+	uint64_t (*heap)[2], tmp[2], cand[2];
+	uint64_t total, nsources;
+	size_t k, nheap, i, j, c;
+	char buf[IPV4PORT_BUFSZ];
+
+	/*
+	 * The report can't have more entries than there are distinct IPs, so
+	 * don't size the heap for more than that.
+	 */
+	k = ncp->nc_gapk;
+	if (k > conns->nch_nused)
+		k = conns->nch_nused;
+	if ((heap = calloc(k + 1, sizeof (*heap))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	nheap = 0;
+	total = 0;
+	for (i = 0; i < conns->nch_size; i++) {
+		if (conns->nch_counts[i] == 0)
+			continue;
+
+		total += conns->nch_counts[i];
+		cand[0] = conns->nch_counts[i];
+		cand[1] = conns->nch_keys[i];
+		if (nheap == k) {
+			if (nc_group_compare(cand, heap[0]) >= 0)
+				continue;
+			nheap--;
+			heap[0][0] = heap[nheap][0];
+			heap[0][1] = heap[nheap][1];
+			for (j = 0; (c = 2 * j + 1) < nheap; j = c) {
+				if (c + 1 < nheap &&
+				    nc_group_compare(heap[c + 1], heap[c]) > 0)
+					c++;
+				if (nc_group_compare(heap[j], heap[c]) >= 0)
+					break;
+				bcopy(heap[j], tmp, sizeof (tmp));
+				bcopy(heap[c], heap[j], sizeof (tmp));
+				bcopy(tmp, heap[c], sizeof (tmp));
+			}
+		}
+
+		bcopy(cand, heap[nheap], sizeof (cand));
+		for (j = nheap++; j > 0 &&
+		    nc_group_compare(heap[(j - 1) / 2], heap[j]) < 0;
+		    j = (j - 1) / 2) {
+			bcopy(heap[j], tmp, sizeof (tmp));
+			bcopy(heap[(j - 1) / 2], heap[j], sizeof (tmp));
+			bcopy(tmp, heap[(j - 1) / 2], sizeof (tmp));
+		}
+	}
+
+	qsort(heap, nheap, sizeof (*heap), nc_group_compare);
+	(void) fprintf(out, "coverage gaps: %lu external connections involve "
+	    "%lu IPs with no data\n", (unsigned long)total,
+	    (unsigned long)conns->nch_nused);
+	if (nheap > 0) {
+		(void) fprintf(out, "    %7s %7s  %s\n", "CONNS", "SOURCES",
+		    "IP");
+	}
+
+	for (i = 0; i < nheap; i++) {
+		nsources = nc_hash_get(&ncp->nc_gapsources, heap[i][1]);
+		nc_ipport_tostr(buf, sizeof (buf), heap[i][1], 0);
+		*strrchr(buf, ':') = '\0';
+		(void) fprintf(out, "    %7lu %7lu  %s\n",
+		    (unsigned long)heap[i][0], (unsigned long)nsources, buf);
+	}
+
+	free(heap);
+}
+
+/*
+ * Build a column store of the classified connections.
+ */
+static int
+nc_result_build(netcmp_t *ncp, ncresult_t *res)
+{
+	ncconn_t *ncc;
+	size_t i, n;
+
+	bzero(res, sizeof (*res));
+	if (ncp->nc_nlabels >= NC_NOLABEL) {
+		warnx("too many sources for a result set");
+		return (-1);
+	}
+
+	n = ncp->nc_nconns;
+	res->ncrs_ip1 = calloc(n + 1, sizeof (*res->ncrs_ip1));
+	res->ncrs_ip2 = calloc(n + 1, sizeof (*res->ncrs_ip2));
+	res->ncrs_port1 = calloc(n + 1, sizeof (*res->ncrs_port1));
+	res->ncrs_port2 = calloc(n + 1, sizeof (*res->ncrs_port2));
+	res->ncrs_state = calloc(n + 1, sizeof (*res->ncrs_state));
+	res->ncrs_class = calloc(n + 1, sizeof (*res->ncrs_class));
+	res->ncrs_label1 = calloc(n + 1, sizeof (*res->ncrs_label1));
+	res->ncrs_label2 = calloc(n + 1, sizeof (*res->ncrs_label2));
+	if (res->ncrs_ip1 == NULL || res->ncrs_ip2 == NULL ||
+	    res->ncrs_port1 == NULL || res->ncrs_port2 == NULL ||
+	    res->ncrs_state == NULL || res->ncrs_class == NULL ||
+	    res->ncrs_label1 == NULL || res->ncrs_label2 == NULL) {
+		warn("calloc");
+		nc_result_free(res);
+		return (-1);
+	}
+
+	i = 0;
+	for (ncc = nc_conn_first(ncp); ncc != NULL;
+	    ncc = nc_conn_next(ncp, ncc), i++) {
+		res->ncrs_ip1[i] = NCC_IP1(ncc);
+		res->ncrs_ip2[i] = NCC_IP2(ncc);
+		res->ncrs_port1[i] = ncc->ncc_port1;
+		res->ncrs_port2[i] = ncc->ncc_port2;
+		res->ncrs_state[i] = ncc->ncc_state;
+		res->ncrs_class[i] = ncc->ncc_class;
+		res->ncrs_label1[i] = NCC_SOURCE(ncc, 0)->ncs_label->ncl_id;
+		res->ncrs_label2[i] = ncc->ncc_nsources > 1 ?
+		    NCC_SOURCE(ncc, 1)->ncs_label->ncl_id : NC_NOLABEL;
+	}
+
+	res->ncrs_n = n;
+	return (0);
+}
+
+static void
+nc_result_free(ncresult_t *res)
+{
+	free(res->ncrs_ip1);
+	free(res->ncrs_ip2);
+	free(res->ncrs_port1);
+	free(res->ncrs_port2);
+	free(res->ncrs_state);
+	free(res->ncrs_class);
+	free(res->ncrs_label1);
+	free(res->ncrs_label2);
+	bzero(res, sizeof (*res));
+}
+
+/*
+ * Build a frozen index (see ncfrozen_t) from a column store.
+ */
+static int
+nc_frozen_build(const ncresult_t *res, ncfrozen_t *fz)
+{
+	ncfrozensample_t *sample;
+	uint32_t hi, prevhi;
+	uint64_t lo, prevlo;
+	size_t i, n, off;
+	uint8_t *keys;
+
+	bzero(fz, sizeof (*fz));
+	n = res->ncrs_n;
+
+	/*
+	 * Each delta takes at most 5 bytes for hi and 10 for lo.
+	 */
+	fz->ncfz_keys = malloc(n * 15 + 1);
+	fz->ncfz_samples = calloc(n / NC_FROZEN_BLOCK + 1,
+	    sizeof (*fz->ncfz_samples));
+	fz->ncfz_stclass = calloc(n + 1, sizeof (*fz->ncfz_stclass));
+	fz->ncfz_label1 = calloc(n + 1, sizeof (*fz->ncfz_label1));
+	fz->ncfz_label2 = calloc(n + 1, sizeof (*fz->ncfz_label2));
+	if (fz->ncfz_keys == NULL || fz->ncfz_samples == NULL ||
+	    fz->ncfz_stclass == NULL || fz->ncfz_label1 == NULL ||
+	    fz->ncfz_label2 == NULL) {
+		warn("calloc");
+		nc_frozen_free(fz);
+		return (-1);
+	}
+
+	off = 0;
+	prevhi = 0;
+	prevlo = 0;
+	for (i = 0; i < n; i++) {
+		hi = res->ncrs_ip1[i];
+		lo = NC_KEY_LO(res->ncrs_ip2[i], res->ncrs_port1[i],
+		    res->ncrs_port2[i]);
+		if (i % NC_FROZEN_BLOCK == 0) {
+			sample = &fz->ncfz_samples[i / NC_FROZEN_BLOCK];
+			sample->ncfs_hi = hi;
+			sample->ncfs_lo = lo;
+			sample->ncfs_off = off;
+		} else {
+			assert(hi > prevhi || (hi == prevhi && lo > prevlo));
+			off += nc_varint_put(fz->ncfz_keys + off, hi - prevhi);
+			off += nc_varint_put(fz->ncfz_keys + off,
+			    hi == prevhi ? lo - prevlo : lo);
+		}
+
+		if (off > UINT32_MAX - 15) {
+			warnx("too many connections for frozen index");
+			nc_frozen_free(fz);
+			return (-1);
+		}
+
+		prevhi = hi;
+		prevlo = lo;
+		fz->ncfz_stclass[i] = res->ncrs_state[i] |
+		    res->ncrs_class[i] << 4;
+		fz->ncfz_label1[i] = res->ncrs_label1[i];
+		fz->ncfz_label2[i] = res->ncrs_label2[i];
+	}
+
+	if ((keys = realloc(fz->ncfz_keys, off + 1)) != NULL)
+		fz->ncfz_keys = keys;
+	fz->ncfz_keysz = off;
+	fz->ncfz_n = n;
+	return (0);
+}
+
+static void
+nc_frozen_free(ncfrozen_t *fz)
+{
+	free(fz->ncfz_keys);
+	free(fz->ncfz_samples);
+	free(fz->ncfz_stclass);
+	free(fz->ncfz_label1);
+	free(fz->ncfz_label2);
+	bzero(fz, sizeof (*fz));
+}
+
+/*
+ * Position "cur" at the first key of block "b".
+ */
+static void
+nc_frozen_block(const ncfrozen_t *fz, size_t b, ncfrozencur_t *cur)
+{
+	const ncfrozensample_t *sample = &fz->ncfz_samples[b];
+
+	cur->ncfc_i = b * NC_FROZEN_BLOCK;
+	cur->ncfc_hi = sample->ncfs_hi;
+	cur->ncfc_lo = sample->ncfs_lo;
+	cur->ncfc_p = fz->ncfz_keys + sample->ncfs_off;
+}
+
+/*
+ * Advance "cur" to the next key.  Returns false if there are no more keys.
+ */
+static ncbool_t
+nc_frozen_next(const ncfrozen_t *fz, ncfrozencur_t *cur)
+{
+	uint64_t dhi, lo;
+
+	if (cur->ncfc_i + 1 >= fz->ncfz_n) {
+		cur->ncfc_i = fz->ncfz_n;
+		return (NB_FALSE);
+	}
+
+	if ((cur->ncfc_i + 1) % NC_FROZEN_BLOCK == 0) {
+		nc_frozen_block(fz, (cur->ncfc_i + 1) / NC_FROZEN_BLOCK, cur);
+		return (NB_TRUE);
+	}
+
+	dhi = nc_varint_get(&cur->ncfc_p);
+	lo = nc_varint_get(&cur->ncfc_p);
+	cur->ncfc_i++;
+	cur->ncfc_hi += dhi;
+	cur->ncfc_lo = dhi == 0 ? cur->ncfc_lo + lo : lo;
+	return (NB_TRUE);
+}
+
+/*
+ * Position "cur" at the first key greater than or equal to (hi, lo).  Returns
+ * false if there's no such key.
+ */
+static ncbool_t
+nc_frozen_seek(const ncfrozen_t *fz, uint32_t hi, uint64_t lo,
+    ncfrozencur_t *cur)
+{
+	const ncfrozensample_t *sample;
+	size_t low, high, mid;
+
+	if (fz->ncfz_n == 0)
+		return (NB_FALSE);
+
+	/*
+	 * Find the last block whose first key is at most (hi, lo).  If there
+	 * isn't one, the first key of the first block is the answer.
+	 */
+	low = 0;
+	high = (fz->ncfz_n - 1) / NC_FROZEN_BLOCK + 1;
+	while (high - low > 1) {
+		mid = low + (high - low) / 2;
+		sample = &fz->ncfz_samples[mid];
+		if (sample->ncfs_hi < hi ||
+		    (sample->ncfs_hi == hi && sample->ncfs_lo <= lo)) {
+			low = mid;
+		} else {
+			high = mid;
+		}
+	}
+
+	nc_frozen_block(fz, low, cur);
+	while (cur->ncfc_hi < hi || (cur->ncfc_hi == hi && cur->ncfc_lo < lo)) {
+		if (!nc_frozen_next(fz, cur))
+			return (NB_FALSE);
+	}
+
+	return (NB_TRUE);
+}
+
+/*
+ * Print the connection at "cur".
+ */
+static void
+nc_frozen_print(netcmp_t *ncp, const ncfrozen_t *fz, const ncfrozencur_t *cur)
+{
+	size_t i = cur->ncfc_i;
+	char buf1[IPV4PORT_BUFSZ];
+	char buf2[IPV4PORT_BUFSZ];
+
+	nc_ipport_tostr(buf1, sizeof (buf1), cur->ncfc_hi,
+	    (cur->ncfc_lo >> 16) & UINT16_MAX);
+	nc_ipport_tostr(buf2, sizeof (buf2), cur->ncfc_lo >> 32,
+	    cur->ncfc_lo & UINT16_MAX);
+	(void) fprintf(ncp->nc_out, "    %21s <-> %21s %-11s %-10s %s%s%s\n",
+	    buf1, buf2, nc_states[fz->ncfz_stclass[i] & 0xf],
+	    nc_classes[fz->ncfz_stclass[i] >> 4],
+	    ncp->nc_labels[fz->ncfz_label1[i]]->ncl_name,
+	    fz->ncfz_label2[i] == NC_NOLABEL ? "" : ",",
+	    fz->ncfz_label2[i] == NC_NOLABEL ? "" :
+	    ncp->nc_labels[fz->ncfz_label2[i]]->ncl_name);
+}
+
+/*
+ * Answer a "lookup" or "pair" query (see the comment at the top of this file)
+ * from the frozen index.
+ */
+static int
+nc_frozen_query(netcmp_t *ncp, const ncfrozen_t *fz, char *line)
+{
+	ncfrozencur_t cur;
+	char *args[4], *lasts, *cmd, *endp;
+	uint32_t ip1, ip2, tip;
+	uint16_t port1, port2, tport;
+	unsigned long limit, nfound;
+	unsigned int nargs;
+	double start;
+	ncbool_t found;
+
+	cmd = strtok_r(line, " \t\n", &lasts);
+	for (nargs = 0; nargs < 4; nargs++) {
+		if ((args[nargs] = strtok_r(NULL, " \t\n", &lasts)) == NULL)
+			break;
+	}
+
+	start = nc_time();
+	if (strcmp(cmd, "lookup") == 0) {
+		if (nargs != 2 ||
+		    nc_parse_ipport(args[0], &ip1, &port1) != 0 ||
+		    nc_parse_ipport(args[1], &ip2, &port2) != 0) {
+			warnx("usage: lookup IP1:PORT1 IP2:PORT2");
+			return (-1);
+		}
+
+		if (ip1 > ip2 || (ip1 == ip2 && port1 > port2)) {
+			tip = ip1;
+			ip1 = ip2;
+			ip2 = tip;
+			tport = port1;
+			port1 = port2;
+			port2 = tport;
+		}
+
+		found = nc_frozen_seek(fz, ip1, NC_KEY_LO(ip2, port1, port2),
+		    &cur) && cur.ncfc_hi == ip1 &&
+		    cur.ncfc_lo == NC_KEY_LO(ip2, port1, port2);
+		(void) fprintf(ncp->nc_out, "%s (%.1f us)\n",
+		    found ? "found" : "not found",
+		    (nc_time() - start) * 1000000);
+		if (found)
+			nc_frozen_print(ncp, fz, &cur);
+		return (0);
+	}
+
+	limit = NC_QUERY_LIMIT;
+	if ((nargs != 2 && nargs != 4) ||
+	    nc_parse_ipaddr(args[0], &ip1) != 0 ||
+	    nc_parse_ipaddr(args[1], &ip2) != 0 ||
+	    (nargs == 4 && (strcmp(args[2], "limit") != 0 ||
+	    (limit = strtoul(args[3], &endp, 10), *endp != '\0')))) {
+		warnx("usage: pair IP1 IP2 [limit N]");
+		return (-1);
+	}
+
+	if (ip1 > ip2) {
+		tip = ip1;
+		ip1 = ip2;
+		ip2 = tip;
+	}
+
+	/*
+	 * All of the connections between these two IPs are adjacent in the
+	 * index, so we seek to the first one and decode until the key changes.
+	 * We count them all, but print only the first "limit".
+	 */
+	nfound = 0;
+	if (nc_frozen_seek(fz, ip1, NC_KEY_LO(ip2, 0, 0), &cur)) {
+		do {
+			if (cur.ncfc_hi != ip1 || (cur.ncfc_lo >> 32) != ip2)
+				break;
+			if (nfound++ < limit)
+				nc_frozen_print(ncp, fz, &cur);
+		} while (nc_frozen_next(fz, &cur));
+	}
+
+	(void) fprintf(ncp->nc_out, "%lu connection%s between these IPs "
+	    "(%.1f us)\n", nfound, nfound == 1 ? "" : "s",
+	    (nc_time() - start) * 1000000);
+	return (0);
+}
+
+/*
+ * Parse a query (see the comment at the top of this file) into "query".
+ * Returns 0 on success.  On failure, prints a message and returns -1.
+ */
+static int
+nc_query_parse(netcmp_t *ncp, char *line, ncquery_t *query)
+{
+	char *token, *lasts, *value, *endp;
+	ncqpred_t *pred;
+	ncqfield_t field;
+	unsigned int i;
+	ncbool_t found;
+
+	bzero(query, sizeof (*query));
+	query->ncq_groupby = NQF_NONE;
+	query->ncq_limit = NC_QUERY_LIMIT;
+
+	for (token = strtok_r(line, " \t\n", &lasts); token != NULL;
+	    token = strtok_r(NULL, " \t\n", &lasts)) {
+		if (strcmp(token, "by") == 0 || strcmp(token, "limit") == 0) {
+			if ((value = strtok_r(NULL, " \t\n", &lasts)) == NULL) {
+				warnx("expected value after \"%s\"", token);
+				return (-1);
+			}
+
+			if (strcmp(token, "limit") == 0) {
+				errno = 0;
+				query->ncq_limit = strtoul(value, &endp, 10);
+				if (errno != 0 || *endp != '\0') {
+					warnx("bad limit: \"%s\"", value);
+					return (-1);
+				}
+				continue;
+			}
+
+			for (field = 0; field < NQF_NFIELDS; field++) {
+				if (strcmp(value, nc_qfields[field]) == 0)
+					break;
+			}
+
+			if (field == NQF_NFIELDS) {
+				warnx("unknown field: \"%s\"", value);
+				return (-1);
+			}
+
+			query->ncq_groupby = field;
+			continue;
+		}
+
+		if (query->ncq_npreds == NC_QUERY_MAXPREDS) {
+			warnx("too many filters");
+			return (-1);
+		}
+
+		pred = &query->ncq_preds[query->ncq_npreds];
+		if ((value = strchr(token, '=')) == NULL) {
+			warnx("expected FIELD=VALUE, \"by\", or \"limit\": "
+			    "\"%s\"", token);
+			return (-1);
+		}
+
+		if (value > token && value[-1] == '!') {
+			pred->ncqp_negate = NB_TRUE;
+			value[-1] = '\0';
+		}
+		*value++ = '\0';
+
+		for (field = 0; field < NQF_PAIR; field++) {
+			if (strcmp(token, nc_qfields[field]) == 0)
+				break;
+		}
+
+		pred->ncqp_field = field;
+		switch (field) {
+		case NQF_IP:
+			if (nc_parse_ipaddr(value, &pred->ncqp_value) != 0) {
+				warnx("bad IP address: \"%s\"", value);
+				return (-1);
+			}
+			break;
+
+		case NQF_PORT:
+			errno = 0;
+			pred->ncqp_value = strtoul(value, &endp, 10);
+			if (errno != 0 || *endp != '\0' ||
+			    pred->ncqp_value > UINT16_MAX) {
+				warnx("bad port: \"%s\"", value);
+				return (-1);
+			}
+			break;
+
+		case NQF_STATE:
+		case NQF_CLASS:
+		case NQF_SOURCE:
+			found = NB_FALSE;
+			if (field == NQF_STATE) {
+				for (i = 0; i < NS_NSTATES && !found; i++) {
+					found = strcasecmp(value,
+					    nc_states[i]) == 0;
+				}
+			} else if (field == NQF_CLASS) {
+				for (i = 0; i < NCL_NCLASSES && !found; i++) {
+					found = strcasecmp(value,
+					    nc_classes[i]) == 0;
+				}
+			} else {
+				for (i = 0; i < ncp->nc_nlabels && !found;
+				    i++) {
+					found = strcmp(value,
+					    ncp->nc_labels[i]->ncl_name) == 0;
+				}
+			}
+
+			if (!found) {
+				warnx("unknown %s: \"%s\"", nc_qfields[field],
+				    value);
+				return (-1);
+			}
+
+			pred->ncqp_value = i - 1;
+			break;
+
+		default:
+			warnx("unknown field: \"%s\"", token);
+			return (-1);
+		}
+
+		query->ncq_npreds++;
+	}
+
+	return (0);
+}
+
+/*
+ * Apply a single filter to every row of "res", clearing mask[i] for each row i
+ * that doesn't match.  Each case is a straight-line pass over one or two
+ * columns that computes a byte per row with no branches and no indirection, so
+ * that the compiler can vectorize it (gcc does with -ftree-vectorize, which the
+ * Makefile passes, or -O3).  The matching rows are gathered afterwards by
+ * nc_query_select().
+ */
+static void
+nc_query_filter(const ncresult_t *res, const ncqpred_t *pred,
+    uint8_t *restrict mask)
+{
+	size_t i, n = res->ncrs_n;
+	uint8_t neg = pred->ncqp_negate ? 1 : 0;
+
+	switch (pred->ncqp_field) {
+	case NQF_IP: {
+		const uint32_t *restrict ip1 = res->ncrs_ip1;
+		const uint32_t *restrict ip2 = res->ncrs_ip2;
+		uint32_t v = pred->ncqp_value;
+
+		for (i = 0; i < n; i++)
+			mask[i] &= ((ip1[i] == v) | (ip2[i] == v)) ^ neg;
+		break;
+	}
+
+	case NQF_PORT:
+	case NQF_SOURCE: {
+		const uint16_t *restrict col1 = pred->ncqp_field == NQF_PORT ?
+		    res->ncrs_port1 : res->ncrs_label1;
+		const uint16_t *restrict col2 = pred->ncqp_field == NQF_PORT ?
+		    res->ncrs_port2 : res->ncrs_label2;
+		uint16_t v = (uint16_t)pred->ncqp_value;
+
+		for (i = 0; i < n; i++)
+			mask[i] &= ((col1[i] == v) | (col2[i] == v)) ^ neg;
+		break;
+	}
+
+	case NQF_STATE:
+	case NQF_CLASS: {
+		const uint8_t *restrict col = pred->ncqp_field == NQF_STATE ?
+		    res->ncrs_state : res->ncrs_class;
+		uint8_t v = (uint8_t)pred->ncqp_value;
+
+		for (i = 0; i < n; i++)
+			mask[i] &= (col[i] == v) ^ neg;
+		break;
+	}
+
+	default:
+		assert(0);
+		break;
+	}
+}
+
+/*
+ * Write the indexes of the rows of "res" whose mask byte is set to the front of
+ * "sel", and return how many there are.  This is kept separate from the filter
+ * passes because the compaction can't be vectorized, and only has to be done
+ * once per query.
+ */
+static size_t
+nc_query_select(const ncresult_t *res, const uint8_t *mask, uint32_t *sel)
+{
+	size_t i, k = 0;
+
+	for (i = 0; i < res->ncrs_n; i++) {
+		sel[k] = (uint32_t)i;
+		k += mask[i];
+	}
+
+	return (k);
+}
+
+/*
+ * Run a parsed query against the column store and print the results.  "mask"
+ * and "sel" must each have room for one entry per row.
+ */
+static void
+nc_query_run(netcmp_t *ncp, const ncresult_t *res, const ncquery_t *query,
+    uint8_t *mask, uint32_t *sel)
+{
+	FILE *out = ncp->nc_out;
+	nchash_t hash;
+	uint64_t (*groups)[2];
+	uint64_t key;
+	size_t nsel, ngroups, i, j, r;
+	unsigned int p;
+	ncbool_t all;
+	double start;
+	char buf1[IPV4PORT_BUFSZ];
+	char buf2[IPV4PORT_BUFSZ];
+
+	start = nc_time();
+	all = query->ncq_npreds == 0 ? NB_TRUE : NB_FALSE;
+	nsel = res->ncrs_n;
+	if (!all) {
+		(void) memset(mask, 1, res->ncrs_n);
+		for (p = 0; p < query->ncq_npreds; p++)
+			nc_query_filter(res, &query->ncq_preds[p], mask);
+		nsel = nc_query_select(res, mask, sel);
+	}
+
+	if (query->ncq_groupby == NQF_NONE) {
+		(void) fprintf(out, "%lu connection%s matched (%.1f ms)\n",
+		    (unsigned long)nsel, nsel == 1 ? "" : "s",
+		    (nc_time() - start) * 1000);
+		for (j = 0; j < nsel && j < query->ncq_limit; j++) {
+			r = all ? j : sel[j];
+			nc_ipport_tostr(buf1, sizeof (buf1),
+			    res->ncrs_ip1[r], res->ncrs_port1[r]);
+			nc_ipport_tostr(buf2, sizeof (buf2),
+			    res->ncrs_ip2[r], res->ncrs_port2[r]);
+			(void) fprintf(out, "    %21s <-> %21s %-11s %-10s %s%s"
+			    "%s\n", buf1, buf2, nc_states[res->ncrs_state[r]],
+			    nc_classes[res->ncrs_class[r]],
+			    ncp->nc_labels[res->ncrs_label1[r]]->ncl_name,
+			    res->ncrs_label2[r] == NC_NOLABEL ? "" : ",",
+			    res->ncrs_label2[r] == NC_NOLABEL ? "" :
+			    ncp->nc_labels[res->ncrs_label2[r]]->ncl_name);
+		}
+		return;
+	}
+
+	/*
+	 * Aggregate the selected rows by the group-by key, then sort the groups
+	 * by size.
+	 */
+	if (nc_hash_init(&hash, 1024) != 0)
+		return;
+
+	for (j = 0; j < nsel; j++) {
+		r = all ? j : sel[j];
+		switch (query->ncq_groupby) {
+		case NQF_IP:
+			if (nc_hash_add(&hash, res->ncrs_ip1[r], 1) != 0 ||
+			    nc_hash_add(&hash, res->ncrs_ip2[r], 1) != 0)
+				goto out;
+			continue;
+		case NQF_PORT:
+			key = res->ncrs_port1[r] < res->ncrs_port2[r] ?
+			    res->ncrs_port1[r] : res->ncrs_port2[r];
+			break;
+		case NQF_STATE:
+			key = res->ncrs_state[r];
+			break;
+		case NQF_CLASS:
+			key = res->ncrs_class[r];
+			break;
+		case NQF_SOURCE:
+			if (res->ncrs_label2[r] != NC_NOLABEL &&
+			    nc_hash_add(&hash, res->ncrs_label2[r], 1) != 0)
+				goto out;
+			key = res->ncrs_label1[r];
+			break;
+		default:
+			key = ((uint64_t)res->ncrs_ip1[r] << 32) |
+			    res->ncrs_ip2[r];
+			break;
+		}
+
+		if (nc_hash_add(&hash, key, 1) != 0)
+			goto out;
+	}
+
+	if ((groups = calloc(hash.nch_nused + 1, sizeof (*groups))) == NULL) {
+		warn("calloc");
+		goto out;
+	}
+
+	ngroups = 0;
+	for (i = 0; i < hash.nch_size; i++) {
+		if (hash.nch_counts[i] == 0)
+			continue;
+		groups[ngroups][0] = hash.nch_counts[i];
+		groups[ngroups][1] = hash.nch_keys[i];
+		ngroups++;
+	}
+
+	qsort(groups, ngroups, sizeof (*groups), nc_group_compare);
+	(void) fprintf(out, "%lu connection%s matched in %lu group%s "
+	    "(%.1f ms)\n", (unsigned long)nsel, nsel == 1 ? "" : "s",
+	    (unsigned long)ngroups, ngroups == 1 ? "" : "s",
+	    (nc_time() - start) * 1000);
+	for (i = 0; i < ngroups && i < query->ncq_limit; i++) {
+		key = groups[i][1];
+		switch (query->ncq_groupby) {
+		case NQF_IP:
+			nc_ipport_tostr(buf1, sizeof (buf1), key, 0);
+			*strrchr(buf1, ':') = '\0';
+			(void) fprintf(out, "    %10lu  %s\n",
+			    (unsigned long)groups[i][0], buf1);
+			break;
+		case NQF_PORT:
+			(void) fprintf(out, "    %10lu  %lu\n",
+			    (unsigned long)groups[i][0], (unsigned long)key);
+			break;
+		case NQF_STATE:
+			(void) fprintf(out, "    %10lu  %s\n",
+			    (unsigned long)groups[i][0], nc_states[key]);
+			break;
+		case NQF_CLASS:
+			(void) fprintf(out, "    %10lu  %s\n",
+			    (unsigned long)groups[i][0], nc_classes[key]);
+			break;
+		case NQF_SOURCE:
+			(void) fprintf(out, "    %10lu  %s\n",
+			    (unsigned long)groups[i][0],
+			    ncp->nc_labels[key]->ncl_name);
+			break;
+		default:
+			nc_ipport_tostr(buf1, sizeof (buf1), key >> 32, 0);
+			*strrchr(buf1, ':') = '\0';
+			nc_ipport_tostr(buf2, sizeof (buf2),
+			    key & UINT32_MAX, 0);
+			*strrchr(buf2, ':') = '\0';
+			(void) fprintf(out, "    %10lu  %s <-> %s\n",
+			    (unsigned long)groups[i][0], buf1, buf2);
+			break;
+		}
+	}
+
+	free(groups);
+out:
+	nc_hash_fini(&hash);
+}
+
+/*
+ * Write the per-source report files ("-O").  nc_report() has already
+ * partitioned the asymmetric connections by label, so each label's file can be
+ * formatted and written independently.  We spread the labels over a handful of
+ * threads, each writing through a large stdio buffer.
+ */
+static int
+nc_report_bylabel(netcmp_t *ncp)
+{
+	ncwriter_t writers[NC_MAXWRITERS];
+	unsigned int i, nwriters;
+	int rv = 0;
+
+	if (mkdir(ncp->nc_reportdir, 0777) != 0 && errno != EEXIST) {
+		warn("mkdir \"%s\"", ncp->nc_reportdir);
+		return (-1);
+	}
+
+	nwriters = ncp->nc_nlabels < NC_MAXWRITERS ?
+	    ncp->nc_nlabels : NC_MAXWRITERS;
+	for (i = 0; i < nwriters; i++) {
+		bzero(&writers[i], sizeof (writers[i]));
+		writers[i].ncw_ncp = ncp;
+		writers[i].ncw_first = i;
+		writers[i].ncw_stride = nwriters;
+		if ((errno = pthread_create(&writers[i].ncw_thread, NULL,
+		    nc_report_writer, &writers[i])) != 0) {
+			warn("pthread_create");
+			nwriters = i;
+			rv = -1;
+			break;
+		}
+	}
+
+	for (i = 0; i < nwriters; i++) {
+		(void) pthread_join(writers[i].ncw_thread, NULL);
+		if (writers[i].ncw_error != 0)
+			rv = -1;
+	}
+
+	return (rv);
+}
+
+/*
+ * Thread body for writing per-source report files.  See nc_report_bylabel().
+ */
+static void *
+nc_report_writer(void *arg)
+{
+	ncwriter_t *ncw = arg;
+	netcmp_t *ncp = ncw->ncw_ncp;
+	nclabel_t *label;
+	FILE *fstream;
+	char *iobuf;
+	char path[PATH_MAX];
+	char buf[256];
+	char *p;
+	unsigned int l;
+	size_t i, len;
+
+	if ((iobuf = malloc(NC_WRITERBUFSZ)) == NULL) {
+		warn("malloc");
+		ncw->ncw_error = 1;
+		return (NULL);
+	}
+
+	for (l = ncw->ncw_first; l < ncp->nc_nlabels; l += ncw->ncw_stride) {
+		label = ncp->nc_labels[l];
+		(void) snprintf(path, sizeof (path), "%s/%s",
+		    ncp->nc_reportdir, label->ncl_name);
+
+		/* Labels for network namespaces ("-N") contain slashes. */
+		len = strlen(ncp->nc_reportdir) + 1;
+		for (p = path + (len < strlen(path) ? len : strlen(path));
+		    *p != '\0'; p++) {
+			if (*p == '/')
+				*p = ':';
+		}
+		if ((fstream = fopen(path, "w")) == NULL) {
+			warn("fopen \"%s\"", path);
+			ncw->ncw_error = 1;
+			continue;
+		}
+
+		(void) setvbuf(fstream, iobuf, _IOFBF, NC_WRITERBUFSZ);
+		for (i = 0; i < label->ncl_nasym; i++) {
+			(void) nc_asym_format(ncp, label->ncl_asym[i],
+			    buf, sizeof (buf));
+			(void) fputs(buf, fstream);
+		}
+
+		if (fclose(fstream) != 0) {
+			warn("write \"%s\"", path);
+			ncw->ncw_error = 1;
+		}
+	}
+
+	free(iobuf);
+	return (NULL);
+}
+
+/*
+ * Format into "buf" the report line for an asymmetric connection.  Returns
+ * NB_FALSE if the connection should not be reported because it was first seen
+ * too recently ("-A").  With TCP_INFO ("-N"), the line also shows how long the
+ * connection has been idle, and connections that are retransmitting without
+ * getting any acknowledgement are flagged "STALLED".
+ */
+static ncbool_t
+nc_asym_format(netcmp_t *ncp, ncconn_t *ncc, char *buf, size_t bufsz)
+{
+	const nctcpinfo_t *ti;
+	unsigned long age;
+	char buf1[IPV4PORT_BUFSZ];
+	char buf2[IPV4PORT_BUFSZ];
+	char agebuf[32];
+	char agestr[48];
+	char infostr[128];
+
+	nc_ipport_tostr(buf1, sizeof (buf1), NCC_IP1(ncc), ncc->ncc_port1);
+	nc_ipport_tostr(buf2, sizeof (buf2), NCC_IP2(ncc), ncc->ncc_port2);
+	agestr[0] = '\0';
+	if (ncp->nc_agefile != NULL) {
+		age = ncp->nc_now > ncc->ncc_firstseen ?
+		    ncp->nc_now - ncc->ncc_firstseen : 0;
+		if (age < ncp->nc_minage)
+			return (NB_FALSE);
+
+		nc_age_tostr(agebuf, sizeof (agebuf), age);
+		(void) snprintf(agestr, sizeof (agestr), " (age %s)", agebuf);
+	}
+
+	infostr[0] = '\0';
+	if ((ti = nc_tcpinfo_lookup(ncp, ncc)) != NULL) {
+		nc_age_tostr(agebuf, sizeof (agebuf), nc_tcpinfo_idle(ti));
+		(void) snprintf(infostr, sizeof (infostr), " (idle %s, rtt "
+		    "%.1fms, %llu bytes acked, %u retransmits)%s", agebuf,
+		    ti->ncti_rtt / 1000.0, (unsigned long long)ti->ncti_acked,
+		    ti->ncti_retrans, ti->ncti_backoff != 0 ? " STALLED" : "");
+	}
+
+	(void) snprintf(buf, bufsz, "%21s <-> %21s only in %s%s%s\n",
+	    buf1, buf2, NCC_SOURCE(ncc, 0)->ncs_label->ncl_name, agestr,
+	    infostr);
+	return (NB_TRUE);
+}
+
+/*
+ * Compare two snapshots of netstat output taken from the same system and report
+ * the connections that were added, removed, or changed state.  Both snapshots
+ * are read into arrays of packed records, sorted with a radix sort, and then
+ * compared with a single linear merge, so this takes time linear in the size of
+ * the input.
+ */
+static int
+nc_diff(netcmp_t *ncp, const char *oldfile, const char *newfile)
+{
+	FILE *out = ncp->nc_out;
+	ncsnap_t oldsnap, newsnap;
+	ncrec_t *orec, *nrec;
+	size_t oi, ni;
+	int cmp;
+	unsigned long nadded = 0;
+	unsigned long nremoved = 0;
+	unsigned long nchanged = 0;
+	unsigned long nunchanged = 0;
+	char buf1[IPV4PORT_BUFSZ];
+	char buf2[IPV4PORT_BUFSZ];
+
+	if (nc_read_file(ncp, oldfile, nc_snap_row) != 0)
+		return (-1);
+	oldsnap = ncp->nc_snap;
+	bzero(&ncp->nc_snap, sizeof (ncp->nc_snap));
+
+	if (nc_read_file(ncp, newfile, nc_snap_row) != 0) {
+		free(oldsnap.ncsn_recs);
+		return (-1);
+	}
+	newsnap = ncp->nc_snap;
+	bzero(&ncp->nc_snap, sizeof (ncp->nc_snap));
+
+	nc_rec_sort(oldsnap.ncsn_recs, oldsnap.ncsn_nrecs);
+	nc_rec_sort(newsnap.ncsn_recs, newsnap.ncsn_nrecs);
+
+	oi = 0;
+	ni = 0;
+	while (oi < oldsnap.ncsn_nrecs || ni < newsnap.ncsn_nrecs) {
+		orec = oi < oldsnap.ncsn_nrecs ? &oldsnap.ncsn_recs[oi] : NULL;
+		nrec = ni < newsnap.ncsn_nrecs ? &newsnap.ncsn_recs[ni] : NULL;
+
+		if (orec == NULL) {
+			cmp = 1;
+		} else if (nrec == NULL) {
+			cmp = -1;
+		} else {
+			cmp = nc_rec_compare(orec, nrec);
+		}
+
+		if (cmp < 0) {
+			nremoved++;
+			oi++;
+			nc_ipport_tostr(buf1, sizeof (buf1),
+			    orec->ncr_ip1, orec->ncr_port1);
+			nc_ipport_tostr(buf2, sizeof (buf2),
+			    orec->ncr_ip2, orec->ncr_port2);
+			(void) fprintf(out, "- %21s <-> %21s %s\n",
+			    buf1, buf2, nc_states[orec->ncr_state]);
+			continue;
+		}
+
+		if (cmp > 0) {
+			nadded++;
+			ni++;
+			nc_ipport_tostr(buf1, sizeof (buf1),
+			    nrec->ncr_ip1, nrec->ncr_port1);
+			nc_ipport_tostr(buf2, sizeof (buf2),
+			    nrec->ncr_ip2, nrec->ncr_port2);
+			(void) fprintf(out, "+ %21s <-> %21s %s\n",
+			    buf1, buf2, nc_states[nrec->ncr_state]);
+			continue;
+		}
+
+		oi++;
+		ni++;
+		if (orec->ncr_state == nrec->ncr_state) {
+			nunchanged++;
+			continue;
+		}
+
+		nchanged++;
+		nc_ipport_tostr(buf1, sizeof (buf1),
+		    nrec->ncr_ip1, nrec->ncr_port1);
+		nc_ipport_tostr(buf2, sizeof (buf2),
+		    nrec->ncr_ip2, nrec->ncr_port2);
+		(void) fprintf(out, "~ %21s <-> %21s %s -> %s\n",
+		    buf1, buf2, nc_states[orec->ncr_state],
+		    nc_states[nrec->ncr_state]);
+	}
+
+	(void) fprintf(out, "summary of changes found:\n");
+	(void) fprintf(out, "    %7lu added (only in %s)\n", nadded, newfile);
+	(void) fprintf(out, "    %7lu removed (only in %s)\n", nremoved,
+	    oldfile);
+	(void) fprintf(out, "    %7lu changed state\n", nchanged);
+	(void) fprintf(out, "    %7lu unchanged\n", nunchanged);
+
+	free(oldsnap.ncsn_recs);
+	free(newsnap.ncsn_recs);
+	return (0);
+}
+
+/*
+ * Map a published result file for reading, validating its header.
+ */
+static int
+nc_pub_map(const char *path, ncpubmap_t *map)
+{
+	const ncpub_hdr_t *hdr;
+	struct stat st;
+	uint64_t n, end;
+	unsigned int i;
+	int fd;
+
+	bzero(map, sizeof (*map));
+	map->ncpm_path = path;
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		warn("open \"%s\"", path);
+		return (-1);
+	}
+
+	if (fstat(fd, &st) != 0) {
+		warn("fstat \"%s\"", path);
+		(void) close(fd);
+		return (-1);
+	}
+
+	if (st.st_size < (off_t)sizeof (*hdr)) {
+		warnx("%s: not a netcmp result file", path);
+		(void) close(fd);
+		return (-1);
+	}
+
+	map->ncpm_size = st.st_size;
+	map->ncpm_base = mmap(NULL, map->ncpm_size, PROT_READ, MAP_SHARED,
+	    fd, 0);
+	(void) close(fd);
+	if (map->ncpm_base == MAP_FAILED) {
+		warn("mmap \"%s\"", path);
+		return (-1);
+	}
+
+	/* LINTED E_BAD_PTR_CAST_ALIGN */
+	hdr = map->ncpm_hdr = (const ncpub_hdr_t *)map->ncpm_base;
+	if (bcmp(hdr->ncph_magic, NCPUB_MAGIC, sizeof (hdr->ncph_magic)) != 0 ||
+	    hdr->ncph_version != NCPUB_VERSION) {
+		warnx("%s: not a netcmp result file (or unsupported version)",
+		    path);
+		goto fail;
+	}
+
+	/*
+	 * Make sure every array fits within the file before we use it.
+	 */
+	n = hdr->ncph_nconns;
+	end = hdr->ncph_off_sources +
+	    (uint64_t)hdr->ncph_nsources * sizeof (ncpub_source_t);
+	if (hdr->ncph_size != map->ncpm_size || end > map->ncpm_size ||
+	    hdr->ncph_off_ip1 + n * sizeof (uint32_t) > map->ncpm_size ||
+	    hdr->ncph_off_ip2 + n * sizeof (uint32_t) > map->ncpm_size ||
+	    hdr->ncph_off_port1 + n * sizeof (uint16_t) > map->ncpm_size ||
+	    hdr->ncph_off_port2 + n * sizeof (uint16_t) > map->ncpm_size ||
+	    hdr->ncph_off_state + n > map->ncpm_size ||
+	    hdr->ncph_off_class + n > map->ncpm_size ||
+	    hdr->ncph_off_source1 + n * sizeof (uint16_t) > map->ncpm_size ||
+	    hdr->ncph_nstates > NCPUB_MAXSTATES ||
+	    hdr->ncph_nclasses > NCPUB_MAXCLASSES) {
+		warnx("%s: corrupt netcmp result file", path);
+		goto fail;
+	}
+
+	/* LINTED E_BAD_PTR_CAST_ALIGN */
+	map->ncpm_ip1 = (const uint32_t *)(map->ncpm_base + hdr->ncph_off_ip1);
+	/* LINTED E_BAD_PTR_CAST_ALIGN */
+	map->ncpm_ip2 = (const uint32_t *)(map->ncpm_base + hdr->ncph_off_ip2);
+	/* LINTED E_BAD_PTR_CAST_ALIGN */
+	map->ncpm_port1 = (const uint16_t *)(map->ncpm_base +
+	    hdr->ncph_off_port1);
+	/* LINTED E_BAD_PTR_CAST_ALIGN */
+	map->ncpm_port2 = (const uint16_t *)(map->ncpm_base +
+	    hdr->ncph_off_port2);
+	map->ncpm_state = (const uint8_t *)(map->ncpm_base +
+	    hdr->ncph_off_state);
+	map->ncpm_class = (const uint8_t *)(map->ncpm_base +
+	    hdr->ncph_off_class);
+	/* LINTED E_BAD_PTR_CAST_ALIGN */
+	map->ncpm_source1 = (const uint16_t *)(map->ncpm_base +
+	    hdr->ncph_off_source1);
+	/* LINTED E_BAD_PTR_CAST_ALIGN */
+	map->ncpm_sources = (const ncpub_source_t *)(map->ncpm_base +
+	    hdr->ncph_off_sources);
+
+	/*
+	 * Look up classes by name rather than assuming that the file was
+	 * written with the same class numbering that we use.
+	 */
+	for (i = 0; i < hdr->ncph_nclasses; i++) {
+		if (strncmp(hdr->ncph_classes[i], nc_classes[NCL_ASYMMETRIC],
+		    sizeof (hdr->ncph_classes[i])) == 0)
+			break;
+	}
+
+	if (i == hdr->ncph_nclasses) {
+		warnx("%s: result file has no \"%s\" class", path,
+		    nc_classes[NCL_ASYMMETRIC]);
+		goto fail;
+	}
+
+	map->ncpm_asym = i;
+	return (0);
+
+fail:
+	(void) munmap(map->ncpm_base, map->ncpm_size);
+	bzero(map, sizeof (*map));
+	return (-1);
+}
+
+static void
+nc_pub_unmap(ncpubmap_t *map)
+{
+	if (map->ncpm_base != NULL)
+		(void) munmap(map->ncpm_base, map->ncpm_size);
+	bzero(map, sizeof (*map));
+}
+
+/*
+ * Print one connection from a mapped result file, prefixed with "prefix".
+ */
+static void
+nc_pub_print(FILE *out, const char *prefix, const ncpubmap_t *map, size_t i)
+{
+	const ncpub_hdr_t *hdr = map->ncpm_hdr;
+	const char *state, *source;
+	char buf1[IPV4PORT_BUFSZ];
+	char buf2[IPV4PORT_BUFSZ];
+
+	nc_ipport_tostr(buf1, sizeof (buf1), map->ncpm_ip1[i],
+	    map->ncpm_port1[i]);
+	nc_ipport_tostr(buf2, sizeof (buf2), map->ncpm_ip2[i],
+	    map->ncpm_port2[i]);
+	state = map->ncpm_state[i] < hdr->ncph_nstates ?
+	    hdr->ncph_states[map->ncpm_state[i]] : "?";
+	source = map->ncpm_source1[i] < hdr->ncph_nsources ?
+	    map->ncpm_sources[map->ncpm_source1[i]].ncps_name : "?";
+	(void) fprintf(out, "%s %21s <-> %21s %-.*s (only in %-.*s)\n",
+	    prefix, buf1, buf2, NCPUB_NAMELEN, state, NCPUB_SOURCELEN, source);
+}
+
+/*
+ * Compare two published result files ("-R").  Both files list connections
+ * sorted by tuple (in nc_conn_compare() order), so we find the new, resolved,
+ * and persistent asymmetric connections with a single linear merge of the two
+ * mapped files.  Along the way, we count asymmetric connections per pair of IP
+ * addresses in each file, and then compare the sets of pairs.
+ */
+static int
+nc_resdiff(netcmp_t *ncp, const char *oldfile, const char *newfile)
+{
+	FILE *out = ncp->nc_out;
+	ncpubmap_t om, nm;
+	nchash_t opairs, npairs;
+	uint64_t (*pairs)[2];
+	uint64_t key;
+	size_t oi, ni, on, nn, npairlist, i;
+	ncbool_t oasym, nasym;
+	int cmp, rv;
+	unsigned long nnew = 0;
+	unsigned long nresolved = 0;
+	unsigned long npersist = 0;
+	unsigned long pnew = 0;
+	unsigned long presolved = 0;
+	unsigned long ppersist = 0;
+	char buf1[IPV4PORT_BUFSZ];
+	char buf2[IPV4PORT_BUFSZ];
+
+	if (nc_pub_map(oldfile, &om) != 0)
+		return (-1);
+
+	if (nc_pub_map(newfile, &nm) != 0) {
+		nc_pub_unmap(&om);
+		return (-1);
+	}
+
+	if (nc_hash_init(&opairs, 1024) != 0) {
+		nc_pub_unmap(&om);
+		nc_pub_unmap(&nm);
+		return (-1);
+	}
+
+	if (nc_hash_init(&npairs, 1024) != 0) {
+		nc_hash_fini(&opairs);
+		nc_pub_unmap(&om);
+		nc_pub_unmap(&nm);
+		return (-1);
+	}
+
+	rv = -1;
+	oi = 0;
+	ni = 0;
+	on = om.ncpm_hdr->ncph_nconns;
+	nn = nm.ncpm_hdr->ncph_nconns;
+	while (oi < on || ni < nn) {
+		if (oi == on) {
+			cmp = 1;
+		} else if (ni == nn) {
+			cmp = -1;
+		} else if (om.ncpm_ip1[oi] != nm.ncpm_ip1[ni]) {
+			cmp = om.ncpm_ip1[oi] < nm.ncpm_ip1[ni] ? -1 : 1;
+		} else if (om.ncpm_ip2[oi] != nm.ncpm_ip2[ni]) {
+			cmp = om.ncpm_ip2[oi] < nm.ncpm_ip2[ni] ? -1 : 1;
+		} else if (om.ncpm_port1[oi] != nm.ncpm_port1[ni]) {
+			cmp = om.ncpm_port1[oi] < nm.ncpm_port1[ni] ? -1 : 1;
+		} else if (om.ncpm_port2[oi] != nm.ncpm_port2[ni]) {
+			cmp = om.ncpm_port2[oi] < nm.ncpm_port2[ni] ? -1 : 1;
+		} else {
+			cmp = 0;
+		}
+
+		oasym = cmp <= 0 && om.ncpm_class[oi] == om.ncpm_asym;
+		nasym = cmp >= 0 && nm.ncpm_class[ni] == nm.ncpm_asym;
+		if (oasym) {
+			key = ((uint64_t)om.ncpm_ip1[oi] << 32) |
+			    om.ncpm_ip2[oi];
+			if (nc_hash_add(&opairs, key, 1) != 0)
+				goto out;
+		}
+
+		if (nasym) {
+			key = ((uint64_t)nm.ncpm_ip1[ni] << 32) |
+			    nm.ncpm_ip2[ni];
+			if (nc_hash_add(&npairs, key, 1) != 0)
+				goto out;
+		}
+
+		if (oasym && nasym) {
+			npersist++;
+			nc_pub_print(out, "=", &nm, ni);
+		} else if (oasym) {
+			nresolved++;
+			nc_pub_print(out, "-", &om, oi);
+		} else if (nasym) {
+			nnew++;
+			nc_pub_print(out, "+", &nm, ni);
+		}
+
+		if (cmp <= 0)
+			oi++;
+		if (cmp >= 0)
+			ni++;
+	}
+
+	/*
+	 * Now compare the pairs.  Each pair is listed with the number of
+	 * asymmetric connections between them in the newer result (or the
+	 * older one, for resolved pairs).
+	 */
+	if ((pairs = calloc(opairs.nch_nused + npairs.nch_nused + 1,
+	    sizeof (*pairs))) == NULL) {
+		warn("calloc");
+		goto out;
+	}
+
+	npairlist = 0;
+	for (i = 0; i < npairs.nch_size; i++) {
+		if (npairs.nch_counts[i] != 0) {
+			pairs[npairlist][0] = npairs.nch_counts[i];
+			pairs[npairlist++][1] = npairs.nch_keys[i];
+		}
+	}
+
+	for (i = 0; i < opairs.nch_size; i++) {
+		if (opairs.nch_counts[i] != 0 &&
+		    nc_hash_get(&npairs, opairs.nch_keys[i]) == 0) {
+			pairs[npairlist][0] = opairs.nch_counts[i];
+			pairs[npairlist++][1] = opairs.nch_keys[i];
+		}
+	}
+
+	qsort(pairs, npairlist, sizeof (*pairs), nc_group_compare);
+	(void) fprintf(out, "IP pairs with asymmetric connections:\n");
+	for (i = 0; i < npairlist; i++) {
+		key = pairs[i][1];
+		nc_ipport_tostr(buf1, sizeof (buf1), key >> 32, 0);
+		*strrchr(buf1, ':') = '\0';
+		nc_ipport_tostr(buf2, sizeof (buf2), key & UINT32_MAX, 0);
+		*strrchr(buf2, ':') = '\0';
+		if (nc_hash_get(&npairs, key) == 0) {
+			presolved++;
+			(void) fprintf(out, "- ");
+		} else if (nc_hash_get(&opairs, key) == 0) {
+			pnew++;
+			(void) fprintf(out, "+ ");
+		} else {
+			ppersist++;
+			(void) fprintf(out, "= ");
+		}
+
+		(void) fprintf(out, "%15s <-> %15s %7lu\n", buf1, buf2,
+		    (unsigned long)pairs[i][0]);
+	}
+
+	free(pairs);
+	(void) fprintf(out, "summary of asymmetric connections:\n");
+	(void) fprintf(out, "    %7lu new (only in %s)\n", nnew, newfile);
+	(void) fprintf(out, "    %7lu resolved (only in %s)\n", nresolved,
+	    oldfile);
+	(void) fprintf(out, "    %7lu persistent\n", npersist);
+	(void) fprintf(out, "summary of IP pairs with asymmetric "
+	    "connections:\n");
+	(void) fprintf(out, "    %7lu new\n", pnew);
+	(void) fprintf(out, "    %7lu resolved\n", presolved);
+	(void) fprintf(out, "    %7lu persistent\n", ppersist);
+	rv = 0;
+
+out:
+	nc_hash_fini(&opairs);
+	nc_hash_fini(&npairs);
+	nc_pub_unmap(&om);
+	nc_pub_unmap(&nm);
+	return (rv);
+}
+
+/*
+ * Append this run's measurements to the benchmark file ("-b").
+ */
+static int
+nc_bench_save(netcmp_t *ncp)
+{
+	FILE *fstream;
+	struct rusage ru;
+	double *values = ncp->nc_bench.ncb_values;
+	int m;
+
+	if (getrusage(RUSAGE_SELF, &ru) == 0) {
+#ifdef __linux__
+		values[NCB_MAXRSS] = ru.ru_maxrss;
+#else
+		/* illumos reports pages rather than kilobytes */
+		values[NCB_MAXRSS] = (double)ru.ru_maxrss *
+		    sysconf(_SC_PAGESIZE) / 1024;
+#endif
+	}
+
+	if ((fstream = fopen(ncp->nc_bench.ncb_path, "a")) == NULL) {
+		warn("fopen \"%s\"", ncp->nc_bench.ncb_path);
+		return (-1);
+	}
+
+	(void) fprintf(fstream, "{\"time\":%lld,\"rows\":%lu",
+	    (long long)ncp->nc_now, ncp->nc_nrows);
+	for (m = 0; m < NCB_NMETRICS; m++) {
+		(void) fprintf(fstream, ",\"%s\":%.*f",
+		    nc_bench_metrics[m].ncbm_name,
+		    nc_bench_metrics[m].ncbm_prec + 2, values[m]);
+	}
+
+	if (fprintf(fstream, "}\n") < 0 || fclose(fstream) != 0) {
+		warn("write \"%s\"", ncp->nc_bench.ncb_path);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Compare the runs recorded in two benchmark files ("-M").  For each metric,
+ * we report the median of each file's runs with a confidence interval, the
+ * change in the median, and the p-value of a Mann-Whitney U test of whether
+ * both sets of runs come from the same distribution.  A change for the worse
+ * of more than nc_benchthresh percent, with p < NC_BENCH_ALPHA, is flagged as a
+ * regression.  Returns the number of regressions, or -1 on failure.
+ */
+static int
+nc_bench_compare(netcmp_t *ncp, const char *oldfile, const char *newfile)
+{
+	FILE *out = ncp->nc_out;
+	ncbenchsample_t old[NCB_NMETRICS], new[NCB_NMETRICS];
+	double oldrows, newrows, thresh, change, worse, p;
+	double med[2], lo[2], hi[2];
+	char buf[2][64];
+	const char *verdict;
+	int m, prec, rv;
+	int nregress = 0;
+
+	bzero(old, sizeof (old));
+	bzero(new, sizeof (new));
+	if (nc_bench_load(oldfile, old, &oldrows) != 0 ||
+	    nc_bench_load(newfile, new, &newrows) != 0) {
+		rv = -1;
+		goto out;
+	}
+
+	if (oldrows != newrows) {
+		warnx("warning: runs ingested different numbers of rows "
+		    "(%.0f and %.0f)", oldrows, newrows);
+	}
+
+	thresh = ncp->nc_benchthresh >= 0 ?
+	    ncp->nc_benchthresh : NC_BENCH_THRESHOLD;
+	(void) fprintf(out, "comparing %s (%lu runs) with %s (%lu runs):\n",
+	    oldfile, (unsigned long)old[0].ncbs_n, newfile,
+	    (unsigned long)new[0].ncbs_n);
+	(void) fprintf(out, "%-17s %27s %27s %7s %6s\n", "METRIC",
+	    "OLD MEDIAN [95% CI]", "NEW MEDIAN [95% CI]", "CHANGE", "P");
+	for (m = 0; m < NCB_NMETRICS; m++) {
+		nc_bench_median(&old[m], &med[0], &lo[0], &hi[0]);
+		nc_bench_median(&new[m], &med[1], &lo[1], &hi[1]);
+		prec = nc_bench_metrics[m].ncbm_prec;
+		for (rv = 0; rv < 2; rv++) {
+			(void) snprintf(buf[rv], sizeof (buf[rv]),
+			    "%.*f [%.*f, %.*f]", prec, med[rv], prec, lo[rv],
+			    prec, hi[rv]);
+		}
+
+		change = med[0] != 0 ? (med[1] - med[0]) / med[0] * 100 : 0;
+		worse = nc_bench_metrics[m].ncbm_higher ? -change : change;
+		p = nc_bench_mannwhitney(&old[m], &new[m]);
+		verdict = "";
+		if (p < NC_BENCH_ALPHA && worse > thresh) {
+			verdict = "  REGRESSION";
+			nregress++;
+		} else if (p < NC_BENCH_ALPHA && -worse > thresh) {
+			verdict = "  improved";
+		}
+
+		(void) fprintf(out, "%-17s %27s %27s %+6.1f%% %6.4f%s\n",
+		    nc_bench_metrics[m].ncbm_desc, buf[0], buf[1], change, p,
+		    verdict);
+	}
+
+	(void) fprintf(out, "%d regression%s (worse by more than %.1f%%, "
+	    "p < %.2f)\n", nregress, nregress == 1 ? "" : "s", thresh,
+	    NC_BENCH_ALPHA);
+	rv = nregress;
+
+out:
+	for (m = 0; m < NCB_NMETRICS; m++) {
+		free(old[m].ncbs_values);
+		free(new[m].ncbs_values);
+	}
+
+	return (rv);
+}
+
+/*
+ * Read the benchmark file "path" ("-b"), adding each run's value of each metric
+ * to samples[metric], and then sort each sample.  The number of rows ingested
+ * by the last run is stored in *rowsp.
+ */
+static int
+nc_bench_load(const char *path, ncbenchsample_t *samples, double *rowsp)
+{
+	FILE *fstream;
+	ncbenchsample_t *s;
+	char line[NC_BENCH_LINESZ];
+	double *values;
+	double v;
+	int m, linenum = 0;
+
+	if ((fstream = fopen(path, "r")) == NULL) {
+		warn("fopen \"%s\"", path);
+		return (-1);
+	}
+
+	while (fgets(line, sizeof (line), fstream) != NULL) {
+		linenum++;
+		if (line[strspn(line, " \t\r\n")] == '\0')
+			continue;
+
+		if (nc_bench_field(line, "rows", rowsp) != 0) {
+			warnx("%s: line %d: missing \"rows\"", path, linenum);
+			(void) fclose(fstream);
+			return (-1);
+		}
+
+		for (m = 0; m < NCB_NMETRICS; m++) {
+			if (nc_bench_field(line, nc_bench_metrics[m].ncbm_name,
+			    &v) != 0) {
+				warnx("%s: line %d: missing \"%s\"", path,
+				    linenum, nc_bench_metrics[m].ncbm_name);
+				(void) fclose(fstream);
+				return (-1);
+			}
+
+			s = &samples[m];
+			if (s->ncbs_n == s->ncbs_nalloc) {
+				s->ncbs_nalloc = s->ncbs_nalloc == 0 ?
+				    16 : s->ncbs_nalloc * 2;
+				values = realloc(s->ncbs_values,
+				    s->ncbs_nalloc * sizeof (*values));
+				if (values == NULL) {
+					warn("realloc");
+					(void) fclose(fstream);
+					return (-1);
+				}
+				s->ncbs_values = values;
+			}
+
+			s->ncbs_values[s->ncbs_n++] = v;
+		}
+	}
+
+	(void) fclose(fstream);
+	if (samples[0].ncbs_n == 0) {
+		warnx("%s: no runs recorded", path);
+		return (-1);
+	}
+
+	for (m = 0; m < NCB_NMETRICS; m++) {
+		qsort(samples[m].ncbs_values, samples[m].ncbs_n,
+		    sizeof (double), nc_double_compare);
+	}
+
+	return (0);
+}
+
+/*
+ * Find the numeric field "name" in a line of a benchmark file.
+ */
+static int
+nc_bench_field(const char *line, const char *name, double *vp)
+{
+	char key[64];
+	const char *p;
+	char *endp;
+
+	(void) snprintf(key, sizeof (key), "\"%s\":", name);
+	if ((p = strstr(line, key)) == NULL)
+		return (-1);
+
+	p += strlen(key);
+	*vp = strtod(p, &endp);
+	return (endp == p ? -1 : 0);
+}
+
+/*
+ * Compute the median of a sorted sample, and a distribution-free confidence
+ * interval for it of at least about 95%: the values whose ranks are 1.96
+ * standard deviations of the binomial distribution either side of n / 2.  With
+ * fewer than about 10 runs, this is the whole range of the sample.
+ */
+static void
+nc_bench_median(const ncbenchsample_t *s, double *medp, double *lop,
+    double *hip)
+{
+	const double *x = s->ncbs_values;
+	size_t n = s->ncbs_n;
+	double d = 1.96 * sqrt((double)n) / 2;
+	long lo, hi;
+
+	*medp = n % 2 == 1 ? x[n / 2] : (x[n / 2 - 1] + x[n / 2]) / 2;
+	lo = lround(n / 2.0 - d);
+	hi = lround(n / 2.0 + 1 + d);
+	if (lo < 1)
+		lo = 1;
+	if (hi > (long)n)
+		hi = (long)n;
+	*lop = x[lo - 1];
+	*hip = x[hi - 1];
+}
+
+/*
+ * Return the two-sided p-value of the Mann-Whitney U test on two sorted
+ * samples, using the normal approximation with a correction for ties.  The
+ * approximation is reasonable with at least about 8 runs in each sample.
+ */
+static double
+nc_bench_mannwhitney(const ncbenchsample_t *a, const ncbenchsample_t *b)
+{
+	const double *x = a->ncbs_values;
+	const double *y = b->ncbs_values;
+	double na = a->ncbs_n;
+	double nb = b->ncbs_n;
+	double n = na + nb;
+	double rank = 1, ranksum = 0, ties = 0;
+	double v, t, u, sigma, z;
+	size_t i = 0, j = 0, ta, tb;
+
+	/* Merge the samples, giving tied values the average of their ranks. */
+	while (i < a->ncbs_n || j < b->ncbs_n) {
+		v = j == b->ncbs_n || (i < a->ncbs_n && x[i] <= y[j]) ?
+		    x[i] : y[j];
+		for (ta = 0; i < a->ncbs_n && x[i] == v; i++)
+			ta++;
+		for (tb = 0; j < b->ncbs_n && y[j] == v; j++)
+			tb++;
+		t = ta + tb;
+		ranksum += ta * (rank + (t - 1) / 2);
+		ties += t * t * t - t;
+		rank += t;
+	}
+
+	u = ranksum - na * (na + 1) / 2;
+	sigma = sqrt(na * nb / 12 * (n + 1 - ties / (n * (n - 1))));
+	if (sigma == 0)
+		return (1);
+
+	z = (fabs(u - na * nb / 2) - 0.5) / sigma;
+	return (z <= 0 ? 1 : erfc(z / sqrt(2)));
+}
+
+/*
+ * Load the connection age file (if it exists), record in each connection when
+ * it was first seen, and then write out a new age file describing the current
+ * set of connections.  Connections that have gone away are dropped from the
+ * file.  The new file is written to a temporary file and renamed into place so
+ * that an interrupted run doesn't lose the history.
+ */
+static int
+nc_age_update(netcmp_t *ncp)
+{
+	FILE *fstream;
+	ncconn_t *ncc;
+	ncagerec_t *old = NULL;
+	ncagerec_t *new, *nca, key;
+	size_t nold = 0;
+	size_t nnew = 0;
+	char magic[NC_AGE_MAGICSZ];
+	char tmpfile[PATH_MAX];
+	uint64_t count;
+
+	if ((fstream = fopen(ncp->nc_agefile, "r")) != NULL) {
+		if (fread(magic, sizeof (magic), 1, fstream) != 1 ||
+		    bcmp(magic, NC_AGE_MAGIC, sizeof (magic)) != 0 ||
+		    fread(&count, sizeof (count), 1, fstream) != 1) {
+			warnx("%s: not a connection age file",
+			    ncp->nc_agefile);
+			(void) fclose(fstream);
+			return (-1);
+		}
+
+		if (count != 0 &&
+		    (old = calloc(count, sizeof (*old))) == NULL) {
+			warn("calloc");
+			(void) fclose(fstream);
+			return (-1);
+		}
+
+		nold = count;
+		if (fread(old, sizeof (*old), nold, fstream) != nold) {
+			warnx("%s: truncated connection age file",
+			    ncp->nc_agefile);
+			free(old);
+			(void) fclose(fstream);
+			return (-1);
+		}
+
+		(void) fclose(fstream);
+	} else if (errno != ENOENT) {
+		warn("fopen \"%s\"", ncp->nc_agefile);
+		return (-1);
+	}
+
+	if ((new = calloc(ncp->nc_nconns + 1,
+	    sizeof (*new))) == NULL) {
+		warn("calloc");
+		free(old);
+		return (-1);
+	}
+
+	for (ncc = nc_conn_first(ncp); ncc != NULL;
+	    ncc = nc_conn_next(ncp, ncc)) {
+		nc_conn_tuple(ncc, &key);
+		nca = nold == 0 ? NULL : bsearch(&key, old, nold,
+		    sizeof (*old), nc_agerec_compare);
+		ncc->ncc_firstseen = nca != NULL ?
+		    nca->nca_firstseen : (uint32_t)ncp->nc_now;
+		key.nca_firstseen = ncc->ncc_firstseen;
+		new[nnew++] = key;
+	}
+
+	free(old);
+	qsort(new, nnew, sizeof (*new), nc_agerec_compare);
+
+	(void) snprintf(tmpfile, sizeof (tmpfile), "%s.tmp", ncp->nc_agefile);
+	if ((fstream = fopen(tmpfile, "w")) == NULL) {
+		warn("fopen \"%s\"", tmpfile);
+		free(new);
+		return (-1);
+	}
+
+	count = nnew;
+	if (fwrite(NC_AGE_MAGIC, NC_AGE_MAGICSZ, 1, fstream) != 1 ||
+	    fwrite(&count, sizeof (count), 1, fstream) != 1 ||
+	    fwrite(new, sizeof (*new), nnew, fstream) != nnew ||
+	    fclose(fstream) != 0) {
+		warn("write \"%s\"", tmpfile);
+		free(new);
+		return (-1);
+	}
+
+	free(new);
+	if (rename(tmpfile, ncp->nc_agefile) != 0) {
+		warn("rename \"%s\"", tmpfile);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Load the ingest checkpoint file ("-c"), if it exists.  "nfiles" and "files"
+ * are the input files for this run, which must include all of the files that
+ * the checkpoint covers.
+ */
+static int
+nc_ckpt_load(netcmp_t *ncp, int nfiles, char *files[])
+{
+	FILE *fstream;
+	ncckpthdr_t hdr;
+	ncpub_source_t plabel;
+	ncckptsrc_t psrc;
+	ncckptconn_t pconn;
+	nclabel_t *label;
+	ncsource_t src, *ncs;
+	ncconn_t *ncc;
+	avl_index_t where;
+	char magic[NC_CKPT_MAGICSZ];
+	char name[PATH_MAX];
+	uint64_t n;
+	size_t len;
+	int c, i, k;
+
+	if ((fstream = fopen(ncp->nc_ckptfile, "r")) == NULL) {
+		if (errno == ENOENT)
+			return (0);
+		warn("fopen \"%s\"", ncp->nc_ckptfile);
+		return (-1);
+	}
+
+	if (fread(magic, sizeof (magic), 1, fstream) != 1 ||
+	    bcmp(magic, NC_CKPT_MAGIC, sizeof (magic)) != 0 ||
+	    fread(&hdr, sizeof (hdr), 1, fstream) != 1) {
+		warnx("%s: not a checkpoint file", ncp->nc_ckptfile);
+		(void) fclose(fstream);
+		return (-1);
+	}
+
+	for (n = 0; n < hdr.ncch_nlabels; n++) {
+		if (fread(&plabel, sizeof (plabel), 1, fstream) != 1)
+			goto truncated;
+
+		plabel.ncps_name[sizeof (plabel.ncps_name) - 1] = '\0';
+		if ((label = nc_label_lookup(ncp, plabel.ncps_name)) == NULL) {
+			(void) fclose(fstream);
+			return (-1);
+		}
+
+		label->ncl_captured = plabel.ncps_captured;
+	}
+
+	for (n = 0; n < hdr.ncch_nsources; n++) {
+		if (fread(&psrc, sizeof (psrc), 1, fstream) != 1)
+			goto truncated;
+
+		bzero(&src, sizeof (src));
+		src.ncs_ip = psrc.nccs_ip;
+		if (psrc.nccs_label >= ncp->nc_nlabels ||
+		    avl_find(&ncp->nc_sources, &src, &where) != NULL)
+			goto corrupt;
+
+		if ((ncs = nc_arena_alloc(&ncp->nc_arena,
+		    sizeof (*ncs))) == NULL) {
+			(void) fclose(fstream);
+			return (-1);
+		}
+
+		ncs->ncs_ip = psrc.nccs_ip;
+		ncs->ncs_label = ncp->nc_labels[psrc.nccs_label];
+		avl_insert(&ncp->nc_sources, ncs, where);
+	}
+
+	for (n = 0; n < hdr.ncch_nconns; n++) {
+		if (fread(&pconn, sizeof (pconn), 1, fstream) != 1)
+			goto truncated;
+
+		if (pconn.nccc_state >= NS_NSTATES ||
+		    pconn.nccc_nsources == 0)
+			goto corrupt;
+
+		if ((ncc = nc_conn_insert(ncp, pconn.nccc_ip1, pconn.nccc_ip2,
+		    pconn.nccc_port1, pconn.nccc_port2)) == NULL) {
+			(void) fclose(fstream);
+			return (-1);
+		}
+
+		if (ncc->ncc_nsources != 0)
+			goto corrupt;
+
+		for (k = 0; k < pconn.nccc_nsources && k < 2; k++) {
+			if (pconn.nccc_side[k] != 1 && pconn.nccc_side[k] != 2)
+				goto corrupt;
+
+			bzero(&src, sizeof (src));
+			src.ncs_ip = pconn.nccc_side[k] == 2 ?
+			    pconn.nccc_ip2 : pconn.nccc_ip1;
+			if ((ncs = avl_find(&ncp->nc_sources,
+			    &src, NULL)) == NULL)
+				goto corrupt;
+
+			ncc->ncc_pair->ncpr_sources[pconn.nccc_side[k] - 1] =
+			    ncs;
+			ncc->ncc_sides |= pconn.nccc_side[k] << (2 * k);
+		}
+
+		ncc->ncc_state = pconn.nccc_state;
+		ncc->ncc_nsources = pconn.nccc_nsources;
+	}
+
+	for (n = 0; n < hdr.ncch_nfiles; n++) {
+		len = 0;
+		while ((c = getc(fstream)) != EOF && c != '\0') {
+			if (len == sizeof (name) - 1)
+				goto corrupt;
+			name[len++] = c;
+		}
+
+		if (c == EOF)
+			goto truncated;
+
+		name[len] = '\0';
+		for (i = 0; i < nfiles; i++) {
+			if (strcmp(files[i], name) == 0)
+				break;
+		}
+
+		if (i == nfiles) {
+			warnx("%s: checkpoint includes \"%s\", which is not "
+			    "one of the input files", ncp->nc_ckptfile, name);
+			(void) fclose(fstream);
+			return (-1);
+		}
+
+		if (nc_ckpt_add(ncp, files[i]) != 0) {
+			(void) fclose(fstream);
+			return (-1);
+		}
+	}
+
+	(void) fclose(fstream);
+	if ((hdr.ncch_others & NC_CKPT_NETNS) != 0 && !ncp->nc_netns) {
+		warnx("%s: checkpoint includes connections from -N, which "
+		    "was not specified", ncp->nc_ckptfile);
+		return (-1);
+	}
+
+	if ((hdr.ncch_others & NC_CKPT_TRACKER) != 0 &&
+	    ncp->nc_trackdir == NULL) {
+		warnx("%s: checkpoint includes connections from -B, which "
+		    "was not specified", ncp->nc_ckptfile);
+		return (-1);
+	}
+
+	ncp->nc_ckptothers = hdr.ncch_others;
+	ncp->nc_nlocalhost = hdr.ncch_nlocalhost;
+	ncp->nc_nrows = hdr.ncch_nrows;
+	if (ncp->nc_debug) {
+		(void) fprintf(stderr, "resumed from checkpoint \"%s\": "
+		    "%u files, %lu connections\n", ncp->nc_ckptfile,
+		    ncp->nc_nckptfiles, ncp->nc_nconns);
+	}
+
+	return (0);
+
+truncated:
+	warnx("%s: truncated checkpoint file", ncp->nc_ckptfile);
+	(void) fclose(fstream);
+	return (-1);
+
+corrupt:
+	warnx("%s: corrupt checkpoint file", ncp->nc_ckptfile);
+	(void) fclose(fstream);
+	return (-1);
+}
+
+/*
+ * Returns true if the named input file is covered by the checkpoint.
+ */
+static int
+nc_ckpt_done(netcmp_t *ncp, const char *filename)
+{
+	unsigned int i;
+
+	for (i = 0; i < ncp->nc_nckptfiles; i++) {
+		if (strcmp(ncp->nc_ckptfiles[i], filename) == 0)
+			return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * Record that the named input file has been read completely.
+ */
+static int
+nc_ckpt_add(netcmp_t *ncp, const char *filename)
+{
+	char **files;
+
+	if ((files = realloc(ncp->nc_ckptfiles,
+	    (ncp->nc_nckptfiles + 1) * sizeof (*files))) == NULL) {
+		warn("realloc");
+		return (-1);
+	}
+
+	ncp->nc_ckptfiles = files;
+	if ((files[ncp->nc_nckptfiles] = strdup(filename)) == NULL) {
+		warn("strdup");
+		return (-1);
+	}
+
+	ncp->nc_nckptfiles++;
+	return (0);
+}
+
+/*
+ * Write the ingest checkpoint file if it's been at least NC_CKPT_INTERVAL
+ * seconds since the last time.  As with the age file, we write a temporary file
+ * and rename it into place so that an interruption never leaves a partial
+ * checkpoint.
+ */
+static int
+nc_ckpt_save(netcmp_t *ncp)
+{
+	FILE *fstream;
+	ncckpthdr_t hdr;
+	ncpub_source_t plabel;
+	ncckptsrc_t psrc;
+	ncckptconn_t pconn;
+	ncsource_t *ncs;
+	ncconn_t *ncc;
+	char tmpfile[PATH_MAX];
+	unsigned int i;
+	int k, rv;
+	double now;
+
+	now = nc_time();
+	if (now - ncp->nc_ckptlast < NC_CKPT_INTERVAL)
+		return (0);
+
+	ncp->nc_ckptlast = now;
+	(void) snprintf(tmpfile, sizeof (tmpfile), "%s.tmp", ncp->nc_ckptfile);
+	if ((fstream = fopen(tmpfile, "w")) == NULL) {
+		warn("fopen \"%s\"", tmpfile);
+		return (-1);
+	}
+
+	bzero(&hdr, sizeof (hdr));
+	hdr.ncch_nconns = ncp->nc_nconns;
+	hdr.ncch_nlocalhost = ncp->nc_nlocalhost;
+	hdr.ncch_nrows = ncp->nc_nrows;
+	hdr.ncch_nlabels = ncp->nc_nlabels;
+	hdr.ncch_nsources = avl_numnodes(&ncp->nc_sources);
+	hdr.ncch_nfiles = ncp->nc_nckptfiles;
+	hdr.ncch_others = ncp->nc_ckptothers;
+	rv = 0;
+	if (fwrite(NC_CKPT_MAGIC, NC_CKPT_MAGICSZ, 1, fstream) != 1 ||
+	    fwrite(&hdr, sizeof (hdr), 1, fstream) != 1) {
+		rv = -1;
+	}
+
+	for (i = 0; rv == 0 && i < ncp->nc_nlabels; i++) {
+		bzero(&plabel, sizeof (plabel));
+		(void) strlcpy(plabel.ncps_name, ncp->nc_labels[i]->ncl_name,
+		    sizeof (plabel.ncps_name));
+		plabel.ncps_captured = ncp->nc_labels[i]->ncl_captured;
+		if (fwrite(&plabel, sizeof (plabel), 1, fstream) != 1)
+			rv = -1;
+	}
+
+	for (ncs = avl_first(&ncp->nc_sources); rv == 0 && ncs != NULL;
+	    ncs = AVL_NEXT(&ncp->nc_sources, ncs)) {
+		psrc.nccs_ip = ncs->ncs_ip;
+		psrc.nccs_label = ncs->ncs_label->ncl_id;
+		if (fwrite(&psrc, sizeof (psrc), 1, fstream) != 1)
+			rv = -1;
+	}
+
+	for (ncc = nc_conn_first(ncp); rv == 0 && ncc != NULL;
+	    ncc = nc_conn_next(ncp, ncc)) {
+		bzero(&pconn, sizeof (pconn));
+		pconn.nccc_ip1 = NCC_IP1(ncc);
+		pconn.nccc_ip2 = NCC_IP2(ncc);
+		pconn.nccc_port1 = ncc->ncc_port1;
+		pconn.nccc_port2 = ncc->ncc_port2;
+		pconn.nccc_state = ncc->ncc_state;
+		pconn.nccc_nsources = ncc->ncc_nsources;
+		for (k = 0; k < ncc->ncc_nsources && k < 2; k++)
+			pconn.nccc_side[k] = NCC_SIDE(ncc, k);
+
+		if (fwrite(&pconn, sizeof (pconn), 1, fstream) != 1)
+			rv = -1;
+	}
+
+	for (i = 0; rv == 0 && i < ncp->nc_nckptfiles; i++) {
+		if (fwrite(ncp->nc_ckptfiles[i],
+		    strlen(ncp->nc_ckptfiles[i]) + 1, 1, fstream) != 1)
+			rv = -1;
+	}
+
+	if (fclose(fstream) != 0 || rv != 0) {
+		warn("write \"%s\"", tmpfile);
+		return (-1);
+	}
+
+	if (rename(tmpfile, ncp->nc_ckptfile) != 0) {
+		warn("rename \"%s\"", tmpfile);
+		return (-1);
+	}
+
+	if (ncp->nc_debug) {
+		(void) fprintf(stderr, "saved checkpoint \"%s\" (%u files)\n",
+		    ncp->nc_ckptfile, ncp->nc_nckptfiles);
+	}
+
+	return (0);
+}
+
+/*
+ * Dump all information we have about one of the connections.  This is intended
+ * for "verbose" mode.
+ */
+static void
+nc_conn_dump(FILE *stream, ncconn_t *ncc)
+{
+	int i;
+	char buf1[IPV4PORT_BUFSZ];
+	char buf2[IPV4PORT_BUFSZ];
+
+	nc_ipport_tostr(buf1, sizeof (buf1), NCC_IP1(ncc), ncc->ncc_port1);
+	nc_ipport_tostr(buf2, sizeof (buf2), NCC_IP2(ncc), ncc->ncc_port2);
+
+	(void) fprintf(stream, "    %21s <-> %21s\n", buf1, buf2);
+	for (i = 0; i < ncc->ncc_nsources && i < 2; i++) {
+		fprintf(stream, "        source: %s\n",
+		    NCC_SOURCE(ncc, i)->ncs_label->ncl_name);
+	}
+}
+
+/*
+ * In debug mode, count a connection in diagnostic category "cat", and keep it
+ * as an example if we don't yet have nc_nsamples of them.
+ */
+static void
+nc_diag_record(netcmp_t *ncp, ncdiagcat_t cat, ncconn_t *ncc)
+{
+	ncdiag_t *diag = &ncp->nc_diag[cat];
+
+	if (!ncp->nc_debug)
+		return;
+
+	if (diag->ncd_count < ncp->nc_nsamples) {
+		if (diag->ncd_samples == NULL && (diag->ncd_samples =
+		    calloc(ncp->nc_nsamples, sizeof (ncconn_t *))) == NULL) {
+			err(EXIT_FAILURE, "calloc");
+		}
+
+		diag->ncd_samples[diag->ncd_count] = ncc;
+	}
+
+	diag->ncd_count++;
+}
+
+/*
+ * In debug mode, print the count of connections in each diagnostic category
+ * along with the examples we kept, then reset the counts.  This goes through a
+ * fully-buffered copy of stderr, since stderr itself is unbuffered.
+ */
+static void
+nc_diag_report(netcmp_t *ncp)
+{
+	ncdiag_t *diag;
+	FILE *stream;
+	unsigned long i;
+	int fd;
+	ncdiagcat_t cat;
+
+	if (!ncp->nc_debug)
+		return;
+
+	if ((fd = dup(STDERR_FILENO)) < 0 ||
+	    (stream = fdopen(fd, "w")) == NULL) {
+		warn("failed to open debug stream");
+		if (fd >= 0)
+			(void) close(fd);
+		stream = stderr;
+	}
+
+	for (cat = 0; cat < NCD_NCATEGORIES; cat++) {
+		diag = &ncp->nc_diag[cat];
+		if (diag->ncd_count == 0)
+			continue;
+
+		(void) fprintf(stream, "found %lu connection%s %s",
+		    diag->ncd_count, diag->ncd_count == 1 ? "" : "s",
+		    nc_diag_descs[cat]);
+		if (diag->ncd_count > ncp->nc_nsamples) {
+			(void) fprintf(stream, " (showing %lu)",
+			    ncp->nc_nsamples);
+		}
+		(void) fprintf(stream, "%s\n", ncp->nc_nsamples > 0 ? ":" : "");
+
+		for (i = 0; i < diag->ncd_count && i < ncp->nc_nsamples; i++)
+			nc_conn_dump(stream, diag->ncd_samples[i]);
+
+		free(diag->ncd_samples);
+		diag->ncd_samples = NULL;
+		diag->ncd_count = 0;
+	}
+
+	if (stream != stderr)
+		(void) fclose(stream);
+}
+
+/*
+ * Writes into "buf" a string representation of the given IPv4 address and port.
+ * This NULL-terminates as long as bufsz > 0, and the string will be complete as
+ * long as bufsz > IPV4PORT_BUFSZ.
+ */
+static void
+nc_ipport_tostr(char *buf, size_t bufsz, uint32_t ip, uint16_t port)
+{
+	(void) snprintf(buf, bufsz, "%u.%u.%u.%u:%d", ip >> 24,
+	    (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, port);
+}
+
+/*
+ * Writes into "buf" a string representation of the given IPv4 address.  This
+ * behaves like nc_ipport_tostr(), with IPV4_STRBUFSZ in place of
+ * IPV4PORT_BUFSZ.
+ */
+static void
+nc_ip_tostr(char *buf, size_t bufsz, uint32_t ip)
+{
+	(void) snprintf(buf, bufsz, "%u.%u.%u.%u", ip >> 24,
+	    (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff);
+}
+
+/*
+ * Writes into "buf" a short, human-readable representation of an age in
+ * seconds (e.g., "3d04h").
+ */
+static void
+nc_age_tostr(char *buf, size_t bufsz, unsigned long age)
+{
+	if (age >= 86400) {
+		(void) snprintf(buf, bufsz, "%lud%02luh", age / 86400,
+		    (age % 86400) / 3600);
+	} else if (age >= 3600) {
+		(void) snprintf(buf, bufsz, "%luh%02lum", age / 3600,
+		    (age % 3600) / 60);
+	} else if (age >= 60) {
+		(void) snprintf(buf, bufsz, "%lum%02lus", age / 60, age % 60);
+	} else {
+		(void) snprintf(buf, bufsz, "%lus", age);
+	}
+}
 
-			ncc_error = ncc;
-			nerror++;
-			continue;
+
+/*
+ * Private functions
+ */
+
+/*
+ * Map a new arena chunk of "chunksz" bytes (a multiple of the large page size),
+ * aligned to the large page size and backed by large pages if possible.
+ * Returns NULL on failure.
+ */
+static char *
+nc_arena_map(ncarena_t *ncar, size_t chunksz)
+{
+	char *chunk, *base;
+	size_t mapsz, lead;
+
+	/*
+	 * Map enough extra to align the chunk to the large page size, then trim
+	 * off the unaligned head and tail.
+	 */
+	mapsz = chunksz + NC_LARGEPAGESZ;
+	base = mmap(NULL, mapsz, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (base == MAP_FAILED) {
+		warn("mmap");
+		return (NULL);
+	}
+
+	lead = (NC_LARGEPAGESZ - ((uintptr_t)base & (NC_LARGEPAGESZ - 1))) &
+	    (NC_LARGEPAGESZ - 1);
+	chunk = base + lead;
+	if (lead != 0)
+		(void) munmap(base, lead);
+	(void) munmap(chunk + chunksz, mapsz - lead - chunksz);
+
+	if (!ncar->ncar_nolarge) {
+#if defined(MADV_HUGEPAGE)
+		if (madvise(chunk, chunksz, MADV_HUGEPAGE) == 0)
+			ncar->ncar_nlarge += chunksz;
+#elif defined(MC_HAT_ADVISE)
+		struct memcntl_mha mha;
+
+		bzero(&mha, sizeof (mha));
+		mha.mha_cmd = MHA_MAPSIZE_VA;
+		mha.mha_pagesize = NC_LARGEPAGESZ;
+		if (memcntl(chunk, chunksz, MC_HAT_ADVISE, (caddr_t)&mha,
+		    0, 0) == 0) {
+			ncar->ncar_nlarge += chunksz;
 		}
+#endif
+	}
 
-		if (ncc->ncc_nsources == 2) {
-			nsymmetric++;
-			continue;
+	ncar->ncar_nchunks++;
+	ncar->ncar_nbytes += chunksz;
+	return (chunk);
+}
+
+/*
+ * Unmap a chunk of "chunksz" bytes returned by nc_arena_map().  This is only
+ * for chunks that the caller used directly, rather than ones that
+ * nc_arena_alloc() allocates from.
+ */
+static void
+nc_arena_unmap(ncarena_t *ncar, char *chunk, size_t chunksz)
+{
+	(void) munmap(chunk, chunksz);
+	ncar->ncar_nchunks--;
+	ncar->ncar_nbytes -= chunksz;
+	if (!ncar->ncar_nolarge && ncar->ncar_nlarge >= chunksz)
+		ncar->ncar_nlarge -= chunksz;
+}
+
+/*
+ * Allocate "size" bytes of zeroed memory from the arena.  Allocations are
+ * 8-byte aligned and can never be freed.  Returns NULL on failure.
+ */
+static void *
+nc_arena_alloc(ncarena_t *ncar, size_t size)
+{
+	char *chunk;
+	size_t chunksz;
+	void *rv;
+
+	size = (size + 7) & ~(size_t)7;
+
+	/*
+	 * A request that won't fit in a normal chunk gets its own chunk.  We
+	 * link it in behind the current chunk, if any, so that we keep
+	 * allocating from what's left of that one.
+	 */
+	if (size > NC_ARENA_CHUNKSZ - sizeof (char *)) {
+		chunksz = (size + sizeof (char *) + NC_LARGEPAGESZ - 1) &
+		    ~(size_t)(NC_LARGEPAGESZ - 1);
+		if ((chunk = nc_arena_map(ncar, chunksz)) == NULL)
+			return (NULL);
+
+		if (ncar->ncar_chunk == NULL) {
+			*(char **)chunk = NULL;
+			ncar->ncar_chunk = chunk;
+			ncar->ncar_used = NC_ARENA_CHUNKSZ;
+		} else {
+			*(char **)chunk = *(char **)ncar->ncar_chunk;
+			*(char **)ncar->ncar_chunk = chunk;
+		}
+
+		return (chunk + sizeof (char *));
+	}
+
+	if (ncar->ncar_chunk == NULL ||
+	    ncar->ncar_used + size > NC_ARENA_CHUNKSZ) {
+		if ((chunk = nc_arena_map(ncar, NC_ARENA_CHUNKSZ)) == NULL)
+			return (NULL);
+
+		*(char **)chunk = ncar->ncar_chunk;
+		ncar->ncar_chunk = chunk;
+		ncar->ncar_used = sizeof (char *);
+	}
+
+	/* Freshly mapped anonymous memory is already zeroed. */
+	rv = ncar->ncar_chunk + ncar->ncar_used;
+	ncar->ncar_used += size;
+	return (rv);
+}
+
+/*
+ * Report on the arena's memory usage and whether large pages were used.  On
+ * systems where we can tell, this reports how much anonymous memory is
+ * actually backed by huge pages.
+ */
+static void
+nc_arena_report(FILE *stream, ncarena_t *ncar)
+{
+	FILE *smaps;
+	char line[128];
+	unsigned long kb;
+
+	(void) fprintf(stream, "arena: %lu chunk%s (%lu MB), ",
+	    ncar->ncar_nchunks, ncar->ncar_nchunks == 1 ? "" : "s",
+	    (unsigned long)(ncar->ncar_nbytes / (1024 * 1024)));
+	if (ncar->ncar_nolarge) {
+		(void) fprintf(stream, "large pages disabled\n");
+	} else {
+		(void) fprintf(stream, "large pages advised for %lu MB\n",
+		    (unsigned long)(ncar->ncar_nlarge / (1024 * 1024)));
+	}
+
+	if ((smaps = fopen("/proc/self/smaps_rollup", "r")) == NULL)
+		return;
+
+	while (fgets(line, sizeof (line), smaps) != NULL) {
+		if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+			(void) fprintf(stream, "arena: %lu MB of anonymous "
+			    "memory backed by huge pages\n", kb / 1024);
+			break;
+		}
+	}
+
+	(void) fclose(smaps);
+}
+
+/*
+ * Returns the current value of a monotonic clock, in seconds.
+ */
+static double
+nc_time(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Record a single row of netstat output from the source with the given label.
+ */
+static int
+nc_parse_row(netcmp_t *ncp, nclabel_t *label, const ncrow_t *row)
+{
+	ncsource_t src, *ncs;
+	avl_index_t avlwhere;
+	ncrow_t xrow;
+
+	/*
+	 * If a NAT gateway translated this connection, use the real remote end
+	 * (see ncnat_t).
+	 */
+	if (ncp->nc_nat.ncn_ntrans != 0 &&
+	    nc_nat_translate(&ncp->nc_nat, row, &xrow))
+		row = &xrow;
+
+	/*
+	 * Ignore connections over 127.0.0.1.  Our methodology assumes IPs are
+	 * unique across all input, which isn't the case here.  That's okay,
+	 * because it's pretty unlikely there would be an asymmetry over
+	 * localhost.
+	 */
+	if (row->ncrw_ip1 == NC_LOCALHOST || row->ncrw_ip2 == NC_LOCALHOST) {
+		ncp->nc_nlocalhost++;
+		return (0);
+	}
+
+	if (row->ncrw_tcpinfo != NULL && nc_tcpinfo_add(ncp, row) != 0)
+		return (-1);
+
+	/*
+	 * Make sure that we have a source record based on the local IP address.
+	 * We look up records using a key on the stack and only allocate a
+	 * record from the arena if it turns out to be new.
+	 */
+	bzero(&src, sizeof (src));
+	src.ncs_ip = row->ncrw_ip1;
+	ncs = avl_find(&ncp->nc_sources, &src, &avlwhere);
+	if (ncs == NULL) {
+		if ((ncs = nc_arena_alloc(&ncp->nc_arena,
+		    sizeof (*ncs))) == NULL) {
+			return (-1);
+		}
+
+		ncs->ncs_ip = row->ncrw_ip1;
+		ncs->ncs_label = label;
+		avl_insert(&ncp->nc_sources, ncs, avlwhere);
+	}
+
+	return (nc_conn_record(ncp, ncs, row));
+}
+
+/*
+ * Record that source "ncs" (whose IP address is the local one in "row") has
+ * the connection in "row".
+ */
+static int
+nc_conn_record(netcmp_t *ncp, ncsource_t *ncs, const ncrow_t *row)
+{
+	ncconn_t *ncc;
+	unsigned int side;
+
+	/*
+	 * Sort the two (IP, port) tuples to normalize the connection
+	 * identifier, and make sure that we have a record for it.  The source
+	 * is for the local IP address, which is on side 1 (ip1) if the tuples
+	 * were already in order and side 2 otherwise.
+	 */
+	ncp->nc_nrows++;
+	if (row->ncrw_ip1 > row->ncrw_ip2 || (row->ncrw_ip1 == row->ncrw_ip2 &&
+	    row->ncrw_port1 > row->ncrw_port2)) {
+		side = 2;
+		ncc = nc_conn_insert(ncp, row->ncrw_ip2, row->ncrw_ip1,
+		    row->ncrw_port2, row->ncrw_port1);
+	} else {
+		side = 1;
+		ncc = nc_conn_insert(ncp, row->ncrw_ip1, row->ncrw_ip2,
+		    row->ncrw_port1, row->ncrw_port2);
+	}
+
+	if (ncc == NULL)
+		return (-1);
+
+	if (ncc->ncc_nsources == 0)
+		ncc->ncc_state = row->ncrw_state;
+
+	/*
+	 * Update the record to refer to this source.  We only actually keep two
+	 * sources.
+	 */
+	ncc->ncc_pair->ncpr_sources[side - 1] = ncs;
+	if (ncc->ncc_nsources < 2) {
+		ncc->ncc_sides |= side << (2 * ncc->ncc_nsources);
+		ncc->ncc_nsources++;
+	} else if (ncc->ncc_nsources < UINT8_MAX) {
+		ncc->ncc_nsources++;
+	}
+
+	return (0);
+}
+
+/*
+ * Like nc_parse_row(), but record the row as a packed record in the snapshot
+ * currently being read ("-D" mode).
+ */
+static int
+nc_snap_row(netcmp_t *ncp, nclabel_t *label, const ncrow_t *row)
+{
+	ncsnap_t *snap = &ncp->nc_snap;
+	ncrec_t *ncr;
+	size_t nalloc;
+
+	/* All records in a snapshot come from the same source. */
+	(void) label;
+
+	if (snap->ncsn_nrecs == snap->ncsn_nalloc) {
+		nalloc = snap->ncsn_nalloc == 0 ? 1024 : snap->ncsn_nalloc * 2;
+		ncr = realloc(snap->ncsn_recs, nalloc * sizeof (*ncr));
+		if (ncr == NULL) {
+			warn("realloc");
+			return (-1);
+		}
+
+		snap->ncsn_recs = ncr;
+		snap->ncsn_nalloc = nalloc;
+	}
+
+	/*
+	 * Unlike nc_parse_row(), we keep connections over 127.0.0.1: both
+	 * snapshots come from the same system, so these are still unique.
+	 */
+	ncr = &snap->ncsn_recs[snap->ncsn_nrecs++];
+	bzero(ncr, sizeof (*ncr));
+	ncr->ncr_ip1 = row->ncrw_ip1;
+	ncr->ncr_ip2 = row->ncrw_ip2;
+	ncr->ncr_port1 = row->ncrw_port1;
+	ncr->ncr_port2 = row->ncrw_port2;
+	ncr->ncr_state = row->ncrw_state;
+	return (0);
+}
+
+/*
+ * Returns the slot in "ncpr"'s connection table for the given ports: either
+ * the slot holding that connection or the empty slot where it belongs.  Only
+ * valid before nc_index_freeze().
+ */
+static ncconn_t *
+nc_pair_slot(ncpair_t *ncpr, uint16_t port1, uint16_t port2)
+{
+	ncconn_t *ncc;
+	uint32_t i, mask;
+
+	mask = ncpr->ncpr_size - 1;
+	i = (uint32_t)nc_keyhash((uint64_t)port1 << 16 | port2,
+	    (uint64_t)ncpr->ncpr_ip1 << 32 | ncpr->ncpr_ip2);
+	for (;;) {
+		ncc = &ncpr->ncpr_conns[i & mask];
+		if (ncc->ncc_nsources == 0 || (ncc->ncc_port1 == port1 &&
+		    ncc->ncc_port2 == port2)) {
+			return (ncc);
+		}
+		i++;
+	}
+}
+
+/*
+ * Find the record for the connection with the given (normalized) tuple,
+ * creating it if needed.  A new record has ncc_nsources == 0, and the caller
+ * must fill it in (making it non-zero) before inserting any other connection.
+ * Only valid before nc_index_freeze().
+ */
+static ncconn_t *
+nc_conn_insert(netcmp_t *ncp, uint32_t ip1, uint32_t ip2, uint16_t port1,
+    uint16_t port2)
+{
+	ncpair_t pair, *ncpr;
+	ncconn_t *ncc, *old;
+	avl_index_t where;
+	uint32_t i, oldsize;
+
+	bzero(&pair, sizeof (pair));
+	pair.ncpr_ip1 = ip1;
+	pair.ncpr_ip2 = ip2;
+	ncpr = avl_find(&ncp->nc_pairs, &pair, &where);
+	if (ncpr == NULL) {
+		if ((ncpr = nc_arena_alloc(&ncp->nc_arena,
+		    sizeof (*ncpr))) == NULL) {
+			return (NULL);
+		}
+
+		bcopy(&pair, ncpr, sizeof (*ncpr));
+		avl_insert(&ncp->nc_pairs, ncpr, where);
+	}
+
+	/*
+	 * Keep the table at most 3/4 full.
+	 */
+	if ((ncpr->ncpr_nconns + 1) * 4 > ncpr->ncpr_size * 3) {
+		old = ncpr->ncpr_conns;
+		oldsize = ncpr->ncpr_size;
+		ncpr->ncpr_size = oldsize == 0 ? NC_PAIR_MINSIZE : oldsize * 2;
+		if ((ncpr->ncpr_conns = nc_conn_table_alloc(ncp,
+		    ncpr->ncpr_size)) == NULL) {
+			ncpr->ncpr_conns = old;
+			ncpr->ncpr_size = oldsize;
+			return (NULL);
+		}
+
+		for (i = 0; i < oldsize; i++) {
+			if (old[i].ncc_nsources != 0) {
+				*nc_pair_slot(ncpr, old[i].ncc_port1,
+				    old[i].ncc_port2) = old[i];
+			}
+		}
+
+		if (old != NULL)
+			nc_conn_table_free(ncp, old, oldsize);
+	}
+
+	ncc = nc_pair_slot(ncpr, port1, port2);
+	if (ncc->ncc_nsources == 0) {
+		ncc->ncc_pair = ncpr;
+		ncc->ncc_port1 = port1;
+		ncc->ncc_port2 = port2;
+		ncpr->ncpr_nconns++;
+		ncp->nc_nconns++;
+	}
+
+	return (ncc);
+}
+
+/*
+ * Returns the first connection at or after slot "i" of pair "ncpr", moving on
+ * to subsequent pairs as needed, or NULL if there are no more connections.
+ */
+static ncconn_t *
+nc_conn_scan(netcmp_t *ncp, ncpair_t *ncpr, size_t i)
+{
+	for (; ncpr != NULL; ncpr = AVL_NEXT(&ncp->nc_pairs, ncpr), i = 0) {
+		for (; i < ncpr->ncpr_size; i++) {
+			if (ncpr->ncpr_conns[i].ncc_nsources != 0)
+				return (&ncpr->ncpr_conns[i]);
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Iterate all connections.  After nc_index_freeze(), connections are visited
+ * in sorted order.  (Before that, the order within each pair is arbitrary.)
+ */
+static ncconn_t *
+nc_conn_first(netcmp_t *ncp)
+{
+	return (nc_conn_scan(ncp, avl_first(&ncp->nc_pairs), 0));
+}
+
+static ncconn_t *
+nc_conn_next(netcmp_t *ncp, ncconn_t *ncc)
+{
+	ncpair_t *ncpr = ncc->ncc_pair;
+
+	return (nc_conn_scan(ncp, ncpr, ncc - ncpr->ncpr_conns + 1));
+}
+
+/*
+ * Allocate a zeroed connection table of "size" slots (a power of 2) for a pair
+ * that's still being indexed.  Tables come from the same large-page-backed
+ * memory as the rest of the index, so ingest gets the benefit of large pages,
+ * too.  Tables smaller than a large page are allocated from the arena.  Arena
+ * memory can't be freed, so when a pair outgrows one of these, it's kept on a
+ * free list for its size, linked through its first bytes, and reused for
+ * another pair.  Bigger tables get arena chunks of their own, which are
+ * unmapped when outgrown, so a pair with millions of connections doesn't leave
+ * all of its old tables behind.  Returns NULL on failure.
+ */
+static ncconn_t *
+nc_conn_table_alloc(netcmp_t *ncp, uint32_t size)
+{
+	size_t bytes = (size_t)size * sizeof (ncconn_t);
+	ncconn_t *table;
+	unsigned int c;
+
+	if (bytes >= NC_LARGEPAGESZ) {
+		bytes = (bytes + NC_LARGEPAGESZ - 1) &
+		    ~(size_t)(NC_LARGEPAGESZ - 1);
+		table = (ncconn_t *)nc_arena_map(&ncp->nc_arena, bytes);
+	} else {
+		for (c = 0; ((uint32_t)1 << c) < size; c++)
+			;
+
+		assert(((uint32_t)1 << c) == size);
+		if ((table = ncp->nc_tablefree[c]) != NULL) {
+			ncp->nc_tablefree[c] = *(ncconn_t **)table;
+			bzero(table, bytes);
+			return (table);
 		}
 
-		assert(ncc->ncc_nsources == 1);
-		bzero(&source, sizeof (source));
-		(void) strlcpy(source.ncs_ip, ncc->ncc_ip1,
-		    sizeof (source.ncs_ip));
-		external = avl_find(&ncp->nc_sources, &source, NULL) == NULL;
-		if (!external) {
-			(void) strlcpy(source.ncs_ip, ncc->ncc_ip2,
-			    sizeof (source.ncs_ip));
-			external = avl_find(
-			    &ncp->nc_sources, &source, NULL) == NULL;
-		}
+		table = nc_arena_alloc(&ncp->nc_arena, bytes);
+	}
+
+	if (table == NULL)
+		return (NULL);
+
+	ncp->nc_tablebytes += bytes;
+	if (ncp->nc_tablebytes > ncp->nc_tablepeak)
+		ncp->nc_tablepeak = ncp->nc_tablebytes;
+	return (table);
+}
+
+static void
+nc_conn_table_free(netcmp_t *ncp, ncconn_t *table, uint32_t size)
+{
+	size_t bytes = (size_t)size * sizeof (ncconn_t);
+	unsigned int c;
+
+	if (bytes >= NC_LARGEPAGESZ) {
+		bytes = (bytes + NC_LARGEPAGESZ - 1) &
+		    ~(size_t)(NC_LARGEPAGESZ - 1);
+		nc_arena_unmap(&ncp->nc_arena, (char *)table, bytes);
+		ncp->nc_tablebytes -= bytes;
+		return;
+	}
+
+	for (c = 0; ((uint32_t)1 << c) < size; c++)
+		;
+
+	*(ncconn_t **)table = ncp->nc_tablefree[c];
+	ncp->nc_tablefree[c] = table;
+}
+
+/*
+ * Once all input has been read, convert each pair's connection table into a
+ * compact array sorted by ports.  This happens in place: the tables are already
+ * in large-page-backed memory, and the connections never move again, so it's
+ * safe to keep pointers to connections after this.
+ */
+static void
+nc_index_freeze(netcmp_t *ncp)
+{
+	ncpair_t *ncpr;
+	uint32_t i, n;
+
+	for (ncpr = avl_first(&ncp->nc_pairs); ncpr != NULL;
+	    ncpr = AVL_NEXT(&ncp->nc_pairs, ncpr)) {
+		for (i = 0, n = 0; i < ncpr->ncpr_size; i++) {
+			if (ncpr->ncpr_conns[i].ncc_nsources != 0)
+				ncpr->ncpr_conns[n++] = ncpr->ncpr_conns[i];
+		}
+
+		assert(n == ncpr->ncpr_nconns);
+		qsort(ncpr->ncpr_conns, n, sizeof (ncconn_t),
+		    nc_conn_port_compare);
+		ncpr->ncpr_size = n;
+	}
+}
+
+/*
+ * Print statistics about the connection index (for "-d").
+ */
+static void
+nc_index_report(FILE *stream, netcmp_t *ncp)
+{
+	unsigned long npairs = avl_numnodes(&ncp->nc_pairs);
+	unsigned long bytes;
+
+	bytes = npairs * sizeof (ncpair_t) + ncp->nc_nconns * sizeof (ncconn_t);
+	(void) fprintf(stream, "index: %lu connections in %lu IP pairs "
+	    "(%lu KB, %.1f bytes per connection)\n", ncp->nc_nconns, npairs,
+	    bytes / 1024, ncp->nc_nconns == 0 ? 0 :
+	    (double)bytes / ncp->nc_nconns);
+
+	bytes = npairs * sizeof (ncpair_t) + ncp->nc_tablepeak;
+	(void) fprintf(stream, "index: %lu KB at peak while reading input "
+	    "(%.1f bytes per connection)\n", bytes / 1024,
+	    ncp->nc_nconns == 0 ? 0 : (double)bytes / ncp->nc_nconns);
+}
+
+/*
+ * Return the label with the given name, creating it if this is the first time
+ * we've seen it.  Returns NULL on failure.
+ */
+static nclabel_t *
+nc_label_lookup(netcmp_t *ncp, const char *name)
+{
+	nclabel_t *label, **labels;
+	unsigned int i;
+
+	for (i = 0; i < ncp->nc_nlabels; i++) {
+		if (strcmp(ncp->nc_labels[i]->ncl_name, name) == 0)
+			return (ncp->nc_labels[i]);
+	}
+
+	if ((labels = realloc(ncp->nc_labels,
+	    (ncp->nc_nlabels + 1) * sizeof (*labels))) == NULL) {
+		warn("realloc");
+		return (NULL);
+	}
+
+	ncp->nc_labels = labels;
+	if ((label = nc_arena_alloc(&ncp->nc_arena, sizeof (*label))) == NULL)
+		return (NULL);
+
+	(void) strlcpy(label->ncl_name, name, sizeof (label->ncl_name));
+	label->ncl_id = ncp->nc_nlabels;
+	ncp->nc_labels[ncp->nc_nlabels++] = label;
+	return (label);
+}
+
+/*
+ * Parse an IPv4 address in dotted-decimal form into *ipp (in host byte order).
+ * Returns 0 on success or -1 if the address is malformed.
+ */
+static int
+nc_parse_ipaddr(const char *str, uint32_t *ipp)
+{
+	unsigned long octet;
+	uint32_t ip = 0;
+	char *endp;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if (!isdigit((unsigned char)*str))
+			return (-1);
+
+		errno = 0;
+		octet = strtoul(str, &endp, 10);
+		if (errno != 0 || octet > UINT8_MAX ||
+		    *endp != (i == 3 ? '\0' : '.')) {
+			return (-1);
+		}
+
+		ip = (ip << 8) | octet;
+		str = endp + 1;
+	}
+
+	*ipp = ip;
+	return (0);
+}
+
+/*
+ * Parse "IP:PORT" into *ipp and *portp.  Returns 0 on success or -1 if the
+ * string is malformed.
+ */
+static int
+nc_parse_ipport(const char *str, uint32_t *ipp, uint16_t *portp)
+{
+	char buf[IPV4PORT_BUFSZ];
+	char *colon, *endp;
+	unsigned long port;
+
+	if (strlcpy(buf, str, sizeof (buf)) >= sizeof (buf) ||
+	    (colon = strrchr(buf, ':')) == NULL) {
+		return (-1);
+	}
+
+	*colon = '\0';
+	errno = 0;
+	port = strtoul(colon + 1, &endp, 10);
+	if (nc_parse_ipaddr(buf, ipp) != 0 || colon[1] == '\0' ||
+	    *endp != '\0' || errno != 0 || port > UINT16_MAX) {
+		return (-1);
+	}
 
-		if (external) {
-			if (ncp->nc_debug) {
-				(void) fprintf(stderr, "found connection "
-				    "involving IP for which we have no "
-				    "data:\n");
-				nc_conn_dump(stderr, ncc);
-			}
+	*portp = port;
+	return (0);
+}
 
-			nexternal++;
-			continue;
-		}
+/*
+ * Write "v" to "buf" as a varint: 7 bits per byte, least significant first,
+ * with the high bit set on all but the last byte.  Returns the number of bytes
+ * written (at most 10).
+ */
+static size_t
+nc_varint_put(uint8_t *buf, uint64_t v)
+{
+	size_t n = 0;
 
-		nasymmetric++;
-		nc_ipport_tostr(buf1, sizeof (buf1), ncc->ncc_ip1,
-		    ncc->ncc_port1);
-		nc_ipport_tostr(buf2, sizeof (buf2), ncc->ncc_ip2,
-		    ncc->ncc_port2);
-		(void) fprintf(stdout, "%21s <-> %21s only in %s\n",
-		    buf1, buf2, ncc->ncc_sources[0]->ncs_label);
+	while (v >= 0x80) {
+		buf[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
 	}
 
-	if (nerror != 0) {
-		warnx("%d connection%s had more than two sources! example:\n",
-		    nerror, nerror == 1 ? "" : "s");
-		nc_conn_dump(stderr, ncc_error);
-	}
+	buf[n++] = v;
+	return (n);
+}
 
-	(void) printf("summary of connections found:\n");
-	(void) printf("    %7lu localhost connections skipped\n",
-	    ncp->nc_nlocalhost);
-	(void) printf("    %7d pruned (in state TIME_WAIT)\n", ntimewait);
-	(void) printf("    %7d symmetric (present on both sides)\n",
-	    nsymmetric);
-	(void) printf("    %7d external (only one side's data was supplied)\n",
-	    nexternal);
-	(void) printf("    %7d asymmetric (abandoned by one side)\n",
-	    nasymmetric);
+/*
+ * Read a varint written by nc_varint_put(), advancing *pp past it.
+ */
+static uint64_t
+nc_varint_get(const uint8_t **pp)
+{
+	const uint8_t *p = *pp;
+	uint64_t v = 0;
+	unsigned int shift = 0;
+
+	do {
+		v |= (uint64_t)(*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+
+	*pp = p;
+	return (v);
 }
 
 /*
- * Dump all information we have about one of the connections.  This is intended
- * for "verbose" mode.
+ * Choose the key for nc_keyhash().  If the system can't supply random bytes,
+ * the key is derived from the time and process ID instead, which at least
+ * differs from run to run.
  */
 static void
-nc_conn_dump(FILE *stream, ncconn_t *ncc)
+nc_hashkey_init(void)
 {
+	struct timespec ts;
+	uint64_t x, z;
 	int i;
-	char buf1[IPV4PORT_BUFSZ];
-	char buf2[IPV4PORT_BUFSZ];
 
-	nc_ipport_tostr(buf1, sizeof (buf1), ncc->ncc_ip1, ncc->ncc_port1);
-	nc_ipport_tostr(buf2, sizeof (buf2), ncc->ncc_ip2, ncc->ncc_port2);
+	if (getentropy(nc_hashkey, sizeof (nc_hashkey)) == 0)
+		return;
 
-	(void) fprintf(stream, "    %21s <-> %21s\n", buf1, buf2);
-	for (i = 0; i < ncc->ncc_nsources && i < 2; i++) {
-		fprintf(stream, "        source: %s\n",
-		    ncc->ncc_sources[i]->ncs_label);
+	(void) clock_gettime(CLOCK_REALTIME, &ts);
+	x = ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) ^
+	    ((uint64_t)getpid() << 32);
+	for (i = 0; i < NC_HASHKEY_WORDS; i++) {
+		/* splitmix64 */
+		x += 0x9e3779b97f4a7c15ULL;
+		z = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		nc_hashkey[i] = z ^ (z >> 31);
 	}
 }
 
 /*
- * Writes into "buf" a string representation of the given IPv4 address and port.
- * This NULL-terminates as long as bufsz > 0, and the string will be complete as
- * long as bufsz > IPV4PORT_BUFSZ.
+ * Replace *a and *b with the low and high words of their 128-bit product.
  */
 static void
-nc_ipport_tostr(char *buf, size_t bufsz, const char *ip, uint16_t port)
+nc_mum(uint64_t *a, uint64_t *b)
 {
-	(void) snprintf(buf, bufsz, "%s:%d", ip, port);
-}
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t)*a * *b;
+
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha, hb, la, lb, hh, hl, lh, ll, t, lo, carry;
 
+	ha = *a >> 32;
+	hb = *b >> 32;
+	la = (uint32_t)*a;
+	lb = (uint32_t)*b;
+	hh = ha * hb;
+	hl = ha * lb;
+	lh = la * hb;
+	ll = la * lb;
+	t = ll + (hl << 32);
+	carry = t < ll;
+	lo = t + (lh << 32);
+	carry += lo < t;
+	*a = lo;
+	*b = hh + (hl >> 32) + (lh >> 32) + carry;
+#endif
+}
 
 /*
- * Private functions
+ * Hash the 128-bit key (a, b) with this run's key (see nc_hashkey).
  */
+static uint64_t
+nc_keyhash(uint64_t a, uint64_t b)
+{
+	a ^= nc_hashkey[0];
+	b ^= nc_hashkey[1];
+	nc_mum(&a, &b);
+	a ^= nc_hashkey[2];
+	b ^= nc_hashkey[3];
+	nc_mum(&a, &b);
+	return (a ^ b);
+}
 
 /*
- * Parse a single line of netstat output.  "line" is guaranteed to be
- * NULL-terminated and to have a newline character at the end of it.  This
- * function may modify the string arbitrarily.
+ * Initialize a hash table with room for at least "size" keys.
  */
 static int
-nc_parse_row(netcmp_t *ncp, const char *source, char *line)
+nc_hash_init(nchash_t *hash, size_t size)
 {
-	ncconn_t *ncc, *oncc;
-	ncsource_t *ncs, *oncs;
-	char *ipport1, *ipport2, *ign, *state, *lasts, *nl;
-	int cmp;
-	char tmpstr[IPV4_STRBUFSZ];
-	uint16_t tmpport;
-	avl_index_t avlwhere;
+	bzero(hash, sizeof (*hash));
+	hash->nch_size = 16;
+	while (hash->nch_size < size * 2)
+		hash->nch_size *= 2;
 
-	ipport2 = NULL;
-	ign = NULL;
-	state = NULL;
-
-	ipport1 = strtok_r(line, " ", &lasts);
-	if (ipport1 != NULL)
-		ipport2 = strtok_r(NULL, " ", &lasts);
-	if (ipport2 != NULL)
-		/* "Swind" is currently ignored. */
-		ign = strtok_r(NULL, " ", &lasts);
-	if (ign != NULL)
-		/* "Send-Q" is currently ignored. */
-		ign = strtok_r(NULL, " ", &lasts);
-	if (ign != NULL)
-		/* "Rwind" is currently ignored. */
-		ign = strtok_r(NULL, " ", &lasts);
-	if (ign != NULL)
-		/* "Recv-Q" is currently ignored. */
-		ign = strtok_r(NULL, " ", &lasts);
-	if (ign != NULL)
-		state = strtok_r(NULL, " ", &lasts);
-
-	if (ipport1 == NULL || ipport2 == NULL || state == NULL) {
-		warnx("failed to parse line");
-		return (-1);
-	}
-
-	nl = strchr(state, '\n');
-	assert(nl != NULL);
-	*nl = '\0';
-
-	if (strcmp(state, "CLOSED") != 0 &&
-	    strcmp(state, "IDLE") != 0 &&
-	    strcmp(state, "BOUND") != 0 &&
-	    strcmp(state, "LISTEN") != 0 &&
-	    strcmp(state, "SYN_SENT") != 0 &&
-	    strcmp(state, "SYN_RCVD") != 0 &&
-	    strcmp(state, "ESTABLISHED") != 0 &&
-	    strcmp(state, "CLOSE_WAIT") != 0 &&
-	    strcmp(state, "FIN_WAIT_1") != 0 &&
-	    strcmp(state, "CLOSING") != 0 &&
-	    strcmp(state, "LAST_ACK") != 0 &&
-	    strcmp(state, "FIN_WAIT_2") != 0 &&
-	    strcmp(state, "TIME_WAIT") != 0) {
-		warnx("unexpected TCP state: \"%s\"", state);
-		return (-1);
-	}
-
-	if ((ncc = calloc(sizeof (*ncc), 1)) == NULL ||
-	    (ncs = calloc(sizeof (*ncs), 1)) == NULL) {
+	hash->nch_keys = calloc(hash->nch_size, sizeof (*hash->nch_keys));
+	hash->nch_counts = calloc(hash->nch_size, sizeof (*hash->nch_counts));
+	if (hash->nch_keys == NULL || hash->nch_counts == NULL) {
 		warn("calloc");
-		free(ncc);
+		nc_hash_fini(hash);
 		return (-1);
 	}
 
-	if (nc_parse_ipport(ncc->ncc_ip1, sizeof (ncc->ncc_ip1),
-	    &ncc->ncc_port1, ipport1) != 0 ||
-	    nc_parse_ipport(ncc->ncc_ip2, sizeof (ncc->ncc_ip2),
-	    &ncc->ncc_port2, ipport2) != 0) {
-		free(ncc);
-		free(ncs);
-		return (-1);
+	return (0);
+}
+
+/*
+ * Returns the slot that holds "key", or the empty slot where it would be
+ * inserted.
+ */
+static size_t
+nc_hash_slot(const nchash_t *hash, uint64_t key)
+{
+	size_t i, mask;
+
+	mask = hash->nch_size - 1;
+	i = (size_t)nc_keyhash(key, 0) & mask;
+	while (hash->nch_counts[i] != 0 && hash->nch_keys[i] != key)
+		i = (i + 1) & mask;
+
+	return (i);
+}
+
+/*
+ * Add "incr" (which must be non-zero) to the count for "key", inserting the
+ * key if it's not already present.  The table is grown as needed to keep it
+ * at most half full.
+ */
+static int
+nc_hash_add(nchash_t *hash, uint64_t key, uint64_t incr)
+{
+	nchash_t bigger;
+	size_t i;
+
+	assert(incr != 0);
+	if (hash->nch_nused * 2 >= hash->nch_size) {
+		if (nc_hash_init(&bigger, hash->nch_size) != 0)
+			return (-1);
+
+		for (i = 0; i < hash->nch_size; i++) {
+			if (hash->nch_counts[i] != 0) {
+				(void) nc_hash_add(&bigger, hash->nch_keys[i],
+				    hash->nch_counts[i]);
+			}
+		}
+
+		nc_hash_fini(hash);
+		*hash = bigger;
 	}
 
-	/*
-	 * Ignore connections over 127.0.0.1.  Our methodology assumes IPs are
-	 * unique across all input, which isn't the case here.  That's okay,
-	 * because it's pretty unlikely there would be an asymmetry over
-	 * localhost.
-	 */
-	if (strcmp(ncc->ncc_ip1, "127.0.0.1") == 0 ||
-	    strcmp(ncc->ncc_ip2, "127.0.0.1") == 0) {
-		ncp->nc_nlocalhost++;
-		free(ncc);
-		free(ncs);
-		return (0);
+	i = nc_hash_slot(hash, key);
+	if (hash->nch_counts[i] == 0) {
+		hash->nch_keys[i] = key;
+		hash->nch_nused++;
+	}
+
+	hash->nch_counts[i] += incr;
+	return (0);
+}
+
+/*
+ * Returns the count for "key", or 0 if it's not present.
+ */
+static uint64_t
+nc_hash_get(const nchash_t *hash, uint64_t key)
+{
+	return (hash->nch_counts[nc_hash_slot(hash, key)]);
+}
+
+static void
+nc_hash_fini(nchash_t *hash)
+{
+	free(hash->nch_keys);
+	free(hash->nch_counts);
+	bzero(hash, sizeof (*hash));
+}
+
+/*
+ * qsort comparator for (count, key) pairs that sorts the largest counts first.
+ */
+static int
+nc_group_compare(const void *vg1, const void *vg2)
+{
+	const uint64_t *g1 = vg1;
+	const uint64_t *g2 = vg2;
+
+	if (g1[0] != g2[0])
+		return (g1[0] > g2[0] ? -1 : 1);
+	if (g1[1] != g2[1])
+		return (g1[1] < g2[1] ? -1 : 1);
+	return (0);
+}
+
+/*
+ * qsort comparator for doubles.
+ */
+static int
+nc_double_compare(const void *vd1, const void *vd2)
+{
+	double d1 = *(const double *)vd1;
+	double d2 = *(const double *)vd2;
+
+	if (d1 != d2)
+		return (d1 < d2 ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Build the DFA that nc_parse_line() uses to recognize TCP state names.  This
+ * is a trie of the names in nc_states.
+ */
+static void
+nc_state_dfa_init(void)
+{
+	const char *name;
+	unsigned int nnodes, node;
+	int i;
+
+	bzero(nc_state_dfa, sizeof (nc_state_dfa));
+	(void) memset(nc_state_accept, -1, sizeof (nc_state_accept));
+	nnodes = 2;
+	for (i = 0; i < NS_NSTATES; i++) {
+		node = 1;
+		for (name = nc_states[i]; *name != '\0'; name++) {
+			if (nc_state_dfa[node][(uint8_t)*name] == 0) {
+				assert(nnodes < NC_DFA_MAXNODES);
+				nc_state_dfa[node][(uint8_t)*name] = nnodes++;
+			}
+
+			node = nc_state_dfa[node][(uint8_t)*name];
+		}
+
+		nc_state_accept[node] = i;
+	}
+}
+
+/*
+ * Returns true if "state" is one that a TCP endpoint normally passes through
+ * within a round trip or so while opening or closing a connection, such that
+ * it's normal for the other endpoint to have no record of the connection yet
+ * (or any more).
+ */
+static ncbool_t
+nc_state_transient(uint8_t state)
+{
+	switch (state) {
+	case NS_SYN_SENT:
+	case NS_SYN_RCVD:
+	case NS_FIN_WAIT_1:
+	case NS_LAST_ACK:
+		return (NB_TRUE);
+	default:
+		return (NB_FALSE);
+	}
+}
+
+/*
+ * Parse a single row of netstat output starting at "line".  The data ends at
+ * "end", and *end must be a NUL byte.  This walks the bytes of the row exactly
+ * once, decoding the IP addresses, ports, queue columns, and TCP state into
+ * "row" as it goes.  The input is not modified.  Returns:
+ *
+ *     NC_PARSE_OK	a row was parsed into "row"
+ *
+ *     NC_PARSE_BLANK	the line was blank
+ *
+ *     NC_PARSE_SHORT	the data ended before the end of the row
+ *
+ *     NC_PARSE_ERROR	the row is malformed
+ *
+ * On NC_PARSE_OK and NC_PARSE_BLANK, *nextp is set to the start of the next
+ * line.  On NC_PARSE_ERROR, "errp" describes the problem and where in the row
+ * it was found.
+ */
+static int
+nc_parse_line(const char *line, const char *end, ncrow_t *row,
+    const char **nextp, ncparseerr_t *errp)
+{
+	const uint8_t *p = (const uint8_t *)line;
+	const char *errmsg;
+	uint32_t val, ip;
+	unsigned int digit, node;
+	int column, part, ndigits;
+
+	column = 0;
+	bzero(row, sizeof (*row));
+	while (*p == ' ' || *p == '\t')
+		p++;
+
+	if (*p == '\n') {
+		*nextp = (const char *)p + 1;
+		return (NC_PARSE_BLANK);
 	}
 
 	/*
-	 * Make sure that we have a source record based on the local IP address.
+	 * The first two columns are IP/port pairs, which netstat prints as five
+	 * dot-separated numbers: the four octets of the address and the port.
 	 */
-	(void) strlcpy(ncs->ncs_ip, ncc->ncc_ip1, sizeof (ncs->ncs_ip));
-	oncs = avl_find(&ncp->nc_sources, ncs, &avlwhere);
-	if (oncs == NULL) {
-		(void) strlcpy(ncs->ncs_label, source,
-		    sizeof (ncs->ncs_label));
-		avl_insert(&ncp->nc_sources, ncs, avlwhere);
-	} else {
-		free(ncs);
-		ncs = oncs;
+	for (column = 0; column < 2; column++) {
+		ip = 0;
+		for (part = 0; part < 5; part++) {
+			val = 0;
+			ndigits = 0;
+			while ((digit = *p - '0') <= 9) {
+				val = val * 10 + digit;
+				if (val > UINT16_MAX) {
+					errmsg = "number too large";
+					goto fail;
+				}
+				ndigits++;
+				p++;
+			}
+
+			if (ndigits == 0) {
+				errmsg = "expected digit";
+				goto fail;
+			}
+
+			if (part == 4)
+				break;
+
+			if (val > UINT8_MAX) {
+				errmsg = "bad IP address octet";
+				goto fail;
+			}
+
+			ip = (ip << 8) | val;
+			if (*p != '.') {
+				errmsg = "expected \".\"";
+				goto fail;
+			}
+			p++;
+		}
+
+		if (column == 0) {
+			row->ncrw_ip1 = ip;
+			row->ncrw_port1 = (uint16_t)val;
+		} else {
+			row->ncrw_ip2 = ip;
+			row->ncrw_port2 = (uint16_t)val;
+		}
+
+		if (*p != ' ' && *p != '\t') {
+			errmsg = "expected space";
+			goto fail;
+		}
+
+		while (*p == ' ' || *p == '\t')
+			p++;
 	}
 
 	/*
-	 * Sort the two (IP, port) tuples within the ncconn_t to normalize the
-	 * connection identifier.
+	 * The next four columns are the send/receive windows and queues.
 	 */
-	cmp = strcmp(ncc->ncc_ip1, ncc->ncc_ip2);
-	if (cmp > 0 || (cmp == 0 && ncc->ncc_port1 > ncc->ncc_port2)) {
-		tmpport = ncc->ncc_port1;
-		ncc->ncc_port1 = ncc->ncc_port2;
-		ncc->ncc_port2 = tmpport;
+	for (; column < 6; column++) {
+		val = 0;
+		ndigits = 0;
+		while ((digit = *p - '0') <= 9) {
+			if (val > (UINT32_MAX - digit) / 10) {
+				errmsg = "number too large";
+				goto fail;
+			}
+			val = val * 10 + digit;
+			ndigits++;
+			p++;
+		}
+
+		if (ndigits == 0) {
+			errmsg = "expected digit";
+			goto fail;
+		}
+
+		switch (column) {
+		case 2:
+			row->ncrw_swind = val;
+			break;
+		case 3:
+			row->ncrw_sendq = val;
+			break;
+		case 4:
+			row->ncrw_rwind = val;
+			break;
+		default:
+			row->ncrw_recvq = val;
+			break;
+		}
+
+		if (*p != ' ' && *p != '\t') {
+			errmsg = "expected space";
+			goto fail;
+		}
 
-		(void) strlcpy(tmpstr, ncc->ncc_ip1, sizeof (tmpstr));
-		(void) strlcpy(ncc->ncc_ip1, ncc->ncc_ip2,
-		    sizeof (ncc->ncc_ip1));
-		(void) strlcpy(ncc->ncc_ip2, tmpstr, sizeof (ncc->ncc_ip2));
+		while (*p == ' ' || *p == '\t')
+			p++;
 	}
 
 	/*
-	 * Make sure that we have a record for this connection.
+	 * The last column is the TCP state.
 	 */
-	oncc = avl_find(&ncp->nc_conns, ncc, &avlwhere);
-	if (oncc == NULL) {
-		(void) strlcpy(ncc->ncc_state, state, sizeof (ncc->ncc_state));
-		avl_insert(&ncp->nc_conns, ncc, avlwhere);
-	} else {
-		free(ncc);
-		ncc = oncc;
+	assert(column == 6);
+	node = 1;
+	while (*p != ' ' && *p != '\t' && *p != '\n' && *p != '\0') {
+		node = *p < 128 ? nc_state_dfa[node][*p] : 0;
+		if (node == 0) {
+			errmsg = "unexpected TCP state";
+			goto fail;
+		}
+		p++;
+	}
+
+	if (nc_state_accept[node] == -1) {
+		errmsg = "unexpected TCP state";
+		goto fail;
+	}
+
+	row->ncrw_state = (uint8_t)nc_state_accept[node];
+	while (*p == ' ' || *p == '\t')
+		p++;
+
+	if (*p != '\n') {
+		errmsg = "expected end of line";
+		goto fail;
 	}
 
+	*nextp = (const char *)p + 1;
+	return (NC_PARSE_OK);
+
+fail:
 	/*
-	 * Update the record to refer to this source.  We only actually keep two
-	 * sources.
+	 * If we hit the NUL at the end of the data, the row is just incomplete.
 	 */
-	if (ncc->ncc_nsources < 2) {
-		ncc->ncc_sources[ncc->ncc_nsources++] = ncs;
-	} else if (ncc->ncc_nsources < UINT8_MAX) {
-		ncc->ncc_nsources++;
-	}
+	if ((const char *)p == end)
+		return (NC_PARSE_SHORT);
 
-	return (0);
+	if (*p == '\0')
+		errmsg = "unexpected NUL byte";
+	errp->ncpe_msg = errmsg;
+	errp->ncpe_column = nc_columns[column];
+	errp->ncpe_offset = (int)((const char *)p - line) + 1;
+	return (NC_PARSE_ERROR);
 }
 
 /*
- * Parse the netstat-reported IP address and TCP port into "outbuf" (for the IP
- * address) and *portp (for the port).  Returns 0 on success.  On failure,
- * returns -1 with undefined contents of the input arguments.
+ * Return the "digit"th byte of the sort key of "ncr", where byte 0 is the least
+ * significant.  Records sort by local IP, local port, remote IP, and then
+ * remote port.
  */
-static int
-nc_parse_ipport(char *outbuf, size_t outbufsz, uint16_t *portp, char *str)
+static uint8_t
+nc_rec_keybyte(const ncrec_t *ncr, int digit)
 {
-	char *dot;
-	char *endp;
-	long portval;
+	if (digit < 2)
+		return ((ncr->ncr_port2 >> (8 * digit)) & 0xff);
+	if (digit < 6)
+		return ((ncr->ncr_ip2 >> (8 * (digit - 2))) & 0xff);
+	if (digit < 8)
+		return ((ncr->ncr_port1 >> (8 * (digit - 6))) & 0xff);
+	return ((ncr->ncr_ip1 >> (8 * (digit - 8))) & 0xff);
+}
 
-	dot = strrchr(str, '.');
-	if (dot == NULL) {
-		warnx("bad IP/port pair");
-		return (-1);
+/*
+ * Sort an array of packed records using a least-significant-digit radix sort.
+ * This makes one pass over the records to build the histograms for every key
+ * byte, and then one scatter pass for each key byte that's not the same for all
+ * records.
+ */
+static void
+nc_rec_sort(ncrec_t *recs, size_t nrecs)
+{
+	size_t counts[NC_REC_KEYBYTES][256];
+	size_t offset, count;
+	ncrec_t *tmp, *src, *dst, *swap;
+	size_t i;
+	int d, b;
+
+	if (nrecs < 2)
+		return;
+
+	if ((tmp = malloc(nrecs * sizeof (*tmp))) == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	bzero(counts, sizeof (counts));
+	for (i = 0; i < nrecs; i++) {
+		for (d = 0; d < NC_REC_KEYBYTES; d++)
+			counts[d][nc_rec_keybyte(&recs[i], d)]++;
 	}
 
-	*dot = '\0';
-	(void) strlcpy(outbuf, str, outbufsz);
+	src = recs;
+	dst = tmp;
+	for (d = 0; d < NC_REC_KEYBYTES; d++) {
+		if (counts[d][nc_rec_keybyte(&src[0], d)] == nrecs)
+			continue;
 
-	errno = 0;
-	portval = strtol(dot + 1, &endp, 10);
-	if (errno != 0 || portval < 0 ||
-	    portval > UINT16_MAX || *endp != '\0') {
-		warnx("bad TCP port");
-		return (-1);
+		offset = 0;
+		for (b = 0; b < 256; b++) {
+			count = counts[d][b];
+			counts[d][b] = offset;
+			offset += count;
+		}
+
+		for (i = 0; i < nrecs; i++)
+			dst[counts[d][nc_rec_keybyte(&src[i], d)]++] = src[i];
+
+		swap = src;
+		src = dst;
+		dst = swap;
 	}
 
-	*portp = (uint16_t)portval;
+	if (src != recs)
+		bcopy(src, recs, nrecs * sizeof (*recs));
+	free(tmp);
+}
+
+/*
+ * Comparator for packed records, consistent with the order produced by
+ * nc_rec_sort().
+ */
+static int
+nc_rec_compare(const ncrec_t *ncr1, const ncrec_t *ncr2)
+{
+	if (ncr1->ncr_ip1 != ncr2->ncr_ip1)
+		return (ncr1->ncr_ip1 < ncr2->ncr_ip1 ? -1 : 1);
+	if (ncr1->ncr_port1 != ncr2->ncr_port1)
+		return (ncr1->ncr_port1 < ncr2->ncr_port1 ? -1 : 1);
+	if (ncr1->ncr_ip2 != ncr2->ncr_ip2)
+		return (ncr1->ncr_ip2 < ncr2->ncr_ip2 ? -1 : 1);
+	if (ncr1->ncr_port2 != ncr2->ncr_port2)
+		return (ncr1->ncr_port2 < ncr2->ncr_port2 ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Fill in the tuple fields of the age record "nca" from the given connection.
+ */
+static void
+nc_conn_tuple(const ncconn_t *ncc, ncagerec_t *nca)
+{
+	bzero(nca, sizeof (*nca));
+	nca->nca_ip1 = NCC_IP1(ncc);
+	nca->nca_ip2 = NCC_IP2(ncc);
+	nca->nca_port1 = ncc->ncc_port1;
+	nca->nca_port2 = ncc->ncc_port2;
+}
+
+/*
+ * qsort/bsearch comparator for age records.  This ignores the first-seen time.
+ */
+static int
+nc_agerec_compare(const void *vnca1, const void *vnca2)
+{
+	const ncagerec_t *nca1 = vnca1;
+	const ncagerec_t *nca2 = vnca2;
+
+	if (nca1->nca_ip1 != nca2->nca_ip1)
+		return (nca1->nca_ip1 < nca2->nca_ip1 ? -1 : 1);
+	if (nca1->nca_port1 != nca2->nca_port1)
+		return (nca1->nca_port1 < nca2->nca_port1 ? -1 : 1);
+	if (nca1->nca_ip2 != nca2->nca_ip2)
+		return (nca1->nca_ip2 < nca2->nca_ip2 ? -1 : 1);
+	if (nca1->nca_port2 != nca2->nca_port2)
+		return (nca1->nca_port2 < nca2->nca_port2 ? -1 : 1);
 	return (0);
 }
 
 /*
- * avl tree comparator for connections.
+ * qsort comparator for an array of connection pointers that sorts the oldest
+ * connections first.
+ */
+static int
+nc_conn_age_compare(const void *vncc1, const void *vncc2)
+{
+	const ncconn_t *ncc1 = *(ncconn_t * const *)vncc1;
+	const ncconn_t *ncc2 = *(ncconn_t * const *)vncc2;
+
+	if (ncc1->ncc_firstseen != ncc2->ncc_firstseen)
+		return (ncc1->ncc_firstseen < ncc2->ncc_firstseen ? -1 : 1);
+	return (nc_conn_compare(ncc1, ncc2));
+}
+
+/*
+ * Comparator for ncidle_t, ordering the longest idle connections first.
+ */
+static int
+nc_idle_compare(const void *vnci1, const void *vnci2)
+{
+	const ncidle_t *nci1 = vnci1;
+	const ncidle_t *nci2 = vnci2;
+
+	if (nci1->nci_idle != nci2->nci_idle)
+		return (nci1->nci_idle > nci2->nci_idle ? -1 : 1);
+	return (nc_conn_compare(nci1->nci_conn, nci2->nci_conn));
+}
+
+/*
+ * Comparator for connections, in the order that nc_conn_first() and
+ * nc_conn_next() visit them.
  */
 static int
 nc_conn_compare(const void *vncc1, const void *vncc2)
@@ -654,15 +10335,63 @@ nc_conn_compare(const void *vncc1, const void *vncc2)
 	const ncconn_t *ncc2 = vncc2;
 	int cmp;
 
-	cmp = strcmp(ncc1->ncc_ip1, ncc2->ncc_ip1);
-	if (cmp == 0)
-		cmp = ncc1->ncc_port1 - ncc2->ncc_port1;
-	if (cmp == 0)
-		cmp = strcmp(ncc1->ncc_ip2, ncc2->ncc_ip2);
-	if (cmp == 0)
-		cmp = ncc1->ncc_port2 - ncc2->ncc_port2;
+	if ((cmp = nc_pair_compare(ncc1->ncc_pair, ncc2->ncc_pair)) != 0)
+		return (cmp);
+	return (nc_conn_port_compare(ncc1, ncc2));
+}
+
+/*
+ * qsort comparator for connections within the same pair.
+ */
+static int
+nc_conn_port_compare(const void *vncc1, const void *vncc2)
+{
+	const ncconn_t *ncc1 = vncc1;
+	const ncconn_t *ncc2 = vncc2;
+
+	if (ncc1->ncc_port1 != ncc2->ncc_port1)
+		return (ncc1->ncc_port1 < ncc2->ncc_port1 ? -1 : 1);
+	if (ncc1->ncc_port2 != ncc2->ncc_port2)
+		return (ncc1->ncc_port2 < ncc2->ncc_port2 ? -1 : 1);
+	return (0);
+}
+
+/*
+ * qsort comparator for captured flows, by their endpoints.
+ */
+static int
+nc_flow_compare(const void *vflow1, const void *vflow2)
+{
+	const ncflow_t *flow1 = vflow1;
+	const ncflow_t *flow2 = vflow2;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (flow1->ncfl_ip[i] != flow2->ncfl_ip[i])
+			return (flow1->ncfl_ip[i] < flow2->ncfl_ip[i] ? -1 : 1);
+		if (flow1->ncfl_port[i] != flow2->ncfl_port[i]) {
+			return (flow1->ncfl_port[i] < flow2->ncfl_port[i] ?
+			    -1 : 1);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * avl tree comparator for IP pairs.
+ */
+static int
+nc_pair_compare(const void *vncpr1, const void *vncpr2)
+{
+	const ncpair_t *ncpr1 = vncpr1;
+	const ncpair_t *ncpr2 = vncpr2;
 
-	return (cmp < 0 ? -1 : (cmp == 0 ? 0 : 1));
+	if (ncpr1->ncpr_ip1 != ncpr2->ncpr_ip1)
+		return (ncpr1->ncpr_ip1 < ncpr2->ncpr_ip1 ? -1 : 1);
+	if (ncpr1->ncpr_ip2 != ncpr2->ncpr_ip2)
+		return (ncpr1->ncpr_ip2 < ncpr2->ncpr_ip2 ? -1 : 1);
+	return (0);
 }
 
 /*
@@ -673,8 +10402,8 @@ nc_source_compare(const void *vncs1, const void *vncs2)
 {
 	const ncsource_t *ncs1 = vncs1;
 	const ncsource_t *ncs2 = vncs2;
-	int cmp;
 
-	cmp = strcmp(ncs1->ncs_ip, ncs2->ncs_ip);
-	return (cmp < 0 ? -1 : (cmp == 0 ? 0 : 1));
+	if (ncs1->ncs_ip != ncs2->ncs_ip)
+		return (ncs1->ncs_ip < ncs2->ncs_ip ? -1 : 1);
+	return (0);
 }
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#
+# Copyright 2022 Joyent, Inc.
+#
+# collide.py MODE NPORTS NCLIENTS DIR: write netstat files "server" and
+# "clients" in DIR, in which each of NCLIENTS clients has NPORTS connections to
+# 10.1.0.1:443.  With MODE "adv", the client ports are chosen to land in the
+# same few slots of a pair's connection table under an unkeyed hash (the fixed
+# multiplicative hash that netcmp once used), as a client choosing its ports
+# could do if the hash weren't keyed.  With MODE "rand", they're chosen at
+# random.  Ingest of the two should run at the same speed; see README.md.
+#
+
+import os
+import random
+import sys
+
+HEADER = """
+TCP: IPv4
+   Local Address        Remote Address    Swind Send-Q Rwind Recv-Q    State
+-------------------- -------------------- ----- ------ ----- ------ -----------
+"""
+
+SERVER_PORT = 443
+
+
+def table_size(nconns):
+    """Size of a pair's table after inserting nconns connections, which is
+    kept at most 3/4 full, starting at 4 slots and doubling."""
+    size = 0
+    for n in range(nconns):
+        if (n + 1) * 4 > size * 3:
+            size = 4 if size == 0 else size * 2
+    return size
+
+
+def main():
+    if len(sys.argv) != 5 or sys.argv[1] not in ('adv', 'rand'):
+        sys.exit('usage: collide.py adv|rand NPORTS NCLIENTS DIR')
+
+    mode, nports, nclients, outdir = sys.argv[1], int(sys.argv[2]), \
+        int(sys.argv[3]), sys.argv[4]
+    mask = table_size(nports) - 1
+
+    def slot(port):
+        key = (SERVER_PORT << 16) | port
+        return ((key * 0x9e3779b1) & 0xffffffff) >> 8 & mask
+
+    ports = list(range(1024, 65536))
+    if mode == 'adv':
+        ports.sort(key=slot)
+    else:
+        random.seed(1)
+        random.shuffle(ports)
+    ports = ports[:nports]
+
+    os.makedirs(outdir, exist_ok=True)
+    with open(os.path.join(outdir, 'server'), 'w') as server, \
+            open(os.path.join(outdir, 'clients'), 'w') as clients:
+        server.write(HEADER)
+        clients.write(HEADER)
+        for k in range(nclients):
+            client = '10.2.%d.%d' % (k // 250, k % 250 + 1)
+            for port in ports:
+                server.write('%-20s %-20s 128872      0 128872      0 '
+                    'ESTABLISHED\n' % ('10.1.0.1.%d' % SERVER_PORT,
+                    '%s.%d' % (client, port)))
+                clients.write('%-20s %-20s 128872      0 128872      0 '
+                    'ESTABLISHED\n' % ('%s.%d' % (client, port),
+                    '10.1.0.1.%d' % SERVER_PORT))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#
+# Copyright 2022 Joyent, Inc.
+#
+# run.sh NETCMP: run NETCMP on each of the fixtures in tests/data and compare
+# its report (stdout) and exit status with those in tests/expected.  Invoked by
+# "make check".
+#
+
+NETCMP="$(cd "$(dirname "$1")" && pwd)/$(basename "$1")"
+TESTS="$(cd "$(dirname "$0")" && pwd)"
+OUT="$(mktemp -d)" || exit 1
+trap 'rm -rf "$OUT"' EXIT
+nfailed=0
+
+#
+# check NAME ARG...: run netcmp with the given arguments (from tests/data, so
+# that file names in the report don't depend on where the tree is) and compare
+# the output with tests/expected/NAME.out, which ends with the exit status.
+#
+check()
+{
+	name="$1"
+	shift
+	(cd "$TESTS/data" && "$NETCMP" "$@" 2>"$OUT/$name.err"
+	    echo "exit status $?") >"$OUT/$name.out"
+	if diff -u "$TESTS/expected/$name.out" "$OUT/$name.out"; then
+		echo "ok    $name"
+	else
+		echo "FAIL  $name"
+		cat "$OUT/$name.err"
+		nfailed=$((nfailed + 1))
+	fi
+}
+
+check netstat		db app
+check gaps		-g 3 db app
+check bgzf		db app.bgz
+check zstd		db app.zst
+check pcap		capture.pcap
+check pcapng		capture.pcapng
+check conntrack		client server gw
+
+#
+# A single pair of IPs with 1.56 million connections (24 server ports times
+# 65000 client ports), whose connection array is bigger than an arena chunk.
+# This is generated rather than checked in because it's 125 MB.
+#
+awk 'BEGIN {
+	print "\nTCP: IPv4"
+	print "   Local Address        Remote Address    Swind Send-Q Rwind " \
+	    "Recv-Q    State"
+	print "-------------------- -------------------- ----- ------ ----- " \
+	    "------ -----------"
+	for (s = 5000; s < 5024; s++) {
+		for (c = 500; c < 65500; c++) {
+			printf("%-20s %-20s 64128      0 64128      0 " \
+			    "ESTABLISHED\n", "10.0.0.1." s, "10.0.0.2." c)
+		}
+	}
+}' >"$OUT/onepair"
+check onepair		"$OUT/onepair"
+
+if [ $nfailed -ne 0 ]; then
+	echo "$nfailed test(s) failed"
+	exit 1
+fi